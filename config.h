@@ -48,5 +48,12 @@
 // Connection retry settings
 #define MAX_RECONNECT_ATTEMPTS 5
 #define RECONNECT_DELAY 5000         // 5 seconds between reconnect attempts
+#define RECONNECT_BACKOFF 30000      // after MAX_RECONNECT_ATTEMPTS failures in a row
+
+// Task timing
+#define COMMAND_POLL_MS 200          // console input check
+#define LINK_CHECK_MS 1000           // Bluetooth link check while connected
+#define CONNECT_SETTLE_MS 1000       // first read after connecting
+#define COMMAND_GAP_MS 100           // between the commands of one read
 
 #endif // CONFIG_H
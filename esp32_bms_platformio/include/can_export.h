@@ -0,0 +1,346 @@
+/*
+ * CAN export in the Pylontech low-voltage protocol
+ *
+ * Hybrid inverters that expect a Pylontech battery on CAN (500 kbit/s,
+ * 11-bit ids) read the pack from a fixed set of frames:
+ *
+ *   0x351  u16 charge voltage limit 0.1 V, i16 charge current limit 0.1 A,
+ *          i16 discharge current limit 0.1 A, u16 discharge voltage 0.1 V
+ *   0x355  u16 SOC %, u16 SOH %
+ *   0x356  i16 voltage 10 mV, i16 current 0.1 A (+ charging), i16 temp 0.1 C
+ *   0x359  protection bytes 0-1, alarm bytes 2-3, module count, "PN"
+ *   0x35C  request bits: charge enable, discharge enable, force charge
+ *   0x35E  manufacturer, "PYLON   "
+ *
+ * all little endian. The loop encodes every frame once per decoded BMS
+ * frame (publish) into a seqlocked table. The CAN task sends them on a
+ * fixed grid: each frame has an absolute deadline that advances by its
+ * period, so the schedule does not drift with send or wake-up latency, and
+ * the frames of one period are staggered a few ms apart instead of filling
+ * the TX queue at once. A deadline missed by whole periods is skipped and
+ * counted, never sent as a burst.
+ *
+ * An inverter's keep-alive (0x305, and 0x307 of some brands) is answered
+ * with the whole set at once, outside the grid. Without a publish for
+ * CAN_STALE_MS the sink falls silent, and the inverter sees the battery as
+ * lost rather than trusting old limits.
+ *
+ * CanDriver hides the controller: TWAI on the ESP32 (below), SocketCAN on
+ * Linux (native/can_bus.h).
+ */
+
+#ifndef CAN_EXPORT_H
+#define CAN_EXPORT_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#define CAN_BITRATE 500000
+#define CAN_FRAME_COUNT 6
+#define CAN_STAGGER_US 2000          // between the frames of one period
+#define CAN_STALE_MS 30000           // silent after this long without a publish
+#define CAN_ANSWER_MIN_US 100000     // keep-alives closer together share one answer
+#define CAN_ID_KEEPALIVE 0x305       // inverter to battery
+#define CAN_ID_INVERTER_INFO 0x307
+
+// Pack conditions behind the 0x359 / 0x35C bits
+#define CAN_FLAG_CELL_HIGH 0x01
+#define CAN_FLAG_CELL_LOW 0x02
+#define CAN_FLAG_SOC_LOW 0x04
+#define CAN_FLAG_NO_DATA 0x08
+#define CAN_FLAG_CHARGE_OFF 0x10      // charge MOS open
+#define CAN_FLAG_DISCHARGE_OFF 0x20   // discharge MOS open
+
+struct CanFrame {
+  uint32_t id = 0;
+  uint8_t len = 0;
+  uint8_t data[8] = {};
+};
+
+class CanDriver {
+public:
+  virtual ~CanDriver() {}
+  // Queue one frame for the bus without waiting; false if the queue is full
+  virtual bool send(const CanFrame& f) = 0;
+  // The next received frame, waiting up to waitUs for one
+  virtual bool receive(CanFrame& f, uint32_t waitUs) = 0;
+};
+
+struct CanSlot {
+  uint16_t id;
+  uint8_t len;
+  uint16_t periodMs;
+};
+
+// What is sent and how often, in send order within a period
+static constexpr CanSlot CAN_SCHEDULE[CAN_FRAME_COUNT] = {
+  {0x351, 8, 1000},
+  {0x355, 4, 1000},
+  {0x356, 6, 1000},
+  {0x359, 7, 1000},
+  {0x35C, 2, 1000},
+  {0x35E, 8, 5000},
+};
+
+// One decoded frame in protocol units
+struct CanPack {
+  uint16_t charge_v_dv = 0;     // charge voltage limit, 0.1 V
+  int16_t charge_a_da = 0;      // charge current limit, 0.1 A
+  int16_t discharge_a_da = 0;   // discharge current limit, 0.1 A
+  uint16_t discharge_v_dv = 0;  // discharge voltage limit, 0.1 V
+  uint16_t soc_pct = 0;
+  uint16_t soh_pct = 100;
+  int16_t voltage_cv = 0;       // 10 mV
+  int16_t current_da = 0;       // 100 mA, + charging
+  int16_t temp_dc = 0;          // 0.1 C
+  uint8_t flags = 0;            // CAN_FLAG_*
+};
+
+inline void canPutU16(uint8_t* p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+inline uint16_t canGetU16(const uint8_t* p) { return (uint16_t)(p[0] | p[1] << 8); }
+
+// The payload of schedule slot `slot`, CAN_SCHEDULE[slot].len bytes
+inline void canEncode(uint8_t slot, const CanPack& v, uint8_t* out) {
+  memset(out, 0, 8);
+  switch (CAN_SCHEDULE[slot].id) {
+    case 0x351:
+      canPutU16(out, v.charge_v_dv);
+      canPutU16(out + 2, (uint16_t)v.charge_a_da);
+      canPutU16(out + 4, (uint16_t)v.discharge_a_da);
+      canPutU16(out + 6, v.discharge_v_dv);
+      break;
+    case 0x355:
+      canPutU16(out, v.soc_pct);
+      canPutU16(out + 2, v.soh_pct);
+      break;
+    case 0x356:
+      canPutU16(out, (uint16_t)v.voltage_cv);
+      canPutU16(out + 2, (uint16_t)v.current_da);
+      canPutU16(out + 4, (uint16_t)v.temp_dc);
+      break;
+    case 0x359:
+      // Protection when the BMS has opened the MOS over it, else an alarm
+      if ((v.flags & CAN_FLAG_CELL_HIGH) && (v.flags & CAN_FLAG_CHARGE_OFF)) out[0] |= 0x02;
+      if ((v.flags & CAN_FLAG_CELL_LOW) && (v.flags & CAN_FLAG_DISCHARGE_OFF)) out[0] |= 0x04;
+      if (v.flags & CAN_FLAG_CELL_HIGH) out[2] |= 0x02;
+      if (v.flags & CAN_FLAG_CELL_LOW) out[2] |= 0x04;
+      if (v.flags & CAN_FLAG_NO_DATA) out[3] |= 0x08;   // internal communication fail
+      out[4] = 1;                                       // modules
+      out[5] = 'P';
+      out[6] = 'N';
+      break;
+    case 0x35C:
+      if (!(v.flags & (CAN_FLAG_CHARGE_OFF | CAN_FLAG_CELL_HIGH))) out[0] |= 0x80;
+      if (!(v.flags & (CAN_FLAG_DISCHARGE_OFF | CAN_FLAG_CELL_LOW))) out[0] |= 0x40;
+      if (v.flags & CAN_FLAG_SOC_LOW) out[0] |= 0x20;
+      break;
+    case 0x35E:
+      memcpy(out, "PYLON   ", 8);
+      break;
+  }
+}
+
+#define CAN_TABLE_WORDS (CAN_FRAME_COUNT * 2)
+
+class CanExporter {
+public:
+  // Loop: encode one decoded frame for every slot
+  void publish(const CanPack& v) {
+    uint8_t table[CAN_FRAME_COUNT * 8];
+    for (uint8_t i = 0; i < CAN_FRAME_COUNT; i++) canEncode(i, v, table + 8 * i);
+    uint32_t s = seq_.load(std::memory_order_relaxed);
+    seq_.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (uint8_t w = 0; w < CAN_TABLE_WORDS; w++) {
+      uint32_t word;
+      memcpy(&word, table + 4 * w, 4);
+      words_[w].store(word, std::memory_order_relaxed);
+    }
+    seq_.store(s + 2, std::memory_order_release);
+  }
+
+  // Any task: stop or resume sending (the schedule keeps running)
+  void setEnabled(bool on) { enabled_.store(on); }
+  bool enabled() const { return enabled_.load(); }
+
+  // CAN task: a received frame; true when it asks for an answer now
+  bool onReceive(const CanFrame& f, uint32_t nowUs) {
+    if (f.id != CAN_ID_KEEPALIVE && f.id != CAN_ID_INVERTER_INFO) {
+      ignored_++;
+      return false;
+    }
+    requests_++;
+    lastRequestUs_ = nowUs;
+    inverterSeen_ = true;
+    if (answerDue_ || (answered_ && nowUs - lastAnswerUs_ < CAN_ANSWER_MIN_US)) {
+      coalesced_++;
+      return false;
+    }
+    answerDue_ = true;
+    return true;
+  }
+
+  // CAN task: send what is due, then the wait in us until the next deadline
+  uint32_t service(CanDriver& bus, uint32_t nowUs) {
+    if (!scheduled_) {
+      for (uint8_t i = 0; i < CAN_FRAME_COUNT; i++) due_[i] = nowUs + i * CAN_STAGGER_US;
+      scheduled_ = true;
+    }
+    uint32_t seq = seq_.load(std::memory_order_acquire);
+    if (seq != lastSeq_) {
+      lastSeq_ = seq;
+      freshUs_ = nowUs;
+    }
+    bool live = enabled_.load() && seq != 0 && nowUs - freshUs_ <= (uint32_t)CAN_STALE_MS * 1000;
+    uint8_t table[CAN_FRAME_COUNT * 8];
+    if (live) read(table);
+
+    if (answerDue_) {
+      answerDue_ = false;
+      if (live) {
+        for (uint8_t i = 0; i < CAN_FRAME_COUNT; i++) sendSlot(bus, i, table);
+        answers_++;
+        answered_ = true;
+        lastAnswerUs_ = nowUs;
+      }
+    }
+
+    uint32_t wait = UINT32_MAX;
+    for (uint8_t i = 0; i < CAN_FRAME_COUNT; i++) {
+      uint32_t periodUs = (uint32_t)CAN_SCHEDULE[i].periodMs * 1000;
+      int32_t late = (int32_t)(nowUs - due_[i]);
+      if (late >= 0) {
+        if (live) {
+          sendSlot(bus, i, table);
+          if ((uint32_t)late > maxLateUs_) maxLateUs_ = (uint32_t)late;
+          lateSumUs_ += (uint32_t)late;
+          lateCount_++;
+        } else {
+          silent_++;
+        }
+        due_[i] += periodUs;
+        if ((int32_t)(nowUs - due_[i]) >= 0) {
+          uint32_t missed = (nowUs - due_[i]) / periodUs + 1;
+          due_[i] += missed * periodUs;
+          overruns_ += missed;
+        }
+      }
+      uint32_t until = due_[i] - nowUs;
+      if (until < wait) wait = until;
+    }
+    return wait;
+  }
+
+  // An inverter keep-alive within the last `windowMs`
+  bool inverterPresent(uint32_t nowUs, uint32_t windowMs = 5000) const {
+    return inverterSeen_ && nowUs - lastRequestUs_ <= windowMs * 1000;
+  }
+
+  uint32_t published() const { return seq_.load() / 2; }
+  uint32_t sent() const { return sent_; }
+  uint32_t refused() const { return refused_; }
+  uint32_t overruns() const { return overruns_; }
+  uint32_t silent() const { return silent_; }
+  uint32_t requests() const { return requests_; }
+  uint32_t answers() const { return answers_; }
+  uint32_t coalesced() const { return coalesced_; }
+  uint32_t ignored() const { return ignored_; }
+  uint32_t maxLateUs() const { return maxLateUs_; }
+  uint32_t avgLateUs() const { return lateCount_ ? (uint32_t)(lateSumUs_ / lateCount_) : 0; }
+
+private:
+  void read(uint8_t* table) const {
+    uint32_t copy[CAN_TABLE_WORDS];
+    for (;;) {
+      uint32_t s1 = seq_.load(std::memory_order_acquire);
+      if (s1 & 1) continue;
+      for (uint8_t w = 0; w < CAN_TABLE_WORDS; w++) copy[w] = words_[w].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq_.load(std::memory_order_relaxed) == s1) break;
+    }
+    memcpy(table, copy, sizeof(copy));
+  }
+
+  void sendSlot(CanDriver& bus, uint8_t i, const uint8_t* table) {
+    CanFrame f;
+    f.id = CAN_SCHEDULE[i].id;
+    f.len = CAN_SCHEDULE[i].len;
+    memcpy(f.data, table + 8 * i, 8);
+    if (bus.send(f)) sent_++;
+    else refused_++;
+  }
+
+  // Loop to CAN task
+  std::atomic<uint32_t> seq_{0};
+  std::atomic<uint32_t> words_[CAN_TABLE_WORDS] = {};
+  std::atomic<bool> enabled_{true};
+
+  // CAN task only
+  bool scheduled_ = false;
+  uint32_t due_[CAN_FRAME_COUNT] = {};
+  uint32_t lastSeq_ = 0;
+  uint32_t freshUs_ = 0;
+  bool answerDue_ = false;
+  bool answered_ = false;
+  uint32_t lastAnswerUs_ = 0;
+  bool inverterSeen_ = false;
+  uint32_t lastRequestUs_ = 0;
+  uint32_t sent_ = 0, refused_ = 0, overruns_ = 0, silent_ = 0;
+  uint32_t requests_ = 0, answers_ = 0, coalesced_ = 0, ignored_ = 0;
+  uint32_t maxLateUs_ = 0;
+  uint64_t lateSumUs_ = 0;
+  uint32_t lateCount_ = 0;
+};
+
+#ifndef BMS_NATIVE
+#include "driver/twai.h"
+
+// The ESP32's TWAI controller at CAN_BITRATE. send() never blocks: a full
+// TX queue refuses the frame, which the exporter counts.
+class TwaiCanDriver : public CanDriver {
+public:
+  bool begin(int txPin, int rxPin) {
+    twai_general_config_t g = TWAI_GENERAL_CONFIG_DEFAULT((gpio_num_t)txPin, (gpio_num_t)rxPin, TWAI_MODE_NORMAL);
+    g.tx_queue_len = 2 * CAN_FRAME_COUNT;
+    g.rx_queue_len = 8;
+    twai_timing_config_t t = TWAI_TIMING_CONFIG_500KBITS();
+    twai_filter_config_t f = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+    return twai_driver_install(&g, &t, &f) == ESP_OK && twai_start() == ESP_OK;
+  }
+
+  bool send(const CanFrame& f) override {
+    twai_message_t m = {};
+    m.identifier = f.id;
+    m.data_length_code = f.len;
+    memcpy(m.data, f.data, f.len);
+    return twai_transmit(&m, 0) == ESP_OK;
+  }
+
+  // Waits whole ticks, rounded down: the last part of a wait returns at
+  // once, so the caller meets a deadline within the tick instead of after it
+  bool receive(CanFrame& f, uint32_t waitUs) override {
+    twai_message_t m;
+    if (twai_receive(&m, waitUs / (portTICK_PERIOD_MS * 1000)) != ESP_OK) return false;
+    if (m.rtr) return false;
+    f.id = m.identifier;
+    f.len = m.data_length_code > 8 ? 8 : m.data_length_code;
+    memcpy(f.data, m.data, f.len);
+    return true;
+  }
+
+  // Bus-off after a wiring fault: start the recovery, then restart
+  void recover() {
+    twai_status_info_t s;
+    if (twai_get_status_info(&s) != ESP_OK) return;
+    if (s.state == TWAI_STATE_BUS_OFF) twai_initiate_recovery();
+    else if (s.state == TWAI_STATE_STOPPED) twai_start();
+  }
+};
+#endif
+
+#endif // CAN_EXPORT_H
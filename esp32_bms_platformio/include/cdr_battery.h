@@ -0,0 +1,194 @@
+/*
+ * sensor_msgs/BatteryState and std_msgs/Float32MultiArray as XCDR1 bytes
+ *
+ * The payload is exactly what a ROS 2 serialized message holds: the 4-byte
+ * CDR_LE encapsulation header followed by the fields in IDL order, each
+ * primitive aligned to its size relative to the end of that header, strings
+ * as uint32 length (with NUL) + bytes + NUL, sequences as uint32 count +
+ * elements. The host can hand it to a publisher as-is (rclpy publishes
+ * bytes) instead of decoding JSON and rebuilding the message.
+ *
+ * On the wire each payload is framed so it can share the port with text:
+ *   AA 55 | topic | length (u16 LE) | payload | CRC-16/CCITT (LE, over topic..payload)
+ */
+
+#ifndef CDR_BATTERY_H
+#define CDR_BATTERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CDR_SYNC0 0xAA
+#define CDR_SYNC1 0x55
+#define CDR_FRAME_HEADER 5          // sync, sync, topic, length
+#define CDR_FRAME_OVERHEAD 7        // header + CRC
+#define CDR_FRAME_MAX 320           // one BatteryState with 32 cells and 31-char strings
+#define CDR_MAX_CELLS 32
+#define CDR_ENCAPSULATION_LE 0x0001 // CDR_LE, plain (XCDR1) encoding
+
+enum CdrTopic : uint8_t {
+  CDR_TOPIC_BATTERY_STATE = 1, CDR_TOPIC_CELL_VOLTAGES = 2,
+  CDR_TOPIC_RAW_DALY = 3      // not CDR: a raw BMS frame record (raw_frames.h)
+};
+
+// sensor_msgs/BatteryState constants
+enum : uint8_t {
+  BATTERY_STATUS_UNKNOWN = 0, BATTERY_STATUS_CHARGING = 1, BATTERY_STATUS_DISCHARGING = 2,
+  BATTERY_STATUS_NOT_CHARGING = 3, BATTERY_STATUS_FULL = 4
+};
+enum : uint8_t {
+  BATTERY_HEALTH_UNKNOWN = 0, BATTERY_HEALTH_GOOD = 1, BATTERY_HEALTH_OVERHEAT = 2, BATTERY_HEALTH_DEAD = 3,
+  BATTERY_HEALTH_OVERVOLTAGE = 4, BATTERY_HEALTH_UNSPEC_FAILURE = 5, BATTERY_HEALTH_COLD = 6
+};
+enum : uint8_t {
+  BATTERY_TECH_UNKNOWN = 0, BATTERY_TECH_NIMH = 1, BATTERY_TECH_LION = 2, BATTERY_TECH_LIPO = 3,
+  BATTERY_TECH_LIFE = 4, BATTERY_TECH_NICD = 5, BATTERY_TECH_LIMN = 6
+};
+
+// Field values for one BatteryState (strings are not copied)
+struct BatteryStateMsg {
+  int32_t stamp_sec = 0;
+  uint32_t stamp_nanosec = 0;
+  const char* frame_id = "";
+  float voltage = 0;
+  float temperature = 0;
+  float current = 0;          // negative while discharging
+  float charge = 0;           // Ah
+  float capacity = 0;         // Ah
+  float design_capacity = 0;  // Ah
+  float percentage = 0;       // 0..1
+  uint8_t power_supply_status = BATTERY_STATUS_UNKNOWN;
+  uint8_t power_supply_health = BATTERY_HEALTH_UNKNOWN;
+  uint8_t power_supply_technology = BATTERY_TECH_UNKNOWN;
+  bool present = true;
+  const float* cell_voltage = nullptr;
+  uint8_t cells = 0;
+  const char* location = "";
+  const char* serial_number = "";
+};
+
+// Little-endian CDR writer over a caller's buffer; a write that does not
+// fit marks the writer failed and everything after it is ignored
+class CdrWriter {
+public:
+  CdrWriter(uint8_t* buf, size_t cap) : buf_(buf), cap_(cap) {}
+
+  void begin() {
+    pos_ = 0;
+    ok_ = cap_ >= 4;
+    if (!ok_) return;
+    buf_[0] = CDR_ENCAPSULATION_LE >> 8;
+    buf_[1] = CDR_ENCAPSULATION_LE & 0xFF;
+    buf_[2] = 0;
+    buf_[3] = 0;
+    pos_ = 4;
+  }
+
+  void u8(uint8_t v) { put(&v, 1, 1); }
+  void boolean(bool v) { u8(v ? 1 : 0); }
+  void u32(uint32_t v) {
+    uint8_t b[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+    put(b, 4, 4);
+  }
+  void i32(int32_t v) { u32((uint32_t)v); }
+  void f32(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, 4);
+    u32(bits);
+  }
+  void str(const char* s) {
+    size_t n = strlen(s);
+    u32((uint32_t)(n + 1));
+    put((const uint8_t*)s, n + 1, 1);
+  }
+  void f32seq(const float* v, uint32_t n) {
+    u32(n);
+    for (uint32_t i = 0; i < n; i++) f32(v[i]);
+  }
+
+  bool ok() const { return ok_; }
+  size_t length() const { return ok_ ? pos_ : 0; }
+
+private:
+  void put(const uint8_t* p, size_t n, size_t alignment) {
+    if (!ok_) return;
+    size_t pad = (alignment - (pos_ - 4) % alignment) % alignment;
+    if (pos_ + pad + n > cap_) {
+      ok_ = false;
+      return;
+    }
+    while (pad--) buf_[pos_++] = 0;
+    memcpy(buf_ + pos_, p, n);
+    pos_ += n;
+  }
+
+  uint8_t* buf_;
+  size_t cap_;
+  size_t pos_ = 0;
+  bool ok_ = false;
+};
+
+// sensor_msgs/BatteryState; returns the payload length, 0 if it did not fit
+inline size_t cdrEncodeBatteryState(const BatteryStateMsg& m, uint8_t* out, size_t cap) {
+  CdrWriter w(out, cap);
+  w.begin();
+  w.i32(m.stamp_sec);             // std_msgs/Header: builtin_interfaces/Time stamp
+  w.u32(m.stamp_nanosec);
+  w.str(m.frame_id);
+  w.f32(m.voltage);
+  w.f32(m.temperature);
+  w.f32(m.current);
+  w.f32(m.charge);
+  w.f32(m.capacity);
+  w.f32(m.design_capacity);
+  w.f32(m.percentage);
+  w.u8(m.power_supply_status);
+  w.u8(m.power_supply_health);
+  w.u8(m.power_supply_technology);
+  w.boolean(m.present);
+  w.f32seq(m.cell_voltage, m.cells);
+  w.f32seq(nullptr, 0);           // cell_temperature: not measured per cell
+  w.str(m.location);
+  w.str(m.serial_number);
+  return w.length();
+}
+
+// std_msgs/Float32MultiArray with one dimension labelled "cells"
+inline size_t cdrEncodeCellVoltages(const float* volts, uint8_t cells, uint8_t* out, size_t cap) {
+  CdrWriter w(out, cap);
+  w.begin();
+  w.u32(1);                       // layout.dim: one MultiArrayDimension
+  w.str("cells");
+  w.u32(cells);                   //   size
+  w.u32(cells);                   //   stride
+  w.u32(0);                       // layout.data_offset
+  w.f32seq(volts, cells);
+  return w.length();
+}
+
+// CRC-16/CCITT-FALSE
+inline uint16_t cdrFrameCrc(const uint8_t* data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t b = 0; b < 8; b++) crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+// Frame a payload already encoded at frame + CDR_FRAME_HEADER; returns the
+// frame length (payload + CDR_FRAME_OVERHEAD)
+inline size_t cdrFrame(uint8_t topic, uint8_t* frame, size_t payload_len) {
+  frame[0] = CDR_SYNC0;
+  frame[1] = CDR_SYNC1;
+  frame[2] = topic;
+  frame[3] = (uint8_t)payload_len;
+  frame[4] = (uint8_t)(payload_len >> 8);
+  uint16_t crc = cdrFrameCrc(frame + 2, payload_len + 3);
+  frame[CDR_FRAME_HEADER + payload_len] = (uint8_t)crc;
+  frame[CDR_FRAME_HEADER + payload_len + 1] = (uint8_t)(crc >> 8);
+  return payload_len + CDR_FRAME_OVERHEAD;
+}
+
+#endif // CDR_BATTERY_H
@@ -0,0 +1,254 @@
+/*
+ * Typed runtime configuration
+ *
+ * RuntimeConfig holds the tunables that used to be compile-time constants.
+ * Every field is described once in CONFIG_KEYS (name, type, range), which
+ * drives parsing, validation, persistence and the `config` listing. Values
+ * persist per key in NVS on the ESP32 and in a key=value file on the host;
+ * a stored value that no longer validates is ignored and the default kept.
+ */
+
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_KEY_MAX 15          // NVS key length limit
+#define CONFIG_VALUE_MAX 63        // longest value as text (a WPA2 passphrase)
+#define CONFIG_MAC_LEN 17          // "41:18:12:01:18:9F"
+#define CONFIG_NAME_MAX 31
+#define CONFIG_SSID_MAX 32
+#define CONFIG_PASS_MAX 63
+#define CONFIG_READ_MS_MIN 500     // smallest read_ms
+#define CONFIG_NVS_NAMESPACE "bmscfg"
+
+struct RuntimeConfig {
+  uint32_t read_interval_ms = 5000;     // between BMS reads while connected
+  uint32_t response_timeout_ms = 3000;  // reply wait upper bound (and until the RTT estimate warms up)
+  uint32_t response_timeout_min_ms = 150; // reply wait lower bound
+  uint32_t scan_interval_ms = 30000;    // between scans while disconnected
+  uint32_t hedge_requests = 0;          // 1 = duplicate a request whose reply is overdue
+  uint32_t capacity_ah = 230;           // pack capacity (SOC estimate, remaining capacity)
+  uint32_t output_format = 0;           // 0 = JSON records, 1 = framed CDR messages, 2 = both, 3 = raw frames
+  uint32_t block_budget_ms = 500;       // loop() blocks longer than this are reported
+  char bms_mac[CONFIG_MAC_LEN + 1] = "41:18:12:01:18:9F";
+  char bms_name[CONFIG_NAME_MAX + 1] = "DL-41181201189F";
+  char wifi_ssid[CONFIG_SSID_MAX + 1] = "";  // empty = Wi-Fi off (no Modbus TCP)
+  char wifi_pass[CONFIG_PASS_MAX + 1] = "";
+  uint32_t modbus_unit = 1;             // RTU slave address
+  uint32_t modbus_baud = 9600;          // RTU line speed, 8N1
+  uint32_t can_export = 0;              // 1 = Pylontech frames to an inverter on CAN
+  uint32_t can_charge_a = 100;          // charge current limit sent to the inverter
+  uint32_t can_discharge_a = 100;       // discharge current limit sent to the inverter
+};
+
+static_assert(sizeof(RuntimeConfig::bms_mac) - 1 <= CONFIG_VALUE_MAX, "MAC must fit the value buffer");
+static_assert(sizeof(RuntimeConfig::bms_name) - 1 <= CONFIG_VALUE_MAX, "name must fit the value buffer");
+static_assert(sizeof(RuntimeConfig::wifi_pass) - 1 <= CONFIG_VALUE_MAX, "passphrase must fit the value buffer");
+static_assert(sizeof(CONFIG_NVS_NAMESPACE) - 1 <= CONFIG_KEY_MAX, "NVS namespace is limited to 15 characters");
+
+enum ConfigType : uint8_t { CONFIG_U32, CONFIG_STR };
+
+enum ConfigResult : uint8_t { CONFIG_OK, CONFIG_UNKNOWN_KEY, CONFIG_INVALID, CONFIG_OUT_OF_RANGE, CONFIG_NOT_SAVED };
+
+struct ConfigKey {
+  const char* name;
+  ConfigType type;
+  uint16_t offset;              // into RuntimeConfig
+  uint32_t min, max;            // value range (U32) or length range (STR, max = buffer - 1)
+  bool (*valid)(const char*);   // extra format check for strings, may be null
+  const char* help;
+};
+
+// Key names go straight to NVS, so they are length-checked at compile time
+template <size_t N>
+constexpr const char* configKeyName(const char (&name)[N]) {
+  static_assert(N - 1 <= CONFIG_KEY_MAX, "config key names are limited to 15 characters (NVS)");
+  return name;
+}
+
+inline bool configValidMac(const char* s) {
+  if (strlen(s) != CONFIG_MAC_LEN) return false;
+  for (int i = 0; i < CONFIG_MAC_LEN; i++) {
+    char c = s[i];
+    bool hex = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    if (i % 3 == 2 ? c != ':' : !hex) return false;
+  }
+  return true;
+}
+
+static const ConfigKey CONFIG_KEYS[] = {
+  {configKeyName("read_ms"), CONFIG_U32, offsetof(RuntimeConfig, read_interval_ms), CONFIG_READ_MS_MIN, 3600000, nullptr,
+   "BMS read interval (ms)"},
+  {configKeyName("timeout_ms"), CONFIG_U32, offsetof(RuntimeConfig, response_timeout_ms), 100, 30000, nullptr,
+   "reply timeout upper bound (ms)"},
+  {configKeyName("timeout_min_ms"), CONFIG_U32, offsetof(RuntimeConfig, response_timeout_min_ms), 20, 30000, nullptr,
+   "reply timeout lower bound (ms)"},
+  {configKeyName("scan_ms"), CONFIG_U32, offsetof(RuntimeConfig, scan_interval_ms), 1000, 3600000, nullptr,
+   "scan interval while disconnected (ms)"},
+  {configKeyName("hedge"), CONFIG_U32, offsetof(RuntimeConfig, hedge_requests), 0, 1, nullptr,
+   "hedged duplicate requests after p90 RTT (0/1)"},
+  {configKeyName("capacity_ah"), CONFIG_U32, offsetof(RuntimeConfig, capacity_ah), 1, 5000, nullptr,
+   "pack capacity (Ah)"},
+  {configKeyName("output"), CONFIG_U32, offsetof(RuntimeConfig, output_format), 0, 3, nullptr,
+   "record format: 0 JSON, 1 CDR BatteryState frames, 2 both, 3 raw BMS frames"},
+  {configKeyName("block_ms"), CONFIG_U32, offsetof(RuntimeConfig, block_budget_ms), 10, 60000, nullptr,
+   "warn when one block holds loop() longer (ms)"},
+  {configKeyName("mac"), CONFIG_STR, offsetof(RuntimeConfig, bms_mac), CONFIG_MAC_LEN, sizeof(RuntimeConfig::bms_mac) - 1,
+   configValidMac, "target BMS MAC (aa:bb:cc:dd:ee:ff)"},
+  {configKeyName("name"), CONFIG_STR, offsetof(RuntimeConfig, bms_name), 1, sizeof(RuntimeConfig::bms_name) - 1, nullptr,
+   "target BMS advertised name"},
+  {configKeyName("wifi_ssid"), CONFIG_STR, offsetof(RuntimeConfig, wifi_ssid), 0, sizeof(RuntimeConfig::wifi_ssid) - 1,
+   nullptr, "Wi-Fi network for Modbus TCP (empty = off)"},
+  {configKeyName("wifi_pass"), CONFIG_STR, offsetof(RuntimeConfig, wifi_pass), 0, sizeof(RuntimeConfig::wifi_pass) - 1,
+   nullptr, "Wi-Fi passphrase (not shown)"},
+  {configKeyName("modbus_unit"), CONFIG_U32, offsetof(RuntimeConfig, modbus_unit), 1, 247, nullptr,
+   "Modbus RTU slave address"},
+  {configKeyName("modbus_baud"), CONFIG_U32, offsetof(RuntimeConfig, modbus_baud), 1200, 115200, nullptr,
+   "Modbus RTU baud rate (8N1)"},
+  {configKeyName("can_export"), CONFIG_U32, offsetof(RuntimeConfig, can_export), 0, 1, nullptr,
+   "Pylontech CAN frames to the inverter (0/1)"},
+  {configKeyName("can_charge_a"), CONFIG_U32, offsetof(RuntimeConfig, can_charge_a), 0, 1000, nullptr,
+   "charge current limit on CAN (A)"},
+  {configKeyName("can_discharge_a"), CONFIG_U32, offsetof(RuntimeConfig, can_discharge_a), 0, 1000, nullptr,
+   "discharge current limit on CAN (A)"},
+};
+
+#define CONFIG_KEY_COUNT (sizeof(CONFIG_KEYS) / sizeof(CONFIG_KEYS[0]))
+
+// Persistent storage for individual keys
+class ConfigBackend {
+public:
+  virtual ~ConfigBackend() {}
+  virtual bool begin() = 0;
+  virtual bool getU32(const char* key, uint32_t& value) = 0;
+  virtual bool getStr(const char* key, char* out, size_t len) = 0;
+  virtual bool putU32(const char* key, uint32_t value) = 0;
+  virtual bool putStr(const char* key, const char* value) = 0;
+  virtual bool clear() = 0;
+};
+
+class ConfigStore {
+public:
+  // Load stored values over the defaults; returns how many were applied
+  uint8_t begin(ConfigBackend* backend) {
+    backend_ = backend;
+    if (!backend_ || !backend_->begin()) {
+      backend_ = nullptr;
+      return 0;
+    }
+    uint8_t loaded = 0;
+    for (uint8_t i = 0; i < CONFIG_KEY_COUNT; i++) {
+      const ConfigKey& k = CONFIG_KEYS[i];
+      char text[CONFIG_VALUE_MAX + 1];
+      uint32_t v;
+      if (k.type == CONFIG_U32) {
+        if (!backend_->getU32(k.name, v)) continue;
+        snprintf(text, sizeof(text), "%lu", (unsigned long)v);
+      } else if (!backend_->getStr(k.name, text, sizeof(text))) {
+        continue;
+      }
+      if (apply(k, text) == CONFIG_OK) loaded++;
+    }
+    return loaded;
+  }
+
+  const RuntimeConfig& get() const { return config_; }
+
+  // Parse, validate, apply and persist one value
+  ConfigResult set(const char* name, const char* text, uint8_t* index = nullptr) {
+    for (uint8_t i = 0; i < CONFIG_KEY_COUNT; i++) {
+      const ConfigKey& k = CONFIG_KEYS[i];
+      if (strcmp(k.name, name) != 0) continue;
+      if (index) *index = i;
+      ConfigResult r = apply(k, text);
+      if (r != CONFIG_OK) return r;
+      if (!backend_) return CONFIG_NOT_SAVED;
+      bool saved = k.type == CONFIG_U32 ? backend_->putU32(k.name, *u32(k)) : backend_->putStr(k.name, str(k));
+      return saved ? CONFIG_OK : CONFIG_NOT_SAVED;
+    }
+    return CONFIG_UNKNOWN_KEY;
+  }
+
+  // Back to compiled-in defaults and forget stored values
+  bool reset() {
+    config_ = RuntimeConfig();
+    return backend_ ? backend_->clear() : false;
+  }
+
+  bool persistent() const { return backend_ != nullptr; }
+
+  void format(uint8_t index, char* out, size_t len) const {
+    const ConfigKey& k = CONFIG_KEYS[index];
+    if (k.type == CONFIG_U32) snprintf(out, len, "%lu", (unsigned long)*u32(k));
+    else snprintf(out, len, "%s", str(k));
+  }
+
+  static const char* resultText(ConfigResult r) {
+    switch (r) {
+      case CONFIG_OK: return "ok";
+      case CONFIG_UNKNOWN_KEY: return "unknown key";
+      case CONFIG_INVALID: return "invalid value";
+      case CONFIG_OUT_OF_RANGE: return "out of range";
+      case CONFIG_NOT_SAVED: return "applied but not saved";
+    }
+    return "?";
+  }
+
+private:
+  ConfigResult apply(const ConfigKey& k, const char* text) {
+    if (k.type == CONFIG_U32) {
+      if (*text < '0' || *text > '9') return CONFIG_INVALID;
+      char* end;
+      unsigned long v = strtoul(text, &end, 10);
+      if (*end != '\0') return CONFIG_INVALID;
+      if (v < k.min || v > k.max) return CONFIG_OUT_OF_RANGE;
+      *u32(k) = (uint32_t)v;
+      return CONFIG_OK;
+    }
+    if (k.valid && !k.valid(text)) return CONFIG_INVALID;
+    size_t n = strlen(text);
+    if (n < k.min || n > k.max) return CONFIG_OUT_OF_RANGE;
+    memcpy(str(k), text, n + 1);
+    return CONFIG_OK;
+  }
+
+  uint32_t* u32(const ConfigKey& k) { return (uint32_t*)((uint8_t*)&config_ + k.offset); }
+  const uint32_t* u32(const ConfigKey& k) const { return (const uint32_t*)((const uint8_t*)&config_ + k.offset); }
+  char* str(const ConfigKey& k) { return (char*)&config_ + k.offset; }
+  const char* str(const ConfigKey& k) const { return (const char*)&config_ + k.offset; }
+
+  RuntimeConfig config_;
+  ConfigBackend* backend_ = nullptr;
+};
+
+#ifndef BMS_NATIVE
+#include <Preferences.h>
+
+// One NVS entry per key in the "bmscfg" namespace
+class NvsConfigBackend : public ConfigBackend {
+public:
+  bool begin() override { return prefs_.begin(CONFIG_NVS_NAMESPACE, false); }
+  bool getU32(const char* key, uint32_t& value) override {
+    if (!prefs_.isKey(key)) return false;
+    value = prefs_.getUInt(key);
+    return true;
+  }
+  bool getStr(const char* key, char* out, size_t len) override {
+    if (!prefs_.isKey(key)) return false;
+    return prefs_.getString(key, out, len) > 0;
+  }
+  bool putU32(const char* key, uint32_t value) override { return prefs_.putUInt(key, value) == sizeof(value); }
+  bool putStr(const char* key, const char* value) override { return prefs_.putString(key, value) == strlen(value); }
+  bool clear() override { return prefs_.clear(); }
+
+private:
+  Preferences prefs_;
+};
+#endif
+
+#endif // CONFIG_STORE_H
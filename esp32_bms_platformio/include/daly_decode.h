@@ -0,0 +1,139 @@
+/*
+ * Daly frame decoding shared by the firmware and host tools
+ *
+ * Two wire formats reach us:
+ * - BLE (fff1 notifications): D2 03 | length | data | Modbus CRC-16 (LE).
+ *   The main info reply (CMD_INFO, 124 data bytes) and the MOS reply
+ *   (MOS_INFO, 18 data bytes) are decoded here.
+ * - UART / Bluetooth Classic: A5 | address | command | 08 | 8 data bytes |
+ *   sum of the first 12 bytes. Commands 0x90-0x94 are decoded here.
+ * Values come out in plain units (V, A, %, mV, degC); current is positive
+ * while charging. Nothing here allocates or touches Arduino, so the host
+ * decoder of the raw passthrough (raw_frames.h) uses the same code.
+ */
+
+#ifndef DALY_DECODE_H
+#define DALY_DECODE_H
+
+#include "frame_stats.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define DALY_CELLS 16
+#define DALY_A5_FRAME_LEN 13
+#define DALY_TEMP_OFFSET 40        // temperatures are sent in degC + 40
+#define DALY_CURRENT_OFFSET 30000  // current in 0.1 A + 30000
+
+inline uint16_t dalyU16(const uint8_t* p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+// CMD_INFO reply (D2 03, 124 data bytes; offsets from the frame start)
+struct DalyInfo {
+  uint16_t cell_mv[DALY_CELLS];
+  float voltage;        // sum of the cells
+  float current;
+  float soc;
+  uint16_t cycles;
+  int16_t temp_c[3];    // T1, T2, MOS
+  uint16_t max_cell_mv;
+  uint16_t min_cell_mv;
+};
+
+inline bool dalyDecodeInfo(const uint8_t* f, size_t len, DalyInfo& out) {
+  if (classifyDalyFrame(f, len, DALY_INFO_DATA_LEN) != FRAME_OK) return false;
+  uint32_t packMv = 0;
+  out.max_cell_mv = 0;
+  out.min_cell_mv = 0xFFFF;
+  for (uint8_t i = 0; i < DALY_CELLS; i++) {
+    uint16_t mv = dalyU16(f + 3 + i * 2);
+    out.cell_mv[i] = mv;
+    packMv += mv;
+    if (mv > out.max_cell_mv) out.max_cell_mv = mv;
+    if (mv < out.min_cell_mv) out.min_cell_mv = mv;
+  }
+  out.voltage = packMv / 1000.0f;
+  out.current = ((int32_t)dalyU16(f + 85) - DALY_CURRENT_OFFSET) / 10.0f;
+  out.soc = dalyU16(f + 87) / 10.0f;
+  out.cycles = dalyU16(f + 105);
+  for (uint8_t i = 0; i < 3; i++) out.temp_c[i] = (int16_t)dalyU16(f + 67 + i * 2) - DALY_TEMP_OFFSET;
+  return true;
+}
+
+// MOS_INFO reply (D2 03, 18 data bytes)
+struct DalyMos {
+  bool charge;
+  bool discharge;
+};
+
+inline bool dalyDecodeMos(const uint8_t* f, size_t len, DalyMos& out) {
+  if (classifyDalyFrame(f, len, DALY_MOS_DATA_LEN) != FRAME_OK) return false;
+  out.charge = f[4] != 0;
+  out.discharge = f[6] != 0;
+  return true;
+}
+
+// A5 frames: start byte, length 08 and the byte sum
+inline bool dalyA5Valid(const uint8_t* f, size_t len) {
+  if (len != DALY_A5_FRAME_LEN || f[0] != 0xA5 || f[3] != 0x08) return false;
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < DALY_A5_FRAME_LEN - 1; i++) sum += f[i];
+  return sum == f[DALY_A5_FRAME_LEN - 1];
+}
+
+// The fields of one A5 reply; `valid` says which of the groups were set
+struct DalyA5Values {
+  uint8_t valid = 0;    // bit (command - 0x90) for 0x90..0x94
+  float voltage = 0, current = 0, soc = 0;                     // 0x90
+  uint16_t max_cell_mv = 0, min_cell_mv = 0;                   // 0x91
+  uint8_t max_cell_no = 0, min_cell_no = 0;
+  int16_t max_temp_c = 0, min_temp_c = 0;                      // 0x92
+  uint8_t mos_state = 0;                                       // 0x93: 0 idle, 1 charge, 2 discharge
+  bool charge_mos = false, discharge_mos = false;
+  uint8_t life_cycles = 0;
+  uint32_t remaining_mah = 0;
+  uint8_t cells = 0, temp_sensors = 0;                         // 0x94
+  bool charger = false, load = false;
+  uint16_t cycles = 0;
+};
+
+// Merge one A5 reply into `out`; false for a bad frame or another command
+inline bool dalyDecodeA5(const uint8_t* f, size_t len, DalyA5Values& out) {
+  if (!dalyA5Valid(f, len)) return false;
+  const uint8_t* d = f + 4;
+  switch (f[2]) {
+    case 0x90:
+      out.voltage = dalyU16(d) / 10.0f;
+      out.current = ((int32_t)dalyU16(d + 4) - DALY_CURRENT_OFFSET) / 10.0f;
+      out.soc = dalyU16(d + 6) / 10.0f;
+      break;
+    case 0x91:
+      out.max_cell_mv = dalyU16(d);
+      out.max_cell_no = d[2];
+      out.min_cell_mv = dalyU16(d + 3);
+      out.min_cell_no = d[5];
+      break;
+    case 0x92:
+      out.max_temp_c = (int16_t)d[0] - DALY_TEMP_OFFSET;
+      out.min_temp_c = (int16_t)d[2] - DALY_TEMP_OFFSET;
+      break;
+    case 0x93:
+      out.mos_state = d[0];
+      out.charge_mos = d[1] != 0;
+      out.discharge_mos = d[2] != 0;
+      out.life_cycles = d[3];
+      out.remaining_mah = (uint32_t)d[4] << 24 | (uint32_t)d[5] << 16 | (uint32_t)d[6] << 8 | d[7];
+      break;
+    case 0x94:
+      out.cells = d[0];
+      out.temp_sensors = d[1];
+      out.charger = d[2] != 0;
+      out.load = d[3] != 0;
+      out.cycles = dalyU16(d + 5);
+      break;
+    default:
+      return false;
+  }
+  out.valid |= 1 << (f[2] - 0x90);
+  return true;
+}
+
+#endif // DALY_DECODE_H
@@ -0,0 +1,299 @@
+/*
+ * Discovered BLE devices, for picking the BMS out of a crowded scan
+ *
+ * The scan callback runs on the BLE stack's task for every advertisement,
+ * and in a depot hundreds of devices advertise at once. Each advertisement
+ * updates one entry of a fixed-capacity open-addressing table (linear
+ * probing) keyed by the 48-bit address: the name from the raw advertising
+ * payload is matched against the BMS patterns in place, RSSI is smoothed
+ * (EWMA, 1/4 per advertisement, in 1/16 dBm), the last-seen time is
+ * stamped and the device classified. Nothing is allocated, formatted or
+ * printed; listing the devices and picking the one to connect to happen
+ * on the loop once the scan window has closed.
+ *
+ * The BLE task is the only writer while a scan runs. The loop changes the
+ * table only between scans (setTarget(), expire(), clear()) and may read
+ * it at any time: a new entry's fields are written before its advertisement
+ * count is published (release), and readers skip slots whose count is 0.
+ *
+ * Ordinary devices may fill DEVICE_TABLE_SLOTS * 3/4 slots, BMS candidates
+ * up to 7/8, so a crowd of phones and beacons cannot keep the BMS out and
+ * probe chains stay short. Devices that do not fit are counted.
+ */
+
+#ifndef DEVICE_TABLE_H
+#define DEVICE_TABLE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define DEVICE_TABLE_SLOTS 512            // power of two; 32 bytes each
+#define DEVICE_NAME_MAX 15                // kept for display; matching sees the whole name
+#define DEVICE_EXPIRE_MS 300000           // not seen for this long: dropped before the next scan
+
+// Name patterns and target matches (DeviceEntry::flags)
+#define DEVICE_FLAG_DALY 0x01             // name contains "Daly"
+#define DEVICE_FLAG_BMS 0x02              // "BMS"
+#define DEVICE_FLAG_DL 0x04               // "DL-", the Daly module prefix
+#define DEVICE_FLAG_SERIAL 0x08           // the serial of the known pack
+#define DEVICE_FLAG_TARGET_MAC 0x10       // address is the configured one
+#define DEVICE_FLAG_TARGET_NAME 0x20      // name is the configured one (case-insensitive)
+#define DEVICE_FLAG_SERVICE 0x40          // advertises a service UUID
+#define DEVICE_FLAGS_NAME (DEVICE_FLAG_DALY | DEVICE_FLAG_BMS | DEVICE_FLAG_DL | DEVICE_FLAG_SERIAL)
+#define DEVICE_FLAGS_TARGET (DEVICE_FLAG_TARGET_MAC | DEVICE_FLAG_TARGET_NAME)
+
+enum DeviceClass : uint8_t {
+  DEVICE_OTHER,        // nothing points at a BMS
+  DEVICE_CANDIDATE,    // name looks like a Daly BMS
+  DEVICE_TARGET,       // the configured MAC or name
+  DEVICE_CLASSES
+};
+
+const char* const DEVICE_CLASS_NAMES[] = {"other", "candidate", "target"};
+
+struct DeviceEntry {
+  uint8_t address[6];                      // in display order, as BLEAddress holds it
+  int16_t rssi16;                          // EWMA, dBm * 16
+  uint32_t lastSeenMs;
+  std::atomic<uint16_t> adverts;           // 0 = free slot; saturates at 0xFFFF
+  uint8_t flags;                           // DEVICE_FLAG_*
+  uint8_t cls;                             // DeviceClass
+  char name[DEVICE_NAME_MAX + 1];
+
+  int rssi() const { return (rssi16 + (rssi16 >= 0 ? 8 : -8)) / 16; }
+};
+static_assert(sizeof(DeviceEntry) == 32, "entry layout");
+
+// "41:18:12:01:18:9f" (either case) into 6 bytes; false if malformed
+inline bool parseBleAddress(const char* s, uint8_t out[6]) {
+  for (uint8_t i = 0; i < 6; i++) {
+    uint8_t v = 0;
+    for (uint8_t k = 0; k < 2; k++) {
+      char c = *s++;
+      if (c >= '0' && c <= '9') v = v << 4 | (c - '0');
+      else if (c >= 'a' && c <= 'f') v = v << 4 | (c - 'a' + 10);
+      else if (c >= 'A' && c <= 'F') v = v << 4 | (c - 'A' + 10);
+      else return false;
+    }
+    out[i] = v;
+    if (i < 5 && *s++ != ':') return false;
+  }
+  return *s == 0;
+}
+
+// Lower case, like BLEAddress::toString(); out holds 18 bytes
+inline void formatBleAddress(const uint8_t a[6], char* out) {
+  static const char hex[] = "0123456789abcdef";
+  for (uint8_t i = 0; i < 6; i++) {
+    out[i * 3] = hex[a[i] >> 4];
+    out[i * 3 + 1] = hex[a[i] & 15];
+    out[i * 3 + 2] = i < 5 ? ':' : 0;
+  }
+}
+
+// Local name from a raw advertising payload (AD structures: length, type,
+// data); the complete name (0x09) or else the shortened one (0x08)
+inline bool advertisedName(const uint8_t* p, size_t len, const char*& name, uint8_t& nameLen) {
+  bool found = false;
+  for (size_t i = 0; p && i + 1 < len && p[i] != 0;) {
+    uint8_t adLen = p[i];
+    if (i + 1 + adLen > len) break;
+    uint8_t type = p[i + 1];
+    if (type == 0x09 || (type == 0x08 && !found)) {
+      name = (const char*)p + i + 2;
+      nameLen = adLen - 1;
+      found = true;
+      if (type == 0x09) return true;
+    }
+    i += 1 + adLen;
+  }
+  return found;
+}
+
+// Does name[0..len) contain pat?
+inline bool nameContains(const char* name, uint8_t len, const char* pat) {
+  size_t n = strlen(pat);
+  for (size_t i = 0; i + n <= len; i++) {
+    if (memcmp(name + i, pat, n) == 0) return true;
+  }
+  return false;
+}
+
+class DeviceTable {
+public:
+  DeviceTable() { clear(); }
+
+  // What counts as the target; called on the loop before a scan
+  void setTarget(const char* mac, const char* name) {
+    hasTargetMac_ = parseBleAddress(mac, targetMac_);
+    size_t n = strlen(name);
+    targetNameLen_ = n < sizeof(targetName_) ? (uint8_t)n : 0;
+    memcpy(targetName_, name, targetNameLen_);
+  }
+
+  // BLE task: one advertisement. name may be null (none in this packet).
+  void observe(const uint8_t address[6], const char* name, uint8_t nameLen, int rssi, bool hasService,
+               uint32_t nowMs) {
+    adverts_++;
+    uint8_t flags = classify(address, name, nameLen) | (hasService ? DEVICE_FLAG_SERVICE : 0);
+    uint8_t cls = flags & DEVICE_FLAGS_TARGET ? DEVICE_TARGET : flags & DEVICE_FLAGS_NAME ? DEVICE_CANDIDATE : DEVICE_OTHER;
+    uint16_t probes = 0;
+    uint16_t i = find(address, probes);
+    if (probes > maxProbe_) maxProbe_ = probes;
+    DeviceEntry& e = slots_[i];
+    uint16_t n = e.adverts.load(std::memory_order_relaxed);
+    if (n == 0) {
+      uint16_t limit = cls == DEVICE_OTHER ? DEVICE_TABLE_SLOTS * 3 / 4 : DEVICE_TABLE_SLOTS * 7 / 8;
+      if (used_ >= limit) {
+        overflow_++;
+        return;
+      }
+      memcpy(e.address, address, 6);
+      e.rssi16 = (int16_t)(rssi * 16);
+      e.lastSeenMs = nowMs;
+      e.flags = flags;
+      e.cls = cls;
+      setName(e, name, nameLen);
+      used_++;
+      e.adverts.store(1, std::memory_order_release);
+      return;
+    }
+    e.rssi16 += (int16_t)((rssi * 16 - e.rssi16) / 4);
+    e.lastSeenMs = nowMs;
+    e.flags |= flags;
+    if (cls > e.cls) e.cls = cls;
+    if (name && nameLen) setName(e, name, nameLen);
+    if (n < 0xFFFF) e.adverts.store(n + 1, std::memory_order_relaxed);
+  }
+
+  // Loop, between scans: drop devices not seen for maxAgeMs. Deleting with
+  // backward shift keeps every probe chain unbroken without tombstones.
+  uint16_t expire(uint32_t nowMs, uint32_t maxAgeMs) {
+    uint16_t dropped = 0;
+    for (uint16_t i = 0; i < DEVICE_TABLE_SLOTS;) {
+      DeviceEntry& e = slots_[i];
+      if (e.adverts.load(std::memory_order_relaxed) && nowMs - e.lastSeenMs > maxAgeMs) {
+        remove(i);
+        dropped++;
+        continue;   // slot i now holds a shifted entry, or is free
+      }
+      i++;
+    }
+    return dropped;
+  }
+
+  void clear() {
+    for (uint16_t i = 0; i < DEVICE_TABLE_SLOTS; i++) slots_[i].adverts.store(0, std::memory_order_relaxed);
+    used_ = 0;
+  }
+
+  // The device to connect to: the target if seen, else the strongest
+  // candidate; only devices seen since sinceMs. Null if none.
+  const DeviceEntry* best(uint32_t sinceMs) const {
+    const DeviceEntry* b = nullptr;
+    for (uint16_t i = 0; i < DEVICE_TABLE_SLOTS; i++) {
+      const DeviceEntry& e = slots_[i];
+      if (!e.adverts.load(std::memory_order_acquire) || e.cls == DEVICE_OTHER) continue;
+      if ((int32_t)(e.lastSeenMs - sinceMs) < 0) continue;
+      if (!b || e.cls > b->cls || (e.cls == b->cls && e.rssi16 > b->rssi16)) b = &e;
+    }
+    return b;
+  }
+
+  // fn(const DeviceEntry&) for every device in the table
+  template <typename Fn>
+  void forEach(Fn fn) const {
+    for (uint16_t i = 0; i < DEVICE_TABLE_SLOTS; i++) {
+      if (slots_[i].adverts.load(std::memory_order_acquire)) fn(slots_[i]);
+    }
+  }
+
+  const DeviceEntry* lookup(const uint8_t address[6]) const {
+    uint16_t probes = 0;
+    uint16_t i = find(address, probes);
+    return slots_[i].adverts.load(std::memory_order_acquire) ? &slots_[i] : nullptr;
+  }
+
+  uint16_t size() const { return used_; }
+  uint32_t adverts() const { return adverts_; }
+  uint32_t overflow() const { return overflow_; }     // advertisements of devices that did not fit
+  uint16_t maxProbe() const { return maxProbe_; }     // longest probe sequence so far
+
+private:
+  static uint16_t hash(const uint8_t a[6]) {
+    uint64_t k = 0;
+    memcpy(&k, a, 6);
+    return (uint16_t)((k * 0x9E3779B97F4A7C15ULL) >> 48) & (DEVICE_TABLE_SLOTS - 1);
+  }
+
+  // Slot holding address, or the free slot where it would go; the table
+  // never fills up, so a free slot always ends the probe
+  uint16_t find(const uint8_t address[6], uint16_t& probes) const {
+    uint16_t i = hash(address);
+    while (slots_[i].adverts.load(std::memory_order_relaxed) && memcmp(slots_[i].address, address, 6) != 0) {
+      i = (i + 1) & (DEVICE_TABLE_SLOTS - 1);
+      probes++;
+    }
+    return i;
+  }
+
+  void remove(uint16_t i) {
+    uint16_t j = i;
+    for (;;) {
+      j = (j + 1) & (DEVICE_TABLE_SLOTS - 1);
+      DeviceEntry& e = slots_[j];
+      if (!e.adverts.load(std::memory_order_relaxed)) break;
+      // e may move into the hole at i only if its home slot is not
+      // cyclically within (i, j]
+      uint16_t home = hash(e.address);
+      if (((j - home) & (DEVICE_TABLE_SLOTS - 1)) < ((j - i) & (DEVICE_TABLE_SLOTS - 1))) continue;
+      DeviceEntry& hole = slots_[i];
+      memcpy(hole.address, e.address, 6);
+      hole.rssi16 = e.rssi16;
+      hole.lastSeenMs = e.lastSeenMs;
+      hole.flags = e.flags;
+      hole.cls = e.cls;
+      memcpy(hole.name, e.name, sizeof(hole.name));
+      hole.adverts.store(e.adverts.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      i = j;
+    }
+    slots_[i].adverts.store(0, std::memory_order_relaxed);
+    used_--;
+  }
+
+  uint8_t classify(const uint8_t address[6], const char* name, uint8_t len) const {
+    uint8_t flags = 0;
+    if (hasTargetMac_ && memcmp(address, targetMac_, 6) == 0) flags |= DEVICE_FLAG_TARGET_MAC;
+    if (!name || !len) return flags;
+    if (nameContains(name, len, "Daly")) flags |= DEVICE_FLAG_DALY;
+    if (nameContains(name, len, "BMS")) flags |= DEVICE_FLAG_BMS;
+    if (nameContains(name, len, "DL-")) flags |= DEVICE_FLAG_DL;
+    if (nameContains(name, len, "41181201189F")) flags |= DEVICE_FLAG_SERIAL;
+    if (targetNameLen_ && len == targetNameLen_ && strncasecmp(name, targetName_, len) == 0) {
+      flags |= DEVICE_FLAG_TARGET_NAME;
+    }
+    return flags;
+  }
+
+  static void setName(DeviceEntry& e, const char* name, uint8_t len) {
+    if (!name) len = 0;
+    if (len > DEVICE_NAME_MAX) len = DEVICE_NAME_MAX;
+    memcpy(e.name, name ? name : "", len);
+    e.name[len] = 0;
+  }
+
+  DeviceEntry slots_[DEVICE_TABLE_SLOTS];
+  uint8_t targetMac_[6] = {0};
+  bool hasTargetMac_ = false;
+  char targetName_[32] = {0};
+  uint8_t targetNameLen_ = 0;
+  uint16_t used_ = 0;
+  uint32_t adverts_ = 0;
+  uint32_t overflow_ = 0;
+  uint16_t maxProbe_ = 0;
+};
+
+#endif // DEVICE_TABLE_H
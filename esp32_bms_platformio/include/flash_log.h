@@ -0,0 +1,269 @@
+/*
+ * Time-indexed sample log on a raw flash partition
+ *
+ * The partition is used as a ring of 4 KB segments. Each segment starts with
+ * a header (magic, sequence number, first timestamp) followed by fixed-size
+ * samples. At boot only the headers are read back, into a table holding one
+ * first-timestamp per segment, so "the last hour" is a binary search over
+ * segments plus a binary search inside one segment, never a partition scan.
+ *
+ * Samples must be appended with non-decreasing timestamps (append() clamps).
+ */
+
+#ifndef FLASH_LOG_H
+#define FLASH_LOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#define FLASH_LOG_SECTOR 4096
+#define FLASH_LOG_MAGIC 0x474C4D42      // "BMLG"
+#define FLASH_LOG_EMPTY 0xFFFFFFFFUL    // erased flash
+
+// One logged sample (16 bytes, little endian as stored)
+struct LogSample {
+  uint32_t timestamp;     // seconds (epoch when known, else log clock)
+  uint16_t voltage_cv;    // pack voltage, 0.01 V
+  int16_t current_da;     // pack current, 0.1 A (negative = discharge)
+  uint16_t soc_pm;        // state of charge, 0.1 %
+  uint16_t max_cell_mv;   // highest cell (mV)
+  uint16_t min_cell_mv;   // lowest cell (mV)
+  int8_t max_temp;        // °C
+  int8_t min_temp;        // °C
+};
+static_assert(sizeof(LogSample) == 16, "LogSample layout is part of the flash format");
+
+struct FlashLogSegmentHeader {
+  uint32_t magic;
+  uint32_t seq;           // increases by one for every segment ever started
+  uint32_t first_ts;      // timestamp of the first sample in the segment
+  uint32_t reserved;
+};
+static_assert(sizeof(FlashLogSegmentHeader) == 16, "segment header is part of the flash format");
+
+#define FLASH_LOG_SLOTS ((FLASH_LOG_SECTOR - sizeof(FlashLogSegmentHeader)) / sizeof(LogSample))
+
+// Raw storage the log lives on: an ESP32 partition, or a file/RAM image on the host
+class FlashStorage {
+public:
+  virtual ~FlashStorage() {}
+  virtual uint32_t size() const = 0;
+  virtual bool read(uint32_t offset, void* dst, uint32_t len) = 0;
+  virtual bool write(uint32_t offset, const void* src, uint32_t len) = 0;
+  virtual bool eraseSector(uint32_t offset) = 0; // erases FLASH_LOG_SECTOR bytes to 0xFF
+};
+
+class FlashLog {
+public:
+  // Rebuild the segment table from the headers on storage
+  bool begin(FlashStorage* storage) {
+    storage_ = storage;
+    segments_ = storage->size() / FLASH_LOG_SECTOR;
+    if (segments_ < 2) return false;
+
+    firstTs_.assign(segments_, 0);
+    std::vector<uint32_t> seqs(segments_, 0);
+    std::vector<bool> valid(segments_, false);
+    uint32_t bestSeq = 0;
+    bool any = false;
+
+    for (uint32_t i = 0; i < segments_; i++) {
+      FlashLogSegmentHeader h;
+      if (!storage_->read(i * FLASH_LOG_SECTOR, &h, sizeof(h))) return false;
+      if (h.magic != FLASH_LOG_MAGIC) continue;
+      valid[i] = true;
+      seqs[i] = h.seq;
+      firstTs_[i] = h.first_ts;
+      if (!any || h.seq > bestSeq) {
+        bestSeq = h.seq;
+        head_ = i;
+        any = true;
+      }
+    }
+
+    used_ = 0;
+    headFill_ = 0;
+    seq_ = 0;
+    lastTs_ = 0;
+    if (!any) return true;
+
+    // Walk back from the head while sequence numbers stay contiguous
+    seq_ = bestSeq;
+    used_ = 1;
+    while (used_ < segments_) {
+      uint32_t prev = (head_ + segments_ - used_) % segments_;
+      if (!valid[prev] || seqs[prev] != bestSeq - used_) break;
+      used_++;
+    }
+
+    headFill_ = findFill(head_);
+    lastTs_ = firstTs_[head_];
+    if (headFill_ > 0) {
+      LogSample s;
+      readSlot(head_, headFill_ - 1, s);
+      lastTs_ = s.timestamp;
+    }
+    return true;
+  }
+
+  bool append(LogSample s) {
+    if (!storage_) return false;
+    if (s.timestamp < lastTs_) s.timestamp = lastTs_;
+    if (used_ == 0 || headFill_ >= FLASH_LOG_SLOTS) {
+      if (!startSegment(s.timestamp)) return false;
+    }
+    if (!storage_->write(slotOffset(head_, headFill_), &s, sizeof(s))) return false;
+    headFill_++;
+    lastTs_ = s.timestamp;
+    return true;
+  }
+
+  // Calls fn(const LogSample&) for every sample with from <= timestamp <= to,
+  // oldest first. Returns the number of samples delivered.
+  template <typename Fn>
+  uint32_t readRange(uint32_t from, uint32_t to, Fn fn) {
+    if (used_ == 0 || from > to || to < firstTs_[physical(0)]) return 0;
+
+    uint32_t logical = findSegment(from);
+    uint32_t slot = findSlot(physical(logical), fillOf(logical), from);
+    uint32_t delivered = 0;
+    LogSample batch[16];
+
+    for (; logical < used_; logical++, slot = 0) {
+      uint32_t seg = physical(logical);
+      if (firstTs_[seg] > to) break;
+      uint32_t fill = fillOf(logical);
+      while (slot < fill) {
+        uint32_t n = fill - slot;
+        if (n > 16) n = 16;
+        if (!storage_->read(slotOffset(seg, slot), batch, n * sizeof(LogSample))) return delivered;
+        for (uint32_t k = 0; k < n; k++) {
+          if (batch[k].timestamp > to) return delivered;
+          fn(batch[k]);
+          delivered++;
+        }
+        slot += n;
+      }
+    }
+    return delivered;
+  }
+
+  uint32_t segmentCount() const { return segments_; }
+  uint32_t usedSegments() const { return used_; }
+  uint32_t sampleCount() const { return used_ == 0 ? 0 : (used_ - 1) * FLASH_LOG_SLOTS + headFill_; }
+  uint32_t capacity() const { return segments_ * FLASH_LOG_SLOTS; }
+  uint32_t oldestTimestamp() const { return used_ == 0 ? 0 : firstTs_[physical(0)]; }
+  uint32_t newestTimestamp() const { return lastTs_; }
+
+private:
+  uint32_t physical(uint32_t logical) const {
+    uint32_t oldest = (head_ + segments_ + 1 - used_) % segments_;
+    return (oldest + logical) % segments_;
+  }
+
+  uint32_t fillOf(uint32_t logical) const {
+    return logical == used_ - 1 ? headFill_ : FLASH_LOG_SLOTS;
+  }
+
+  uint32_t slotOffset(uint32_t seg, uint32_t slot) const {
+    return seg * FLASH_LOG_SECTOR + sizeof(FlashLogSegmentHeader) + slot * sizeof(LogSample);
+  }
+
+  bool readSlot(uint32_t seg, uint32_t slot, LogSample& s) {
+    return storage_->read(slotOffset(seg, slot), &s, sizeof(s));
+  }
+
+  // Number of written slots in a segment (written slots are a prefix)
+  uint32_t findFill(uint32_t seg) {
+    uint32_t lo = 0, hi = FLASH_LOG_SLOTS;
+    while (lo < hi) {
+      uint32_t mid = (lo + hi) / 2;
+      LogSample s;
+      if (!readSlot(seg, mid, s) || s.timestamp == FLASH_LOG_EMPTY) hi = mid;
+      else lo = mid + 1;
+    }
+    return lo;
+  }
+
+  // Last logical segment whose first timestamp is <= ts (0 if ts is older than everything)
+  uint32_t findSegment(uint32_t ts) const {
+    uint32_t lo = 0, hi = used_;
+    while (lo < hi) {
+      uint32_t mid = (lo + hi) / 2;
+      if (firstTs_[physical(mid)] <= ts) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo == 0 ? 0 : lo - 1;
+  }
+
+  // First slot in seg with timestamp >= ts
+  uint32_t findSlot(uint32_t seg, uint32_t fill, uint32_t ts) {
+    uint32_t lo = 0, hi = fill;
+    while (lo < hi) {
+      uint32_t mid = (lo + hi) / 2;
+      LogSample s;
+      if (readSlot(seg, mid, s) && s.timestamp < ts) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
+  }
+
+  bool startSegment(uint32_t ts) {
+    uint32_t next = used_ == 0 ? 0 : (head_ + 1) % segments_;
+    if (!storage_->eraseSector(next * FLASH_LOG_SECTOR)) return false;
+
+    FlashLogSegmentHeader h;
+    h.magic = FLASH_LOG_MAGIC;
+    h.seq = ++seq_;
+    h.first_ts = ts;
+    h.reserved = FLASH_LOG_EMPTY;
+    if (!storage_->write(next * FLASH_LOG_SECTOR, &h, sizeof(h))) return false;
+
+    // Overwriting the oldest segment keeps the ring full rather than growing it
+    if (used_ < segments_) used_++;
+    head_ = next;
+    headFill_ = 0;
+    firstTs_[next] = ts;
+    return true;
+  }
+
+  FlashStorage* storage_ = nullptr;
+  std::vector<uint32_t> firstTs_; // first timestamp per physical segment
+  uint32_t segments_ = 0;
+  uint32_t used_ = 0;             // segments holding data, oldest..head
+  uint32_t head_ = 0;             // physical segment being filled
+  uint32_t headFill_ = 0;
+  uint32_t seq_ = 0;
+  uint32_t lastTs_ = 0;
+};
+
+#ifndef BMS_NATIVE
+#include "esp_partition.h"
+
+// Log storage on the data partition labelled "bmslog" (partitions.csv). A
+// table without one disables the log rather than erasing some other
+// partition, such as a SPIFFS filesystem that may hold the user's files.
+class EspPartitionStorage : public FlashStorage {
+public:
+  bool begin() {
+    part_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "bmslog");
+    return part_ != nullptr;
+  }
+  uint32_t size() const override { return part_ ? part_->size : 0; }
+  bool read(uint32_t offset, void* dst, uint32_t len) override {
+    return esp_partition_read(part_, offset, dst, len) == ESP_OK;
+  }
+  bool write(uint32_t offset, const void* src, uint32_t len) override {
+    return esp_partition_write(part_, offset, src, len) == ESP_OK;
+  }
+  bool eraseSector(uint32_t offset) override {
+    return esp_partition_erase_range(part_, offset, FLASH_LOG_SECTOR) == ESP_OK;
+  }
+
+private:
+  const esp_partition_t* part_ = nullptr;
+};
+#endif
+
+#endif // FLASH_LOG_H
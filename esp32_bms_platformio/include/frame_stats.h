@@ -0,0 +1,157 @@
+/*
+ * Frame-quality counters for the BMS link
+ *
+ * Every request ends in exactly one outcome: a reply that checks out, a reply
+ * rejected by class (CRC, header, length byte, short frame), or no reply in
+ * time. Replies that turn up when nobody is waiting for them (no request is
+ * pending, or their length byte belongs to the other command) are counted as
+ * late or as the expected duplicate of a hedged request. Counts are kept per command,
+ * once for the current link (cleared on connect) and once since boot.
+ * The BLE callback and loop() both count, so every counter is an atomic
+ * incremented with a relaxed fetch_add; readers may see a snapshot that is
+ * one increment apart between classes, never a torn value.
+ */
+
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DALY_FRAME_OVERHEAD 5      // D2 03 len ... crc_lo crc_hi
+#define DALY_INFO_DATA_LEN 124     // length byte of the 129-byte info reply
+#define DALY_MOS_DATA_LEN 18       // length byte of the 23-byte MOS reply
+#define DALY_REPLY_MAX (255 + DALY_FRAME_OVERHEAD)
+
+enum FrameOutcome : uint8_t {
+  FRAME_OK,
+  FRAME_CRC_FAIL,
+  FRAME_BAD_HEADER,
+  FRAME_BAD_LENGTH,
+  FRAME_TRUNCATED,
+  FRAME_TIMEOUT,
+  FRAME_DUPLICATE,
+  FRAME_LATE,
+  FRAME_OUTCOMES
+};
+
+enum FrameCommand : uint8_t { FRAME_CMD_INFO, FRAME_CMD_MOS, FRAME_COMMANDS };
+
+static const char* const FRAME_OUTCOME_NAMES[FRAME_OUTCOMES] = {
+  "ok", "crc", "bad_header", "bad_length", "truncated", "timeout", "duplicate", "late"};
+static const char* const FRAME_COMMAND_NAMES[FRAME_COMMANDS] = {"main_info", "mos_info"};
+
+// Modbus CRC-16 as the Daly BLE protocol appends it (low byte first)
+inline uint16_t dalyFrameCrc(const uint8_t* data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t b = 0; b < 8; b++) crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+  }
+  return crc;
+}
+
+// Check a complete reply: D2 03, the expected length byte, exactly that many
+// data bytes plus CRC, and the CRC itself
+inline FrameOutcome classifyDalyFrame(const uint8_t* f, size_t len, uint8_t expect_data_len) {
+  if (len < 3) return FRAME_TRUNCATED;
+  if (f[0] != 0xD2 || f[1] != 0x03) return FRAME_BAD_HEADER;
+  if (f[2] != expect_data_len) return FRAME_BAD_LENGTH;
+  size_t want = (size_t)expect_data_len + DALY_FRAME_OVERHEAD;
+  if (len < want) return FRAME_TRUNCATED;
+  if (len > want) return FRAME_BAD_LENGTH;
+  uint16_t crc = dalyFrameCrc(f, want - 2);
+  if (f[want - 2] != (crc & 0xFF) || f[want - 1] != (crc >> 8)) return FRAME_CRC_FAIL;
+  return FRAME_OK;
+}
+
+// The command a reply answers, from the length byte at its start; false
+// when the notification starts no frame or the length byte fits neither
+inline bool dalyReplyCommand(const uint8_t* data, size_t length, FrameCommand& cmd) {
+  if (length < 3 || data[0] != 0xD2 || data[1] != 0x03) return false;
+  if (data[2] == DALY_INFO_DATA_LEN) cmd = FRAME_CMD_INFO;
+  else if (data[2] == DALY_MOS_DATA_LEN) cmd = FRAME_CMD_MOS;
+  else return false;
+  return true;
+}
+
+// Puts a reply back together from its notifications (the BMS sends up to
+// the ATT MTU per notification, 20 bytes by default). A notification that
+// starts with D2 03 begins a frame, the length byte says when it is whole.
+// A first notification without the header is taken as the whole reply so
+// that classifyDalyFrame() can report it. Fed from the BLE callback only.
+class DalyReplyAssembler {
+public:
+  void reset() { len_ = 0; }
+
+  // Append one notification; true once the frame is complete
+  bool feed(const uint8_t* data, size_t length) {
+    bool header = length >= 2 && data[0] == 0xD2 && data[1] == 0x03;
+    if (header) len_ = 0;
+    bool first = len_ == 0;
+    size_t n = length < DALY_REPLY_MAX - len_ ? length : DALY_REPLY_MAX - len_;
+    memcpy(buf_ + len_, data, n);
+    len_ += n;
+    if (first && !header) return true;
+    return len_ >= 3 && len_ >= (size_t)buf_[2] + DALY_FRAME_OVERHEAD;
+  }
+
+  const uint8_t* data() const { return buf_; }
+  size_t length() const { return len_; }
+
+private:
+  uint8_t buf_[DALY_REPLY_MAX];
+  size_t len_ = 0;
+};
+
+class FrameStats {
+public:
+  FrameStats() {
+    for (uint8_t c = 0; c < FRAME_COMMANDS; c++) {
+      for (uint8_t o = 0; o < FRAME_OUTCOMES; o++) {
+        link_[c][o].store(0, std::memory_order_relaxed);
+        total_[c][o].store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void count(FrameCommand cmd, FrameOutcome outcome) {
+    if (cmd >= FRAME_COMMANDS || outcome >= FRAME_OUTCOMES) return;
+    link_[cmd][outcome].fetch_add(1, std::memory_order_relaxed);
+    total_[cmd][outcome].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // New connection: start the per-link counts over
+  void resetLink() {
+    for (uint8_t c = 0; c < FRAME_COMMANDS; c++) {
+      for (uint8_t o = 0; o < FRAME_OUTCOMES; o++) link_[c][o].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  uint32_t link(FrameCommand cmd, FrameOutcome outcome) const {
+    return link_[cmd][outcome].load(std::memory_order_relaxed);
+  }
+  uint32_t total(FrameCommand cmd, FrameOutcome outcome) const {
+    return total_[cmd][outcome].load(std::memory_order_relaxed);
+  }
+
+  // Sum over commands, for the one-line summaries
+  uint32_t linkAll(FrameOutcome outcome) const {
+    uint32_t n = 0;
+    for (uint8_t c = 0; c < FRAME_COMMANDS; c++) n += link((FrameCommand)c, outcome);
+    return n;
+  }
+  uint32_t totalAll(FrameOutcome outcome) const {
+    uint32_t n = 0;
+    for (uint8_t c = 0; c < FRAME_COMMANDS; c++) n += total((FrameCommand)c, outcome);
+    return n;
+  }
+
+private:
+  std::atomic<uint32_t> link_[FRAME_COMMANDS][FRAME_OUTCOMES];
+  std::atomic<uint32_t> total_[FRAME_COMMANDS][FRAME_OUTCOMES];
+};
+
+#endif // FRAME_STATS_H
@@ -0,0 +1,353 @@
+/*
+ * Re-export of the decoded pack over our own GATT server
+ *
+ * A Daly BMS takes one central at a time: while the ESP32 holds its link a
+ * phone cannot read it, and a phone holding it locks the reader out. The
+ * ESP32 therefore serves the pack itself, as a peripheral next to its
+ * central link, to as many phones as the BLE stack admits.
+ *
+ * Each decoded frame is encoded once (GattSnapshot): a 20-byte pack payload
+ * and the cell voltages in 20-byte pages, sized to the default ATT MTU of 23
+ * so no phone needs an MTU exchange. Every subscriber is served from that
+ * one encoding. Each has its own minimum interval, which the phone sets by
+ * writing the control characteristic, so a dashboard at 1 Hz and a logger
+ * at 5 s cost what they ask for. A subscriber that is behind by several
+ * snapshots gets only the newest one. Nothing goes to a connection until
+ * the phone turns notifications on in the characteristic's CCCD: the stack
+ * sends whatever it is handed, and the BLE2902 value is one for all
+ * phones, so the exporter keeps that bit per connection.
+ *
+ * Connects, disconnects, CCCD and control writes arrive on the BLE task
+ * and only touch the atomics of a slot. service() runs on the loop and
+ * does the sending. A notification the stack refuses (congested link) is
+ * retried on the next pass, from the part where it stopped.
+ *
+ * Pack payload, little endian:
+ *    0 u8  format (GATT_FORMAT)        10 u16 lowest cell, mV
+ *    1 u8  snapshot sequence           12 i8  highest temperature, C
+ *    2 u16 pack voltage, 10 mV         13 i8  lowest temperature, C
+ *    4 i16 current, 100 mA, + charge   14 u16 remaining capacity, 0.1 Ah
+ *    6 u16 SOC, 0.1 %                  16 u16 charge cycles
+ *    8 u16 highest cell, mV            18 u8  GATT_STATUS_* bits
+ *                                      19 u8  alarm bits of the JSON record
+ * Cell page: u8 sequence, u8 first cell, u8 count, then count u16 mV.
+ * Control write: u16 minimum interval in ms, then optionally u8 GATT_WANT_*.
+ */
+
+#ifndef GATT_EXPORT_H
+#define GATT_EXPORT_H
+
+#include <Arduino.h>
+#include <atomic>
+
+#define GATT_FORMAT 1
+#define GATT_PACK_LEN 20            // fits the 20 bytes of a default-MTU notification
+#define GATT_MAX_CELLS 16
+#define GATT_CELLS_PER_PAGE 8
+#define GATT_CELL_PAGES ((GATT_MAX_CELLS + GATT_CELLS_PER_PAGE - 1) / GATT_CELLS_PER_PAGE)
+#define GATT_PAGE_LEN (3 + 2 * GATT_CELLS_PER_PAGE)
+#define GATT_MAX_SUBSCRIBERS 8      // slots; the stack's link limit usually bites first
+#define GATT_DEFAULT_INTERVAL_MS 1000
+#define GATT_MIN_INTERVAL_MS 200    // floor for what a phone may ask for
+#define GATT_MAX_INTERVAL_MS 60000
+
+#define GATT_STATUS_CHARGE_MOS 0x01
+#define GATT_STATUS_DISCHARGE_MOS 0x02
+
+#define GATT_WANT_PACK 0x01
+#define GATT_WANT_CELLS 0x02
+#define GATT_WANT_ALL (GATT_WANT_PACK | GATT_WANT_CELLS)
+
+enum GattChar : uint8_t { GATT_CHAR_PACK, GATT_CHAR_CELLS };
+
+// The decoded values one snapshot carries, in payload units
+struct GattPack {
+  uint16_t voltage_cv = 0;   // 10 mV
+  int16_t current_da = 0;    // 100 mA
+  uint16_t soc_pm = 0;       // 0.1 %
+  uint16_t max_cell_mv = 0;
+  uint16_t min_cell_mv = 0;
+  int8_t max_temp = 0;
+  int8_t min_temp = 0;
+  uint16_t remaining_dah = 0; // 0.1 Ah
+  uint16_t cycles = 0;
+  uint8_t status = 0;        // GATT_STATUS_*
+  uint8_t alarms = 0;
+  const uint16_t* cell_mv = nullptr;
+  uint8_t cells = 0;
+};
+
+inline void gattPutU16(uint8_t* p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+inline uint16_t gattGetU16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// A temperature in C as the payload's i8, saturating
+inline int8_t gattTemp(int16_t c) {
+  return (int8_t)(c < -128 ? -128 : c > 127 ? 127 : c);
+}
+
+// One decoded frame, encoded once for every subscriber
+class GattSnapshot {
+public:
+  void encode(const GattPack& v) {
+    seq_++;
+    uint8_t* p = pack_;
+    p[0] = GATT_FORMAT;
+    p[1] = (uint8_t)seq_;
+    gattPutU16(p + 2, v.voltage_cv);
+    gattPutU16(p + 4, (uint16_t)v.current_da);
+    gattPutU16(p + 6, v.soc_pm);
+    gattPutU16(p + 8, v.max_cell_mv);
+    gattPutU16(p + 10, v.min_cell_mv);
+    p[12] = (uint8_t)v.max_temp;
+    p[13] = (uint8_t)v.min_temp;
+    gattPutU16(p + 14, v.remaining_dah);
+    gattPutU16(p + 16, v.cycles);
+    p[18] = v.status;
+    p[19] = v.alarms;
+
+    uint8_t cells = v.cells > GATT_MAX_CELLS ? GATT_MAX_CELLS : v.cells;
+    pages_ = 0;
+    for (uint8_t first = 0; first < cells; first += GATT_CELLS_PER_PAGE) {
+      uint8_t* page = pageBuf_[pages_];
+      uint8_t n = cells - first < GATT_CELLS_PER_PAGE ? cells - first : GATT_CELLS_PER_PAGE;
+      page[0] = (uint8_t)seq_;
+      page[1] = first;
+      page[2] = n;
+      for (uint8_t i = 0; i < n; i++) gattPutU16(page + 3 + 2 * i, v.cell_mv[first + i]);
+      pageLen_[pages_++] = 3 + 2 * n;
+    }
+  }
+
+  uint32_t seq() const { return seq_; } // 0 until the first frame
+  const uint8_t* pack() const { return pack_; }
+  uint8_t pages() const { return pages_; }
+  const uint8_t* page(uint8_t i) const { return pageBuf_[i]; }
+  uint8_t pageLen(uint8_t i) const { return pageLen_[i]; }
+
+private:
+  uint32_t seq_ = 0;
+  uint8_t pack_[GATT_PACK_LEN] = {};
+  uint8_t pageBuf_[GATT_CELL_PAGES][GATT_PAGE_LEN] = {};
+  uint8_t pageLen_[GATT_CELL_PAGES] = {};
+  uint8_t pages_ = 0;
+};
+
+// Pack payload back to values, for phones and host tools (cell_mv stays unset)
+inline bool gattDecodePack(const uint8_t* p, size_t len, GattPack& v, uint8_t* seq = nullptr) {
+  if (len < GATT_PACK_LEN || p[0] != GATT_FORMAT) return false;
+  if (seq) *seq = p[1];
+  v.voltage_cv = gattGetU16(p + 2);
+  v.current_da = (int16_t)gattGetU16(p + 4);
+  v.soc_pm = gattGetU16(p + 6);
+  v.max_cell_mv = gattGetU16(p + 8);
+  v.min_cell_mv = gattGetU16(p + 10);
+  v.max_temp = (int8_t)p[12];
+  v.min_temp = (int8_t)p[13];
+  v.remaining_dah = gattGetU16(p + 14);
+  v.cycles = gattGetU16(p + 16);
+  v.status = p[18];
+  v.alarms = p[19];
+  return true;
+}
+
+// The BLE stack as seen by the exporter: one notification to one connection
+class GattNotifier {
+public:
+  virtual ~GattNotifier() {}
+  // False when the stack refuses it (congested, link gone); retried later
+  virtual bool notify(uint16_t connId, GattChar ch, const uint8_t* data, uint8_t len) = 0;
+};
+
+enum GattSlotState : uint8_t { GATT_SLOT_FREE, GATT_SLOT_CLAIMED, GATT_SLOT_ACTIVE };
+
+struct GattSubscriber {
+  // Written by the BLE task
+  std::atomic<uint8_t> state{GATT_SLOT_FREE};
+  std::atomic<uint16_t> connId{0};
+  std::atomic<uint16_t> intervalMs{GATT_DEFAULT_INTERVAL_MS};
+  std::atomic<uint8_t> wants{GATT_WANT_ALL};
+  std::atomic<uint8_t> enabled{0}; // GATT_WANT_* whose CCCD has notifications on
+  std::atomic<uint32_t> epoch{0};  // bumped by every connect into the slot
+  // Loop side only
+  uint32_t seenEpoch = 0;
+  uint32_t sentSeq = 0;            // last snapshot sent in full
+  uint32_t sendingSeq = 0;         // snapshot being sent, parts from nextPart on
+  uint8_t nextPart = 0;            // 0 = pack, 1.. = cell pages
+  uint32_t lastSentMs = 0;
+  uint32_t connectedMs = 0;
+  uint32_t notifications = 0;
+  uint32_t coalesced = 0;          // snapshots skipped by the interval or congestion
+  uint32_t congested = 0;          // notifications the stack refused
+};
+
+class GattExporter {
+public:
+  // BLE task: a central connected. False when every slot is taken.
+  bool connect(uint16_t connId) {
+    for (GattSubscriber& s : slots_) {
+      uint8_t expect = GATT_SLOT_FREE;
+      if (!s.state.compare_exchange_strong(expect, GATT_SLOT_CLAIMED)) continue;
+      s.connId.store(connId);
+      s.intervalMs.store(GATT_DEFAULT_INTERVAL_MS);
+      s.wants.store(GATT_WANT_ALL);
+      s.enabled.store(0);
+      s.epoch.fetch_add(1);
+      s.state.store(GATT_SLOT_ACTIVE, std::memory_order_release);
+      connects_.fetch_add(1);
+      return true;
+    }
+    rejected_.fetch_add(1);
+    return false;
+  }
+
+  // BLE task
+  void disconnect(uint16_t connId) {
+    GattSubscriber* s = find(connId);
+    if (s) s->state.store(GATT_SLOT_FREE, std::memory_order_release);
+  }
+
+  // BLE task: a CCCD write turned notifications of `ch` on or off
+  bool subscribe(uint16_t connId, GattChar ch, bool on) {
+    GattSubscriber* s = find(connId);
+    if (!s) return false;
+    uint8_t bit = ch == GATT_CHAR_PACK ? GATT_WANT_PACK : GATT_WANT_CELLS;
+    if (on) s->enabled.fetch_or(bit);
+    else s->enabled.fetch_and((uint8_t)~bit);
+    return true;
+  }
+
+  // BLE task: a write to the control characteristic. False if malformed.
+  bool control(uint16_t connId, const uint8_t* data, size_t len) {
+    GattSubscriber* s = find(connId);
+    if (!s || len < 2) return false;
+    uint32_t ms = gattGetU16(data);
+    if (ms < GATT_MIN_INTERVAL_MS) ms = GATT_MIN_INTERVAL_MS;
+    if (ms > GATT_MAX_INTERVAL_MS) ms = GATT_MAX_INTERVAL_MS;
+    s->intervalMs.store((uint16_t)ms);
+    if (len >= 3) s->wants.store(data[2] & GATT_WANT_ALL);
+    return true;
+  }
+
+  // Loop: a decoded frame, encoded once for every subscriber
+  void publish(const GattPack& v) { snapshot_.encode(v); }
+
+  // Loop: sends what is due. Returns ms until the next subscriber is due
+  // (GATT_MAX_INTERVAL_MS when nothing waits for a newer snapshot).
+  uint32_t service(GattNotifier& out, uint32_t nowMs) {
+    uint32_t nextMs = GATT_MAX_INTERVAL_MS;
+    uint32_t seq = snapshot_.seq();
+    for (GattSubscriber& s : slots_) {
+      if (s.state.load(std::memory_order_acquire) != GATT_SLOT_ACTIVE) continue;
+      uint32_t epoch = s.epoch.load();
+      if (epoch != s.seenEpoch) {
+        // A new central in this slot: fresh counters, first snapshot at once
+        s.seenEpoch = epoch;
+        s.sentSeq = s.sendingSeq = seq > 0 ? seq - 1 : 0;
+        s.nextPart = 0;
+        s.lastSentMs = nowMs - GATT_MAX_INTERVAL_MS;
+        s.connectedMs = nowMs;
+        s.notifications = s.coalesced = s.congested = 0;
+      }
+      // Only what the phone asked for and has notifications on for
+      uint8_t wants = s.wants.load() & s.enabled.load();
+      if (seq == 0 || s.sentSeq == seq || !wants) continue;
+
+      uint16_t connId = s.connId.load();
+      if (s.nextPart > 0 && s.sendingSeq != seq) {
+        // A newer snapshot while one was half sent: start over on it
+        s.coalesced += seq - s.sendingSeq;
+        s.sendingSeq = seq;
+        s.nextPart = 0;
+      } else if (s.nextPart == 0) {
+        // Start on the newest snapshot once the interval has passed
+        uint32_t since = nowMs - s.lastSentMs;
+        uint32_t interval = s.intervalMs.load();
+        if (since < interval) {
+          if (interval - since < nextMs) nextMs = interval - since;
+          continue;
+        }
+        if (seq - s.sentSeq > 1) s.coalesced += seq - s.sentSeq - 1;
+        s.sendingSeq = seq;
+        s.nextPart = 0;
+        s.lastSentMs = nowMs;
+      }
+
+      uint8_t parts = 1 + snapshot_.pages();
+      while (s.nextPart < parts) {
+        uint8_t part = s.nextPart;
+        bool wanted = part == 0 ? (wants & GATT_WANT_PACK) : (wants & GATT_WANT_CELLS);
+        if (wanted) {
+          bool ok = part == 0 ? out.notify(connId, GATT_CHAR_PACK, snapshot_.pack(), GATT_PACK_LEN)
+                              : out.notify(connId, GATT_CHAR_CELLS, snapshot_.page(part - 1),
+                                           snapshot_.pageLen(part - 1));
+          if (!ok) {
+            s.congested++;
+            congested_++;
+            break;
+          }
+          s.notifications++;
+          notifications_++;
+        }
+        s.nextPart++;
+      }
+      if (s.nextPart < parts) {
+        nextMs = 0;
+        continue;
+      }
+      s.sentSeq = seq;
+      s.nextPart = 0;
+      uint32_t interval = s.intervalMs.load();
+      if (interval < nextMs) nextMs = interval;
+    }
+    return nextMs;
+  }
+
+  const GattSnapshot& snapshot() const { return snapshot_; }
+
+  // Loop: fn(const GattSubscriber&) for every connected subscriber
+  template <typename Fn>
+  void forEach(Fn fn) const {
+    for (const GattSubscriber& s : slots_) {
+      if (s.state.load(std::memory_order_acquire) == GATT_SLOT_ACTIVE) fn(s);
+    }
+  }
+
+  uint8_t connected() const {
+    uint8_t n = 0;
+    for (const GattSubscriber& s : slots_) n += s.state.load() == GATT_SLOT_ACTIVE;
+    return n;
+  }
+  // Connections with notifications on for at least one characteristic
+  uint8_t subscribers() const {
+    uint8_t n = 0;
+    for (const GattSubscriber& s : slots_) n += s.state.load() == GATT_SLOT_ACTIVE && s.enabled.load() != 0;
+    return n;
+  }
+  uint32_t connects() const { return connects_.load(); }
+  uint32_t rejected() const { return rejected_.load(); }
+  uint32_t notifications() const { return notifications_; }
+  uint32_t congested() const { return congested_; }
+
+private:
+  GattSubscriber* find(uint16_t connId) {
+    for (GattSubscriber& s : slots_) {
+      if (s.state.load(std::memory_order_acquire) == GATT_SLOT_ACTIVE && s.connId.load() == connId) return &s;
+    }
+    return nullptr;
+  }
+
+  GattSnapshot snapshot_;
+  GattSubscriber slots_[GATT_MAX_SUBSCRIBERS];
+  std::atomic<uint32_t> connects_{0};
+  std::atomic<uint32_t> rejected_{0};
+  uint32_t notifications_ = 0;
+  uint32_t congested_ = 0;
+};
+
+#endif // GATT_EXPORT_H
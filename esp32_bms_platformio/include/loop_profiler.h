@@ -0,0 +1,110 @@
+/*
+ * Where loop() is held, and for how long
+ *
+ * Regions of the loop that can block (scan, connect, request writes, the
+ * serial writes, the idle delays) are timed per call site: count, total and longest
+ * block, plus a top-N list of the longest single blocks since boot with the
+ * site and the millis() at which each started. Regions nest (a read step
+ * holds its request write and record write), so every time is inclusive of
+ * the regions inside it.
+ *
+ * A block over the budget is counted; record() also says when it should be
+ * reported, at most once per LOOP_PROFILE_WARN_MS per site, so a scan that
+ * always takes 10 s warns once a minute instead of every time. Only the loop
+ * task records, so nothing here is atomic. The clock is passed in, which
+ * keeps the class usable on the host.
+ */
+
+#ifndef LOOP_PROFILER_H
+#define LOOP_PROFILER_H
+
+#include <stdint.h>
+
+#define LOOP_PROFILE_TOP 8            // longest blocks kept
+#define LOOP_PROFILE_WARN_MS 60000    // per site, between over-budget warnings
+
+enum LoopSite : uint8_t {
+  LOOP_SITE_PASS,          // one whole loop() pass
+  LOOP_SITE_COMMAND,       // console input: readStringUntil and the command it runs
+  LOOP_SITE_SCAN,          // scanForBMS (BLE scan, 10 s)
+  LOOP_SITE_CONNECT,       // connectToBMS (connect + service discovery)
+  LOOP_SITE_READ_CYCLE,    // one step of the read sequence: a request, parsing, output
+  LOOP_SITE_REQUEST_WRITE, // writeRequest: the GATT write (replies are awaited without blocking)
+  LOOP_SITE_RECORD_WRITE,  // BMS_DATA line and CDR frames to Serial
+  LOOP_SITE_FLASH_LOG,     // history compaction, including the flash log writes
+  LOOP_SITE_METRICS,       // BMS_METRICS line
+  LOOP_SITE_IDLE,          // delay() at the end of a pass
+  LOOP_SITES
+};
+
+static const char* const LOOP_SITE_NAMES[LOOP_SITES] = {
+  "loop_pass", "command", "scan", "connect", "read_cycle", "request_write", "record_write", "flash_log",
+  "metrics", "idle_delay"};
+
+struct LoopBlockStats {
+  uint32_t count = 0;
+  uint64_t totalUs = 0;
+  uint32_t maxUs = 0;
+  uint32_t overBudget = 0;
+  uint32_t lastWarnMs = 0;
+  bool warned = false;
+};
+
+struct LoopBlockEntry {
+  LoopSite site;
+  uint32_t startMs;
+  uint32_t us;
+};
+
+class LoopProfiler {
+public:
+  void setBudgetMs(uint32_t ms) { budgetUs_ = ms * 1000; }
+  uint32_t budgetMs() const { return budgetUs_ / 1000; }
+
+  // One finished block; true when it is over budget and a warning is due
+  bool record(LoopSite site, uint32_t start_ms, uint32_t us) {
+    if (site >= LOOP_SITES) return false;
+    LoopBlockStats& s = sites_[site];
+    s.count++;
+    s.totalUs += us;
+    if (us > s.maxUs) s.maxUs = us;
+    insertTop(site, start_ms, us);
+
+    if (us <= budgetUs_) return false;
+    s.overBudget++;
+    uint32_t now = start_ms + us / 1000;
+    if (s.warned && now - s.lastWarnMs < LOOP_PROFILE_WARN_MS) return false;
+    s.warned = true;
+    s.lastWarnMs = now;
+    return true;
+  }
+
+  const LoopBlockStats& site(LoopSite site) const { return sites_[site]; }
+  uint8_t topCount() const { return topCount_; }
+  const LoopBlockEntry& top(uint8_t i) const { return top_[i]; }   // longest first
+
+  void reset() {
+    for (uint8_t i = 0; i < LOOP_SITES; i++) sites_[i] = LoopBlockStats();
+    topCount_ = 0;
+  }
+
+private:
+  void insertTop(LoopSite site, uint32_t start_ms, uint32_t us) {
+    if (topCount_ == LOOP_PROFILE_TOP && us <= top_[LOOP_PROFILE_TOP - 1].us) return;
+    uint8_t i = topCount_ < LOOP_PROFILE_TOP ? topCount_++ : LOOP_PROFILE_TOP - 1;
+    while (i > 0 && top_[i - 1].us < us) {
+      top_[i] = top_[i - 1];
+      i--;
+    }
+    top_[i].site = site;
+    top_[i].startMs = start_ms;
+    top_[i].us = us;
+  }
+
+  uint32_t budgetUs_ = 500000;
+  LoopBlockStats sites_[LOOP_SITES];
+  LoopBlockEntry top_[LOOP_PROFILE_TOP];
+  uint8_t topCount_ = 0;
+};
+
+#endif // LOOP_PROFILER_H
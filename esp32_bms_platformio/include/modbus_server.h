@@ -0,0 +1,372 @@
+/*
+ * Modbus RTU / TCP server over a precomputed register image
+ *
+ * Inverters, PLCs and SCADA gateways poll the pack as Modbus registers.
+ * The register map is fixed at compile time (MODBUS_MAP). The loop fills
+ * one array of register values per decoded frame and publishes it into
+ * ModbusImage once. The image keeps the registers in wire order, big
+ * endian, so a read request costs a copy of the asked-for slice. No value
+ * is scaled, converted or formatted per request.
+ *
+ * The servers run on their own task (RTU on the second UART, TCP over
+ * Wi-Fi) while the loop publishes. The image is therefore a seqlock: the
+ * writer makes the sequence odd, stores the words and makes it even again.
+ * A reader copies its words and retries if the sequence was odd or moved
+ * meanwhile. The words are relaxed atomics, so a torn copy is retried, not
+ * undefined. A reader never blocks the writer, and a response never mixes
+ * two frames. A reader spins while a publish is in flight, so it must not
+ * preempt the writer on the writer's core.
+ *
+ * Function codes 03 (holding) and 04 (input) both read the image. Anything
+ * else gets exception 01, an address outside the map exception 02, and a
+ * quantity of 0 or over 125 exception 03. RTU frames are delimited by
+ * length, since every request we answer has a known size, and a gap of
+ * 3.5 characters resynchronises. TCP sessions take pipelined requests
+ * split across reads.
+ */
+
+#ifndef MODBUS_SERVER_H
+#define MODBUS_SERVER_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MODBUS_PORT 502
+#define MODBUS_MAX_READ 125          // registers per read request (spec limit)
+#define MODBUS_RTU_MAX 256           // ADU: address, PDU up to 253, CRC
+#define MODBUS_TCP_HEADER 7          // MBAP: transaction, protocol, length, unit
+#define MODBUS_TCP_MAX (MODBUS_TCP_HEADER + 253)
+#define MODBUS_CELLS 16
+
+#define MODBUS_FC_READ_HOLDING 0x03
+#define MODBUS_FC_READ_INPUT 0x04
+#define MODBUS_EX_ILLEGAL_FUNCTION 0x01
+#define MODBUS_EX_ILLEGAL_ADDRESS 0x02
+#define MODBUS_EX_ILLEGAL_VALUE 0x03
+
+#define MODBUS_STATUS_CHARGE_MOS 0x01
+#define MODBUS_STATUS_DISCHARGE_MOS 0x02
+#define MODBUS_STATUS_LINK_UP 0x04   // the BMS link is up (the data is current)
+#define MODBUS_NONE 0xFFFF           // value not available (time to empty/full)
+#define MODBUS_NONE_SIGNED 0x8000    // the same for a signed register; 0xFFFF there is -1
+
+// Register addresses, the same for input and holding reads
+enum ModbusReg : uint16_t {
+  MB_PACK_VOLTAGE = 0,   // 10 mV
+  MB_CURRENT = 1,        // 100 mA, signed, + charging
+  MB_SOC = 2,            // 0.1 %, BMS
+  MB_MAX_CELL = 3,       // mV
+  MB_MIN_CELL = 4,       // mV
+  MB_MAX_TEMP = 5,       // C, signed, MODBUS_NONE_SIGNED before the first frame
+  MB_MIN_TEMP = 6,       // C, signed, MODBUS_NONE_SIGNED before the first frame
+  MB_REMAINING = 7,      // 0.1 Ah
+  MB_CAPACITY = 8,       // 0.1 Ah
+  MB_CYCLES = 9,
+  MB_STATUS = 10,        // MODBUS_STATUS_*
+  MB_ALARMS = 11,        // alarm bits of the JSON record
+  MB_SOC_ESTIMATE = 12,  // 0.1 %, EKF estimate
+  MB_TIME_TO_EMPTY = 13, // minutes, MODBUS_NONE when not discharging
+  MB_TIME_TO_FULL = 14,  // minutes, MODBUS_NONE when not charging
+  MB_FRAMES = 15,        // frames published, wraps; unchanged = stale
+  MB_TIMESTAMP_HI = 16,  // s, log timestamp of the frame
+  MB_TIMESTAMP_LO = 17,
+  MB_CELL_COUNT = 18,
+  MB_CELL_BASE = 20,     // cell 1..16, mV
+  MB_REG_COUNT = MB_CELL_BASE + MODBUS_CELLS
+};
+
+struct ModbusField {
+  uint16_t reg;
+  uint16_t words;
+  const char* name;
+  const char* unit;
+};
+
+// The register map as published, for `modbus map` and host tools
+static constexpr ModbusField MODBUS_MAP[] = {
+  {MB_PACK_VOLTAGE, 1, "pack_voltage", "10 mV"},
+  {MB_CURRENT, 1, "current", "100 mA signed"},
+  {MB_SOC, 1, "soc", "0.1 %"},
+  {MB_MAX_CELL, 1, "max_cell", "mV"},
+  {MB_MIN_CELL, 1, "min_cell", "mV"},
+  {MB_MAX_TEMP, 1, "max_temp", "C signed"},
+  {MB_MIN_TEMP, 1, "min_temp", "C signed"},
+  {MB_REMAINING, 1, "remaining", "0.1 Ah"},
+  {MB_CAPACITY, 1, "capacity", "0.1 Ah"},
+  {MB_CYCLES, 1, "cycles", ""},
+  {MB_STATUS, 1, "status", "bits: charge MOS, discharge MOS, link up"},
+  {MB_ALARMS, 1, "alarms", "bits: no data, cell high, cell low, SOC low"},
+  {MB_SOC_ESTIMATE, 1, "soc_estimate", "0.1 %"},
+  {MB_TIME_TO_EMPTY, 1, "time_to_empty", "min"},
+  {MB_TIME_TO_FULL, 1, "time_to_full", "min"},
+  {MB_FRAMES, 1, "frames", ""},
+  {MB_TIMESTAMP_HI, 2, "timestamp", "s, high word first"},
+  {MB_CELL_COUNT, 1, "cell_count", ""},
+  {MB_CELL_BASE, MODBUS_CELLS, "cells", "mV"},
+};
+
+#define MODBUS_FIELD_COUNT (sizeof(MODBUS_MAP) / sizeof(MODBUS_MAP[0]))
+
+// Fields in address order, not overlapping, inside the image
+constexpr bool modbusMapValid() {
+  for (size_t i = 0; i < MODBUS_FIELD_COUNT; i++) {
+    if (MODBUS_MAP[i].words == 0 || MODBUS_MAP[i].reg + MODBUS_MAP[i].words > MB_REG_COUNT) return false;
+    if (i > 0 && MODBUS_MAP[i].reg < MODBUS_MAP[i - 1].reg + MODBUS_MAP[i - 1].words) return false;
+  }
+  return true;
+}
+static_assert(modbusMapValid(), "MODBUS_MAP must be ordered, non-overlapping and inside the image");
+static_assert(MB_REG_COUNT <= MODBUS_MAX_READ, "the whole image must fit one read");
+
+// CRC-16/MODBUS from a table built at compile time
+struct ModbusCrcTable {
+  uint16_t t[256];
+  constexpr ModbusCrcTable() : t() {
+    for (int i = 0; i < 256; i++) {
+      uint16_t c = (uint16_t)i;
+      for (int b = 0; b < 8; b++) c = (c & 1) ? (uint16_t)((c >> 1) ^ 0xA001) : (uint16_t)(c >> 1);
+      t[i] = c;
+    }
+  }
+};
+static constexpr ModbusCrcTable MODBUS_CRC_TABLE;
+
+inline uint16_t modbusCrc(const uint8_t* data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++) crc = (uint16_t)((crc >> 8) ^ MODBUS_CRC_TABLE.t[(crc ^ data[i]) & 0xFF]);
+  return crc;
+}
+
+#define MODBUS_IMAGE_WORDS ((MB_REG_COUNT + 1) / 2) // two registers per atomic word
+
+class ModbusImage {
+public:
+  // Loop: one decoded frame, in host order
+  void publish(const uint16_t* regs) {
+    uint8_t wire[MODBUS_IMAGE_WORDS * 4] = {};
+    for (uint16_t i = 0; i < MB_REG_COUNT; i++) {
+      wire[2 * i] = (uint8_t)(regs[i] >> 8);
+      wire[2 * i + 1] = (uint8_t)regs[i];
+    }
+    uint32_t s = seq_.load(std::memory_order_relaxed);
+    seq_.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (uint16_t w = 0; w < MODBUS_IMAGE_WORDS; w++) {
+      uint32_t v;
+      memcpy(&v, wire + 4 * w, 4);
+      words_[w].store(v, std::memory_order_relaxed);
+    }
+    seq_.store(s + 2, std::memory_order_release);
+  }
+
+  // Any task: count registers from start, big endian, into out.
+  // False if the range leaves the image.
+  bool read(uint16_t start, uint16_t count, uint8_t* out) const {
+    if (count == 0 || (uint32_t)start + count > MB_REG_COUNT) return false;
+    uint16_t first = start / 2, last = (uint16_t)((start + count - 1) / 2);
+    uint32_t copy[MODBUS_IMAGE_WORDS];
+    for (;;) {
+      uint32_t s1 = seq_.load(std::memory_order_acquire);
+      if (s1 & 1) {
+        retries_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      for (uint16_t w = first; w <= last; w++) copy[w] = words_[w].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq_.load(std::memory_order_relaxed) == s1) break;
+      retries_.fetch_add(1, std::memory_order_relaxed);
+    }
+    memcpy(out, (const uint8_t*)copy + 2 * start, 2 * count);
+    return true;
+  }
+
+  uint16_t reg(uint16_t r) const {
+    uint8_t b[2];
+    return read(r, 1, b) ? (uint16_t)(b[0] << 8 | b[1]) : 0;
+  }
+
+  uint32_t published() const { return seq_.load() / 2; }
+  uint32_t retries() const { return retries_.load(); }
+
+private:
+  std::atomic<uint32_t> seq_{0};
+  std::atomic<uint32_t> words_[MODBUS_IMAGE_WORDS] = {};
+  mutable std::atomic<uint32_t> retries_{0};
+};
+
+struct ModbusStats {
+  std::atomic<uint32_t> requests{0};
+  std::atomic<uint32_t> exceptions{0};
+  std::atomic<uint32_t> badFrames{0};   // CRC errors, bad MBAP headers
+  std::atomic<uint32_t> otherUnits{0};  // RTU frames addressed to another slave
+};
+
+// One request PDU (function code onwards) to its response PDU in out,
+// which needs 2 + 2 * MODBUS_MAX_READ bytes. Returns the response length.
+inline size_t modbusReply(const ModbusImage& image, const uint8_t* pdu, size_t len, uint8_t* out,
+                          ModbusStats* stats = nullptr) {
+  if (stats) stats->requests.fetch_add(1, std::memory_order_relaxed);
+  uint8_t fc = len ? pdu[0] : 0;
+  uint8_t ex = 0;
+  if (fc != MODBUS_FC_READ_HOLDING && fc != MODBUS_FC_READ_INPUT) {
+    ex = MODBUS_EX_ILLEGAL_FUNCTION;
+  } else if (len != 5) {
+    ex = MODBUS_EX_ILLEGAL_VALUE;
+  } else {
+    uint16_t start = (uint16_t)(pdu[1] << 8 | pdu[2]);
+    uint16_t count = (uint16_t)(pdu[3] << 8 | pdu[4]);
+    if (count == 0 || count > MODBUS_MAX_READ) ex = MODBUS_EX_ILLEGAL_VALUE;
+    else if (!image.read(start, count, out + 2)) ex = MODBUS_EX_ILLEGAL_ADDRESS;
+    else {
+      out[0] = fc;
+      out[1] = (uint8_t)(2 * count);
+      return 2 + 2 * count;
+    }
+  }
+  if (stats) stats->exceptions.fetch_add(1, std::memory_order_relaxed);
+  out[0] = (uint8_t)(fc | 0x80);
+  out[1] = ex;
+  return 2;
+}
+
+// RTU slave on a byte stream. feed() takes the bytes as they arrive and
+// calls send(reply, len) once a request for this unit is complete.
+class ModbusRtuServer {
+public:
+  // The silent interval: 3.5 characters, 1750 us above 19200 baud
+  void begin(const ModbusImage* image, uint8_t unit, uint32_t baud, ModbusStats* stats) {
+    image_ = image;
+    unit_ = unit;
+    stats_ = stats;
+    gapUs_ = baud > 19200 ? 1750 : (uint32_t)(38500000ULL / baud);
+    len_ = 0;
+  }
+
+  template <typename Send>
+  void feed(const uint8_t* data, size_t n, uint32_t nowUs, Send send) {
+    idle(nowUs, send);
+    lastUs_ = nowUs;
+    for (size_t i = 0; i < n; i++) {
+      if (len_ == sizeof(buf_)) discard();
+      buf_[len_++] = data[i];
+      size_t want = expected();
+      if (want == 0 || len_ < want) continue;
+      frame(want, send);
+      len_ = 0;
+    }
+  }
+
+  // Between reads: a frame whose length the function code does not tell
+  // ends with the silent interval
+  template <typename Send>
+  void idle(uint32_t nowUs, Send send) {
+    if (len_ == 0 || nowUs - lastUs_ <= gapUs_) return;
+    if (len_ >= 4 && expected() == 0) frame(len_, send);
+    else discard();
+    len_ = 0;
+  }
+
+  uint8_t unit() const { return unit_; }
+
+private:
+  // Length of the frame in buf_, 0 while unknown
+  size_t expected() const {
+    if (len_ < 2) return 0;
+    uint8_t fc = buf_[1];
+    if (fc >= 1 && fc <= 6) return 8;
+    if (fc == 15 || fc == 16) return len_ < 7 ? 0 : (size_t)9 + buf_[6];
+    return 0;
+  }
+
+  template <typename Send>
+  void frame(size_t len, Send send) {
+    uint16_t crc = modbusCrc(buf_, len - 2);
+    if (buf_[len - 2] != (uint8_t)crc || buf_[len - 1] != (uint8_t)(crc >> 8)) {
+      if (stats_) stats_->badFrames.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (buf_[0] != unit_) {
+      // Broadcast (0) carries no reads; other units are not ours to answer
+      if (stats_) stats_->otherUnits.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    uint8_t reply[MODBUS_RTU_MAX];
+    reply[0] = unit_;
+    size_t n = 1 + modbusReply(*image_, buf_ + 1, len - 3, reply + 1, stats_);
+    uint16_t c = modbusCrc(reply, n);
+    reply[n] = (uint8_t)c;
+    reply[n + 1] = (uint8_t)(c >> 8);
+    send(reply, n + 2);
+  }
+
+  void discard() {
+    if (len_ && stats_) stats_->badFrames.fetch_add(1, std::memory_order_relaxed);
+    len_ = 0;
+  }
+
+  const ModbusImage* image_ = nullptr;
+  ModbusStats* stats_ = nullptr;
+  uint8_t unit_ = 1;
+  uint32_t gapUs_ = 1750;
+  uint32_t lastUs_ = 0;
+  uint8_t buf_[MODBUS_RTU_MAX];
+  size_t len_ = 0;
+};
+
+// One Modbus TCP connection. Any unit id is answered: we are the only
+// device behind this address.
+class ModbusTcpSession {
+public:
+  void begin(const ModbusImage* image, ModbusStats* stats) {
+    image_ = image;
+    stats_ = stats;
+    len_ = 0;
+  }
+
+  // Bytes from the socket; send(reply, len) for every complete request,
+  // pipelined ones included. False when the stream is not Modbus TCP and
+  // the connection should be closed.
+  template <typename Send>
+  bool feed(const uint8_t* data, size_t n, Send send) {
+    while (n > 0) {
+      size_t take = sizeof(buf_) - len_ < n ? sizeof(buf_) - len_ : n;
+      memcpy(buf_ + len_, data, take);
+      len_ += take;
+      data += take;
+      n -= take;
+
+      size_t used = 0;
+      while (len_ - used >= MODBUS_TCP_HEADER) {
+        const uint8_t* h = buf_ + used;
+        uint16_t proto = (uint16_t)(h[2] << 8 | h[3]);
+        uint16_t length = (uint16_t)(h[4] << 8 | h[5]);
+        if (proto != 0 || length < 2 || length > MODBUS_TCP_MAX - 6) {
+          if (stats_) stats_->badFrames.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+        if (len_ - used < (size_t)6 + length) break;
+        uint8_t reply[MODBUS_TCP_HEADER + 2 + 2 * MODBUS_MAX_READ];
+        size_t pdu = modbusReply(*image_, h + MODBUS_TCP_HEADER, length - 1, reply + MODBUS_TCP_HEADER, stats_);
+        memcpy(reply, h, 4); // transaction and protocol id
+        reply[4] = (uint8_t)((pdu + 1) >> 8);
+        reply[5] = (uint8_t)(pdu + 1);
+        reply[6] = h[6];     // unit id
+        send(reply, MODBUS_TCP_HEADER + pdu);
+        used += 6 + length;
+      }
+      memmove(buf_, buf_ + used, len_ - used);
+      len_ -= used;
+    }
+    return true;
+  }
+
+private:
+  const ModbusImage* image_ = nullptr;
+  ModbusStats* stats_ = nullptr;
+  uint8_t buf_[MODBUS_TCP_MAX];
+  size_t len_ = 0;
+};
+
+#endif // MODBUS_SERVER_H
@@ -0,0 +1,105 @@
+/*
+ * Output fidelity under backpressure
+ *
+ * When the serial sink drains slower than records are produced, println()
+ * blocks and the read loop (and with it the BLE side) stalls. Before each
+ * record the controller looks at how full the sink's TX queue is and whether
+ * the previous read cycle overran its interval. Pressure steps the output
+ * down one level per cycle (full -> compact -> summary -> heartbeat); only
+ * after a run of clear cycles does it step back up one level. A relapse soon
+ * after stepping up doubles the run needed next time (up to
+ * OVERLOAD_RECOVER_MAX), so a sink that can carry one level but not the next
+ * settles instead of flapping; a long quiet spell resets it.
+ */
+
+#ifndef OVERLOAD_CONTROLLER_H
+#define OVERLOAD_CONTROLLER_H
+
+#include <stdint.h>
+
+#define OVERLOAD_HIGH_PERMILLE 500    // sink queue at least this full = pressure
+#define OVERLOAD_LOW_PERMILLE 125     // clear needs the queue at most this full
+#define OVERLOAD_RECOVER_CYCLES 6     // clear cycles in a row before stepping up
+#define OVERLOAD_RECOVER_MAX 96       // longest run after repeated relapses
+#define OVERLOAD_HEARTBEAT_MS 60000   // record interval at heartbeat level (alarms go out at once)
+
+enum OverloadLevel : uint8_t {
+  OVERLOAD_FULL,        // complete record with raw frame and protocol detail
+  OVERLOAD_COMPACT,     // decoded values, cell mV array, estimates
+  OVERLOAD_SUMMARY,     // pack voltage, current, SOC and alarms
+  OVERLOAD_HEARTBEAT,   // alive + alarms, once per OVERLOAD_HEARTBEAT_MS
+  OVERLOAD_LEVELS
+};
+
+class OverloadController {
+public:
+  // queue_permille: sink TX queue fill; cycle_ms: duration of the last read
+  // cycle including its output; budget_ms: the read interval
+  OverloadLevel update(uint16_t queue_permille, uint32_t cycle_ms, uint32_t budget_ms) {
+    bool pressure = queue_permille >= OVERLOAD_HIGH_PERMILLE || cycle_ms > budget_ms;
+    bool clear = queue_permille <= OVERLOAD_LOW_PERMILLE && cycle_ms <= budget_ms / 2;
+
+    if (sinceUp_ < UINT16_MAX) sinceUp_++;
+    if (pressure) {
+      stepDown();
+    } else if (clear && level_ > OVERLOAD_FULL) {
+      if (++clearRun_ >= recover_) {
+        level_ = (OverloadLevel)(level_ - 1);
+        stepsUp_++;
+        clearRun_ = 0;
+        sinceUp_ = 0;
+      }
+    } else if (!clear) {
+      clearRun_ = 0;
+    }
+    if (sinceUp_ == OVERLOAD_RECOVER_MAX * 2) recover_ = OVERLOAD_RECOVER_CYCLES;
+    cycles_[level_]++;
+    return level_;
+  }
+
+  OverloadLevel level() const { return level_; }
+  uint32_t stepsDown() const { return stepsDown_; }
+  uint32_t stepsUp() const { return stepsUp_; }
+  uint32_t cyclesAt(OverloadLevel level) const { return cycles_[level]; }
+  uint16_t recoverCycles() const { return recover_; }
+
+  // A record that did not fit the sink queue and was not written: pressure
+  // right away, so the chatter of the next cycle is already cut
+  void onDropped() {
+    dropped_++;
+    stepDown();
+  }
+  uint32_t dropped() const { return dropped_; }
+
+  static const char* name(OverloadLevel level) {
+    switch (level) {
+      case OVERLOAD_FULL: return "full";
+      case OVERLOAD_COMPACT: return "compact";
+      case OVERLOAD_SUMMARY: return "summary";
+      case OVERLOAD_HEARTBEAT: return "heartbeat";
+      default: return "?";
+    }
+  }
+
+private:
+  void stepDown() {
+    clearRun_ = 0;
+    if (sinceUp_ <= recover_ && recover_ < OVERLOAD_RECOVER_MAX) recover_ *= 2;
+    sinceUp_ = UINT16_MAX;
+    if (level_ < OVERLOAD_HEARTBEAT) {
+      level_ = (OverloadLevel)(level_ + 1);
+      stepsDown_++;
+    }
+  }
+
+  OverloadLevel level_ = OVERLOAD_FULL;
+  uint8_t clearRun_ = 0;
+  uint8_t recover_ = OVERLOAD_RECOVER_CYCLES;
+  uint16_t sinceUp_ = UINT16_MAX;   // cycles since the last step up
+  uint32_t dropped_ = 0;
+  uint32_t stepsDown_ = 0;
+  uint32_t stepsUp_ = 0;
+  uint32_t cycles_[OVERLOAD_LEVELS] = {};
+};
+
+#endif // OVERLOAD_CONTROLLER_H
@@ -0,0 +1,139 @@
+/*
+ * Rolling peak power and load-duration tracking
+ *
+ * Each window keeps two monotonic deques of (time, power): one with
+ * decreasing values for the maximum and one with increasing values for the
+ * minimum. A new sample pops every entry it dominates from the back and
+ * expired entries fall off the front, so each sample is pushed and popped at
+ * most once per deque and both extremes are read from the front in O(1).
+ *
+ * The load-duration histogram credits the time between two samples to the
+ * discharge power of the earlier one, giving "hours spent at each load".
+ *
+ * Power is in watts, positive = charging (same sign as the pack current).
+ */
+
+#ifndef POWER_PROFILE_H
+#define POWER_PROFILE_H
+
+#include <stdint.h>
+
+#define POWER_HIST_BINS 12
+#define POWER_HIST_BIN_W 250     // discharge watts per bin, last bin is open-ended
+#define POWER_SAMPLE_MIN_MS 500  // one sample per read: the smallest read_ms (config_store.h)
+
+// Deque entries a window needs when every sample is kept (a monotonic run)
+#define POWER_WINDOW_SAMPLES(window_ms) ((window_ms) / POWER_SAMPLE_MIN_MS + 1)
+
+// Max and min over the samples of the last window_ms. N bounds the samples
+// one deque can hold; when a monotonic run outgrows it the oldest entry is
+// dropped early, so size N with POWER_WINDOW_SAMPLES(window_ms).
+template <uint16_t N>
+class WindowExtrema {
+public:
+  explicit WindowExtrema(uint32_t window_ms) : window_(window_ms) {}
+
+  void add(uint32_t t_ms, int32_t watts) {
+    expire(t_ms);
+    while (maxLen_ && maxQ_[back(maxHead_, maxLen_)].watts <= watts) maxLen_--;
+    push(maxQ_, maxHead_, maxLen_, t_ms, watts);
+    while (minLen_ && minQ_[back(minHead_, minLen_)].watts >= watts) minLen_--;
+    push(minQ_, minHead_, minLen_, t_ms, watts);
+  }
+
+  // Drop samples older than the window without adding a new one
+  void expire(uint32_t now_ms) {
+    while (maxLen_ && now_ms - maxQ_[maxHead_].t_ms >= window_) pop(maxHead_, maxLen_);
+    while (minLen_ && now_ms - minQ_[minHead_].t_ms >= window_) pop(minHead_, minLen_);
+  }
+
+  bool empty() const { return maxLen_ == 0; }
+  int32_t max() const { return maxLen_ ? maxQ_[maxHead_].watts : 0; }
+  int32_t min() const { return minLen_ ? minQ_[minHead_].watts : 0; }
+  uint32_t windowMs() const { return window_; }
+
+private:
+  struct Entry {
+    uint32_t t_ms;
+    int32_t watts;
+  };
+
+  static uint16_t back(uint16_t head, uint16_t len) { return (head + len - 1) % N; }
+  static void pop(uint16_t& head, uint16_t& len) {
+    head = (head + 1) % N;
+    len--;
+  }
+  static void push(Entry* q, uint16_t& head, uint16_t& len, uint32_t t_ms, int32_t watts) {
+    if (len == N) pop(head, len);
+    q[(head + len) % N] = {t_ms, watts};
+    len++;
+  }
+
+  uint32_t window_;
+  Entry maxQ_[N];
+  Entry minQ_[N];
+  uint16_t maxHead_ = 0, maxLen_ = 0;
+  uint16_t minHead_ = 0, minLen_ = 0;
+};
+
+class PowerProfile {
+public:
+  static const uint8_t WINDOWS = 3;
+  static const uint32_t MAX_GAP_MS = 60000; // longer gaps (link down) are not credited
+
+  PowerProfile() : w1_(1000), w10_(10000), w60_(60000) {}
+
+  void add(uint32_t t_ms, int32_t watts) {
+    if (samples_ > 0) {
+      uint32_t dt = t_ms - lastMs_;
+      if (dt <= MAX_GAP_MS) histMs_[bin(lastWatts_)] += dt;
+    }
+    w1_.add(t_ms, watts);
+    w10_.add(t_ms, watts);
+    w60_.add(t_ms, watts);
+    lastMs_ = t_ms;
+    lastWatts_ = watts;
+    samples_++;
+  }
+
+  void expire(uint32_t now_ms) {
+    w1_.expire(now_ms);
+    w10_.expire(now_ms);
+    w60_.expire(now_ms);
+  }
+
+  // Window i: 0 = 1 s, 1 = 10 s, 2 = 60 s
+  int32_t peak(uint8_t i) const { return i == 0 ? w1_.max() : (i == 1 ? w10_.max() : w60_.max()); }
+  int32_t trough(uint8_t i) const { return i == 0 ? w1_.min() : (i == 1 ? w10_.min() : w60_.min()); }
+  uint32_t windowMs(uint8_t i) const {
+    return i == 0 ? w1_.windowMs() : (i == 1 ? w10_.windowMs() : w60_.windowMs());
+  }
+
+  int32_t lastWatts() const { return lastWatts_; }
+  uint32_t samples() const { return samples_; }
+  uint64_t binMs(uint8_t b) const { return histMs_[b]; }
+
+  // Time the discharge load was at least the lower edge of bin b
+  uint64_t msAtOrAbove(uint8_t b) const {
+    uint64_t sum = 0;
+    for (uint8_t i = b; i < POWER_HIST_BINS; i++) sum += histMs_[i];
+    return sum;
+  }
+
+  static uint8_t bin(int32_t watts) {
+    int32_t load = watts < 0 ? -watts : 0;
+    int32_t b = load / POWER_HIST_BIN_W;
+    return b >= POWER_HIST_BINS ? POWER_HIST_BINS - 1 : (uint8_t)b;
+  }
+
+private:
+  WindowExtrema<POWER_WINDOW_SAMPLES(1000)> w1_;
+  WindowExtrema<POWER_WINDOW_SAMPLES(10000)> w10_;
+  WindowExtrema<POWER_WINDOW_SAMPLES(60000)> w60_;
+  uint64_t histMs_[POWER_HIST_BINS] = {0};
+  uint32_t lastMs_ = 0;
+  int32_t lastWatts_ = 0;
+  uint32_t samples_ = 0;
+};
+
+#endif // POWER_PROFILE_H
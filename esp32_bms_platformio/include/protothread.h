@@ -0,0 +1,118 @@
+/*
+ * Stackless coroutines (protothreads) for multi-step protocol exchanges
+ *
+ * A protothread is a function that can stop at a wait point and carry on
+ * from there the next time it is called. The resume point is the source
+ * line of the wait, kept in a 2-byte Pt; PT_BEGIN switch()es to it. There is
+ * no stack of its own, so switching is a call plus a jump table lookup and a
+ * thread costs the Pt and whatever state it keeps in its own struct. Many
+ * exchanges can be in flight on one task: keep one state struct per
+ * exchange and call each thread until it ends.
+ *
+ *   struct Exchange { Pt pt; uint32_t sentMs; };
+ *   PT_THREAD(run(Exchange& x)) {
+ *     PT_BEGIN(&x.pt);
+ *     write(...);
+ *     x.sentMs = millis();
+ *     PT_WAIT_UNTIL(&x.pt, replied() || millis() - x.sentMs >= 500);
+ *     ...
+ *     PT_END(&x.pt);
+ *   }
+ *
+ * Rules that come with the switch() trick:
+ * - Local variables do not survive a wait. Whatever is needed after one
+ *   lives in the state struct.
+ * - No wait inside a switch() statement of the thread's own.
+ * - At most one wait per source line.
+ * Plain C++ with no compiler extensions, so it builds the same with the
+ * ESP32 toolchain and on the host.
+ */
+
+#ifndef PROTOTHREAD_H
+#define PROTOTHREAD_H
+
+#include <stdint.h>
+
+struct Pt {
+  uint16_t lc = 0;   // line of the wait to resume at, 0 = start
+};
+
+// What a thread call returns
+enum PtState : uint8_t {
+  PT_WAITING,   // blocked on a condition
+  PT_YIELDED,   // gave up the CPU, ready to go on
+  PT_EXITED,    // left through PT_EXIT
+  PT_ENDED      // ran to PT_END
+};
+
+#define PT_THREAD(decl) PtState decl
+
+// The case label of a wait follows the code before it; the attribute tells
+// -Wimplicit-fallthrough that running on into it is meant
+#define PT_FALLTHROUGH __attribute__((fallthrough))
+
+#define PT_INIT(pt) ((pt)->lc = 0)
+
+#define PT_BEGIN(pt)                                                                                          \
+  {                                                                                                           \
+    bool ptYielded = true;                                                                                    \
+    (void)ptYielded;                                                                                          \
+    switch ((pt)->lc) {                                                                                       \
+    case 0:
+
+#define PT_END(pt)                                                                                            \
+  }                                                                                                           \
+  PT_INIT(pt);                                                                                                \
+  return PT_ENDED;                                                                                            \
+  }
+
+// Resume here until `cond` holds
+#define PT_WAIT_UNTIL(pt, cond)                                                                               \
+  do {                                                                                                        \
+    (pt)->lc = __LINE__;                                                                                      \
+    PT_FALLTHROUGH;                                                                                           \
+    case __LINE__:                                                                                            \
+      if (!(cond)) return PT_WAITING;                                                                         \
+  } while (0)
+
+#define PT_WAIT_WHILE(pt, cond) PT_WAIT_UNTIL(pt, !(cond))
+
+// Give up the CPU once, carry on at the next call
+#define PT_YIELD(pt)                                                                                          \
+  do {                                                                                                        \
+    ptYielded = false;                                                                                        \
+    (pt)->lc = __LINE__;                                                                                      \
+    PT_FALLTHROUGH;                                                                                           \
+    case __LINE__:                                                                                            \
+      if (!ptYielded) return PT_YIELDED;                                                                      \
+  } while (0)
+
+// Run a child thread to its end; the caller waits (and passes on WAITING or
+// YIELDED) meanwhile
+#define PT_WAIT_THREAD(pt, thread) PT_WAIT_UNTIL(pt, (thread) >= PT_EXITED)
+
+#define PT_SPAWN(pt, child, thread)                                                                           \
+  do {                                                                                                        \
+    PT_INIT(child);                                                                                           \
+    PT_WAIT_THREAD(pt, thread);                                                                               \
+  } while (0)
+
+#define PT_EXIT(pt)                                                                                           \
+  do {                                                                                                        \
+    PT_INIT(pt);                                                                                              \
+    return PT_EXITED;                                                                                         \
+  } while (0)
+
+#define PT_RESTART(pt)                                                                                        \
+  do {                                                                                                        \
+    PT_INIT(pt);                                                                                              \
+    return PT_WAITING;                                                                                        \
+  } while (0)
+
+// True while the thread has not finished
+#define PT_SCHEDULE(f) ((f) < PT_EXITED)
+
+// Started and stopped at a wait, not yet ended
+#define PT_IN_PROGRESS(pt) ((pt)->lc != 0)
+
+#endif // PROTOTHREAD_H
@@ -0,0 +1,117 @@
+/*
+ * Raw Daly frame passthrough (`set output 3`)
+ *
+ * Instead of decoding on the ESP32 and printing JSON, each BMS reply is
+ * checked (CRC or checksum), stamped and forwarded as received; the host
+ * decodes it with include/daly_decode.h. The record travels in the framed
+ * envelope of cdr_battery.h under CDR_TOPIC_RAW_DALY, so it shares the port
+ * with text and the other topics:
+ *   seq (u32 LE) | rx ms (u32 LE) | proto | command | frame bytes
+ * seq counts forwarded frames only, so a gap on the host means records
+ * lost between the ESP32 and the host (dropped under backpressure or on
+ * the line), not bad frames from the BMS, which are counted separately.
+ */
+
+#ifndef RAW_FRAMES_H
+#define RAW_FRAMES_H
+
+#include "daly_decode.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RAW_RECORD_HEADER 10                 // seq, ms, proto, command
+#define RAW_FRAME_MAX DALY_REPLY_MAX         // longest frame carried
+
+enum RawProto : uint8_t {
+  RAW_PROTO_D203 = 1,   // BLE Modbus-style reply, command = FrameCommand
+  RAW_PROTO_A5 = 2      // UART / Bluetooth Classic reply, command = 0x90..
+};
+
+// A D2 03 frame that is whole and carries its own CRC; the length is taken
+// from the frame, since the passthrough does not care which reply it is
+inline bool rawD203Valid(const uint8_t* f, size_t len) {
+  return len >= 3 && classifyDalyFrame(f, len, f[2]) == FRAME_OK;
+}
+
+// Validates and encodes one record per frame; the sequence number lives here
+class RawForwarder {
+public:
+  // Record payload for `frame` into `out`; returns its length, 0 (and
+  // counts it rejected) if the frame fails its check or does not fit
+  size_t encode(RawProto proto, uint8_t command, const uint8_t* frame, size_t len, uint32_t rxMs, uint8_t* out,
+                size_t cap) {
+    bool valid = proto == RAW_PROTO_A5 ? dalyA5Valid(frame, len) : rawD203Valid(frame, len);
+    if (!valid || len > RAW_FRAME_MAX || RAW_RECORD_HEADER + len > cap) {
+      rejected_++;
+      return 0;
+    }
+    putU32(out, seq_++);
+    putU32(out + 4, rxMs);
+    out[8] = proto;
+    out[9] = command;
+    memcpy(out + RAW_RECORD_HEADER, frame, len);
+    return RAW_RECORD_HEADER + len;
+  }
+
+  uint32_t forwarded() const { return seq_; }
+  uint32_t rejected() const { return rejected_; }
+
+private:
+  static void putU32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+  }
+
+  uint32_t seq_ = 0;
+  uint32_t rejected_ = 0;
+};
+
+// One record as the host sees it; `frame` points into the payload
+struct RawRecord {
+  uint32_t seq;
+  uint32_t rxMs;
+  RawProto proto;
+  uint8_t command;
+  const uint8_t* frame;
+  size_t len;
+};
+
+inline bool rawParseRecord(const uint8_t* p, size_t len, RawRecord& r) {
+  if (len <= RAW_RECORD_HEADER) return false;
+  r.seq = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+  r.rxMs = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+  r.proto = (RawProto)p[8];
+  r.command = p[9];
+  r.frame = p + RAW_RECORD_HEADER;
+  r.len = len - RAW_RECORD_HEADER;
+  return r.proto == RAW_PROTO_D203 || r.proto == RAW_PROTO_A5;
+}
+
+// Host side: sequence gaps across records, with the wrap of seq
+class RawSequenceTracker {
+public:
+  void feed(uint32_t seq) {
+    if (records_ > 0) gaps_ += seq - next_;
+    next_ = seq + 1;
+    records_++;
+  }
+  uint32_t records() const { return records_; }
+  uint32_t gaps() const { return gaps_; }   // records missing between the ones seen
+
+private:
+  uint32_t next_ = 0;
+  uint32_t records_ = 0;
+  uint32_t gaps_ = 0;
+};
+
+// CPU spent from a reply to its output (raw record or decoded record), to
+// compare the output formats on the device
+struct OutputCost {
+  uint32_t frames = 0;
+  uint64_t cycles = 0;     // ESP.getCycleCount() ticks
+};
+
+#endif // RAW_FRAMES_H
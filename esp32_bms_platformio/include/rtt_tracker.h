@@ -0,0 +1,118 @@
+/*
+ * Streaming round-trip-time percentiles for the BMS link
+ *
+ * RTTs go into a log-scale histogram (each bucket 25 % wider than the last,
+ * 8 ms .. ~40 s). When the count reaches RTT_DECAY_AT all buckets are halved,
+ * so the estimate follows the link as it gets better or worse in fixed
+ * memory. The reply timeout is p99 x RTT_TIMEOUT_FACTOR, clamped, and doubles
+ * after each timeout until the next clean sample (as TCP does), so a link that
+ * got slower than its history still gets replies through and re-learns.
+ */
+
+#ifndef RTT_TRACKER_H
+#define RTT_TRACKER_H
+
+#include <atomic>
+#include <stdint.h>
+
+#define RTT_BUCKETS 40
+#define RTT_FIRST_EDGE_MS 8
+#define RTT_DECAY_AT 512          // halve the histogram at this many samples
+#define RTT_MIN_SAMPLES 8         // below this the timeout stays at its upper bound
+#define RTT_TIMEOUT_FACTOR 2      // timeout = p99 * factor
+#define RTT_MAX_BACKOFF 4         // at most 16 x after repeated timeouts
+
+// Request/reply accounting for one link. The BLE callback counts late and
+// duplicate replies while loop() prints them, so those two are atomics.
+struct ResponseStats {
+  uint32_t requests = 0;        // writes, including retries
+  uint32_t replies = 0;         // replies matched to a pending request
+  uint32_t timeouts = 0;        // waits that expired
+  uint32_t retries = 0;         // fast retries after a timeout
+  std::atomic<uint32_t> lateReplies{0}; // replies that arrived after their wait expired
+  uint32_t hedges = 0;          // duplicate requests sent while a reply was overdue
+  std::atomic<uint32_t> duplicateReplies{0}; // second replies to a hedged request, discarded
+  uint32_t failedCycles = 0;    // read cycles without a reply after all retries
+  uint32_t cycles = 0;
+  uint32_t lastCycleMs = 0;
+  uint32_t maxCycleMs = 0;
+  uint64_t totalCycleMs = 0;
+};
+
+class RttTracker {
+public:
+  RttTracker() {
+    uint32_t edge = RTT_FIRST_EDGE_MS;
+    for (uint8_t i = 0; i < RTT_BUCKETS; i++) {
+      edges_[i] = edge;
+      edge += edge / 4 > 0 ? edge / 4 : 1;
+    }
+    reset();
+  }
+
+  void reset() {
+    for (uint8_t i = 0; i < RTT_BUCKETS; i++) counts_[i] = 0;
+    total_ = 0;
+    backoff_ = 0;
+  }
+
+  void onTimeout() {
+    if (backoff_ < RTT_MAX_BACKOFF) backoff_++;
+  }
+
+  // Only for replies that unambiguously belong to one request
+  void record(uint32_t rtt_ms) {
+    backoff_ = 0;
+    uint8_t b = 0;
+    while (b < RTT_BUCKETS - 1 && rtt_ms > edges_[b]) b++;
+    counts_[b]++;
+    total_++;
+    if (total_ >= RTT_DECAY_AT) {
+      total_ = 0;
+      for (uint8_t i = 0; i < RTT_BUCKETS; i++) {
+        counts_[i] /= 2;
+        total_ += counts_[i];
+      }
+    }
+  }
+
+  // Upper edge of the bucket holding the given percentile (per mille), 0 when empty
+  uint32_t percentile(uint16_t per_mille) const {
+    if (total_ == 0) return 0;
+    uint32_t rank = ((uint32_t)total_ * per_mille + 999) / 1000;
+    if (rank == 0) rank = 1;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < RTT_BUCKETS; i++) {
+      seen += counts_[i];
+      if (seen >= rank) return edges_[i];
+    }
+    return edges_[RTT_BUCKETS - 1];
+  }
+
+  uint16_t samples() const { return total_; }
+
+  // When to send a hedged duplicate: p90, or 0 (no hedging) while the
+  // estimate is cold or p90 is not comfortably inside the timeout
+  uint32_t hedgeDelayMs(uint32_t timeout_ms) const {
+    if (total_ < RTT_MIN_SAMPLES) return 0;
+    uint32_t p90 = percentile(900);
+    return p90 * 2 <= timeout_ms ? p90 : 0;
+  }
+  uint8_t backoff() const { return backoff_; }
+
+  uint32_t timeoutMs(uint32_t min_ms, uint32_t max_ms) const {
+    if (total_ < RTT_MIN_SAMPLES) return max_ms;
+    uint32_t t = percentile(990) * RTT_TIMEOUT_FACTOR;
+    if (t < min_ms) t = min_ms;
+    t <<= backoff_;
+    return t > max_ms ? max_ms : t;
+  }
+
+private:
+  uint32_t edges_[RTT_BUCKETS];
+  uint16_t counts_[RTT_BUCKETS];
+  uint16_t total_;
+  uint8_t backoff_;
+};
+
+#endif // RTT_TRACKER_H
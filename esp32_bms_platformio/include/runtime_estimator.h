@@ -0,0 +1,164 @@
+/*
+ * Time to empty / time to full from remaining charge and a smoothed current
+ *
+ * The current is averaged at two rates: a fast EWMA (10 s time constant)
+ * that follows load changes and a slow one (5 min) that irons out pulsed
+ * loads, inverter ripple and the aliasing of a 5 s read interval. The slow
+ * average drives the prediction. When the two stay apart by more than a
+ * quarter of the load (and at least 2 A) for a minute, longer than the
+ * low phase of a typical duty-cycled load, the load has changed level
+ * rather than pulsed: the slow average restarts from the fast one, so the
+ * estimate settles in about a minute instead of 15 after a step.
+ *
+ * Discharging: remaining mAh / load. Charging follows a CC/CV profile: the
+ * constant current runs until the taper knee (a share of the capacity, or
+ * the CV cell voltage), then the current decays roughly exponentially,
+ * I(t) = I0 * exp(-t / tau), until the termination current (C/20). The
+ * charge left at the knee fixes tau = Q / (I0 - I_term), and the CV time is
+ * tau * ln(I0 / I_term). In CV the fast average is used, since the current
+ * falls steadily and the slow one would lag it.
+ *
+ * Updated on every decoded frame with the time since the previous one;
+ * current in mA, positive = charging.
+ */
+
+#ifndef RUNTIME_ESTIMATOR_H
+#define RUNTIME_ESTIMATOR_H
+
+#include <math.h>
+#include <stdint.h>
+
+#define RUNTIME_FAST_TAU_MS 10000
+#define RUNTIME_SLOW_TAU_MS 300000
+#define RUNTIME_CHANGE_PERMILLE 250      // fast and slow this far apart (share of the load) ...
+#define RUNTIME_CHANGE_MIN_MA 2000       // ... and by at least this much ...
+#define RUNTIME_CHANGE_CONFIRM_MS 60000  // ... for this long: a new load level
+#define RUNTIME_IDLE_MA 500              // below this either way the pack is idle
+#define RUNTIME_MAX_GAP_MS 60000         // longer gaps between frames restart the averages
+#define RUNTIME_NONE 0xFFFFFFFFUL        // no estimate in this direction
+
+// Where the charger tapers and when it stops
+struct ChargeProfile {
+  const char* name;
+  uint16_t cv_cell_mv;          // highest cell at or above this: in CV
+  uint16_t taper_permille;      // share of capacity at the CC/CV knee
+  uint16_t term_c_permille;     // termination current, share of 1C
+};
+
+static const ChargeProfile CHARGE_LFP = {"LFP", 3550, 950, 50};
+static const ChargeProfile CHARGE_NMC = {"NMC", 4150, 850, 50};
+
+enum RuntimeState : uint8_t {
+  RUNTIME_UNKNOWN,       // no frame yet
+  RUNTIME_IDLE,
+  RUNTIME_DISCHARGING,
+  RUNTIME_CHARGING_CC,
+  RUNTIME_CHARGING_CV,
+  RUNTIME_STATES
+};
+static const char* const RUNTIME_STATE_NAMES[] = {"unknown", "idle", "discharging", "charging_cc", "charging_cv"};
+
+class RuntimeEstimator {
+public:
+  explicit RuntimeEstimator(const ChargeProfile* profile = &CHARGE_LFP) : profile_(profile) {}
+
+  void setProfile(const ChargeProfile* profile) { profile_ = profile; }
+
+  void reset() {
+    state_ = RUNTIME_UNKNOWN;
+    cv_ = false;
+    changeMs_ = 0;
+    tte_s_ = ttf_s_ = RUNTIME_NONE;
+  }
+
+  // One frame: pack current, remaining and full charge, highest cell, and
+  // the time since the previous frame
+  void update(int32_t current_ma, uint32_t remaining_mah, uint32_t full_mah, uint16_t max_cell_mv, uint32_t dt_ms) {
+    float i = (float)current_ma;
+    if (state_ == RUNTIME_UNKNOWN || dt_ms > RUNTIME_MAX_GAP_MS) {
+      fast_ = slow_ = i;
+      changeMs_ = 0;
+    } else {
+      fast_ += (i - fast_) * dt_ms / (RUNTIME_FAST_TAU_MS + dt_ms);
+      slow_ += (i - slow_) * dt_ms / (RUNTIME_SLOW_TAU_MS + dt_ms);
+      float apart = fabsf(fast_ - slow_);
+      float limit = fabsf(slow_) * RUNTIME_CHANGE_PERMILLE / 1000;
+      if (apart > (limit > RUNTIME_CHANGE_MIN_MA ? limit : RUNTIME_CHANGE_MIN_MA)) {
+        changeMs_ += dt_ms;
+        if (changeMs_ >= RUNTIME_CHANGE_CONFIRM_MS) {
+          slow_ = fast_;
+          changeMs_ = 0;
+          loadChanges_++;
+        }
+      } else {
+        changeMs_ = 0;
+      }
+    }
+    if (remaining_mah > full_mah) remaining_mah = full_mah;
+    estimate(remaining_mah, full_mah, max_cell_mv);
+  }
+
+  RuntimeState state() const { return state_; }
+  uint32_t tteS() const { return tte_s_; }       // RUNTIME_NONE unless discharging
+  uint32_t ttfS() const { return ttf_s_; }       // RUNTIME_NONE unless charging
+  int32_t loadMa() const { return (int32_t)lroundf(load_); }   // the current the estimate uses
+  int32_t fastMa() const { return (int32_t)lroundf(fast_); }
+  int32_t slowMa() const { return (int32_t)lroundf(slow_); }
+  uint32_t loadChanges() const { return loadChanges_; }
+
+private:
+  void estimate(uint32_t remaining_mah, uint32_t full_mah, uint16_t max_cell_mv) {
+    tte_s_ = RUNTIME_NONE;
+    ttf_s_ = RUNTIME_NONE;
+    // The slow average unless it is still near zero after a start from idle
+    load_ = fabsf(slow_) > RUNTIME_IDLE_MA ? slow_ : fast_;
+    if (fabsf(load_) <= RUNTIME_IDLE_MA) {
+      state_ = RUNTIME_IDLE;
+      cv_ = false;
+      return;
+    }
+    if (load_ < 0) {
+      state_ = RUNTIME_DISCHARGING;
+      cv_ = false;
+      tte_s_ = seconds(remaining_mah / -load_);
+      return;
+    }
+
+    // Charging; the knee latches until the pack stops charging
+    uint32_t kneeMah = (uint32_t)((uint64_t)full_mah * profile_->taper_permille / 1000);
+    if (remaining_mah >= kneeMah || max_cell_mv >= profile_->cv_cell_mv) cv_ = true;
+    float termMa = (float)full_mah * profile_->term_c_permille / 1000;
+    if (cv_) {
+      state_ = RUNTIME_CHARGING_CV;
+      load_ = fast_;
+      ttf_s_ = load_ <= termMa ? 0 : seconds(taperHours(full_mah - remaining_mah, load_, termMa));
+      return;
+    }
+    state_ = RUNTIME_CHARGING_CC;
+    ttf_s_ = seconds((kneeMah - remaining_mah) / load_ + taperHours(full_mah - kneeMah, load_, termMa));
+  }
+
+  // Hours to put `mah` in while the current decays from i0 to the termination
+  static float taperHours(uint32_t mah, float i0, float termMa) {
+    if (i0 <= termMa * 1.01f) return mah / i0;   // the charger never gets above C/20
+    float tau = mah / (i0 - termMa);
+    return tau * logf(i0 / termMa);
+  }
+
+  static uint32_t seconds(float hours) {
+    float s = hours * 3600.0f;
+    return s >= 4.0e9f ? RUNTIME_NONE - 1 : (uint32_t)lroundf(s);
+  }
+
+  const ChargeProfile* profile_;
+  RuntimeState state_ = RUNTIME_UNKNOWN;
+  bool cv_ = false;
+  float fast_ = 0, slow_ = 0;   // mA
+  float load_ = 0;
+  uint32_t changeMs_ = 0;       // how long fast and slow have been apart
+  uint32_t loadChanges_ = 0;
+  uint32_t tte_s_ = RUNTIME_NONE;
+  uint32_t ttf_s_ = RUNTIME_NONE;
+};
+
+#endif // RUNTIME_ESTIMATOR_H
@@ -0,0 +1,505 @@
+/*
+ * Raw log on an SD card with double-buffered block writes
+ *
+ * The card is a dedicated log volume, not a FAT filesystem: block 0 holds a
+ * label written by `sd format`, the rest is a ring of 512-byte blocks.
+ * Records (here the raw frame records of raw_frames.h) are packed into
+ * blocks, each length-prefixed and never split. Every block carries its
+ * own header (volume id, a serial that counts every block ever written,
+ * file number, block within the file, day, first timestamp, fill) and a
+ * CRC-32, so a header is never rewritten after the fact: a block is either
+ * whole or ignored, and after a power cut the newest whole block is found
+ * by a binary search over serials, like the flash log's segment table.
+ *
+ * Blocks are collected in two buffers of SD_LOG_BUFFER_BLOCKS blocks. The
+ * poll path only copies into the buffer being filled; a full buffer (or
+ * one holding data older than the flush interval) is sealed and handed to
+ * a writer running on its own task, which writes it while the other one
+ * fills. A card stall therefore costs the poll path nothing unless it
+ * outlasts a whole buffer, and then records are dropped and counted rather
+ * than waited for.
+ *
+ * "Files" are runs of blocks with one file number: a new one starts on a
+ * new day (timestamp / 86400) and after SD_LOG_FILE_BLOCKS blocks, so a
+ * reader can cut the log by day or size. When the ring wraps, the oldest
+ * blocks are overwritten. The block device is an interface, so the logger
+ * runs against an image file on the host (native/block_image.h).
+ */
+
+#ifndef SD_LOGGER_H
+#define SD_LOGGER_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SD_BLOCK 512
+#define SD_LOG_MAGIC 0x44534D42          // "BMSD", data block
+#define SD_LABEL_MAGIC 0x56534D42        // "BMSV", volume label in block 0
+#define SD_LOG_VERSION 1
+#define SD_LOG_BUFFER_BLOCKS 8           // per buffer: 4 KB, written in one go
+#define SD_LOG_FILE_BLOCKS 131072        // 64 MB per file at most
+#define SD_LOG_FLUSH_MS 60000            // a buffer holding older data is written anyway
+#define SD_LOG_NONE 0xFF
+
+// Storage the log lives on: an SD card, or an image on the host
+class BlockDevice {
+public:
+  virtual ~BlockDevice() {}
+  virtual uint32_t blockCount() const = 0;
+  virtual bool readBlocks(uint32_t lba, void* dst, uint32_t count) = 0;
+  virtual bool writeBlocks(uint32_t lba, const void* src, uint32_t count) = 0;
+};
+
+struct SdBlockHeader {
+  uint32_t magic;
+  uint32_t volume;      // id from the label; blocks of an earlier format do not match
+  uint32_t serial;      // every block ever written, from 1
+  uint32_t file;        // +1 on every rotation
+  uint32_t fileBlock;   // block number within the file
+  uint32_t day;         // of the file, timestamp / 86400
+  uint32_t firstTs;     // timestamp of the first record
+  uint16_t used;        // record bytes after the header
+  uint16_t records;
+  uint32_t crc;         // CRC-32 of the whole block with this field zero
+};
+static_assert(sizeof(SdBlockHeader) == 36, "block header is part of the card format");
+
+#define SD_BLOCK_PAYLOAD ((uint16_t)(SD_BLOCK - sizeof(SdBlockHeader)))
+#define SD_RECORD_MAX (SD_BLOCK_PAYLOAD - 2)
+
+struct SdVolumeLabel {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t volume;
+  uint32_t blocks;      // card size at format time
+  uint32_t crc;
+};
+
+// CRC-32 (IEEE, reflected), a nibble at a time
+inline uint32_t sdCrc32(const uint8_t* p, size_t len, uint32_t crc = 0) {
+  static const uint32_t T[16] = {0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+                                 0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+                                 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= p[i];
+    crc = (crc >> 4) ^ T[crc & 15];
+    crc = (crc >> 4) ^ T[crc & 15];
+  }
+  return ~crc;
+}
+
+inline uint32_t sdBlockCrc(const uint8_t* block) {
+  uint32_t crc = sdCrc32(block, offsetof(SdBlockHeader, crc));
+  static const uint8_t zero[4] = {0, 0, 0, 0};
+  crc = sdCrc32(zero, 4, crc);
+  return sdCrc32(block + sizeof(SdBlockHeader), SD_BLOCK_PAYLOAD, crc);
+}
+
+// Header of a whole block of this volume, or false
+inline bool sdBlockValid(const uint8_t* block, uint32_t volume, SdBlockHeader& h) {
+  memcpy(&h, block, sizeof(h));
+  return h.magic == SD_LOG_MAGIC && h.volume == volume && h.used <= SD_BLOCK_PAYLOAD && h.crc == sdBlockCrc(block);
+}
+
+// Ring blocks are 1..blockCount-1; position p is block p + 1
+class SdVolume {
+public:
+  bool open(BlockDevice* dev) {
+    dev_ = dev;
+    uint8_t block[SD_BLOCK];
+    if (!dev || dev->blockCount() < 2 + SD_LOG_BUFFER_BLOCKS || !dev->readBlocks(0, block, 1)) return false;
+    SdVolumeLabel l;
+    memcpy(&l, block, sizeof(l));
+    if (l.magic != SD_LABEL_MAGIC || l.version != SD_LOG_VERSION ||
+        l.crc != sdCrc32(block, offsetof(SdVolumeLabel, crc))) {
+      return false;
+    }
+    volume_ = l.volume;
+    ring_ = dev->blockCount() - 1;
+    return true;
+  }
+
+  // Label the card as a new log volume; earlier log blocks stop counting
+  static bool format(BlockDevice* dev, uint32_t volumeId) {
+    if (!dev || dev->blockCount() < 2 + SD_LOG_BUFFER_BLOCKS) return false;
+    uint8_t block[SD_BLOCK];
+    memset(block, 0, sizeof(block));
+    SdVolumeLabel l = {SD_LABEL_MAGIC, SD_LOG_VERSION, volumeId, dev->blockCount(), 0};
+    memcpy(block, &l, sizeof(l));
+    l.crc = sdCrc32(block, offsetof(SdVolumeLabel, crc));
+    memcpy(block, &l, sizeof(l));
+    return dev->writeBlocks(0, block, 1);
+  }
+
+  // Header at ring position p; false if the block is not a whole block of this volume
+  bool header(uint32_t p, SdBlockHeader& h, uint8_t* block) {
+    return dev_->readBlocks(p + 1, block, 1) && sdBlockValid(block, volume_, h);
+  }
+
+  // Position of the newest whole block, NO_BLOCK if there is none.
+  // Serials increase from position 0 up to the newest block; after it come
+  // blocks of the previous lap (lower) or blocks never written.
+  static const uint32_t NO_BLOCK = 0xFFFFFFFFUL;
+  uint32_t findNewest(SdBlockHeader& newest) {
+    uint8_t block[SD_BLOCK];
+    SdBlockHeader first, h;
+    if (!header(0, first, block)) {
+      // Position 0 never written, or torn while the ring wrapped onto it
+      if (header(ring_ - 1, h, block)) {
+        newest = h;
+        return ring_ - 1;
+      }
+      return NO_BLOCK;
+    }
+    uint32_t lo = 0, hi = ring_;   // serial >= first.serial holds for [0, lo]
+    while (hi - lo > 1) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (header(mid, h, block) && h.serial >= first.serial) lo = mid;
+      else hi = mid;
+    }
+    header(lo, newest, block);
+    return lo;
+  }
+
+  uint32_t ring() const { return ring_; }
+  uint32_t volume() const { return volume_; }
+  BlockDevice* device() const { return dev_; }
+
+private:
+  BlockDevice* dev_ = nullptr;
+  uint32_t volume_ = 0;
+  uint32_t ring_ = 0;
+};
+
+class SdLogger {
+public:
+  typedef uint32_t (*Clock)();
+  typedef void (*WakeFn)();
+
+  // Finds the newest whole block and continues after it; false if the card
+  // carries no log volume label. clockUs times the writes for the stats.
+  bool begin(BlockDevice* dev, Clock clockUs, WakeFn wake = nullptr) {
+    ready_ = false;
+    if (!volume_.open(dev)) return false;
+    clockUs_ = clockUs;
+    wake_ = wake;
+    SdBlockHeader newest;
+    uint32_t pos = volume_.findNewest(newest);
+    if (pos == SdVolume::NO_BLOCK) {
+      head_ = 0;
+      serial_ = 0;
+      file_ = 0;
+      fileBlock_ = 0;
+      day_ = 0;
+      haveFile_ = false;
+    } else {
+      head_ = (pos + 1) % volume_.ring();
+      serial_ = newest.serial;
+      file_ = newest.file;
+      fileBlock_ = newest.fileBlock + 1;
+      day_ = newest.day;
+      haveFile_ = true;
+    }
+    resumedFile_ = file_;
+    for (uint8_t i = 0; i < 2; i++) buffers_[i].state.store(BUF_FREE);
+    cur_ = 0;
+    startBuffer(0);
+    ready_ = true;
+    return true;
+  }
+
+  // Poll path: copy one record in. Never touches the card; false when the
+  // record was dropped (both buffers waiting on the card) or is too long.
+  bool append(const uint8_t* rec, uint16_t len, uint32_t ts, uint32_t nowMs) {
+    if (!ready_) return false;
+    if (len > SD_RECORD_MAX) {
+      tooLong_++;
+      return false;
+    }
+    uint32_t day = ts / 86400;
+    if (blockRecords_ > 0 && (day != day_ || blockUsed_ + 2 + len > SD_BLOCK_PAYLOAD)) {
+      closeBlock();
+      if (curBlocks_ == SD_LOG_BUFFER_BLOCKS) seal();
+    }
+    if (cur_ == SD_LOG_NONE && !acquire()) {
+      dropped_++;
+      return false;
+    }
+    if (blockRecords_ == 0) openBlock(day, ts, nowMs);
+    uint8_t* p = payload() + blockUsed_;
+    p[0] = (uint8_t)len;
+    p[1] = (uint8_t)(len >> 8);
+    memcpy(p + 2, rec, len);
+    blockUsed_ += 2 + len;
+    blockRecords_++;
+    appended_++;
+    return true;
+  }
+
+  // Poll path, periodically: hand over a buffer holding data older than
+  // the flush interval, so a quiet log still reaches the card
+  void tick(uint32_t nowMs) {
+    if (!ready_) return;
+    if (cur_ == SD_LOG_NONE) {
+      acquire();
+      return;
+    }
+    if ((blockRecords_ > 0 || curBlocks_ > 0) && nowMs - bufferStartMs_ >= flushMs_) seal();
+  }
+
+  // Writer task: write the oldest sealed buffer to the card. Returns true
+  // if it wrote one (call again until false).
+  bool writePending() {
+    uint8_t i = SD_LOG_NONE;
+    for (uint8_t k = 0; k < 2; k++) {
+      if (buffers_[k].state.load(std::memory_order_acquire) != BUF_SEALED) continue;
+      if (i == SD_LOG_NONE || buffers_[k].sealSeq < buffers_[i].sealSeq) i = k;
+    }
+    if (i == SD_LOG_NONE) return false;
+    Buffer& b = buffers_[i];
+    uint32_t start = clockUs_ ? clockUs_() : 0;
+    bool ok = true;
+    uint32_t done = 0;
+    while (done < b.blocks && ok) {
+      uint32_t pos = (b.pos + done) % volume_.ring();
+      uint32_t n = b.blocks - done;
+      if (pos + n > volume_.ring()) n = volume_.ring() - pos;   // split at the end of the ring
+      ok = volume_.device()->writeBlocks(pos + 1, b.data + done * SD_BLOCK, n);
+      done += n;
+    }
+    uint32_t us = clockUs_ ? clockUs_() - start : 0;
+    if (ok) blocksWritten_.fetch_add(b.blocks, std::memory_order_relaxed);
+    else writeErrors_.fetch_add(1, std::memory_order_relaxed);
+    writeUs_.fetch_add(us, std::memory_order_relaxed);
+    if (us > maxWriteUs_.load(std::memory_order_relaxed)) maxWriteUs_.store(us, std::memory_order_relaxed);
+    writes_.fetch_add(1, std::memory_order_relaxed);
+    b.state.store(BUF_FREE, std::memory_order_release);
+    return true;
+  }
+
+  // Stops taking records; true once the writer holds no buffer any more, so
+  // the card can be relabelled and begin() called again
+  bool end() {
+    ready_ = false;
+    for (uint8_t k = 0; k < 2; k++) {
+      if (buffers_[k].state.load(std::memory_order_acquire) == BUF_SEALED) return false;
+    }
+    return true;
+  }
+
+  void setFlushMs(uint32_t ms) { flushMs_ = ms; }
+  void setFileBlocks(uint32_t blocks) { fileBlocks_ = blocks; }
+
+  bool ready() const { return ready_; }
+  uint32_t volumeId() const { return volume_.volume(); }
+  uint32_t ringBlocks() const { return volume_.ring(); }
+  uint32_t headPosition() const { return head_; }     // where the next block goes
+  uint32_t serial() const { return serial_; }          // blocks filled so far, all time
+  uint32_t file() const { return file_; }
+  uint32_t filesStarted() const { return file_ - resumedFile_; }
+  uint32_t appended() const { return appended_; }
+  uint32_t dropped() const { return dropped_; }
+  uint32_t tooLong() const { return tooLong_; }
+  uint32_t blocksWritten() const { return blocksWritten_.load(std::memory_order_relaxed); }
+  uint32_t writes() const { return writes_.load(std::memory_order_relaxed); }
+  uint32_t writeErrors() const { return writeErrors_.load(std::memory_order_relaxed); }
+  uint64_t writeUs() const { return writeUs_.load(std::memory_order_relaxed); }
+  uint32_t maxWriteUs() const { return maxWriteUs_.load(std::memory_order_relaxed); }
+  uint8_t buffersBusy() const {
+    return (buffers_[0].state.load() != BUF_FREE) + (buffers_[1].state.load() != BUF_FREE);
+  }
+
+private:
+  enum BufferState : uint8_t { BUF_FREE, BUF_FILLING, BUF_SEALED };
+
+  struct Buffer {
+    alignas(4) uint8_t data[SD_LOG_BUFFER_BLOCKS * SD_BLOCK];
+    uint32_t pos = 0;       // ring position of the first block
+    uint32_t blocks = 0;
+    uint32_t sealSeq = 0;
+    std::atomic<uint8_t> state{BUF_FREE};
+  };
+
+  uint8_t* block() { return buffers_[cur_].data + curBlocks_ * SD_BLOCK; }
+  uint8_t* payload() { return block() + sizeof(SdBlockHeader); }
+
+  void startBuffer(uint8_t i) {
+    cur_ = i;
+    curBlocks_ = 0;
+    blockRecords_ = 0;
+    blockUsed_ = 0;
+    buffers_[i].pos = head_;
+    buffers_[i].state.store(BUF_FILLING, std::memory_order_relaxed);
+  }
+
+  bool acquire() {
+    for (uint8_t k = 0; k < 2; k++) {
+      uint8_t i = (lastSealed_ + 1 + k) % 2;
+      if (buffers_[i].state.load(std::memory_order_acquire) == BUF_FREE) {
+        startBuffer(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // A new block in the current buffer, in a new file on a new day or when
+  // the file is full
+  void openBlock(uint32_t day, uint32_t ts, uint32_t nowMs) {
+    if (!haveFile_ || day != day_ || fileBlock_ >= fileBlocks_) {
+      if (haveFile_) file_++;
+      haveFile_ = true;
+      fileBlock_ = 0;
+      day_ = day;
+    }
+    if (curBlocks_ == 0) bufferStartMs_ = nowMs;
+    blockFirstTs_ = ts;
+  }
+
+  void closeBlock() {
+    uint8_t* b = block();
+    memset(payload() + blockUsed_, 0, SD_BLOCK_PAYLOAD - blockUsed_);
+    SdBlockHeader h;
+    h.magic = SD_LOG_MAGIC;
+    h.volume = volume_.volume();
+    h.serial = ++serial_;
+    h.file = file_;
+    h.fileBlock = fileBlock_++;
+    h.day = day_;
+    h.firstTs = blockFirstTs_;
+    h.used = blockUsed_;
+    h.records = blockRecords_;
+    h.crc = 0;
+    memcpy(b, &h, sizeof(h));
+    h.crc = sdBlockCrc(b);
+    memcpy(b, &h, sizeof(h));
+    curBlocks_++;
+    head_ = (head_ + 1) % volume_.ring();
+    blockRecords_ = 0;
+    blockUsed_ = 0;
+  }
+
+  // Hand the current buffer to the writer and move on to the other one
+  void seal() {
+    if (blockRecords_ > 0) closeBlock();
+    if (curBlocks_ == 0) return;
+    Buffer& b = buffers_[cur_];
+    b.blocks = curBlocks_;
+    b.sealSeq = ++sealSeq_;
+    b.state.store(BUF_SEALED, std::memory_order_release);
+    lastSealed_ = cur_;
+    cur_ = SD_LOG_NONE;
+    if (wake_) wake_();
+    acquire();
+  }
+
+  SdVolume volume_;
+  Clock clockUs_ = nullptr;
+  WakeFn wake_ = nullptr;
+  bool ready_ = false;
+  Buffer buffers_[2];
+
+  // Poll path only
+  uint8_t cur_ = SD_LOG_NONE;   // buffer being filled
+  uint8_t lastSealed_ = 1;
+  uint32_t sealSeq_ = 0;
+  uint32_t curBlocks_ = 0;      // closed blocks in it
+  uint16_t blockUsed_ = 0;      // open block
+  uint16_t blockRecords_ = 0;
+  uint32_t blockFirstTs_ = 0;
+  uint32_t bufferStartMs_ = 0;
+  uint32_t head_ = 0;
+  uint32_t serial_ = 0;
+  uint32_t file_ = 0;
+  uint32_t resumedFile_ = 0;
+  uint32_t fileBlock_ = 0;
+  uint32_t day_ = 0;
+  bool haveFile_ = false;
+  uint32_t flushMs_ = SD_LOG_FLUSH_MS;
+  uint32_t fileBlocks_ = SD_LOG_FILE_BLOCKS;
+  uint32_t appended_ = 0;
+  uint32_t dropped_ = 0;
+  uint32_t tooLong_ = 0;
+
+  // Writer task
+  std::atomic<uint32_t> blocksWritten_{0};
+  std::atomic<uint32_t> writes_{0};
+  std::atomic<uint32_t> writeErrors_{0};
+  std::atomic<uint64_t> writeUs_{0};
+  std::atomic<uint32_t> maxWriteUs_{0};
+};
+
+// Host side: every whole block of the volume, oldest first, and the records
+// in it. fn(const SdBlockHeader&, const uint8_t* record, uint16_t len).
+// Returns the number of blocks read back.
+template <typename Fn>
+uint32_t sdLogReadAll(BlockDevice* dev, Fn fn) {
+  SdVolume v;
+  if (!v.open(dev)) return 0;
+  SdBlockHeader newest;
+  uint32_t head = v.findNewest(newest);
+  if (head == SdVolume::NO_BLOCK) return 0;
+  uint8_t block[SD_BLOCK];
+  uint32_t blocks = 0;
+  for (uint32_t k = 1; k <= v.ring(); k++) {
+    SdBlockHeader h;
+    if (!v.header((head + k) % v.ring(), h, block)) continue;
+    blocks++;
+    for (uint16_t off = 0, r = 0; r < h.records && off + 2 <= h.used; r++) {
+      const uint8_t* p = block + sizeof(SdBlockHeader) + off;
+      uint16_t len = p[0] | p[1] << 8;
+      if (off + 2 + len > h.used) break;
+      fn(h, p + 2, len);
+      off += 2 + len;
+    }
+  }
+  return blocks;
+}
+
+#ifndef BMS_NATIVE
+#include <SPI.h>
+#include "diskio.h"
+#include "sd_diskio.h"
+
+// The card on the SPI bus, addressed by sector through the SD library's
+// disk layer, without mounting a filesystem
+class EspSdBlockDevice : public BlockDevice {
+public:
+  bool begin(uint8_t csPin, uint32_t hz = 20000000) {
+    SPI.begin();
+    pdrv_ = sdcard_init(csPin, &SPI, hz);
+    if (pdrv_ == 0xFF) return false;
+    // sdcard_init() only registers the drive; the card is brought up (and
+    // its sector count read) by the first disk_initialize()
+    if (disk_initialize(pdrv_) & (STA_NOINIT | STA_NODISK)) {
+      sdcard_uninit(pdrv_);
+      pdrv_ = 0xFF;
+      return false;
+    }
+    blocks_ = sdcard_num_sectors(pdrv_);
+    return blocks_ > 0;
+  }
+  uint32_t blockCount() const override { return blocks_; }
+  bool readBlocks(uint32_t lba, void* dst, uint32_t count) override {
+    for (uint32_t i = 0; i < count; i++) {
+      if (!sd_read_raw(pdrv_, (uint8_t*)dst + i * SD_BLOCK, lba + i)) return false;
+    }
+    return true;
+  }
+  bool writeBlocks(uint32_t lba, const void* src, uint32_t count) override {
+    for (uint32_t i = 0; i < count; i++) {
+      if (!sd_write_raw(pdrv_, (uint8_t*)src + i * SD_BLOCK, lba + i)) return false;
+    }
+    return true;
+  }
+
+private:
+  uint8_t pdrv_ = 0xFF;
+  uint32_t blocks_ = 0;
+};
+#endif
+
+#endif // SD_LOGGER_H
@@ -0,0 +1,188 @@
+/*
+ * Fixed-point extended Kalman filter for state of charge
+ *
+ * One state (SOC). Predict integrates the pack current (coulomb counting);
+ * once the pack has rested long enough for the cells to relax, the average
+ * cell voltage is taken as OCV and corrects the state through the
+ * chemistry's OCV-SOC table. The measurement Jacobian is the table slope at
+ * the current estimate, so the flat LFP plateau automatically gets a weak
+ * correction and the steep ends a strong one.
+ *
+ * Integer-only: SOC in nano-units (1e-9), variance in ppm^2, voltages in uV.
+ */
+
+#ifndef SOC_EKF_H
+#define SOC_EKF_H
+
+#include <stdint.h>
+
+struct OcvPoint {
+  uint16_t soc_permille; // 0..1000
+  uint16_t cell_mv;      // rested cell voltage at that SOC
+};
+
+struct SocChemistry {
+  const char* name;
+  const OcvPoint* ocv;        // ascending soc_permille, first 0, last 1000
+  uint8_t points;
+  uint32_t rest_ms;           // time below rest current before OCV is trusted
+  uint32_t ocv_sigma_uv;      // OCV measurement/model error (1 sigma)
+};
+
+static const OcvPoint OCV_LFP[] = {
+  {0, 2900}, {50, 3150}, {100, 3200}, {200, 3250}, {300, 3275}, {400, 3290}, {500, 3300},
+  {600, 3305}, {700, 3315}, {800, 3330}, {900, 3335}, {950, 3345}, {1000, 3400},
+};
+
+static const OcvPoint OCV_NMC[] = {
+  {0, 3000}, {50, 3300}, {100, 3450}, {200, 3550}, {300, 3620}, {400, 3680}, {500, 3740},
+  {600, 3820}, {700, 3900}, {800, 3980}, {900, 4080}, {1000, 4180},
+};
+
+static const SocChemistry CHEMISTRY_LFP = {"LFP", OCV_LFP, sizeof(OCV_LFP) / sizeof(OCV_LFP[0]), 30UL * 60 * 1000, 4000};
+static const SocChemistry CHEMISTRY_NMC = {"NMC", OCV_NMC, sizeof(OCV_NMC) / sizeof(OCV_NMC[0]), 10UL * 60 * 1000, 8000};
+
+class SocEkf {
+public:
+  static const int32_t SOC_ONE = 1000000000;       // 100 % in nano-SOC
+  static const int64_t VAR_MAX = 250000000000LL;   // (50 %)^2 in ppm^2
+
+  void begin(const SocChemistry* chem, uint32_t capacity_mah) {
+    chem_ = chem;
+    capacity_mah_ = capacity_mah ? capacity_mah : 1;
+    initialized_ = false;
+  }
+
+  void setCapacity(uint32_t capacity_mah) { capacity_mah_ = capacity_mah ? capacity_mah : 1; }
+
+  // Seed from the BMS SOC register, trusted to within sigma_permille
+  void reset(uint16_t soc_permille, uint16_t sigma_permille) {
+    x_ = (int32_t)soc_permille * 1000000;
+    int64_t s = (int64_t)sigma_permille * 1000;
+    p_ = s * s;
+    remainder_ = 0;
+    restMs_ = 0;
+    nextCorrectionMs_ = chem_->rest_ms;
+    initialized_ = true;
+  }
+
+  // One frame: pack current (mA, + = charging), mean cell voltage (mV), elapsed ms
+  void update(int32_t current_ma, uint16_t cell_mv, uint32_t dt_ms) {
+    if (!initialized_) return;
+    predict(current_ma, dt_ms);
+
+    int32_t absI = current_ma < 0 ? -current_ma : current_ma;
+    if (absI <= restCurrentMa()) {
+      restMs_ += dt_ms;
+    } else {
+      restMs_ = 0;
+      nextCorrectionMs_ = chem_->rest_ms;
+    }
+    atRest_ = restMs_ >= chem_->rest_ms;
+
+    // OCV errors are strongly correlated within one rest period, so take one
+    // reading per rest_ms rather than treating every frame as independent
+    if (atRest_ && cell_mv > 0 && restMs_ >= nextCorrectionMs_) {
+      correct(cell_mv);
+      nextCorrectionMs_ = restMs_ + chem_->rest_ms;
+    }
+  }
+
+  bool initialized() const { return initialized_; }
+  bool atRest() const { return atRest_; }
+  uint16_t socPermille() const { return (uint16_t)((x_ + 500000) / 1000000); }
+  float socPercent() const { return x_ / 10000000.0f; }
+  // 1-sigma uncertainty in 0.1 % (integer square root of the variance)
+  uint16_t sigmaPermille() const { return (uint16_t)(isqrt64(p_) / 1000); }
+  uint32_t corrections() const { return corrections_; }
+
+  // OCV (uV) and slope dOCV/dSOC (uV per unit SOC) at nano-SOC x
+  int32_t ocvUv(int32_t x, int32_t* slope) const {
+    const OcvPoint* t = chem_->ocv;
+    int32_t pm = x / 1000000;
+    uint8_t i = 1;
+    while (i < chem_->points - 1 && t[i].soc_permille < pm) i++;
+    int32_t s0 = (int32_t)t[i - 1].soc_permille * 1000000, s1 = (int32_t)t[i].soc_permille * 1000000;
+    int32_t v0 = (int32_t)t[i - 1].cell_mv * 1000, v1 = (int32_t)t[i].cell_mv * 1000;
+    // slope in uV per unit SOC = dV / (dS / 1e9)
+    if (slope) *slope = (int32_t)((int64_t)(v1 - v0) * SOC_ONE / (s1 - s0));
+    return v0 + (int32_t)((int64_t)(v1 - v0) * (x - s0) / (s1 - s0));
+  }
+
+private:
+  // Rest threshold: C/100, at least 500 mA
+  int32_t restCurrentMa() const {
+    int32_t c = (int32_t)(capacity_mah_ / 100);
+    return c > 500 ? c : 500;
+  }
+
+  void predict(int32_t current_ma, uint32_t dt_ms) {
+    // dSOC = I*t / capacity, in nano-SOC: I[mA]*t[ms]*1e4 / (36*C[mAh]); carry the remainder
+    int64_t num = (int64_t)current_ma * dt_ms * 10000 + remainder_;
+    int64_t den = (int64_t)capacity_mah_ * 36;
+    int64_t dx = num / den;
+    remainder_ = num - dx * den;
+    int64_t x = (int64_t)x_ + dx;
+    x_ = (int32_t)(x < 0 ? 0 : (x > SOC_ONE ? SOC_ONE : x));
+
+    // Process noise: current gain error grows with charge moved (about 1 %
+    // of a half-cycle), sensor offset grows with time
+    int64_t absDx = dx < 0 ? -dx : dx;
+    p_ += absDx * GAIN_PPM2_PER_PPM / 1000 + (int64_t)dt_ms * DRIFT_PPM2_PER_S / 1000;
+    if (p_ > VAR_MAX) p_ = VAR_MAX;
+  }
+
+  void correct(uint16_t cell_mv) {
+    int32_t h;
+    int32_t predicted = ocvUv(x_, &h);
+    int64_t y = (int64_t)cell_mv * 1000 - predicted;          // innovation, uV
+    if (y > 1000000) y = 1000000;
+    if (y < -1000000) y = -1000000;
+    int64_t r = (int64_t)chem_->ocv_sigma_uv * chem_->ocv_sigma_uv; // uV^2
+
+    int64_t hp = (int64_t)h * p_ / 1000000;                    // uV*ppm
+    int64_t s = (hp / 1000) * h / 1000 + r;                    // uV^2
+    if (s <= 0) return;
+
+    // x += K*y with K = hp/s (ppm per uV), carried to nano-SOC
+    int64_t prod = hp * y;
+    int64_t dppm = prod / s;
+    int64_t dx = dppm * 1000 + (prod - dppm * s) * 1000 / s;
+    int64_t x = (int64_t)x_ + dx;
+    x_ = (int32_t)(x < 0 ? 0 : (x > SOC_ONE ? SOC_ONE : x));
+
+    // Scalar form of P = (1 - KH)P is P*R/S; ratio in Q30
+    int64_t ratio = (r << 30) / s;
+    p_ = p_ < (1LL << 32) ? (p_ * ratio) >> 30 : ((p_ >> 8) * ratio) >> 22;
+    if (p_ < 1) p_ = 1;
+    corrections_++;
+  }
+
+  static int64_t isqrt64(int64_t v) {
+    if (v <= 0) return 0;
+    int64_t r = 0, bit = 1LL << 62;
+    while (bit > v) bit >>= 2;
+    while (bit) {
+      if (v >= r + bit) { v -= r + bit; r = (r >> 1) + bit; }
+      else r >>= 1;
+      bit >>= 2;
+    }
+    return r;
+  }
+
+  static const int64_t GAIN_PPM2_PER_PPM = 50;  // 1 % gain error over a 50 % swing
+  static const int64_t DRIFT_PPM2_PER_S = 400;  // ~0.12 %/h offset drift
+
+  const SocChemistry* chem_ = &CHEMISTRY_LFP;
+  uint32_t capacity_mah_ = 1;
+  bool initialized_ = false;
+  bool atRest_ = false;
+  int32_t x_ = 0;            // nano-SOC
+  int64_t p_ = 0;            // ppm^2
+  int64_t remainder_ = 0;    // coulomb-counting remainder, mA*ms*1e4
+  uint32_t restMs_ = 0;
+  uint32_t nextCorrectionMs_ = 0;
+  uint32_t corrections_ = 0;
+};
+
+#endif // SOC_EKF_H
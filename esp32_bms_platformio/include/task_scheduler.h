@@ -0,0 +1,301 @@
+/*
+ * Cooperative run-to-completion task scheduler on a hierarchical timer wheel
+ *
+ * Every task is a plain function that does a bounded piece of work and
+ * returns. It runs when its deadline comes up; a periodic task is re-armed
+ * one period after the deadline it ran for (fixed rate, so a late run does
+ * not push every later one back), and a task that fell a whole period or
+ * more behind skips the missed runs instead of bursting. A task can also
+ * re-arm itself from inside its function with wake(), which takes precedence
+ * over the period, or take itself off the wheel with suspend().
+ *
+ * Deadlines are 1 ms ticks kept in SCHED_LEVELS wheels of SCHED_SLOTS slots.
+ * A task goes into the lowest level whose span still covers its deadline
+ * (the level is picked from the highest bit group in which deadline and
+ * current tick differ), and a level's slot is re-sorted into the levels
+ * below when the tick reaches it. Insert and remove are O(1); advancing the
+ * clock skips empty stretches with the per-level occupancy bitmaps, so a
+ * long idle costs one step per 64 ms at most. Six levels of 6 bits cover
+ * the full 32-bit millis() range, wrap included.
+ *
+ * run() fires everything due, then returns how long the caller may idle
+ * before the next deadline. Per task it keeps run count, runtime and
+ * lateness (start of run - deadline). Clocks are passed in so the
+ * scheduler runs on the host against a virtual clock.
+ */
+
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <stdint.h>
+
+#define SCHED_MAX_TASKS 16
+#define SCHED_SLOT_BITS 6
+#define SCHED_SLOTS (1u << SCHED_SLOT_BITS)     // slots per wheel level
+#define SCHED_SLOT_MASK (SCHED_SLOTS - 1)
+#define SCHED_LEVELS 6                          // 6 x 6 bits >= 32-bit tick
+#define SCHED_LISTS (SCHED_LEVELS * SCHED_SLOTS + 1)
+#define SCHED_READY_LIST (SCHED_LEVELS * SCHED_SLOTS)
+#define SCHED_NONE 0xFF
+#define SCHED_MAX_IDLE_MS 1000                  // run() never asks for a longer idle
+
+typedef void (*TaskFn)();
+
+struct TaskStats {
+  uint32_t runs = 0;
+  uint64_t totalUs = 0;     // time spent inside the task function
+  uint32_t maxUs = 0;
+  uint64_t totalLateMs = 0; // start of run minus deadline
+  uint32_t maxLateMs = 0;
+  uint32_t skipped = 0;     // periodic runs dropped after falling a period behind
+};
+
+class TaskScheduler {
+public:
+  typedef uint32_t (*Clock)();
+
+  TaskScheduler() {
+    for (uint16_t i = 0; i < SCHED_LISTS; i++) heads_[i] = SCHED_NONE;
+  }
+
+  void begin(Clock clock_ms, Clock clock_us) {
+    clockMs_ = clock_ms;
+    clockUs_ = clock_us;
+    now_ = clockMs_();
+  }
+
+  // Register a task; it is idle until wake()/resume() unless first_ms is given.
+  // Returns the task id, SCHED_NONE when the table is full.
+  uint8_t add(const char* name, TaskFn fn, uint32_t period_ms, int32_t first_ms = -1) {
+    if (count_ >= SCHED_MAX_TASKS) return SCHED_NONE;
+    uint8_t id = count_++;
+    Task& t = tasks_[id];
+    t.name = name;
+    t.fn = fn;
+    t.period = period_ms;
+    if (first_ms >= 0) place(id, now_ + (uint32_t)first_ms);
+    return id;
+  }
+
+  // (Re)arm a task delay_ms from now, replacing any pending deadline
+  void wake(uint8_t id, uint32_t delay_ms) {
+    if (id >= count_) return;
+    unlink(id);
+    place(id, clockMs_() + delay_ms);
+  }
+  void resume(uint8_t id, uint32_t delay_ms) { wake(id, delay_ms); }
+
+  // Take a task off the wheel; it stays idle until the next wake()
+  void suspend(uint8_t id) {
+    if (id >= count_) return;
+    unlink(id);
+    tasks_[id].suspendedInRun = id == running_;
+  }
+
+  void setPeriod(uint8_t id, uint32_t period_ms) {
+    if (id < count_) tasks_[id].period = period_ms;
+  }
+
+  bool pending(uint8_t id) const { return id < count_ && tasks_[id].list != SCHED_NONE_LIST; }
+
+  // Milliseconds until the task's deadline (0 if due), UINT32_MAX when idle
+  uint32_t dueIn(uint8_t id) const {
+    if (!pending(id)) return UINT32_MAX;
+    int32_t d = (int32_t)(tasks_[id].due - clockMs_());
+    return d > 0 ? (uint32_t)d : 0;
+  }
+
+  // Run every task that is due; returns ms the caller may idle
+  uint32_t run() {
+    for (;;) {
+      advance(clockMs_());
+      if (heads_[SCHED_READY_LIST] == SCHED_NONE) break;
+      while (heads_[SCHED_READY_LIST] != SCHED_NONE) runOne(heads_[SCHED_READY_LIST]);
+    }
+    return idleMs();
+  }
+
+  uint8_t count() const { return count_; }
+  const char* name(uint8_t id) const { return tasks_[id].name; }
+  uint32_t period(uint8_t id) const { return tasks_[id].period; }
+  const TaskStats& stats(uint8_t id) const { return tasks_[id].stats; }
+  uint32_t advanceSteps() const { return steps_; }
+
+private:
+  static const uint16_t SCHED_NONE_LIST = 0xFFFF;
+
+  struct Task {
+    const char* name = "";
+    TaskFn fn = nullptr;
+    uint32_t period = 0;
+    uint32_t due = 0;
+    uint16_t list = SCHED_NONE_LIST;   // wheel slot or ready list holding it
+    uint8_t prev = SCHED_NONE;
+    uint8_t next = SCHED_NONE;
+    bool suspendedInRun = false;
+    TaskStats stats;
+  };
+
+  void runOne(uint8_t id) {
+    Task& t = tasks_[id];
+    unlink(id);
+    uint32_t start = clockMs_();
+    uint32_t late = (int32_t)(start - t.due) > 0 ? start - t.due : 0;
+    uint32_t due = t.due;
+
+    running_ = id;
+    t.suspendedInRun = false;
+    uint32_t startUs = clockUs_();
+    t.fn();
+    uint32_t us = clockUs_() - startUs;
+    running_ = SCHED_NONE;
+
+    t.stats.runs++;
+    t.stats.totalUs += us;
+    if (us > t.stats.maxUs) t.stats.maxUs = us;
+    t.stats.totalLateMs += late;
+    if (late > t.stats.maxLateMs) t.stats.maxLateMs = late;
+
+    // Periodic re-arm unless the task re-armed or suspended itself
+    if (t.period == 0 || t.list != SCHED_NONE_LIST || t.suspendedInRun) return;
+    uint32_t next = due + t.period;
+    uint32_t now = clockMs_();
+    if ((int32_t)(next - now) <= 0) {
+      t.stats.skipped += (now - due) / t.period;
+      next = now + t.period - (now - due) % t.period;
+    }
+    place(id, next);
+  }
+
+  // Put a task on the wheel (or straight on the ready list when already due)
+  void place(uint8_t id, uint32_t due) {
+    Task& t = tasks_[id];
+    t.due = due;
+    if ((int32_t)(due - now_) <= 0) {
+      pushReady(id);
+      return;
+    }
+    uint32_t diff = due ^ now_;
+    uint8_t level = 0;
+    while (level < SCHED_LEVELS - 1 && (diff >> (SCHED_SLOT_BITS * (level + 1))) != 0) level++;
+    uint8_t slot = (due >> (SCHED_SLOT_BITS * level)) & SCHED_SLOT_MASK;
+    pushFront(id, level * SCHED_SLOTS + slot);
+    occupied_[level] |= 1ULL << slot;
+  }
+
+  // Move the wheel up to tick `to`, collecting due tasks onto the ready list
+  void advance(uint32_t to) {
+    while ((int32_t)(to - now_) > 0) {
+      uint32_t cur = now_ & SCHED_SLOT_MASK;
+      uint64_t ahead = cur == SCHED_SLOT_MASK ? 0 : occupied_[0] & (~0ULL << (cur + 1));
+      uint32_t step = ahead ? (uint32_t)__builtin_ctzll(ahead) - cur : SCHED_SLOTS - cur;
+      if (to - now_ < step) {
+        now_ = to;   // nothing due and no level boundary before `to`
+        return;
+      }
+      now_ += step;
+      steps_++;
+      if ((now_ & SCHED_SLOT_MASK) == 0) cascade();
+      collect(now_ & SCHED_SLOT_MASK);
+    }
+  }
+
+  // At a level boundary re-sort the upper levels' current slots downwards,
+  // highest first so a task can drop several levels in one tick
+  void cascade() {
+    for (int8_t level = SCHED_LEVELS - 1; level >= 1; level--) {
+      uint8_t shift = SCHED_SLOT_BITS * level;
+      if ((now_ & ((1u << shift) - 1)) != 0) continue;
+      uint8_t slot = (now_ >> shift) & SCHED_SLOT_MASK;
+      uint16_t list = level * SCHED_SLOTS + slot;
+      occupied_[level] &= ~(1ULL << slot);
+      uint8_t id = heads_[list];
+      heads_[list] = SCHED_NONE;
+      while (id != SCHED_NONE) {
+        uint8_t next = tasks_[id].next;
+        tasks_[id].list = SCHED_NONE_LIST;
+        place(id, tasks_[id].due);
+        id = next;
+      }
+    }
+  }
+
+  void collect(uint8_t slot) {
+    occupied_[0] &= ~(1ULL << slot);
+    uint8_t id = heads_[slot];
+    heads_[slot] = SCHED_NONE;
+    while (id != SCHED_NONE) {
+      uint8_t next = tasks_[id].next;
+      tasks_[id].list = SCHED_NONE_LIST;
+      pushReady(id);
+      id = next;
+    }
+  }
+
+  // Earliest deadline: the first occupied slot of each level (in tick order)
+  // holds that level's earliest tasks; take the minimum over those lists
+  uint32_t idleMs() const {
+    if (heads_[SCHED_READY_LIST] != SCHED_NONE) return 0;
+    uint32_t best = SCHED_MAX_IDLE_MS;
+    for (uint8_t level = 0; level < SCHED_LEVELS; level++) {
+      uint64_t bits = occupied_[level];
+      if (!bits) continue;
+      uint8_t cur = (now_ >> (SCHED_SLOT_BITS * level)) & SCHED_SLOT_MASK;
+      uint64_t rotated = cur ? (bits >> cur) | (bits << (SCHED_SLOTS - cur)) : bits;
+      uint8_t slot = (cur + __builtin_ctzll(rotated)) & SCHED_SLOT_MASK;
+      for (uint8_t id = heads_[level * SCHED_SLOTS + slot]; id != SCHED_NONE; id = tasks_[id].next) {
+        int32_t d = (int32_t)(tasks_[id].due - now_);
+        if (d <= 0) return 0;
+        if ((uint32_t)d < best) best = d;
+      }
+    }
+    return best;
+  }
+
+  void pushFront(uint8_t id, uint16_t list) {
+    Task& t = tasks_[id];
+    t.list = list;
+    t.prev = SCHED_NONE;
+    t.next = heads_[list];
+    if (t.next != SCHED_NONE) tasks_[t.next].prev = id;
+    heads_[list] = id;
+  }
+
+  // Ready list is FIFO so tasks that came due together run in deadline order
+  void pushReady(uint8_t id) {
+    Task& t = tasks_[id];
+    t.list = SCHED_READY_LIST;
+    t.next = SCHED_NONE;
+    t.prev = readyTail_;
+    if (readyTail_ != SCHED_NONE) tasks_[readyTail_].next = id;
+    else heads_[SCHED_READY_LIST] = id;
+    readyTail_ = id;
+  }
+
+  void unlink(uint8_t id) {
+    Task& t = tasks_[id];
+    if (t.list == SCHED_NONE_LIST) return;
+    if (t.prev != SCHED_NONE) tasks_[t.prev].next = t.next;
+    else heads_[t.list] = t.next;
+    if (t.next != SCHED_NONE) tasks_[t.next].prev = t.prev;
+    else if (t.list == SCHED_READY_LIST) readyTail_ = t.prev;
+    if (t.list != SCHED_READY_LIST && heads_[t.list] == SCHED_NONE) {
+      occupied_[t.list / SCHED_SLOTS] &= ~(1ULL << (t.list % SCHED_SLOTS));
+    }
+    t.list = SCHED_NONE_LIST;
+    t.prev = t.next = SCHED_NONE;
+  }
+
+  Clock clockMs_ = nullptr;
+  Clock clockUs_ = nullptr;
+  uint32_t now_ = 0;                 // wheel time: every tick up to here is collected
+  Task tasks_[SCHED_MAX_TASKS];
+  uint8_t count_ = 0;
+  uint8_t running_ = SCHED_NONE;
+  uint8_t heads_[SCHED_LISTS];
+  uint8_t readyTail_ = SCHED_NONE;
+  uint64_t occupied_[SCHED_LEVELS] = {};
+  uint32_t steps_ = 0;
+};
+
+#endif // TASK_SCHEDULER_H
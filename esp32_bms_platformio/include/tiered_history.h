@@ -0,0 +1,355 @@
+/*
+ * Tiered sample history: internal RAM -> PSRAM -> flash
+ *
+ * Every decoded sample goes into a ring of raw LogSamples in internal RAM
+ * (the last hour at the default read interval). A background step folds
+ * finished minutes of it into one LogSample per minute, kept in a much
+ * larger ring in PSRAM, and folds those minutes again into one LogSample
+ * per 10 minutes appended to the flash log (flash_log.h). Each tier is
+ * coarser and reaches further back: an hour raw, months of minutes, years
+ * of 10-minute samples, and flash survives a reboot. Folding averages
+ * voltage, current and SOC and keeps the highest cell and temperature as
+ * the maximum and the lowest as the minimum, so extremes survive it.
+ *
+ * One query spans the tiers without overlap in timestamps: flash below the
+ * oldest PSRAM minute, PSRAM up to the first minute the RAM ring still
+ * holds whole, raw samples from there on. A folded sample is stamped with
+ * the start of its bucket. The caller passes the buffers in, so it decides
+ * where they live (internal RAM, ps_malloc or host memory); nothing here
+ * touches Arduino. append() is O(1) and never writes flash; only when a
+ * ring wraps onto samples the background step has not reached yet are they
+ * folded on the spot.
+ */
+
+#ifndef TIERED_HISTORY_H
+#define TIERED_HISTORY_H
+
+#include "flash_log.h"
+
+#define HISTORY_MINUTE_S 60          // resolution of the PSRAM tier
+#define HISTORY_FLASH_BUCKET_S 600   // resolution of the flash tier
+#define HISTORY_COMPACT_BUDGET 256   // raw samples folded per compact() call
+#define HISTORY_FLUSH_BUDGET 32      // minutes folded towards flash per compact() call
+#define HISTORY_TS_MAX 0xFFFFFFFFUL
+
+enum HistoryTier : uint8_t {
+  HISTORY_TIER_RAM,
+  HISTORY_TIER_PSRAM,
+  HISTORY_TIER_FLASH,
+  HISTORY_TIERS
+};
+static const char* const HISTORY_TIER_NAMES[] = {"ram", "psram", "flash"};
+
+// Samples in time order on a caller-provided buffer; the oldest is dropped
+// when it is full
+class SampleRing {
+public:
+  void begin(LogSample* buf, uint32_t cap) {
+    buf_ = buf;
+    cap_ = buf ? cap : 0;
+    start_ = count_ = 0;
+  }
+
+  uint32_t size() const { return count_; }
+  uint32_t capacity() const { return cap_; }
+  bool full() const { return count_ == cap_; }
+  const LogSample& at(uint32_t i) const { return buf_[(start_ + i) % cap_]; }   // 0 = oldest
+
+  void push(const LogSample& s) {
+    if (cap_ == 0) return;
+    if (count_ == cap_) dropOldest();
+    buf_[(start_ + count_) % cap_] = s;
+    count_++;
+  }
+
+  void dropOldest() {
+    start_ = (start_ + 1) % cap_;
+    count_--;
+  }
+
+  // First index with timestamp >= ts (size() if none)
+  uint32_t lowerBound(uint32_t ts) const {
+    uint32_t lo = 0, hi = count_;
+    while (lo < hi) {
+      uint32_t mid = (lo + hi) / 2;
+      if (at(mid).timestamp < ts) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
+  }
+
+private:
+  LogSample* buf_ = nullptr;
+  uint32_t cap_ = 0;
+  uint32_t start_ = 0;
+  uint32_t count_ = 0;
+};
+
+// Folds samples in time order into one per bucket of bucketS seconds
+class SampleFolder {
+public:
+  explicit SampleFolder(uint32_t bucketS) : bucketS_(bucketS) {}
+
+  uint32_t bucketOf(uint32_t ts) const { return ts - ts % bucketS_; }
+  bool open() const { return count_ > 0; }
+  uint32_t bucket() const { return bucket_; }
+
+  // Adds s; when s opens a new bucket the finished one is put in `done`
+  // first and true is returned
+  bool add(const LogSample& s, LogSample& done) {
+    uint32_t b = bucketOf(s.timestamp);
+    bool finished = count_ > 0 && b != bucket_;
+    if (finished) done = close();
+    if (count_ == 0) {
+      bucket_ = b;
+      voltage_ = soc_ = 0;
+      current_ = 0;
+      acc_ = s;
+    }
+    voltage_ += s.voltage_cv;
+    current_ += s.current_da;
+    soc_ += s.soc_pm;
+    if (s.max_cell_mv > acc_.max_cell_mv) acc_.max_cell_mv = s.max_cell_mv;
+    if (s.min_cell_mv < acc_.min_cell_mv) acc_.min_cell_mv = s.min_cell_mv;
+    if (s.max_temp > acc_.max_temp) acc_.max_temp = s.max_temp;
+    if (s.min_temp < acc_.min_temp) acc_.min_temp = s.min_temp;
+    count_++;
+    return finished;
+  }
+
+  // The bucket so far, averages rounded to nearest
+  LogSample sample() const {
+    LogSample s = acc_;
+    int32_t half = count_ / 2;
+    s.timestamp = bucket_;
+    s.voltage_cv = (uint16_t)((voltage_ + half) / count_);
+    s.current_da = (int16_t)((current_ + (current_ < 0 ? -half : half)) / (int32_t)count_);
+    s.soc_pm = (uint16_t)((soc_ + half) / count_);
+    return s;
+  }
+
+  LogSample close() {
+    LogSample s = sample();
+    count_ = 0;
+    return s;
+  }
+
+  void reset() { count_ = 0; }
+
+private:
+  uint32_t bucketS_;
+  uint32_t bucket_ = 0;
+  uint32_t count_ = 0;
+  uint32_t voltage_ = 0;
+  int32_t current_ = 0;
+  uint32_t soc_ = 0;
+  LogSample acc_;   // timestamp and extremes
+};
+
+class TieredHistory {
+public:
+  // Without a PSRAM buffer finished minutes are folded straight towards
+  // flash; without flash the history ends with the oldest PSRAM minute
+  void begin(LogSample* ram, uint32_t ramCap, LogSample* psram, uint32_t psramCap, FlashLog* flash) {
+    ram_.begin(ram, ramCap);
+    psram_.begin(psram, psramCap);
+    flash_ = flash;
+    uncompacted_ = unflushed_ = 0;
+    minute_.reset();
+    flashBucket_.reset();
+    evicted_ = false;
+    lastTs_ = 0;
+  }
+
+  bool append(LogSample s) {
+    if (ram_.capacity() == 0) return false;
+    if (s.timestamp < lastTs_) s.timestamp = lastTs_;
+    lastTs_ = s.timestamp;
+    if (ram_.full()) {
+      if (uncompacted_ == ram_.size()) {   // compaction fell a whole ring behind
+        foldRaw(ram_.at(0));
+        uncompacted_--;
+        forcedFolds_++;
+      }
+      evictedTs_ = ram_.at(0).timestamp;
+      evicted_ = true;
+      ram_.dropOldest();
+    }
+    ram_.push(s);
+    uncompacted_++;
+    appended_++;
+    return true;
+  }
+
+  // Background step: fold finished minutes from RAM into PSRAM, then fold
+  // the minutes not yet passed on towards flash, each within its budget.
+  // Returns true while work is left for another call.
+  bool compact() {
+    uint32_t newest = minute_.bucketOf(lastTs_);
+    uint32_t folded = 0;
+    while (uncompacted_ > 0 && folded < HISTORY_COMPACT_BUDGET) {
+      const LogSample& s = oldestUncompacted();
+      if (minute_.bucketOf(s.timestamp) >= newest) break;   // the current minute stays open
+      foldRaw(s);
+      uncompacted_--;
+      folded++;
+    }
+    // The folded minute is finished once the next raw sample lies past it
+    if (minute_.open() && minute_.bucket() < newest &&
+        (uncompacted_ == 0 || minute_.bucketOf(oldestUncompacted().timestamp) > minute_.bucket())) {
+      emitMinute(minute_.close());
+    }
+
+    uint32_t passed = 0;
+    while (unflushed_ > 0 && passed < HISTORY_FLUSH_BUDGET) {
+      foldFlash(psram_.at(psram_.size() - unflushed_));
+      unflushed_--;
+      passed++;
+    }
+
+    bool foldLeft = uncompacted_ > 0 && minute_.bucketOf(oldestUncompacted().timestamp) < newest;
+    return foldLeft || unflushed_ > 0;
+  }
+
+  // Calls fn(const LogSample&) for every sample with from <= timestamp <= to,
+  // oldest first, across all tiers; per-tier counts go to perTier when given.
+  // Returns the number of samples delivered.
+  template <typename Fn>
+  uint32_t readRange(uint32_t from, uint32_t to, Fn fn, uint32_t* perTier = nullptr) {
+    uint32_t counts[HISTORY_TIERS] = {0, 0, 0};
+    if (from <= to) {
+      uint32_t rawStart = rawFrom();
+      uint32_t psramStart = psramFrom();
+
+      if (from < psramStart) {
+        uint32_t end = to < psramStart ? to : psramStart - 1;
+        if (flash_) counts[HISTORY_TIER_FLASH] = flash_->readRange(from, end, fn);
+        // The 10 minutes being folded, once PSRAM no longer holds all of them
+        if (flashBucket_.open() && flashBucket_.bucket() >= from && flashBucket_.bucket() <= end) {
+          LogSample s = flashBucket_.sample();
+          fn(s);
+          counts[HISTORY_TIER_FLASH]++;
+        }
+      }
+
+      uint32_t i = psram_.size() > 0 ? psram_.lowerBound(from > psramStart ? from : psramStart) : 0;
+      for (; i < psram_.size(); i++) {
+        const LogSample& s = psram_.at(i);
+        if (s.timestamp > to || s.timestamp >= rawStart) break;
+        fn(s);
+        counts[HISTORY_TIER_PSRAM]++;
+      }
+      // Likewise the minute being folded, once the RAM ring no longer holds all of it
+      if (minute_.open() && minute_.bucket() < rawStart && minute_.bucket() >= from && minute_.bucket() <= to) {
+        LogSample s = minute_.sample();
+        fn(s);
+        counts[HISTORY_TIER_PSRAM]++;
+      }
+
+      i = ram_.size() > 0 ? ram_.lowerBound(from > rawStart ? from : rawStart) : 0;
+      for (; i < ram_.size(); i++) {
+        const LogSample& s = ram_.at(i);
+        if (s.timestamp > to) break;
+        fn(s);
+        counts[HISTORY_TIER_RAM]++;
+      }
+    }
+    if (perTier) {
+      for (uint8_t t = 0; t < HISTORY_TIERS; t++) perTier[t] = counts[t];
+    }
+    return counts[HISTORY_TIER_RAM] + counts[HISTORY_TIER_PSRAM] + counts[HISTORY_TIER_FLASH];
+  }
+
+  // First timestamp served from raw samples (HISTORY_TS_MAX while RAM is empty)
+  uint32_t rawFrom() const {
+    if (ram_.size() == 0) return HISTORY_TS_MAX;
+    if (!evicted_) return ram_.at(0).timestamp;
+    uint32_t whole = minute_.bucketOf(evictedTs_) + HISTORY_MINUTE_S;
+    return whole > ram_.at(0).timestamp ? whole : ram_.at(0).timestamp;
+  }
+
+  // First timestamp served from PSRAM; flash serves everything before it
+  uint32_t psramFrom() const {
+    if (psram_.size() > 0) return psram_.at(0).timestamp;
+    if (minute_.open() && minute_.bucket() < rawFrom()) return minute_.bucket();
+    return rawFrom();
+  }
+
+  uint32_t oldestTimestamp() const {
+    uint32_t ts = psramFrom();
+    if (flashBucket_.open() && flashBucket_.bucket() < ts) ts = flashBucket_.bucket();
+    if (flash_ && flash_->sampleCount() > 0 && flash_->oldestTimestamp() < ts) ts = flash_->oldestTimestamp();
+    return ts == HISTORY_TS_MAX ? 0 : ts;
+  }
+  uint32_t newestTimestamp() const {
+    uint32_t flashTs = flash_ ? flash_->newestTimestamp() : 0;
+    return lastTs_ > flashTs ? lastTs_ : flashTs;
+  }
+
+  uint32_t size(HistoryTier tier) const {
+    if (tier == HISTORY_TIER_RAM) return ram_.size();
+    if (tier == HISTORY_TIER_PSRAM) return psram_.size();
+    return flash_ ? flash_->sampleCount() : 0;
+  }
+  uint32_t capacity(HistoryTier tier) const {
+    if (tier == HISTORY_TIER_RAM) return ram_.capacity();
+    if (tier == HISTORY_TIER_PSRAM) return psram_.capacity();
+    return flash_ ? flash_->capacity() : 0;
+  }
+  uint32_t appended() const { return appended_; }
+  uint32_t minutes() const { return minutes_; }         // minutes folded from raw samples
+  uint32_t flushed() const { return flushed_; }         // 10-minute samples written to flash
+  uint32_t pendingFold() const { return uncompacted_; }
+  uint32_t pendingFlush() const { return unflushed_; }
+  uint32_t forcedFolds() const { return forcedFolds_; } // folded on the spot, compaction too slow
+  uint32_t flashErrors() const { return flashErrors_; }
+
+private:
+  const LogSample& oldestUncompacted() const { return ram_.at(ram_.size() - uncompacted_); }
+
+  void foldRaw(const LogSample& s) {
+    LogSample done;
+    if (minute_.add(s, done)) emitMinute(done);
+  }
+
+  void emitMinute(const LogSample& m) {
+    minutes_++;
+    if (psram_.capacity() == 0) {
+      foldFlash(m);
+      return;
+    }
+    if (psram_.full() && unflushed_ == psram_.size()) {   // folding towards flash fell a whole ring behind
+      foldFlash(psram_.at(0));
+      unflushed_--;
+      forcedFolds_++;
+    }
+    psram_.push(m);
+    if (flash_) unflushed_++;
+  }
+
+  void foldFlash(const LogSample& m) {
+    LogSample done;
+    if (!flash_ || !flashBucket_.add(m, done)) return;
+    if (flash_->append(done)) flushed_++;
+    else flashErrors_++;
+  }
+
+  SampleRing ram_;
+  SampleRing psram_;
+  FlashLog* flash_ = nullptr;
+  SampleFolder minute_{HISTORY_MINUTE_S};          // raw samples -> PSRAM
+  SampleFolder flashBucket_{HISTORY_FLASH_BUCKET_S}; // minutes -> flash
+  uint32_t uncompacted_ = 0;   // newest raw samples not folded yet
+  uint32_t unflushed_ = 0;     // newest PSRAM minutes not folded towards flash yet
+  bool evicted_ = false;       // the RAM ring has wrapped
+  uint32_t evictedTs_ = 0;     // newest raw sample dropped from it
+  uint32_t lastTs_ = 0;
+
+  uint32_t appended_ = 0;
+  uint32_t minutes_ = 0;
+  uint32_t flushed_ = 0;
+  uint32_t forcedFolds_ = 0;
+  uint32_t flashErrors_ = 0;
+};
+
+#endif // TIERED_HISTORY_H
@@ -0,0 +1,200 @@
+/*
+ * Host stand-in for the Arduino core used by the native build
+ * Provides String, Serial, millis()/delay() on a virtual clock so the
+ * firmware in src/ compiles and runs on Linux without a board
+ */
+
+#ifndef FAKE_ARDUINO_H
+#define FAKE_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+#include <deque>
+#include <functional>
+
+#define HEX 16
+#define DEC 10
+
+// Virtual clock and event pump (fake_arduino.cpp)
+namespace fakehw {
+  uint64_t nowUs();
+  void advanceUs(uint64_t us);
+  // Run fn once the virtual clock reaches atUs (events fire inside delay())
+  void schedule(uint64_t atUs, std::function<void()> fn);
+  // Run all events that are due without moving the clock
+  void runDue();
+  // Block like a FreeRTOS wait: fire events in order until done() holds or
+  // the clock reaches atUs; true if done() holds
+  bool advanceUntil(uint64_t atUs, const std::function<bool()>& done);
+  // Queue text as if typed into the serial monitor at virtual time atUs
+  void serialInput(uint64_t atUs, const std::string& text);
+  // Silence Serial output (stats are still collected)
+  void setQuiet(bool quiet);
+  // Called with every complete line the firmware writes to Serial, with the
+  // virtual time its first byte was written and the time its last byte
+  // leaves the UART at the configured baud rate
+  void setLineObserver(std::function<void(const std::string& line, uint64_t firstByteUs, uint64_t onWireUs)> observer);
+  // Called with every chunk of raw bytes written to Serial (binary frames)
+  void setByteObserver(std::function<void(const uint8_t* data, size_t len)> observer);
+  // Slow host: Serial drains at no more than this many baud (0 = as configured)
+  void throttleSerial(unsigned long baud);
+  // Host stops reading Serial for forUs starting at atUs
+  void stallSerial(uint64_t atUs, uint64_t forUs);
+}
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+class String {
+public:
+  String() {}
+  String(const char* s) : s_(s ? s : "") {}
+  String(const std::string& s) : s_(s) {}
+  String(char c) : s_(1, c) {}
+  String(unsigned char v, unsigned char base = DEC) { fromUnsigned(v, base); }
+  String(int v, unsigned char base = DEC) { if (base == DEC) s_ = std::to_string(v); else fromUnsigned((unsigned int)v, base); }
+  String(unsigned int v, unsigned char base = DEC) { fromUnsigned(v, base); }
+  String(long v, unsigned char base = DEC) { if (base == DEC) s_ = std::to_string(v); else fromUnsigned((unsigned long)v, base); }
+  String(unsigned long v, unsigned char base = DEC) { fromUnsigned(v, base); }
+  String(long long v) : s_(std::to_string(v)) {}
+  String(unsigned long long v) : s_(std::to_string(v)) {}
+  String(float v, unsigned char decimals = 2) { fromDouble(v, decimals); }
+  String(double v, unsigned char decimals = 2) { fromDouble(v, decimals); }
+
+  unsigned int length() const { return s_.size(); }
+  const char* c_str() const { return s_.c_str(); }
+  char operator[](unsigned int i) const { return i < s_.size() ? s_[i] : 0; }
+  char charAt(unsigned int i) const { return (*this)[i]; }
+
+  String& operator+=(const String& o) { s_ += o.s_; return *this; }
+  String& operator+=(const char* o) { s_ += o; return *this; }
+  String& operator+=(char c) { s_ += c; return *this; }
+  bool concat(const String& o) { s_ += o.s_; return true; }
+  bool reserve(unsigned int n) { s_.reserve(n); return true; }
+
+  bool operator==(const String& o) const { return s_ == o.s_; }
+  bool operator==(const char* o) const { return s_ == o; }
+  bool operator!=(const String& o) const { return s_ != o.s_; }
+  bool operator!=(const char* o) const { return s_ != o; }
+  bool equals(const String& o) const { return s_ == o.s_; }
+  bool equalsIgnoreCase(const String& o) const { return strcasecmp(s_.c_str(), o.s_.c_str()) == 0; }
+  bool startsWith(const String& o) const { return s_.compare(0, o.s_.size(), o.s_) == 0; }
+
+  int indexOf(char c, unsigned int from = 0) const { size_t p = s_.find(c, from); return p == std::string::npos ? -1 : (int)p; }
+  int indexOf(const String& o, unsigned int from = 0) const { size_t p = s_.find(o.s_, from); return p == std::string::npos ? -1 : (int)p; }
+  String substring(unsigned int from) const { return from < s_.size() ? String(s_.substr(from)) : String(); }
+  String substring(unsigned int from, unsigned int to) const {
+    if (from > to) { unsigned int t = from; from = to; to = t; }
+    if (from >= s_.size()) return String();
+    return String(s_.substr(from, to - from));
+  }
+
+  void toUpperCase() { for (auto& c : s_) c = toupper((unsigned char)c); }
+  void toLowerCase() { for (auto& c : s_) c = tolower((unsigned char)c); }
+  void trim() {
+    size_t b = s_.find_first_not_of(" \t\r\n");
+    size_t e = s_.find_last_not_of(" \t\r\n");
+    s_ = (b == std::string::npos) ? std::string() : s_.substr(b, e - b + 1);
+  }
+  void replace(const String& from, const String& to) {
+    if (from.s_.empty()) return;
+    size_t p = 0;
+    while ((p = s_.find(from.s_, p)) != std::string::npos) {
+      s_.replace(p, from.s_.size(), to.s_);
+      p += to.s_.size();
+    }
+  }
+  long toInt() const { return strtol(s_.c_str(), nullptr, 10); }
+  float toFloat() const { return strtof(s_.c_str(), nullptr); }
+
+  friend String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+  friend String operator+(const char* a, const String& b) { String r(a); r += b; return r; }
+  friend String operator+(const String& a, const char* b) { String r(a); r += b; return r; }
+  friend String operator+(const String& a, char b) { String r(a); r += b; return r; }
+
+private:
+  void fromUnsigned(unsigned long long v, int base) {
+    if (base == DEC) { s_ = std::to_string(v); return; }
+    char buf[32];
+    snprintf(buf, sizeof(buf), base == HEX ? "%llx" : "%llo", v);
+    s_ = buf;
+  }
+  void fromDouble(double v, unsigned int decimals) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", (int)decimals, v);
+    s_ = buf;
+  }
+
+  std::string s_;
+};
+
+class HardwareSerial {
+public:
+  void begin(unsigned long baud) { baud_ = baud; }
+  operator bool() const { return true; }
+
+  size_t write(uint8_t b);
+  size_t write(const uint8_t* data, size_t len);
+  size_t print(const String& s);
+  size_t print(const char* s);
+  size_t print(char c);
+  size_t print(int v, int base = DEC);
+  size_t print(unsigned int v, int base = DEC);
+  size_t print(long v, int base = DEC);
+  size_t print(unsigned long v, int base = DEC);
+  size_t print(double v, int decimals = 2);
+  template <typename T> size_t println(const T& v) { size_t n = print(v); return n + print("\n"); }
+  template <typename T> size_t println(const T& v, int fmt) { size_t n = print(v, fmt); return n + print("\n"); }
+  size_t println() { return print("\n"); }
+  size_t printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+  void flush() { fflush(stdout); }
+  void setTxBufferSize(size_t size) { txBuffer_ = size; }
+  int availableForWrite();
+
+  int available();
+  int read();
+  int peek();
+  String readStringUntil(char terminator);
+
+  // Bytes written since boot, for throughput accounting in the native runner
+  uint64_t bytesWritten() const { return written_; }
+
+private:
+  uint64_t written_ = 0;
+  unsigned long baud_ = 115200;
+  uint64_t txDoneUs_ = 0; // when the last queued byte has left the UART
+  size_t txBuffer_ = 0;   // software TX buffer on top of the hardware FIFO
+  double byteUs() const;
+  size_t txCapacity() const;
+};
+
+extern HardwareSerial Serial;
+
+// ESP.getCycleCount() for CPU timing: host nanoseconds (real time, not the
+// virtual clock) at a nominal 1000 MHz
+class EspClass {
+public:
+  uint32_t getCycleCount();
+  uint32_t getCpuFreqMHz() { return 1000; }
+};
+
+extern EspClass ESP;
+
+// PSRAM of a WROVER module, simulated with host memory
+inline bool psramFound() { return true; }
+inline void* ps_malloc(size_t size) { return malloc(size); }
+
+// Hardware RNG; a fixed sequence here
+inline uint32_t esp_random() { return (uint32_t)rand(); }
+
+#endif // FAKE_ARDUINO_H
@@ -0,0 +1,3 @@
+// Native build: forwards to the fake BLE stack
+#pragma once
+#include "fake_ble.h"
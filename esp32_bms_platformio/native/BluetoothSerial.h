@@ -0,0 +1,119 @@
+/*
+ * Host fake of the ESP32 BluetoothSerial (Classic BT SPP) class for the
+ * Arduino sketches at the repository root
+ * A scripted Daly BMS (namespace fakebt) answers every 13-byte A5 command
+ * written and flushed with a 13-byte reply after a random latency, handed
+ * to the host stack in chunks on the virtual clock from Arduino.h. As on
+ * the ESP32, received bytes go to the onData() callback when one is
+ * registered and to the available()/read() buffer otherwise.
+ */
+
+#ifndef FAKE_BLUETOOTH_SERIAL_H
+#define FAKE_BLUETOOTH_SERIAL_H
+
+#include "Arduino.h"
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <random>
+#include <vector>
+
+namespace fakebt {
+  struct Bms {
+    uint32_t replyMinUs = 20000;  // command flushed -> first reply byte
+    uint32_t replyMaxUs = 60000;
+    size_t chunk = 13;            // reply bytes per delivery to the host stack
+    uint32_t chunkGapUs = 2000;   // between deliveries of one reply
+    uint8_t data[256][8] = {};    // reply payload by command
+    uint32_t commands = 0;
+    std::mt19937 rng{7};
+
+    void reply(uint8_t cmd, std::initializer_list<uint8_t> payload) {
+      size_t i = 0;
+      for (uint8_t b : payload) if (i < 8) data[cmd][i++] = b;
+    }
+  };
+
+  inline Bms& bms() {
+    static Bms b;
+    return b;
+  }
+}
+
+class BluetoothSerial {
+public:
+  typedef std::function<void(const uint8_t* buffer, size_t size)> BluetoothSerialDataCb;
+
+  bool begin(const String& /*name*/, bool /*isMaster*/ = false) { return true; }
+  bool connect(uint8_t* /*remoteAddress*/) {
+    link_ = true;
+    return true;
+  }
+  bool connected(int /*timeout*/ = 0) { return link_; }
+  bool disconnect() {
+    link_ = false;
+    return true;
+  }
+  void onData(BluetoothSerialDataCb cb) { onData_ = cb; }
+
+  int available() { return (int)rx_.size(); }
+  int read() {
+    if (rx_.empty()) return -1;
+    uint8_t b = rx_.front();
+    rx_.pop_front();
+    return b;
+  }
+  size_t write(uint8_t c) {
+    tx_.push_back(c);
+    return 1;
+  }
+  size_t write(const uint8_t* data, size_t len) {
+    tx_.insert(tx_.end(), data, data + len);
+    return len;
+  }
+
+  // Sends what was written; the BMS answers each whole command frame
+  void flush() {
+    size_t i = 0;
+    while (link_ && tx_.size() - i >= 13) {
+      if (tx_[i] != 0xA5) {
+        i++;
+        continue;
+      }
+      answer(tx_[i + 4]);
+      i += 13;
+    }
+    tx_.clear();
+  }
+
+private:
+  void answer(uint8_t cmd) {
+    fakebt::Bms& bms = fakebt::bms();
+    bms.commands++;
+    std::vector<uint8_t> frame = {0xA5, 0x01, cmd, 0x08};
+    frame.insert(frame.end(), bms.data[cmd], bms.data[cmd] + 8);
+    uint8_t sum = 0;
+    for (uint8_t b : frame) sum += b;
+    frame.push_back(sum);
+
+    std::uniform_int_distribution<uint32_t> latency(bms.replyMinUs, bms.replyMaxUs);
+    uint64_t at = fakehw::nowUs() + latency(bms.rng);
+    for (size_t off = 0; off < frame.size(); off += bms.chunk, at += bms.chunkGapUs) {
+      std::vector<uint8_t> part(frame.begin() + off, frame.begin() + std::min(frame.size(), off + bms.chunk));
+      fakehw::schedule(at, [this, part]() { receive(part.data(), part.size()); });
+    }
+  }
+
+  void receive(const uint8_t* data, size_t len) {
+    if (!link_) return;
+    if (onData_) onData_(data, len);
+    else rx_.insert(rx_.end(), data, data + len);
+  }
+
+  bool link_ = false;
+  BluetoothSerialDataCb onData_;
+  std::deque<uint8_t> rx_;
+  std::vector<uint8_t> tx_;
+};
+
+#endif // FAKE_BLUETOOTH_SERIAL_H
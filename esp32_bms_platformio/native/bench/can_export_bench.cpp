@@ -0,0 +1,418 @@
+/*
+ * CAN export check and benchmark
+ * - encoding: every Pylontech frame of a known pack, byte for byte, and
+ *   what the flags do to the 0x359 protection/alarm bits and the 0x35C
+ *   charge/discharge requests
+ * - schedule, on a virtual clock: the staggered grid and each frame's
+ *   period, nothing sent before the first publish, while disabled or once
+ *   stale, keep-alives answered with the whole set and those within
+ *   CAN_ANSWER_MIN_US coalesced, a stall of several periods skipped on the
+ *   grid rather than sent as a burst
+ * - real time: a battery thread (service + receive, as the firmware's CAN
+ *   task) and an inverter thread that timestamps every frame, while a
+ *   writer publishes at 10 Hz. Per run: the interval jitter of the 1 s
+ *   frames (|interval - period| p50/p99/max) and the drift of 0x351 over
+ *   the run, set against a naive sender that sleeps a period after each
+ *   set. Then keep-alives every 250 ms and in bursts: answer latency, and
+ *   answered vs coalesced.
+ *
+ * Runs on a SocketCAN interface when one is up (ip link add vcan0 type
+ * vcan; ip link set vcan0 up), else on a socketpair carrying the same
+ * struct can_frame.
+ *
+ * Build: g++ -std=gnu++17 -O2 -pthread -DBMS_NATIVE -Iinclude -Inative native/bench/can_export_bench.cpp -o can_export_bench
+ * Run:   ./can_export_bench [ifname=vcan0] [seconds=10]
+ */
+
+#include "can_bus.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <math.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static bool check(bool cond, const char* what) {
+  if (!cond) printf("FAIL %s\n", what);
+  return cond;
+}
+
+static uint32_t nowUs() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static int slotOf(uint32_t id) {
+  for (int i = 0; i < CAN_FRAME_COUNT; i++) {
+    if (CAN_SCHEDULE[i].id == id) return i;
+  }
+  return -1;
+}
+
+// 16S LFP at 53.12 V, charging 12.3 A, 31.4 C, 87 % of a healthy pack
+static CanPack samplePack() {
+  CanPack v;
+  v.charge_v_dv = 568;
+  v.charge_a_da = 1000;
+  v.discharge_a_da = 1000;
+  v.discharge_v_dv = 464;
+  v.soc_pct = 87;
+  v.soh_pct = 98;
+  v.voltage_cv = 5312;
+  v.current_da = 123;
+  v.temp_dc = 314;
+  return v;
+}
+
+static bool encodingChecks() {
+  bool ok = true;
+  CanPack v = samplePack();
+  uint8_t b[8];
+  canEncode(slotOf(0x351), v, b);
+  ok = check(canGetU16(b) == 568 && canGetU16(b + 2) == 1000 && canGetU16(b + 4) == 1000 && canGetU16(b + 6) == 464,
+             "0x351 limits") && ok;
+  canEncode(slotOf(0x355), v, b);
+  ok = check(canGetU16(b) == 87 && canGetU16(b + 2) == 98 && b[4] == 0, "0x355 SOC/SOH") && ok;
+  canEncode(slotOf(0x356), v, b);
+  ok = check(canGetU16(b) == 5312 && canGetU16(b + 2) == 123 && canGetU16(b + 4) == 314, "0x356 V/I/T") && ok;
+  v.current_da = -456;
+  v.temp_dc = -52;
+  canEncode(slotOf(0x356), v, b);
+  ok = check((int16_t)canGetU16(b + 2) == -456 && (int16_t)canGetU16(b + 4) == -52, "0x356 signed current/temp") && ok;
+  canEncode(slotOf(0x359), v, b);
+  ok = check(b[0] == 0 && b[2] == 0 && b[3] == 0 && b[4] == 1 && b[5] == 'P' && b[6] == 'N', "0x359 healthy") && ok;
+  canEncode(slotOf(0x35C), v, b);
+  ok = check(b[0] == 0xC0, "0x35C charge and discharge enabled") && ok;
+  canEncode(slotOf(0x35E), v, b);
+  ok = check(memcmp(b, "PYLON   ", 8) == 0, "0x35E manufacturer") && ok;
+
+  // A high cell is an alarm until the BMS opens the charge MOS over it
+  v.flags = CAN_FLAG_CELL_HIGH;
+  canEncode(slotOf(0x359), v, b);
+  ok = check(b[0] == 0 && b[2] == 0x02, "0x359 cell high: alarm only") && ok;
+  canEncode(slotOf(0x35C), v, b);
+  ok = check(b[0] == 0x40, "0x35C cell high: charge request dropped") && ok;
+  v.flags = CAN_FLAG_CELL_HIGH | CAN_FLAG_CHARGE_OFF;
+  canEncode(slotOf(0x359), v, b);
+  ok = check(b[0] == 0x02 && b[2] == 0x02, "0x359 cell high, charge MOS open: protection") && ok;
+  v.flags = CAN_FLAG_CELL_LOW | CAN_FLAG_DISCHARGE_OFF | CAN_FLAG_SOC_LOW;
+  canEncode(slotOf(0x359), v, b);
+  ok = check(b[0] == 0x04 && b[2] == 0x04, "0x359 cell low, discharge MOS open: protection") && ok;
+  canEncode(slotOf(0x35C), v, b);
+  ok = check(b[0] == (0x80 | 0x20), "0x35C cell low: discharge dropped, force charge") && ok;
+  v.flags = CAN_FLAG_NO_DATA;
+  canEncode(slotOf(0x359), v, b);
+  ok = check(b[3] == 0x08, "0x359 no data: communication alarm") && ok;
+  return ok;
+}
+
+// Drives the exporter on a virtual clock, waking exactly when it asks
+struct VirtualRun {
+  CanExporter exporter;
+  MemoryCanBus bus;
+  uint32_t now = 0;
+  uint32_t wake = 0;
+  std::vector<std::pair<uint32_t, CanFrame>> sent;
+
+  VirtualRun() {
+    bus.onSend = [this](const CanFrame& f) { sent.push_back({now, f}); };
+  }
+
+  void runUntil(uint32_t end) {
+    while (wake <= end) {
+      now = wake;
+      wake = now + exporter.service(bus, now);
+    }
+    now = end;
+  }
+
+  size_t count(uint32_t id, uint32_t from = 0) const {
+    size_t n = 0;
+    for (auto& s : sent) n += s.second.id == id && s.first >= from;
+    return n;
+  }
+};
+
+static bool scheduleChecks() {
+  bool ok = true;
+  {
+    VirtualRun r;
+    r.runUntil(2500000);
+    ok = check(r.sent.empty() && r.exporter.silent() > 0, "nothing sent before the first publish") && ok;
+    r.exporter.publish(samplePack());
+    uint32_t from = r.now;
+    r.runUntil(from + 10000000 - 1);
+    ok = check(r.count(0x351, from) == 10 && r.count(0x359, from) == 10 && r.count(0x35E, from) == 2,
+               "10 s: ten of each 1 s frame, two of 0x35E") && ok;
+    // Grid: slot i goes out i * CAN_STAGGER_US after slot 0, at whole periods
+    uint32_t first351 = 0;
+    bool onGrid = true;
+    for (auto& s : r.sent) {
+      int i = slotOf(s.second.id);
+      if (s.second.id == 0x351 && !first351) first351 = s.first;
+      if (first351 && (s.first - first351 - i * CAN_STAGGER_US) % 1000000 != 0) onGrid = false;
+    }
+    ok = check(onGrid && r.exporter.maxLateUs() == 0, "frames staggered on a fixed 1 s grid") && ok;
+
+    // Stale: the last publish was at `from`
+    size_t before = r.sent.size();
+    r.runUntil(from + (CAN_STALE_MS + 5000) * 1000u);
+    size_t after = r.sent.size();
+    r.runUntil(r.now + 10000000);
+    ok = check(after > before && r.sent.size() == after, "silent once stale") && ok;
+    r.exporter.publish(samplePack());
+    r.runUntil(r.now + 2000000);
+    ok = check(r.sent.size() > after, "resumes on the next publish") && ok;
+
+    r.exporter.setEnabled(false);
+    after = r.sent.size();
+    r.runUntil(r.now + 3000000);
+    ok = check(r.sent.size() == after, "silent while disabled") && ok;
+    r.exporter.setEnabled(true);
+  }
+  {
+    VirtualRun r;
+    r.exporter.publish(samplePack());
+    r.runUntil(500000);
+    CanFrame ka;
+    ka.id = CAN_ID_KEEPALIVE;
+    size_t before = r.sent.size();
+    bool asks = r.exporter.onReceive(ka, r.now);
+    r.wake = r.now;
+    r.runUntil(r.now);
+    ok = check(asks && r.sent.size() - before == CAN_FRAME_COUNT && r.exporter.answers() == 1,
+               "keep-alive answered with the whole set") && ok;
+    before = r.sent.size();
+    r.runUntil(r.now + 50000);
+    asks = r.exporter.onReceive(ka, r.now);
+    r.wake = r.now;
+    r.runUntil(r.now);
+    ok = check(!asks && r.sent.size() == before && r.exporter.coalesced() == 1, "keep-alive 50 ms later coalesced") &&
+         ok;
+    r.runUntil(r.now + 100000);
+    asks = r.exporter.onReceive(ka, r.now);
+    ok = check(asks && !r.exporter.onReceive(ka, r.now), "a second request before the answer is sent coalesced") && ok;
+    CanFrame other;
+    other.id = 0x123;
+    ok = check(!r.exporter.onReceive(other, r.now) && r.exporter.ignored() == 1, "other ids ignored") && ok;
+    ok = check(r.exporter.inverterPresent(r.now) && !r.exporter.inverterPresent(r.now + 6000000),
+               "inverter presence follows its keep-alives") && ok;
+  }
+  {
+    // A stall of 3.5 periods: one late frame per slot, then back on the grid
+    VirtualRun r;
+    r.exporter.publish(samplePack());
+    r.runUntil(2500000);
+    size_t before = r.count(0x351);
+    r.now = r.wake + 3500000;
+    r.exporter.publish(samplePack());
+    r.wake = r.exporter.service(r.bus, r.now) + r.now;
+    ok = check(r.count(0x351) == before + 1, "a stall sends one late frame, not a burst") && ok;
+    ok = check(r.exporter.overruns() >= 3, "the missed periods are counted") && ok;
+    size_t stallEnd = r.sent.size();
+    r.runUntil(r.now + 3000000);
+    bool onGrid = r.sent.size() > stallEnd;
+    for (size_t k = stallEnd; k < r.sent.size(); k++) {
+      int i = slotOf(r.sent[k].second.id);
+      if (r.sent[k].first % 1000000 != (uint32_t)i * CAN_STAGGER_US) onGrid = false;
+    }
+    ok = check(onGrid, "back on the original grid after the stall") && ok;
+  }
+  return ok;
+}
+
+// Frames the inverter side received, stamped on arrival
+struct Capture {
+  std::mutex m;
+  std::vector<std::pair<uint32_t, CanFrame>> frames;
+  void add(uint32_t t, const CanFrame& f) {
+    std::lock_guard<std::mutex> g(m);
+    frames.push_back({t, f});
+  }
+};
+
+struct Jitter {
+  std::vector<uint32_t> us;
+  double driftMs = 0;
+  uint32_t p(double q) {
+    if (us.empty()) return 0;
+    std::sort(us.begin(), us.end());
+    return us[std::min(us.size() - 1, (size_t)(q / 100.0 * us.size()))];
+  }
+};
+
+static Jitter jitterOf(Capture& cap) {
+  Jitter j;
+  for (int i = 0; i < CAN_FRAME_COUNT; i++) {
+    if (CAN_SCHEDULE[i].periodMs != 1000) continue;
+    std::vector<uint32_t> at;
+    for (auto& f : cap.frames) {
+      if (f.second.id == CAN_SCHEDULE[i].id) at.push_back(f.first);
+    }
+    for (size_t k = 1; k < at.size(); k++) {
+      int32_t dev = (int32_t)(at[k] - at[k - 1]) - 1000000;
+      j.us.push_back((uint32_t)abs(dev));
+    }
+    if (CAN_SCHEDULE[i].id == 0x351 && at.size() > 1) {
+      j.driftMs = ((int64_t)(at.back() - at.front()) - (int64_t)(at.size() - 1) * 1000000) / 1000.0;
+    }
+  }
+  return j;
+}
+
+// Either two sockets on a SocketCAN interface, or a socketpair
+static bool openLink(const char* ifname, SocketCanDriver& battery, SocketCanDriver& inverter, bool& vcan) {
+  vcan = battery.open(ifname) && inverter.open(ifname);
+  return vcan || SocketCanDriver::pair(battery, inverter);
+}
+
+static void inverterRx(SocketCanDriver& inverter, Capture& cap, std::atomic<bool>& stop) {
+  CanFrame f;
+  while (!stop.load()) {
+    if (inverter.receive(f, 20000)) cap.add(nowUs(), f);
+  }
+}
+
+// The firmware's CAN task with a 10 Hz loop publishing
+static void exporterRun(SocketCanDriver& battery, SocketCanDriver& inverter, CanExporter& exporter, int seconds,
+                        Capture& cap, const std::vector<uint32_t>& keepAlivesAt) {
+  std::atomic<bool> stop{false};
+  exporter.publish(samplePack());
+  std::thread rx(inverterRx, std::ref(inverter), std::ref(cap), std::ref(stop));
+  std::thread writer([&]() {
+    CanPack v = samplePack();
+    while (!stop.load()) {
+      v.current_da = (int16_t)(v.current_da + 1);
+      exporter.publish(v);
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  });
+  std::thread task([&]() {
+    CanFrame f;
+    while (!stop.load()) {
+      uint32_t wait = exporter.service(battery, nowUs());
+      if (battery.receive(f, std::min<uint32_t>(wait, 20000))) exporter.onReceive(f, nowUs());
+    }
+  });
+  uint32_t start = nowUs();
+  for (uint32_t at : keepAlivesAt) {
+    int32_t until = (int32_t)(start + at - nowUs());
+    if (until > 0) std::this_thread::sleep_for(std::chrono::microseconds(until));
+    CanFrame ka;
+    ka.id = CAN_ID_KEEPALIVE;
+    ka.len = 8;
+    cap.add(nowUs(), ka);
+    inverter.send(ka);
+  }
+  int32_t rest = (int32_t)(start + seconds * 1000000u - nowUs());
+  if (rest > 0) std::this_thread::sleep_for(std::chrono::microseconds(rest));
+  stop = true;
+  task.join();
+  writer.join();
+  rx.join();
+}
+
+// Sends the 1 s frames, then sleeps a period: every send and wake-up adds up
+static void naiveRun(SocketCanDriver& battery, SocketCanDriver& inverter, int seconds, Capture& cap) {
+  std::atomic<bool> stop{false};
+  std::thread rx(inverterRx, std::ref(inverter), std::ref(cap), std::ref(stop));
+  std::mutex m;
+  CanPack pack = samplePack();
+  std::thread writer([&]() {
+    while (!stop.load()) {
+      {
+        std::lock_guard<std::mutex> g(m);
+        pack.current_da = (int16_t)(pack.current_da + 1);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  });
+  uint32_t start = nowUs();
+  while (nowUs() - start < seconds * 1000000u) {
+    for (uint8_t i = 0; i < CAN_FRAME_COUNT - 1; i++) {
+      CanFrame f;
+      f.id = CAN_SCHEDULE[i].id;
+      f.len = CAN_SCHEDULE[i].len;
+      {
+        std::lock_guard<std::mutex> g(m);
+        canEncode(i, pack, f.data);
+      }
+      battery.send(f);
+      std::this_thread::sleep_for(std::chrono::microseconds(CAN_STAGGER_US));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+  }
+  stop = true;
+  writer.join();
+  rx.join();
+}
+
+int main(int argc, char** argv) {
+  const char* ifname = argc > 1 ? argv[1] : "vcan0";
+  int seconds = argc > 2 ? atoi(argv[2]) : 10;
+  if (seconds < 3) seconds = 3;
+
+  bool ok = encodingChecks();
+  ok = scheduleChecks() && ok;
+
+  SocketCanDriver battery, inverter;
+  bool vcan = false;
+  if (!check(openLink(ifname, battery, inverter, vcan), "open a CAN link")) return 1;
+  printf("Link: %s\n", vcan ? ifname : "socketpair (no SocketCAN interface up)");
+
+  printf("\n%-30s %7s %9s %9s %9s %10s\n", "Sender, 1 s frames", "frames", "p50 us", "p99 us", "max us", "drift ms");
+  CanExporter exporter;
+  Capture grid;
+  exporterRun(battery, inverter, exporter, seconds, grid, {});
+  Jitter jg = jitterOf(grid);
+  printf("%-30s %7zu %9u %9u %9u %10.2f\n", "exporter (absolute deadlines)", grid.frames.size(), jg.p(50), jg.p(99),
+         jg.p(100), jg.driftMs);
+  Capture naive;
+  naiveRun(battery, inverter, seconds, naive);
+  Jitter jn = jitterOf(naive);
+  printf("%-30s %7zu %9u %9u %9u %10.2f\n", "naive (sleep after send)", naive.frames.size(), jn.p(50), jn.p(99),
+         jn.p(100), jn.driftMs);
+  printf("(jitter is |interval - 1000 ms|; drift is the 0x351 span against whole periods)\n");
+  ok = check(exporter.refused() == 0 && exporter.overruns() == 0, "no frame refused or skipped") && ok;
+  ok = check(jg.us.size() >= (size_t)(seconds - 2) * 5, "every 1 s frame arrived") && ok;
+  ok = check(fabs(jg.driftMs) < 5 && fabs(jg.driftMs) < fabs(jn.driftMs), "the grid does not drift, naive does") && ok;
+
+  // Keep-alives every 250 ms, then bursts of three 10 ms apart
+  std::vector<uint32_t> at;
+  for (uint32_t t = 100000; t < 2000000; t += 250000) at.push_back(t);
+  for (uint32_t t = 2100000; t < 3000000; t += 300000) {
+    for (int k = 0; k < 3; k++) at.push_back(t + k * 10000);
+  }
+  CanExporter answering;
+  Capture cap;
+  exporterRun(battery, inverter, answering, 3, cap, at);
+  std::vector<uint32_t> lat;
+  uint32_t askedAt = 0;
+  bool waiting = false;
+  for (auto& f : cap.frames) {
+    // Latency of the 250 ms ones; a burst's later keep-alives are coalesced
+    if (f.second.id == CAN_ID_KEEPALIVE && f.first - cap.frames.front().first < 2000000) {
+      if (!waiting) askedAt = f.first;
+      waiting = true;
+    } else if (waiting && f.second.id == 0x35E) {
+      // 0x35E comes every 5 s on the grid, so within a run it marks an answer
+      lat.push_back(f.first - askedAt);
+      waiting = false;
+    }
+  }
+  Jitter la;
+  la.us = lat;
+  printf("\nKeep-alives: %u sent, %u answered, %u coalesced; answer latency p50 %u us, max %u us\n",
+         answering.requests(), answering.answers(), answering.coalesced(), la.p(50), la.p(100));
+  ok = check(answering.requests() == at.size(), "every keep-alive received") && ok;
+  ok = check(answering.answers() == 8 + 3 && answering.coalesced() == 6,
+             "every 250 ms keep-alive answered, bursts answered once") && ok;
+  ok = check(!lat.empty() && la.p(100) < 20000, "answers within 20 ms") && ok;
+
+  printf("\n%s\n", ok ? "All checks passed" : "CHECKS FAILED");
+  return ok ? 0 : 1;
+}
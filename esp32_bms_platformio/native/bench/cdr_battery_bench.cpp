@@ -0,0 +1,252 @@
+/*
+ * CDR BatteryState check and encode benchmark
+ * Checks the encoder against hand-computed offsets of the
+ * sensor_msgs/BatteryState IDL layout, round-trips random messages through
+ * the independent host decoder (native/cdr_decode.h), makes sure truncated
+ * payloads are rejected and that framed messages survive being mixed into
+ * text and fed in odd-sized chunks. Then times one encode + frame per
+ * message against printing the same fields as JSON.
+ *
+ * Build: g++ -std=gnu++17 -O2 -Iinclude -Inative native/bench/cdr_battery_bench.cpp -o cdr_battery_bench
+ * Run:   ./cdr_battery_bench [messages]
+ */
+
+#include "cdr_battery.h"
+#include "cdr_decode.h"
+#include <chrono>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+static uint32_t u32At(const uint8_t* p, size_t off) {
+  return (uint32_t)p[off] | (uint32_t)p[off + 1] << 8 | (uint32_t)p[off + 2] << 16 | (uint32_t)p[off + 3] << 24;
+}
+
+static float f32At(const uint8_t* p, size_t off) {
+  uint32_t bits = u32At(p, off);
+  float v;
+  memcpy(&v, &bits, 4);
+  return v;
+}
+
+static bool sameFloat(float a, float b) { return memcmp(&a, &b, 4) == 0; }
+
+static BatteryStateMsg sampleMessage(float* cells) {
+  for (int i = 0; i < 16; i++) cells[i] = 3.318f + i * 0.001f;
+  BatteryStateMsg m;
+  m.stamp_sec = 1700000000;
+  m.stamp_nanosec = 250000000;
+  m.frame_id = "bms";
+  m.voltage = 53.08f;
+  m.temperature = NAN;
+  m.current = -12.5f;
+  m.charge = 207.9f;
+  m.capacity = 230.0f;
+  m.design_capacity = 230.0f;
+  m.percentage = 0.904f;
+  m.power_supply_status = BATTERY_STATUS_DISCHARGING;
+  m.power_supply_health = BATTERY_HEALTH_GOOD;
+  m.power_supply_technology = BATTERY_TECH_LIFE;
+  m.cell_voltage = cells;
+  m.cells = 16;
+  m.serial_number = "DL-41181201189F";
+  return m;
+}
+
+// Offsets worked out by hand from the IDL, relative to the start of the payload
+static bool checkLayout() {
+  float cells[16];
+  BatteryStateMsg m = sampleMessage(cells);
+  uint8_t buf[CDR_FRAME_MAX];
+  size_t n = cdrEncodeBatteryState(m, buf, sizeof(buf));
+  bool ok = n == 152;
+  ok &= buf[0] == 0x00 && buf[1] == 0x01 && buf[2] == 0 && buf[3] == 0;  // CDR_LE
+  ok &= u32At(buf, 4) == 1700000000 && u32At(buf, 8) == 250000000;       // header.stamp
+  ok &= u32At(buf, 12) == 4 && memcmp(buf + 16, "bms", 4) == 0;           // header.frame_id
+  ok &= sameFloat(f32At(buf, 20), 53.08f) && isnan(f32At(buf, 24));      // voltage, temperature
+  ok &= sameFloat(f32At(buf, 28), -12.5f) && sameFloat(f32At(buf, 32), 207.9f);
+  ok &= sameFloat(f32At(buf, 36), 230.0f) && sameFloat(f32At(buf, 40), 230.0f);
+  ok &= sameFloat(f32At(buf, 44), 0.904f);                               // percentage
+  ok &= buf[48] == BATTERY_STATUS_DISCHARGING && buf[49] == BATTERY_HEALTH_GOOD;
+  ok &= buf[50] == BATTERY_TECH_LIFE && buf[51] == 1;                    // technology, present
+  ok &= u32At(buf, 52) == 16 && sameFloat(f32At(buf, 56), 3.318f) && sameFloat(f32At(buf, 116), cells[15]);
+  ok &= u32At(buf, 120) == 0;                                            // cell_temperature
+  ok &= u32At(buf, 124) == 1 && buf[128] == 0;                           // location ""
+  ok &= buf[129] == 0 && buf[130] == 0 && buf[131] == 0;                 // padding to 4
+  ok &= u32At(buf, 132) == 16 && memcmp(buf + 136, "DL-41181201189F", 16) == 0;
+  if (!ok) printf("FAIL BatteryState layout (%zu bytes)\n", n);
+
+  // Float32MultiArray: dim[1] {label "cells", size, stride}, data_offset, data[]
+  uint8_t arr[CDR_FRAME_MAX];
+  size_t an = cdrEncodeCellVoltages(cells, 16, arr, sizeof(arr));
+  bool aok = an == 4 + 4 + 4 + 6 + 2 + 4 + 4 + 4 + 4 + 64;
+  aok &= u32At(arr, 4) == 1 && u32At(arr, 8) == 6 && memcmp(arr + 12, "cells", 6) == 0;
+  aok &= u32At(arr, 20) == 16 && u32At(arr, 24) == 16 && u32At(arr, 28) == 0 && u32At(arr, 32) == 16;
+  aok &= sameFloat(f32At(arr, 36), cells[0]) && sameFloat(f32At(arr, 96), cells[15]);
+  if (!aok) printf("FAIL Float32MultiArray layout (%zu bytes)\n", an);
+  return ok && aok;
+}
+
+static std::string randomString(std::mt19937& rng, size_t maxLen) {
+  std::string s(rng() % (maxLen + 1), ' ');
+  for (char& c : s) c = (char)(' ' + rng() % 95);
+  return s;
+}
+
+static bool checkRoundTrip(uint32_t count) {
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> f(-500.0f, 500.0f);
+  float cells[CDR_MAX_CELLS];
+  uint8_t buf[CDR_FRAME_MAX];
+  for (uint32_t i = 0; i < count; i++) {
+    std::string frame = randomString(rng, 31), location = randomString(rng, 31), serial = randomString(rng, 31);
+    BatteryStateMsg m;
+    m.stamp_sec = (int32_t)rng();
+    m.stamp_nanosec = rng() % 1000000000u;
+    m.frame_id = frame.c_str();
+    m.voltage = f(rng);
+    m.temperature = i % 3 ? f(rng) : NAN;
+    m.current = f(rng);
+    m.charge = f(rng);
+    m.capacity = f(rng);
+    m.design_capacity = f(rng);
+    m.percentage = f(rng);
+    m.power_supply_status = rng() % 5;
+    m.power_supply_health = rng() % 7;
+    m.power_supply_technology = rng() % 7;
+    m.present = rng() & 1;
+    m.cells = rng() % (CDR_MAX_CELLS + 1);
+    for (uint8_t c = 0; c < m.cells; c++) cells[c] = f(rng);
+    m.cell_voltage = cells;
+    m.location = location.c_str();
+    m.serial_number = serial.c_str();
+
+    size_t n = cdrEncodeBatteryState(m, buf, sizeof(buf));
+    DecodedBatteryState d;
+    bool ok = n > 0 && cdrDecodeBatteryState(buf, n, d);
+    ok = ok && d.stamp_sec == m.stamp_sec && d.stamp_nanosec == m.stamp_nanosec && d.frame_id == frame;
+    ok = ok && sameFloat(d.voltage, m.voltage) && sameFloat(d.temperature, m.temperature);
+    ok = ok && sameFloat(d.current, m.current) && sameFloat(d.charge, m.charge) && sameFloat(d.capacity, m.capacity);
+    ok = ok && sameFloat(d.design_capacity, m.design_capacity) && sameFloat(d.percentage, m.percentage);
+    ok = ok && d.power_supply_status == m.power_supply_status && d.power_supply_health == m.power_supply_health;
+    ok = ok && d.power_supply_technology == m.power_supply_technology && d.present == m.present;
+    ok = ok && d.cell_voltage.size() == m.cells && d.cell_temperature.empty();
+    for (uint8_t c = 0; ok && c < m.cells; c++) ok = sameFloat(d.cell_voltage[c], cells[c]);
+    ok = ok && d.location == location && d.serial_number == serial;
+    if (!ok) {
+      printf("FAIL round trip message %u (%zu bytes)\n", i, n);
+      return false;
+    }
+
+    // Every shorter prefix must be rejected, and so must a buffer one byte short
+    for (size_t cut = 0; cut < n; cut += 1 + cut / 8) {
+      if (cdrDecodeBatteryState(buf, cut, d)) {
+        printf("FAIL message %u decoded from %zu of %zu bytes\n", i, cut, n);
+        return false;
+      }
+    }
+    if (cdrEncodeBatteryState(m, buf, n - 1) != 0) {
+      printf("FAIL message %u encoded into %zu bytes\n", i, n - 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Frames mixed into text and fed in random chunk sizes all come back; a
+// flipped byte costs exactly that frame
+static bool checkScanner() {
+  std::mt19937 rng(11);
+  float cells[16];
+  BatteryStateMsg m = sampleMessage(cells);
+  std::vector<uint8_t> stream;
+  uint8_t frame[CDR_FRAME_MAX];
+  const int FRAMES = 2000;
+  for (int i = 0; i < FRAMES; i++) {
+    std::string text = "BMS_DATA:{\"x\":" + std::to_string(i) + "}\n" + randomString(rng, 40) + "\n";
+    stream.insert(stream.end(), text.begin(), text.end());
+    m.stamp_sec = i;
+    size_t len = cdrFrame(CDR_TOPIC_BATTERY_STATE, frame,
+                          cdrEncodeBatteryState(m, frame + CDR_FRAME_HEADER, CDR_FRAME_MAX - CDR_FRAME_OVERHEAD));
+    stream.insert(stream.end(), frame, frame + len);
+  }
+  size_t damaged = stream.size() / 2;
+  while (stream[damaged] != CDR_SYNC0) damaged++;
+  stream[damaged + 20] ^= 0x40; // inside the payload of one frame
+
+  int decoded = 0, expectSec = 0;
+  bool inOrder = true;
+  CdrFrameScanner scanner([&](uint8_t topic, const uint8_t* payload, size_t len) {
+    DecodedBatteryState d;
+    if (topic != CDR_TOPIC_BATTERY_STATE || !cdrDecodeBatteryState(payload, len, d)) return;
+    if (d.stamp_sec < expectSec) inOrder = false;
+    expectSec = d.stamp_sec + 1;
+    decoded++;
+  });
+  for (size_t off = 0; off < stream.size();) {
+    size_t n = std::min(stream.size() - off, (size_t)(1 + rng() % 300));
+    scanner.feed(&stream[off], n);
+    off += n;
+  }
+  bool ok = decoded == FRAMES - 1 && inOrder && scanner.crcErrors >= 1;
+  if (!ok) printf("FAIL scanner: %d of %d frames, %u CRC errors\n", decoded, FRAMES - 1, scanner.crcErrors);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  uint32_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+
+  bool ok = checkLayout();
+  ok &= checkRoundTrip(20000);
+  ok &= checkScanner();
+  printf("IDL layout, round trip, truncation and framing: %s\n", ok ? "OK" : "FAILED");
+
+  float cells[16];
+  BatteryStateMsg m = sampleMessage(cells);
+  uint8_t frame[CDR_FRAME_MAX];
+  volatile size_t sink = 0;
+  size_t cdrBytes = 0;
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < count; i++) {
+    m.stamp_nanosec = i;
+    size_t n = cdrEncodeBatteryState(m, frame + CDR_FRAME_HEADER, CDR_FRAME_MAX - CDR_FRAME_OVERHEAD);
+    cdrBytes = cdrFrame(CDR_TOPIC_BATTERY_STATE, frame, n);
+    sink += frame[cdrBytes - 1];
+  }
+  double stateNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / count;
+
+  size_t cellBytes = 0;
+  t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < count; i++) {
+    size_t n = cdrEncodeCellVoltages(cells, 16, frame + CDR_FRAME_HEADER, CDR_FRAME_MAX - CDR_FRAME_OVERHEAD);
+    cellBytes = cdrFrame(CDR_TOPIC_CELL_VOLTAGES, frame, n);
+    sink += frame[cellBytes - 1];
+  }
+  double cellNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / count;
+
+  // The same fields as JSON text, for scale
+  char json[1024];
+  size_t jsonBytes = 0;
+  t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < count; i++) {
+    int n = snprintf(json, sizeof(json),
+                     "{\"stamp\":%d.%09u,\"voltage\":%.3f,\"current\":%.1f,\"charge\":%.1f,\"capacity\":%.0f,"
+                     "\"percentage\":%.3f,\"status\":%u,\"health\":%u,\"cells\":[",
+                     (int)m.stamp_sec, i, m.voltage, m.current, m.charge, m.capacity, m.percentage,
+                     m.power_supply_status, m.power_supply_health);
+    for (int c = 0; c < 16; c++) n += snprintf(json + n, sizeof(json) - n, c ? ",%.3f" : "%.3f", cells[c]);
+    n += snprintf(json + n, sizeof(json) - n, "],\"serial\":\"%s\"}", m.serial_number);
+    jsonBytes = n;
+    sink += json[n - 1];
+  }
+  double jsonNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / count;
+
+  printf("BatteryState encode + frame: %.1f ns/msg, %zu bytes\n", stateNs, cdrBytes);
+  printf("Cell Float32MultiArray encode + frame: %.1f ns/msg, %zu bytes\n", cellNs, cellBytes);
+  printf("Same fields as JSON (snprintf): %.1f ns/msg, %zu bytes\n", jsonNs, jsonBytes);
+  return ok ? 0 : 1;
+}
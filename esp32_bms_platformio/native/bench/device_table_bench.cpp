@@ -0,0 +1,266 @@
+/*
+ * Discovered-device table check and scan callback benchmark
+ * - table: random addresses in and found again, aging with backward-shift
+ *   deletion keeping every survivor reachable, the fill limits (a crowd of
+ *   ordinary devices cannot keep a BMS candidate out), best() choosing the
+ *   target over a stronger candidate
+ * - callback: the fake scanner (native/fake_ble.cpp) delivers 1000
+ *   advertisements/s from 300 devices plus the BMS for 10 s of virtual
+ *   time, once to the table callback of src/main.cpp and once to the old
+ *   one that built Strings and printed every advertisement. Per callback:
+ *   host CPU, heap allocations made inside it, and how long it held the BLE
+ *   task on the 115200 baud console.
+ *
+ * Build: g++ -std=gnu++17 -O2 -DBMS_NATIVE -Iinclude -Inative native/bench/device_table_bench.cpp native/fake_ble.cpp native/fake_arduino.cpp -o device_table_bench
+ * Run:   ./device_table_bench
+ */
+
+#include "Arduino.h"
+#include "BLEDevice.h"
+#include "device_table.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <new>
+#include <random>
+#include <vector>
+
+void setup() {}
+void loop() {}
+
+// Heap allocations while g_counting is set
+static bool g_counting = false;
+static uint64_t g_allocs = 0;
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t n) {
+  if (g_counting) g_allocs++;
+  void* p = malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+static bool check(bool cond, const char* what) {
+  if (!cond) printf("FAIL %s\n", what);
+  return cond;
+}
+
+static void randomAddress(std::mt19937& rng, uint8_t a[6]) {
+  for (int i = 0; i < 6; i++) a[i] = (uint8_t)rng();
+}
+
+static bool tableChecks() {
+  bool ok = true;
+  std::mt19937 rng(7);
+  static DeviceTable t;
+  t.setTarget("41:18:12:01:18:9F", "DL-41181201189F");
+
+  // 300 devices, then every other one ages out
+  std::vector<std::array<uint8_t, 6>> addrs(300);
+  for (uint32_t i = 0; i < addrs.size(); i++) {
+    randomAddress(rng, addrs[i].data());
+    t.observe(addrs[i].data(), "Tile", 4, -70, false, i % 2 ? 100000 : 1000);
+  }
+  bool found = t.size() == 300;
+  for (auto& a : addrs) found = found && t.lookup(a.data());
+  ok = check(found, "every inserted device is found") && ok;
+  uint16_t dropped = t.expire(200000, 150000);
+  bool kept = dropped == 150 && t.size() == 150;
+  for (uint32_t i = 0; i < addrs.size(); i++) kept = kept && (t.lookup(addrs[i].data()) != nullptr) == (i % 2 == 1);
+  ok = check(kept, "expire keeps exactly the recent devices reachable") && ok;
+  printf("Table: 300 random devices, longest probe %u; 150 aged out, the other 150 still found\n", t.maxProbe());
+
+  // A crowd fills the ordinary share; candidates and the target still get in
+  t.clear();
+  for (uint32_t i = 0; i < 1000; i++) {
+    uint8_t a[6];
+    randomAddress(rng, a);
+    t.observe(a, "iPhone", 6, -60, false, 0);
+  }
+  uint8_t cand[6], target[6];
+  randomAddress(rng, cand);
+  parseBleAddress("41:18:12:01:18:9f", target);
+  t.observe(cand, "Daly-BMS-7", 10, -40, true, 0);
+  t.observe(target, nullptr, 0, -80, false, 0);
+  t.observe(target, "DL-41181201189F", 15, -84, true, 0);
+  const DeviceEntry* best = t.best(0);
+  ok = check(t.size() == DEVICE_TABLE_SLOTS * 3 / 4 + 2 && t.overflow() == 1000 - DEVICE_TABLE_SLOTS * 3 / 4,
+             "ordinary devices stop at 3/4, the rest are counted") && ok;
+  ok = check(best && memcmp(best->address, target, 6) == 0 && best->cls == DEVICE_TARGET &&
+                 best->flags == (DEVICE_FLAG_DL | DEVICE_FLAG_SERIAL | DEVICE_FLAG_TARGET_MAC |
+                                 DEVICE_FLAG_TARGET_NAME | DEVICE_FLAG_SERVICE) &&
+                 best->rssi() == -81 && strcmp(best->name, "DL-41181201189F") == 0,
+             "the target wins over a stronger candidate") && ok;
+  const DeviceEntry* c = t.lookup(cand);
+  ok = check(c && c->cls == DEVICE_CANDIDATE && (c->flags & DEVICE_FLAG_BMS), "a candidate gets in when full") && ok;
+  printf("Table full of phones: %u/%u slots, %u advertisements refused, BMS candidate and target admitted,"
+         " longest probe %u\n", t.size(), DEVICE_TABLE_SLOTS, t.overflow(), t.maxProbe());
+  return ok;
+}
+
+// The callback as it is in src/main.cpp
+DeviceTable bleDevices;
+class TableCallbacks : public BLEAdvertisedDeviceCallbacks {
+  void onResult(BLEAdvertisedDevice advertisedDevice) {
+    const char* name = nullptr;
+    uint8_t nameLen = 0;
+    advertisedName(advertisedDevice.getPayload(), advertisedDevice.getPayloadLength(), name, nameLen);
+    bleDevices.observe(*advertisedDevice.getAddress().getNative(), name, nameLen, advertisedDevice.getRSSI(),
+                       advertisedDevice.haveServiceUUID(), millis());
+  }
+};
+
+// The callback before the table
+int deviceCount = 0;
+String discovered_bms_mac = "";
+String discovered_bms_name = "";
+bool bms_found_by_scan = false;
+const char* cfgMac = "41:18:12:01:18:9F";
+const char* cfgName = "DL-41181201189F";
+class PrintingCallbacks : public BLEAdvertisedDeviceCallbacks {
+  void onResult(BLEAdvertisedDevice advertisedDevice) {
+    deviceCount++;
+    String deviceName = advertisedDevice.getName().c_str();
+    String deviceAddress = advertisedDevice.getAddress().toString().c_str();
+    Serial.println("Device #" + String(deviceCount) + ": " + deviceName + " [" + deviceAddress + "]");
+    Serial.println("  RSSI: " + String(advertisedDevice.getRSSI()) + " dBm");
+    if (advertisedDevice.haveServiceUUID()) {
+      Serial.print("  Service UUID: ");
+      Serial.println(advertisedDevice.getServiceUUID().toString().c_str());
+    }
+    if (deviceName.indexOf("Daly") >= 0 || deviceName.indexOf("BMS") >= 0 || deviceName.indexOf("DL-") >= 0 ||
+        deviceName.indexOf("41181201189F") >= 0 || deviceAddress.equalsIgnoreCase(cfgMac) ||
+        deviceName.equalsIgnoreCase(cfgName)) {
+      Serial.println("*** Potential BMS device found! ***");
+      Serial.println("Name: " + deviceName);
+      Serial.println("MAC: " + deviceAddress);
+      if (deviceAddress.equalsIgnoreCase(cfgMac) || deviceName.equalsIgnoreCase(cfgName)) {
+        Serial.println("*** Target BMS found! ***");
+        discovered_bms_mac = deviceAddress;
+        discovered_bms_name = deviceName;
+        bms_found_by_scan = true;
+      } else if (discovered_bms_mac.length() == 0) {
+        discovered_bms_mac = deviceAddress;
+        discovered_bms_name = deviceName;
+        Serial.println("*** Stored as potential BMS ***");
+      }
+    }
+    Serial.println("---");
+  }
+};
+
+// Wraps a callback: host CPU, allocations and virtual time inside it. A
+// callback blocked on the console lets the clock run and more
+// advertisements fall due; like the BLE task's event queue, they wait
+// until it returns.
+struct Measured : public BLEAdvertisedDeviceCallbacks {
+  BLEAdvertisedDeviceCallbacks* inner;
+  std::vector<uint32_t> ns;
+  uint64_t allocs = 0;
+  uint64_t heldUs = 0;
+  uint64_t maxHeldUs = 0;
+  uint64_t maxQueueUs = 0;
+  bool busy = false;
+  std::deque<std::pair<BLEAdvertisedDevice, uint64_t>> queue;
+  explicit Measured(BLEAdvertisedDeviceCallbacks* cb) : inner(cb) {}
+  void onResult(BLEAdvertisedDevice dev) override {
+    bool counting = g_counting;
+    g_counting = false;
+    queue.emplace_back(std::move(dev), fakehw::nowUs());
+    g_counting = counting;
+    if (busy) return;
+    busy = true;
+    while (!queue.empty()) {
+      BLEAdvertisedDevice next = std::move(queue.front().first);
+      maxQueueUs = std::max(maxQueueUs, fakehw::nowUs() - queue.front().second);
+      queue.pop_front();
+      uint64_t v0 = fakehw::nowUs();
+      g_allocs = 0;
+      g_counting = true;
+      auto t0 = std::chrono::steady_clock::now();
+      inner->onResult(std::move(next));
+      auto t1 = std::chrono::steady_clock::now();
+      g_counting = false;
+      allocs += g_allocs;
+      ns.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+      uint64_t held = fakehw::nowUs() - v0;
+      heldUs += held;
+      maxHeldUs = std::max(maxHeldUs, held);
+    }
+    busy = false;
+  }
+  uint32_t pct(double p) {
+    std::vector<uint32_t> v = ns;
+    size_t k = std::min(v.size() - 1, (size_t)(v.size() * p / 100));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+  }
+};
+
+static const uint32_t NOISE = 300;
+static const uint32_t INTERVAL_MS = 301;   // 301 advertisers every 301 ms: 1000/s
+static const uint32_t SCAN_S = 10;
+
+static void scan(BLEAdvertisedDeviceCallbacks* cb) {
+  fakeble::reset(3);
+  fakeble::Peripheral bms;
+  bms.address = "41:18:12:01:18:9F";
+  bms.name = "DL-41181201189F";
+  bms.serviceUUID = "fff0";
+  fakeble::addPeripheral(bms);
+  fakeble::addNoiseAdvertisers(NOISE);
+  fakeble::LinkProfile profile;
+  profile.advertIntervalMs = INTERVAL_MS;
+  fakeble::setLinkProfile(profile);
+  BLEDevice::init("bench");
+  BLEScan* s = BLEDevice::getScan();
+  s->setAdvertisedDeviceCallbacks(cb, true);
+  s->start(SCAN_S, false);
+  s->clearResults();
+}
+
+int main() {
+  bool ok = tableChecks();
+
+  Serial.begin(115200);
+  Serial.setTxBufferSize(4096);
+  fakehw::setQuiet(true);
+
+  TableCallbacks table;
+  Measured t(&table);
+  bleDevices.setTarget(cfgMac, cfgName);
+  scan(&t);
+  const DeviceEntry* best = bleDevices.best(0);
+
+  PrintingCallbacks printing;
+  Measured p(&printing);
+  uint64_t serialBefore = Serial.bytesWritten();
+  uint64_t start = fakehw::nowUs();
+  scan(&p);
+  double window = (fakehw::nowUs() - start) / 1e6;
+
+  printf("\n%u devices every %u ms (1000/s once all are on air): %zu advertisements in %u s on the fake scanner\n",
+         NOISE + 1, INTERVAL_MS, t.ns.size(), SCAN_S);
+  printf("%-9s %8s %8s %8s %11s %12s %10s\n", "callback", "p50 ns", "p99 ns", "max ns", "allocs/call",
+         "held ms/call", "BLE busy");
+  printf("%-9s %8u %8u %8u %11.2f %12.3f %9.1f%%\n", "table", t.pct(50), t.pct(99), t.pct(100),
+         (double)t.allocs / t.ns.size(), t.heldUs / 1000.0 / t.ns.size(), 100.0 * t.heldUs / (SCAN_S * 1e6));
+  printf("%-9s %8u %8u %8u %11.2f %12.3f %9.1f%%\n", "printing", p.pct(50), p.pct(99), p.pct(100),
+         (double)p.allocs / p.ns.size(), p.heldUs / 1000.0 / p.ns.size(), 100.0 * p.heldUs / (window * 1e6));
+  printf("Printing callback: %.0f bytes/s of console output for a %u byte/s line; longest hold %.0f ms,"
+         " advertisements queued up to %.1f s, the last handled %.1f s after the window\n",
+         (Serial.bytesWritten() - serialBefore) / window, 11520, p.maxHeldUs / 1000.0, p.maxQueueUs / 1e6,
+         window - SCAN_S);
+  printf("Table: %u devices, longest probe %u, best %s (%s, %d dBm)\n", bleDevices.size(), bleDevices.maxProbe(),
+         best ? best->name : "-", best ? DEVICE_CLASS_NAMES[best->cls] : "-", best ? best->rssi() : 0);
+
+  ok = check(t.ns.size() >= SCAN_S * 900, "1000 advertisements/s delivered") && ok;
+  ok = check(t.allocs == 0, "table callback allocates nothing") && ok;
+  ok = check(t.heldUs == 0, "table callback never waits on the console") && ok;
+  ok = check(bleDevices.size() == NOISE + 1 && best && best->cls == DEVICE_TARGET, "every device in, target found") && ok;
+  ok = check(p.heldUs > 0 && p.allocs > 0, "printing callback allocates and blocks") && ok;
+  printf("Device table: %s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+/*
+ * Flash log benchmark on a host file-backed image
+ * Fills an image with months of 1 Hz samples, then measures index rebuild,
+ * "last hour" lookups and range read throughput against a linear scan
+ *
+ * Build: g++ -std=gnu++17 -O2 -DBMS_NATIVE -Iinclude -Inative native/bench/flash_log_bench.cpp -o flash_log_bench
+ * Run:   ./flash_log_bench [image path] [days]     (defaults: /tmp/bms_log.img 90)
+ */
+
+#include "flash_image.h"
+#include <chrono>
+#include <random>
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point t) {
+  return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "/tmp/bms_log.img";
+  uint32_t days = argc > 2 ? strtoul(argv[2], nullptr, 10) : 90;
+  uint32_t samples = days * 86400;
+  uint32_t segments = samples / FLASH_LOG_SLOTS + 2;
+  uint32_t t0 = 1700000000;
+
+  remove(path);
+  FileFlashStorage storage;
+  if (!storage.open(path, segments * FLASH_LOG_SECTOR)) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return 1;
+  }
+
+  FlashLog log;
+  log.begin(&storage);
+  auto t = Clock::now();
+  for (uint32_t i = 0; i < samples; i++) {
+    LogSample s = {t0 + i, 5300, (int16_t)(i % 400 - 200), 904, 3320, 3310, 30, 29};
+    if (!log.append(s)) { fprintf(stderr, "append failed at %u\n", i); return 1; }
+  }
+  double fillSec = secondsSince(t);
+  printf("fill: %u samples (%u days, %.1f MB, %u segments) in %.2f s, %.0f samples/s\n",
+         samples, days, segments * (double)FLASH_LOG_SECTOR / 1e6, segments, fillSec, samples / fillSec);
+
+  // Reboot: rebuild the segment table from headers only
+  FlashLog reopened;
+  t = Clock::now();
+  reopened.begin(&storage);
+  printf("rebuild: %u segments, %u samples in %.2f ms (table %zu bytes)\n",
+         reopened.usedSegments(), reopened.sampleCount(), secondsSince(t) * 1e3,
+         (size_t)reopened.segmentCount() * sizeof(uint32_t));
+
+  // Point lookups: a zero-width range costs two binary searches
+  std::mt19937 rng(42);
+  const int lookups = 20000;
+  uint32_t hits = 0;
+  t = Clock::now();
+  for (int i = 0; i < lookups; i++) {
+    uint32_t ts = t0 + rng() % samples;
+    hits += reopened.readRange(ts, ts, [](const LogSample&) {});
+  }
+  double lookupSec = secondsSince(t);
+  printf("lookup: %d random timestamps, %u hits, %.2f us/lookup\n", lookups, hits, lookupSec / lookups * 1e6);
+
+  // Range reads
+  const uint32_t spans[] = {3600, 86400, 7 * 86400};
+  for (uint32_t span : spans) {
+    uint64_t sum = 0;
+    t = Clock::now();
+    uint32_t n = reopened.readRange(t0 + samples - span, t0 + samples, [&](const LogSample& s) { sum += s.voltage_cv; });
+    double sec = secondsSince(t);
+    printf("range %6us: %u samples in %.2f ms, %.0f samples/s\n", span, n, sec * 1e3, n / sec);
+  }
+
+  // Baseline: find "the last hour" by scanning every slot from the start
+  t = Clock::now();
+  uint32_t from = t0 + samples - 3600, found = 0;
+  LogSample s;
+  for (uint32_t seg = 0; seg < reopened.usedSegments() && !found; seg++) {
+    for (uint32_t slot = 0; slot < FLASH_LOG_SLOTS; slot++) {
+      storage.read(seg * FLASH_LOG_SECTOR + sizeof(FlashLogSegmentHeader) + slot * sizeof(LogSample), &s, sizeof(s));
+      if (s.timestamp >= from) { found = 1; break; }
+    }
+  }
+  printf("linear scan to last hour: %.2f ms\n", secondsSince(t) * 1e3);
+  return 0;
+}
@@ -0,0 +1,554 @@
+/*
+ * InfluxDB export check and benchmark, against a local HTTP stand-in
+ * - line protocol: a known message byte for byte, tag escaping, negative
+ *   and extreme integers
+ * - batching: sealed at the point count and at batchMs
+ * - delivery through HttpPoster to a stand-in server on 127.0.0.1 that
+ *   parses every request and counts each point it stores: every point
+ *   arrives exactly once over one kept-alive connection; a 503 is retried
+ *   after the backoff; a 400 drops the batch without a retry; a server
+ *   that closes every connection is followed; a 300 s outage (server
+ *   stopped) costs a bounded number of attempts, spools to disk and is
+ *   replayed once the server is back; a restart picks up the spool of the
+ *   last run; a full spool drops its oldest batches and counts them
+ * - benchmark: points/s serialized, preformatted prefixes and integer
+ *   fields against snprintf of the tags and float fields per point; then
+ *   points/s serialized and sent for batch sizes from 1 to 5000, against a
+ *   naive sender that POSTs each point on a new connection
+ *
+ * Build: g++ -std=gnu++17 -O2 -pthread -Iinclude -Inative native/bench/influx_export_bench.cpp -o influx_export_bench
+ * Run:   ./influx_export_bench
+ */
+
+#include "cdr_battery.h"
+#include "influx_export.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static bool check(bool cond, const char* what) {
+  if (!cond) printf("FAIL %s\n", what);
+  return cond;
+}
+
+static const char* PACK_NAMES[] = {"DL-41181201189F", "DL-41181201AA01", "DL-41181201AA02"};
+#define PACKS 3
+
+// Sample i of a pack reporting at 1 Hz; stamp in whole seconds plus 250 ms
+static DecodedBatteryState sample(uint32_t i) {
+  DecodedBatteryState m;
+  m.stamp_sec = 1700000000 + (int32_t)i;
+  m.stamp_nanosec = 250000000;
+  m.voltage = 53.088f;
+  m.current = -12.5f + (float)(i % 100) * 0.25f;
+  m.charge = 207.9f;
+  m.capacity = 230.0f;
+  m.percentage = 0.904f;
+  m.power_supply_status = BATTERY_STATUS_DISCHARGING;
+  for (int c = 0; c < 16; c++) m.cell_voltage.push_back(3.316f + (float)((c + i) % 5) * 0.001f);
+  m.serial_number = PACK_NAMES[0];
+  return m;
+}
+
+// --- The stand-in: an HTTP/1.1 server that stores line protocol ---
+
+class StandIn {
+public:
+  ~StandIn() { stop(); }
+
+  bool start(uint16_t onPort = 0) {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(onPort);
+    socklen_t alen = sizeof(addr);
+    if (bind(listener_, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener_, 16) != 0) {
+      close(listener_);
+      return false;
+    }
+    getsockname(listener_, (sockaddr*)&addr, &alen);
+    port = ntohs(addr.sin_port);
+    running_ = true;
+    thread_ = std::thread([this]() { serve(); });
+    return true;
+  }
+
+  // Closes the listener and every connection: clients get refused
+  void stop() {
+    if (!running_) return;
+    running_ = false;
+    thread_.join();
+    close(listener_);
+  }
+
+  std::string url() const { return "http://127.0.0.1:" + std::to_string(port) + "/api/v2/write?org=o&bucket=b&precision=ms"; }
+
+  uint16_t port = 0;
+  std::atomic<int> status{204};          // reply to a write
+  std::atomic<int> failNext{0};          // that many 503s first
+  std::atomic<bool> closeEach{false};    // Connection: close on every reply
+  std::atomic<bool> keepPoints{true};    // store points (checks) or only count them (benchmark)
+  std::atomic<uint64_t> requests{0}, lines{0}, badLines{0}, duplicates{0};
+  std::mutex m;
+  std::set<std::string> stored;          // pack tag + timestamp of every stored point
+
+private:
+  struct Conn {
+    int fd;
+    std::string in;
+  };
+
+  void serve() {
+    std::vector<Conn> conns;
+    while (running_) {
+      std::vector<pollfd> fds = {{listener_, POLLIN, 0}};
+      for (Conn& c : conns) fds.push_back({c.fd, POLLIN, 0});
+      if (poll(fds.data(), fds.size(), 20) <= 0) continue;
+      if (fds[0].revents & POLLIN) {
+        int fd = accept(listener_, nullptr, nullptr);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (fd >= 0) conns.push_back({fd, ""});
+      }
+      for (size_t i = 1; i < fds.size(); i++) {
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        Conn& c = conns[i - 1];
+        char buf[65536];
+        ssize_t n = read(c.fd, buf, sizeof(buf));
+        if (n <= 0 || !handle(c, buf, (size_t)n)) {
+          close(c.fd);
+          c.fd = -1;
+        }
+      }
+      conns.erase(std::remove_if(conns.begin(), conns.end(), [](const Conn& c) { return c.fd < 0; }), conns.end());
+    }
+    for (Conn& c : conns) close(c.fd);
+  }
+
+  // False to close the connection
+  bool handle(Conn& c, const char* data, size_t len) {
+    c.in.append(data, len);
+    for (;;) {
+      size_t end = c.in.find("\r\n\r\n");
+      if (end == std::string::npos) return true;
+      size_t cl = c.in.find("Content-Length: ");
+      if (cl == std::string::npos || cl > end) return false;
+      size_t bodyLen = strtoul(c.in.c_str() + cl + 16, nullptr, 10);
+      if (c.in.size() < end + 4 + bodyLen) return true;
+      requests++;
+      int reply = status.load();
+      if (failNext.load() > 0) {
+        failNext--;
+        reply = 503;
+      }
+      if (reply == 204) store(c.in.data() + end + 4, bodyLen);
+      c.in.erase(0, end + 4 + bodyLen);
+      // Errors carry a JSON body, as InfluxDB's do
+      std::string body = reply == 204 ? ""
+                         : reply == 400 ? "{\"code\":\"invalid\",\"message\":\"unable to parse\"}"
+                                        : "{\"code\":\"unavailable\",\"message\":\"try again\"}";
+      std::string r = reply == 204 ? "HTTP/1.1 204 No Content\r\n"
+                                   : "HTTP/1.1 " + std::to_string(reply) + " Error\r\nContent-Type: application/json\r\n"
+                                     "Content-Length: " + std::to_string(body.size()) + "\r\n";
+      if (closeEach) r += "Connection: close\r\n";
+      r += "\r\n" + body;
+      if (write(c.fd, r.data(), r.size()) != (ssize_t)r.size()) return false;
+      if (closeEach) return false;
+    }
+  }
+
+  // A point is "measurement,tags fields timestamp"; keeps pack + timestamp
+  void store(const char* body, size_t len) {
+    size_t start = 0;
+    std::lock_guard<std::mutex> g(m);
+    while (start < len) {
+      const char* nl = (const char*)memchr(body + start, '\n', len - start);
+      size_t end = nl ? (size_t)(nl - body) : len;
+      std::string line(body + start, end - start);
+      start = end + 1;
+      lines++;
+      size_t tags = line.find(' ');
+      size_t ts = line.rfind(' ');
+      if (line.compare(0, 9, "bms,pack=") != 0 || tags == ts || line[ts - 1] != 'i' ||
+          line.find_first_not_of("0123456789", ts + 1) != std::string::npos) {
+        badLines++;
+        continue;
+      }
+      if (!keepPoints) continue;
+      if (!stored.insert(line.substr(0, tags) + line.substr(ts)).second) duplicates++;
+    }
+  }
+
+  int listener_ = -1;
+  std::atomic<bool> running_{false};
+  std::thread thread_;
+};
+
+// --- Checks ---
+
+static bool formatChecks() {
+  bool ok = true;
+  InfluxOptions opt;
+  opt.tags = "site=shed";
+  DecodedBatteryState m = sample(0);
+  std::string line;
+  influxAppendPoint(line, influxPrefix(opt, "DL-41181201189F"), m);
+  const char* want = "bms,pack=DL-41181201189F,site=shed voltage_mv=53088i,current_ma=-12500i,soc_dpct=904i,"
+                     "charge_mah=207900i,capacity_mah=230000i,status=2i,cell_min_mv=3316i,cell_max_mv=3320i,"
+                     "c01=3316i,c02=3317i,c03=3318i,c04=3319i,c05=3320i,c06=3316i,c07=3317i,c08=3318i,c09=3319i,"
+                     "c10=3320i,c11=3316i,c12=3317i,c13=3318i,c14=3319i,c15=3320i,c16=3316i 1700000000250\n";
+  ok = check(line == want, "line protocol of a known message") && ok;
+  if (line != want) printf("  got  %s  want %s", line.c_str(), want);
+  ok = check(influxPrefix(opt, "DL 1,x=y") == "bms,pack=DL\\ 1\\,x\\=y,site=shed ", "tag values escaped") && ok;
+  std::string s;
+  influxAppendInt(s, INT64_MIN);
+  s += ' ';
+  influxAppendInt(s, 0);
+  s += ' ';
+  influxAppendInt(s, -7);
+  ok = check(s == "-9223372036854775808 0 -7", "integers down to INT64_MIN") && ok;
+  m.cell_voltage.clear();
+  line.clear();
+  influxAppendPoint(line, influxPrefix(InfluxOptions(), "p"), m);
+  ok = check(line.find("cell_") == std::string::npos && line.find("status=2i 1700000000250\n") != std::string::npos,
+             "no cell fields without cells") && ok;
+  return ok;
+}
+
+// Counts posts and records what each returned
+class CountingTransport : public InfluxTransport {
+public:
+  explicit CountingTransport(InfluxTransport& t) : t_(t) {}
+  int post(const char* body, size_t len) override {
+    auto t0 = Clock::now();
+    int status = t_.post(body, len);
+    us.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count());
+    statuses.push_back(status);
+    return status;
+  }
+  std::vector<uint32_t> us;
+  std::vector<int> statuses;
+
+private:
+  InfluxTransport& t_;
+};
+
+// `seconds` of three packs at 1 Hz on a virtual clock, serviced every 100 ms
+static void feedPacks(InfluxExporter& exporter, uint32_t fromS, uint32_t seconds, uint32_t& nowMs) {
+  for (uint32_t s = fromS; s < fromS + seconds; s++) {
+    for (uint8_t p = 0; p < PACKS; p++) {
+      DecodedBatteryState m = sample(s);
+      exporter.add(PACK_NAMES[p], m, nowMs);
+    }
+    for (int k = 0; k < 10; k++) {
+      exporter.service(nowMs);
+      nowMs += 100;
+    }
+  }
+}
+
+static void removeSpool(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) return;
+  while (dirent* e = readdir(d)) {
+    if (e->d_name[0] != '.') unlink((dir + "/" + e->d_name).c_str());
+  }
+  closedir(d);
+  rmdir(dir.c_str());
+}
+
+static bool deliveryChecks() {
+  bool ok = true;
+  {
+    // Batching alone, no server needed
+    HttpPoster nowhere;
+    nowhere.begin("http://127.0.0.1:1/write");
+    InfluxExporter e;
+    InfluxOptions opt;
+    opt.batchPoints = 100;
+    opt.queued = 8;
+    e.begin(&nowhere, opt);
+    DecodedBatteryState m = sample(0);
+    for (int i = 0; i < 250; i++) e.add("p", m, 0);
+    ok = check(e.queuedBatches() == 2, "sealed at the point count") && ok;
+    e.service(opt.batchMs - 1);
+    ok = check(e.queuedBatches() == 2 && e.posts == 1, "an open batch younger than batchMs stays open") && ok;
+    e.service(opt.batchMs);
+    ok = check(e.queuedBatches() == 3 && e.posts == 1, "sealed at batchMs, no post before the backoff") && ok;
+  }
+
+  StandIn server;
+  if (!check(server.start(), "stand-in server listening")) return false;
+  {
+    HttpPoster poster;
+    poster.begin(server.url(), "secret");
+    InfluxExporter e;
+    e.begin(&poster);
+    uint32_t now = 0;
+    feedPacks(e, 0, 600, now);
+    e.flush(now);
+    ok = check(server.stored.size() == 1800 && server.duplicates == 0 && server.badLines == 0 && e.sent == 1800,
+               "10 min of 3 packs: every point stored once") && ok;
+    ok = check(poster.connects == 1 && e.posts == server.requests && e.posts <= 61,
+               "batches of 10 s over one kept-alive connection") && ok;
+  }
+  {
+    server.stored.clear();
+    server.failNext = 1;
+    HttpPoster poster;
+    poster.begin(server.url());
+    CountingTransport counted(poster);
+    InfluxExporter e;
+    InfluxOptions opt;
+    opt.batchPoints = 30;
+    e.begin(&counted, opt);
+    uint32_t now = 0;
+    feedPacks(e, 0, 12, now);
+    ok = check(counted.statuses.size() >= 2 && counted.statuses[0] == 503 && counted.statuses[1] == 204 &&
+                   e.failures == 1 && e.sent == 30 && !e.down(),
+               "a 503 is retried after the backoff") && ok;
+    server.status = 400;
+    feedPacks(e, 12, 10, now);
+    e.flush(now);
+    server.status = 204;
+    ok = check(e.rejected == 36 && e.dropped == 0 && e.spooled == 0 && e.sent == 30 && e.queuedBatches() == 0,
+               "a 400 drops the batch without a retry") && ok;
+  }
+  {
+    server.stored.clear();
+    server.closeEach = true;
+    HttpPoster poster;
+    poster.begin(server.url());
+    InfluxExporter e;
+    InfluxOptions opt;
+    opt.batchPoints = 30;
+    e.begin(&poster, opt);
+    uint32_t now = 0;
+    feedPacks(e, 0, 100, now);
+    e.flush(now);
+    server.closeEach = false;
+    ok = check(e.sent == 300 && server.stored.size() == 300 && poster.connects == 10 && e.failures == 0,
+               "Connection: close followed with a new connection") && ok;
+  }
+
+  std::string spool = "influx_bench_spool";
+  removeSpool(spool);
+  {
+    // Outage: the server is gone from 100 s to 400 s
+    server.stored.clear();
+    HttpPoster poster;
+    poster.begin(server.url());
+    InfluxExporter e;
+    InfluxOptions opt;
+    opt.spoolDir = spool;
+    e.begin(&poster, opt);
+    uint32_t now = 0;
+    uint16_t port = server.port;
+    feedPacks(e, 0, 100, now);
+    server.stop();
+    uint32_t postsBefore = e.posts;
+    feedPacks(e, 100, 300, now);
+    uint32_t outagePosts = e.posts - postsBefore;
+    size_t spooledFiles = e.spoolFiles();
+    ok = check(server.start(port), "stand-in back on its port") && ok;
+    feedPacks(e, 400, 100, now);
+    e.flush(now);
+    printf("Outage of 300 s at 3 points/s: %u posts while down, %zu batches spooled, %llu points replayed\n",
+           outagePosts, spooledFiles, (unsigned long long)e.replayed);
+    ok = check(outagePosts <= 1 + opt.retries + 300000 / opt.backoffMaxMs + 1, "bounded attempts while down") && ok;
+    ok = check(spooledFiles >= 25 && e.spooled >= 900 && e.dropped == 0, "the outage went to the spool") && ok;
+    ok = check(server.stored.size() == 1500 && server.duplicates == 0 && e.sent == 1500 && e.spoolFiles() == 0,
+               "after the outage every point stored once, spool empty") && ok;
+  }
+  {
+    // Down at exit: the spool waits for the next run
+    server.stored.clear();
+    uint16_t port = server.port;
+    server.stop();
+    {
+      HttpPoster poster;
+      poster.begin(server.url());
+      InfluxExporter e;
+      InfluxOptions opt;
+      opt.spoolDir = spool;
+      e.begin(&poster, opt);
+      uint32_t now = 0;
+      feedPacks(e, 0, 60, now);
+      e.flush(now);
+      ok = check(e.sent == 0 && e.spooled == 180 && e.dropped == 0, "points spooled when the server is down at exit") &&
+           ok;
+    }
+    server.start(port);
+    HttpPoster poster;
+    poster.begin(server.url());
+    InfluxExporter e;
+    InfluxOptions opt;
+    opt.spoolDir = spool;
+    ok = check(e.begin(&poster, opt) && e.spoolFiles() > 0, "spool of the last run picked up") && ok;
+    uint32_t now = 0;
+    feedPacks(e, 60, 30, now);
+    e.flush(now);
+    ok = check(server.stored.size() == 270 && server.duplicates == 0 && e.replayed == 180 && e.spoolFiles() == 0,
+               "the last run's points replayed once") && ok;
+  }
+  {
+    // A spool of 20 kB holds about two 10 s batches; older ones go
+    uint16_t port = server.port;
+    server.stop();
+    HttpPoster poster;
+    poster.begin(server.url());
+    InfluxExporter e;
+    InfluxOptions opt;
+    opt.spoolDir = spool;
+    opt.spoolBytes = 20000;
+    e.begin(&poster, opt);
+    uint32_t now = 0;
+    feedPacks(e, 0, 300, now);
+    e.flush(now);
+    ok = check(e.spooledBytes() <= opt.spoolBytes && e.spooled == e.points && e.dropped > e.points / 2,
+               "a full spool drops its oldest batches") && ok;
+    server.start(port);
+  }
+  removeSpool(spool);
+  return ok;
+}
+
+// --- Benchmark ---
+
+// What a script does: float fields, tags escaped and keys formatted per point
+static void naiveAppendPoint(std::string& out, const std::string& pack, const DecodedBatteryState& m) {
+  char buf[1024];
+  std::string tag;
+  influxEscapeTag(tag, pack);
+  int n = snprintf(buf, sizeof(buf), "bms,pack=%s,site=shed voltage=%.3f,current=%.3f,soc=%.1f,charge=%.3f,capacity=%.3f,status=%di",
+                   tag.c_str(), m.voltage, m.current, m.percentage * 100.0f, m.charge, m.capacity, m.power_supply_status);
+  for (size_t i = 0; i < m.cell_voltage.size(); i++) n += snprintf(buf + n, sizeof(buf) - n, ",c%02zu=%.3f", i + 1, m.cell_voltage[i]);
+  snprintf(buf + n, sizeof(buf) - n, " %lld\n", (long long)m.stamp_sec * 1000 + m.stamp_nanosec / 1000000);
+  out += buf;
+}
+
+static double serializeRate(bool naive, size_t& bytesPerPoint) {
+  InfluxOptions opt;
+  opt.tags = "site=shed";
+  std::vector<DecodedBatteryState> msgs;
+  for (uint32_t i = 0; i < 100; i++) msgs.push_back(sample(i));
+  std::string prefix = influxPrefix(opt, PACK_NAMES[0]);
+  std::string out;
+  out.reserve(1 << 20);
+  double best = 0;
+  for (int round = 0; round < 3; round++) {
+    const uint32_t points = 300000;
+    size_t bytes = 0;
+    auto t0 = Clock::now();
+    for (uint32_t i = 0; i < points; i++) {
+      if (naive) naiveAppendPoint(out, PACK_NAMES[0], msgs[i % 100]);
+      else influxAppendPoint(out, prefix, msgs[i % 100]);
+      if (out.size() > (1 << 20) - 1024) {
+        bytes += out.size();
+        out.clear();
+      }
+    }
+    bytes += out.size();
+    out.clear();
+    best = std::max(best, points / std::chrono::duration<double>(Clock::now() - t0).count());
+    bytesPerPoint = bytes / points;
+  }
+  return best;
+}
+
+static uint32_t percentile(std::vector<uint32_t> v, double q) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, (size_t)(q / 100.0 * v.size()))];
+}
+
+int main() {
+  bool ok = formatChecks();
+  ok = deliveryChecks() && ok;
+
+  size_t fastBytes = 0, naiveBytes = 0;
+  double fast = serializeRate(false, fastBytes);
+  double slow = serializeRate(true, naiveBytes);
+  printf("\n%-44s %12s %10s %10s\n", "Serialize, 16 cells", "points/s", "ns/point", "B/point");
+  printf("%-44s %12.0f %10.1f %10zu\n", "preformatted prefix, integer fields", fast, 1e9 / fast, fastBytes);
+  printf("%-44s %12.0f %10.1f %10zu\n", "snprintf per point, float fields", slow, 1e9 / slow, naiveBytes);
+  ok = check(fast > 3 * slow, "preformatted serialization 3x faster") && ok;
+
+  StandIn server;
+  server.keepPoints = false;
+  server.start();
+  printf("\n%-44s %8s %12s %9s %9s %9s\n", "Serialize + POST to the stand-in", "points", "points/s", "posts/s",
+         "p50 us", "p99 us");
+  struct Run { const char* name; uint32_t batch; uint32_t points; };
+  const Run runs[] = {
+    {"batch 1", 1, 20000},
+    {"batch 10", 10, 100000},
+    {"batch 100", 100, 300000},
+    {"batch 1000", 1000, 600000},
+    {"batch 5000", 5000, 600000},
+  };
+  std::vector<DecodedBatteryState> msgs;
+  for (uint32_t i = 0; i < 1000; i++) msgs.push_back(sample(i));
+  double batched = 0;
+  for (const Run& run : runs) {
+    HttpPoster poster;
+    poster.begin(server.url());
+    CountingTransport counted(poster);
+    InfluxExporter e;
+    InfluxOptions opt;
+    opt.batchPoints = run.batch;
+    opt.batchBytes = 64u << 20;
+    e.begin(&counted, opt);
+    uint64_t lines0 = server.lines;
+    auto t0 = Clock::now();
+    for (uint32_t i = 0; i < run.points; i++) {
+      e.add(PACK_NAMES[i % PACKS], msgs[i % 1000], 0);
+      e.service(0);
+    }
+    e.flush(0);
+    double s = std::chrono::duration<double>(Clock::now() - t0).count();
+    // The stand-in counts on its own thread; wait for the last reply's lines
+    while (server.lines - lines0 < run.points && std::chrono::duration<double>(Clock::now() - t0).count() < s + 2) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    printf("%-44s %8u %12.0f %9.0f %9u %9u\n", run.name, run.points, run.points / s, e.posts / s,
+           percentile(counted.us, 50), percentile(counted.us, 99));
+    ok = check(e.sent == run.points && server.lines - lines0 == run.points, "every point sent and counted") && ok;
+    if (run.batch == 1000) batched = run.points / s;
+  }
+  {
+    // A new connection and request per point, as a curl loop does
+    const uint32_t points = 5000;
+    uint64_t lines0 = server.lines;
+    std::vector<uint32_t> us;
+    auto t0 = Clock::now();
+    for (uint32_t i = 0; i < points; i++) {
+      HttpPoster poster;
+      poster.begin(server.url());
+      std::string body;
+      naiveAppendPoint(body, PACK_NAMES[i % PACKS], msgs[i % 1000]);
+      auto p0 = Clock::now();
+      poster.post(body.data(), body.size());
+      us.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - p0).count());
+    }
+    double s = std::chrono::duration<double>(Clock::now() - t0).count();
+    printf("%-44s %8u %12.0f %9.0f %9u %9u\n", "naive: snprintf, POST per point, new conn.", points, points / s,
+           points / s, percentile(us, 50), percentile(us, 99));
+    ok = check(server.lines - lines0 == points, "naive points counted") && ok;
+    ok = check(batched > 20 * points / s, "batched export 20x the naive rate") && ok;
+  }
+
+  printf("\n%s\n", ok ? "All checks passed" : "CHECKS FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+/*
+ * Rolling peak power check and benchmark
+ * Feeds a random load profile (steps, ramps and spikes, jittered sample
+ * intervals) through the monotonic-deque windows and compares every result
+ * with a brute-force scan of the same window. Also checks the load-duration
+ * histogram against a direct sum, then times both approaches. The firmware
+ * profile also runs at the fastest read_ms with the load ramping down and up
+ * for minutes at a time, so a 60 s window holds one sample per read.
+ *
+ * Build: g++ -std=gnu++17 -O2 -Iinclude native/bench/power_profile_bench.cpp -o power_profile_bench
+ * Run:   ./power_profile_bench [samples]
+ */
+
+#include "power_profile.h"
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+struct Sample {
+  uint32_t t_ms;
+  int32_t watts;
+};
+
+static std::vector<Sample> makeProfile(uint32_t count, uint32_t minDt, uint32_t maxDt, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint32_t> dt(minDt, maxDt);
+  std::uniform_int_distribution<int32_t> step(-3000, 1500);
+  std::uniform_int_distribution<int> pick(0, 99);
+  std::vector<Sample> out;
+  out.reserve(count);
+
+  // Start near the 32-bit millis() wrap so the window arithmetic is exercised across it
+  uint32_t t = 0xFFFFFFFFu - 200000;
+  int32_t base = -400;
+  for (uint32_t i = 0; i < count; i++) {
+    t += dt(rng);
+    int p = pick(rng);
+    if (p < 2) base = step(rng);             // load change
+    else if (p < 30) base += pick(rng) - 50; // drift
+    int32_t w = base + (pick(rng) < 3 ? -(int32_t)(pick(rng) * 40) : 0); // short spikes
+    out.push_back({t, w});
+  }
+  return out;
+}
+
+// One sample per read at readMs, each published up to maxLagMs after its
+// read started; the load ramps down and up by 3 W per read (monotonic runs
+// of 300 samples, longer than any window)
+static std::vector<Sample> makeRamps(uint32_t count, uint32_t readMs, uint32_t maxLagMs, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint32_t> lag(0, maxLagMs);
+  std::vector<Sample> out;
+  out.reserve(count);
+  uint32_t start = 0xFFFFFFFFu - 200000;
+  for (uint32_t i = 0; i < count; i++, start += readMs) {
+    uint32_t phase = i % 600;
+    int32_t w = -200 - 3 * (int32_t)(phase < 300 ? phase : 600 - phase);
+    out.push_back({start + lag(rng), w});
+  }
+  return out;
+}
+
+static void bruteWindow(const std::vector<Sample>& s, size_t i, uint32_t window, int32_t& mx, int32_t& mn) {
+  mx = mn = s[i].watts;
+  for (size_t j = i; j-- > 0;) {
+    if (s[i].t_ms - s[j].t_ms >= window) break;
+    if (s[j].watts > mx) mx = s[j].watts;
+    if (s[j].watts < mn) mn = s[j].watts;
+  }
+}
+
+// Deque windows sized for the sample rate must match brute force exactly
+static bool checkWindows(const std::vector<Sample>& s) {
+  const uint32_t windows[3] = {1000, 10000, 60000};
+  WindowExtrema<4096> w[3] = {WindowExtrema<4096>(1000), WindowExtrema<4096>(10000), WindowExtrema<4096>(60000)};
+  for (size_t i = 0; i < s.size(); i++) {
+    for (int k = 0; k < 3; k++) {
+      w[k].add(s[i].t_ms, s[i].watts);
+      int32_t mx, mn;
+      bruteWindow(s, i, windows[k], mx, mn);
+      if (w[k].max() != mx || w[k].min() != mn) {
+        printf("FAIL window %u ms sample %zu: deque %d/%d, brute %d/%d\n",
+               windows[k], i, w[k].max(), w[k].min(), mx, mn);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// The firmware profile (deques of POWER_WINDOW_SAMPLES) at the firmware's sample rates
+static bool checkProfile(const std::vector<Sample>& s) {
+  PowerProfile profile;
+  uint64_t hist[POWER_HIST_BINS] = {0};
+  for (size_t i = 0; i < s.size(); i++) {
+    profile.add(s[i].t_ms, s[i].watts);
+    if (i > 0 && s[i].t_ms - s[i - 1].t_ms <= PowerProfile::MAX_GAP_MS) {
+      hist[PowerProfile::bin(s[i - 1].watts)] += s[i].t_ms - s[i - 1].t_ms;
+    }
+    for (uint8_t k = 0; k < PowerProfile::WINDOWS; k++) {
+      int32_t mx, mn;
+      bruteWindow(s, i, profile.windowMs(k), mx, mn);
+      if (profile.peak(k) != mx || profile.trough(k) != mn) {
+        printf("FAIL profile window %u ms sample %zu: %d/%d, brute %d/%d\n",
+               profile.windowMs(k), i, profile.peak(k), profile.trough(k), mx, mn);
+        return false;
+      }
+    }
+  }
+  for (uint8_t b = 0; b < POWER_HIST_BINS; b++) {
+    if (profile.binMs(b) != hist[b]) {
+      printf("FAIL histogram bin %u: %llu, expected %llu\n", b,
+             (unsigned long long)profile.binMs(b), (unsigned long long)hist[b]);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  uint32_t count = argc > 1 ? (uint32_t)atoi(argv[1]) : 200000;
+
+  std::vector<Sample> fast = makeProfile(count, 20, 200, 1);      // 5..50 Hz
+  std::vector<Sample> firmware = makeProfile(count, 1000, 6000, 2); // BLE read cadence plus jitter
+  std::vector<Sample> ramps = makeRamps(count, POWER_SAMPLE_MIN_MS, 400, 3); // fastest read_ms
+  bool ok = checkWindows(fast) && checkProfile(firmware) && checkProfile(ramps);
+  printf("Brute-force comparison: %s (%u samples per profile)\n", ok ? "OK" : "FAILED", count);
+  if (!ok) return 1;
+
+  // Timing on the fast profile, 60 s window (~600 samples deep)
+  WindowExtrema<4096> w(60000);
+  auto t0 = std::chrono::steady_clock::now();
+  int64_t sink = 0;
+  for (const Sample& s : fast) {
+    w.add(s.t_ms, s.watts);
+    sink += w.max() - w.min();
+  }
+  double dequeNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / fast.size();
+
+  t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < fast.size(); i++) {
+    int32_t mx, mn;
+    bruteWindow(fast, i, 60000, mx, mn);
+    sink -= mx - mn;
+  }
+  double bruteNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / fast.size();
+
+  PowerProfile profile;
+  t0 = std::chrono::steady_clock::now();
+  for (const Sample& s : firmware) profile.add(s.t_ms, s.watts);
+  double profileNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / firmware.size();
+
+  printf("60 s window max/min: deque %.1f ns/sample, brute force %.1f ns/sample (%s)\n",
+         dequeNs, bruteNs, sink == 0 ? "results agree" : "results differ");
+  printf("PowerProfile (3 windows + histogram): %.1f ns/sample\n", profileNs);
+
+  printf("Load duration (firmware profile):\n");
+  for (uint8_t b = 0; b < POWER_HIST_BINS; b++) {
+    printf("  >= %5d W: %8.2f h\n", b * POWER_HIST_BIN_W, profile.msAtOrAbove(b) / 3600000.0);
+  }
+  return sink == 0 ? 0 : 1;
+}
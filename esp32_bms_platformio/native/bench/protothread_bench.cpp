@@ -0,0 +1,191 @@
+/*
+ * Protothread check and benchmark: many Daly exchanges in flight on one task
+ * Every simulated pack runs the firmware's sequence as a protothread:
+ * subscribe, write MOS_INFO, await the reply or a timeout, write CMD_INFO,
+ * await, repeat. Replies come back in 20-byte notifications after a random
+ * delay on a virtual clock, with a share lost, and go through the firmware's
+ * DalyReplyAssembler. One loop resumes every exchange once per millisecond,
+ * like pollTask() does. Checks that each exchange gets its own frames back
+ * whole and times out exactly when its reply was lost, for 1 to 256 packs.
+ * Then times a resume (a context switch between exchanges) against a
+ * swapcontext() switch between stackful coroutines.
+ *
+ * Build: g++ -std=gnu++17 -O2 -Iinclude native/bench/protothread_bench.cpp -o protothread_bench
+ * Run:   ./protothread_bench
+ */
+
+#include "frame_stats.h"
+#include "protothread.h"
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdio.h>
+#include <ucontext.h>
+#include <vector>
+
+static uint32_t g_ms = 0;
+static std::mt19937 g_rng(7);
+
+// One pack's link: requests go out, replies come back in fragments later
+struct FakeLink {
+  std::multimap<uint32_t, std::vector<uint8_t>> inbound;   // due ms -> notification
+  DalyReplyAssembler assembler;
+  bool replyComplete = false;
+  uint32_t writes = 0, lost = 0;
+};
+
+static std::vector<uint8_t> replyFrame(uint8_t dataLen, uint8_t tag) {
+  std::vector<uint8_t> f(3 + dataLen, 0);
+  f[0] = 0xD2;
+  f[1] = 0x03;
+  f[2] = dataLen;
+  for (uint8_t i = 0; i < dataLen; i++) f[3 + i] = (uint8_t)(tag + i);
+  uint16_t crc = dalyFrameCrc(f.data(), f.size());
+  f.push_back(crc & 0xFF);
+  f.push_back(crc >> 8);
+  return f;
+}
+
+static void linkWrite(FakeLink& l, FrameCommand cmd, uint8_t tag) {
+  l.writes++;
+  l.assembler.reset();
+  l.replyComplete = false;
+  if (g_rng() % 100 < 5) {
+    l.lost++;
+    return;
+  }
+  std::vector<uint8_t> f = replyFrame(cmd == FRAME_CMD_INFO ? DALY_INFO_DATA_LEN : DALY_MOS_DATA_LEN, tag);
+  uint32_t at = g_ms + 40 + g_rng() % 100;
+  for (size_t off = 0; off < f.size(); off += 20) {
+    l.inbound.emplace(at, std::vector<uint8_t>(f.begin() + off, f.begin() + std::min(f.size(), off + 20)));
+    at += 1;
+  }
+}
+
+static void linkDeliver(FakeLink& l) {
+  while (!l.inbound.empty() && l.inbound.begin()->first <= g_ms) {
+    const std::vector<uint8_t>& part = l.inbound.begin()->second;
+    if (!l.replyComplete && l.assembler.feed(part.data(), part.size())) l.replyComplete = true;
+    l.inbound.erase(l.inbound.begin());
+  }
+}
+
+// The firmware's sequence, with the state it keeps across waits
+struct Exchange {
+  Pt pt;
+  FakeLink* link;
+  bool subscribed;
+  uint8_t tag;          // changes per request, so a stale reply would show
+  FrameCommand cmd;
+  uint32_t sentMs;
+  uint32_t done, timeouts, badFrames;
+};
+
+static const uint32_t TIMEOUT_MS = 500;
+
+static bool replyMatches(const Exchange& x) {
+  const DalyReplyAssembler& a = x.link->assembler;
+  uint8_t dataLen = x.cmd == FRAME_CMD_INFO ? DALY_INFO_DATA_LEN : DALY_MOS_DATA_LEN;
+  return classifyDalyFrame(a.data(), a.length(), dataLen) == FRAME_OK && a.data()[3] == x.tag;
+}
+
+static PT_THREAD(exchangeThread(Exchange& x)) {
+  PT_BEGIN(&x.pt);
+  if (!x.subscribed) {
+    x.subscribed = true;
+    PT_YIELD(&x.pt);   // the CCCD write
+  }
+  for (x.cmd = FRAME_CMD_MOS;; x.cmd = FRAME_CMD_INFO) {
+    x.tag++;
+    linkWrite(*x.link, x.cmd, x.tag);
+    x.sentMs = g_ms;
+    PT_WAIT_UNTIL(&x.pt, x.link->replyComplete || g_ms - x.sentMs >= TIMEOUT_MS);
+    if (!x.link->replyComplete) x.timeouts++;
+    else if (!replyMatches(x)) x.badFrames++;
+    if (x.cmd == FRAME_CMD_INFO) break;
+  }
+  x.done++;
+  PT_END(&x.pt);
+}
+
+static bool runPacks(uint32_t packs, uint32_t seconds) {
+  std::vector<FakeLink> links(packs);
+  std::vector<Exchange> ex(packs);
+  for (uint32_t i = 0; i < packs; i++) {
+    ex[i] = Exchange();
+    ex[i].link = &links[i];
+    ex[i].tag = (uint8_t)(i * 37);
+  }
+  for (g_ms = 0; g_ms < seconds * 1000; g_ms++) {
+    for (auto& l : links) linkDeliver(l);
+    for (auto& x : ex) exchangeThread(x);
+  }
+
+  for (uint32_t i = 0; i < packs; i++) {
+    const Exchange& x = ex[i];
+    // the last request may still be waiting out its timeout
+    if (x.badFrames || x.timeouts > links[i].lost || links[i].lost - x.timeouts > 1 || x.done == 0) {
+      printf("FAIL %u packs: pack %u cycles %u timeouts %u (lost %u) bad frames %u\n", packs, i, x.done,
+             x.timeouts, links[i].lost, x.badFrames);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Resume cost of an exchange that is waiting for its reply: all packs have
+// written and the clock stands still, so every call is a switch in and out
+static double resumeNs(uint32_t packs) {
+  std::vector<FakeLink> links(packs);
+  std::vector<Exchange> ex(packs);
+  g_ms = 1000000;
+  for (uint32_t i = 0; i < packs; i++) {
+    ex[i] = Exchange();
+    ex[i].link = &links[i];
+    ex[i].subscribed = true;
+    exchangeThread(ex[i]);
+  }
+  const uint32_t passes = 20000000 / packs;
+  auto t0 = std::chrono::steady_clock::now();
+  for (uint32_t p = 0; p < passes; p++) {
+    for (auto& x : ex) exchangeThread(x);
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+  return ns / ((double)passes * packs);
+}
+
+// Stackful comparison: two ucontext coroutines passing control back and forth
+static ucontext_t g_main, g_co;
+static uint64_t g_switches = 0;
+static void coroutineBody() {
+  for (;;) {
+    g_switches++;
+    swapcontext(&g_co, &g_main);
+  }
+}
+
+static double swapcontextNs() {
+  static std::vector<char> stack(16384);
+  getcontext(&g_co);
+  g_co.uc_stack.ss_sp = stack.data();
+  g_co.uc_stack.ss_size = stack.size();
+  g_co.uc_link = &g_main;
+  makecontext(&g_co, coroutineBody, 0);
+  const uint32_t n = 2000000;
+  auto t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < n; i++) swapcontext(&g_main, &g_co);
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+  return ns / (2.0 * n);   // there and back
+}
+
+int main() {
+  bool ok = true;
+  const uint32_t counts[] = {1, 16, 256};
+  for (uint32_t packs : counts) ok = runPacks(packs, 600) && ok;
+  printf("Exchanges in flight on one task (1/16/256 packs, 10 virtual min, 5 %% lost): %s\n",
+         ok ? "OK" : "FAILED");
+  printf("State per exchange: Pt %zu bytes, this bench's Exchange %zu bytes\n", sizeof(Pt), sizeof(Exchange));
+  for (uint32_t packs : counts) printf("Resume of a waiting exchange, %3u packs: %.1f ns\n", packs, resumeNs(packs));
+  printf("swapcontext() between stackful coroutines: %.1f ns per switch, plus a stack each\n", swapcontextNs());
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,263 @@
+/*
+ * Raw passthrough check and benchmark
+ * Builds random Daly replies with known values (D2 03 main info and MOS,
+ * A5 0x90..0x94), forwards them through RawForwarder into framed records,
+ * and sends the stream to the host side in random chunks with text lines
+ * in between, a share of frames damaged before forwarding and a share of
+ * records lost after it. The host side (CdrFrameScanner, rawParseRecord,
+ * daly_decode.h) must decode every forwarded frame to the values that went
+ * in, the forwarder must reject every damaged one, and the sequence gaps
+ * must equal the records lost. Then times the device side per frame
+ * (validate + record + envelope CRC) and the host decode, and prints the
+ * frame rate the serial line allows at common baud rates.
+ *
+ * Build: g++ -std=gnu++17 -O2 -Iinclude -Inative native/bench/raw_frames_bench.cpp -o raw_frames_bench
+ * Run:   ./raw_frames_bench
+ */
+
+#include "cdr_decode.h"
+#include "raw_frames.h"
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+static std::mt19937 g_rng(11);
+
+struct InfoTruth {
+  uint16_t cell_mv[DALY_CELLS];
+  int32_t current_da;   // 0.1 A
+  uint16_t soc_pm;
+  uint16_t cycles;
+  int16_t temp_c[3];
+};
+
+static void putU16(std::vector<uint8_t>& f, size_t at, uint16_t v) {
+  f[at] = v >> 8;
+  f[at + 1] = v & 0xFF;
+}
+
+static void sealD203(std::vector<uint8_t>& f) {
+  uint16_t crc = dalyFrameCrc(f.data(), f.size() - 2);
+  f[f.size() - 2] = crc & 0xFF;
+  f[f.size() - 1] = crc >> 8;
+}
+
+static std::vector<uint8_t> infoFrame(InfoTruth& t) {
+  std::vector<uint8_t> f(DALY_INFO_DATA_LEN + DALY_FRAME_OVERHEAD, 0);
+  f[0] = 0xD2;
+  f[1] = 0x03;
+  f[2] = DALY_INFO_DATA_LEN;
+  for (uint8_t i = 0; i < DALY_CELLS; i++) {
+    t.cell_mv[i] = 2800 + g_rng() % 850;
+    putU16(f, 3 + i * 2, t.cell_mv[i]);
+  }
+  t.current_da = (int32_t)(g_rng() % 4001) - 2000;
+  putU16(f, 85, (uint16_t)(t.current_da + DALY_CURRENT_OFFSET));
+  t.soc_pm = g_rng() % 1001;
+  putU16(f, 87, t.soc_pm);
+  t.cycles = g_rng() % 5000;
+  putU16(f, 105, t.cycles);
+  for (uint8_t i = 0; i < 3; i++) {
+    t.temp_c[i] = (int16_t)(g_rng() % 90) - 20;
+    putU16(f, 67 + i * 2, (uint16_t)(t.temp_c[i] + DALY_TEMP_OFFSET));
+  }
+  sealD203(f);
+  return f;
+}
+
+static std::vector<uint8_t> mosFrame(DalyMos& t) {
+  std::vector<uint8_t> f(DALY_MOS_DATA_LEN + DALY_FRAME_OVERHEAD, 0);
+  f[0] = 0xD2;
+  f[1] = 0x03;
+  f[2] = DALY_MOS_DATA_LEN;
+  t.charge = g_rng() % 2;
+  t.discharge = g_rng() % 2;
+  f[4] = t.charge;
+  f[6] = t.discharge;
+  sealD203(f);
+  return f;
+}
+
+// A5 reply with random data; the decoder is checked against the raw bytes
+static std::vector<uint8_t> a5Frame(uint8_t command) {
+  std::vector<uint8_t> f(DALY_A5_FRAME_LEN, 0);
+  f[0] = 0xA5;
+  f[1] = 0x01;
+  f[2] = command;
+  f[3] = 0x08;
+  for (uint8_t i = 4; i < 12; i++) f[i] = g_rng();
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < 12; i++) sum += f[i];
+  f[12] = sum;
+  return f;
+}
+
+static bool infoMatches(const DalyInfo& d, const InfoTruth& t) {
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < DALY_CELLS; i++) {
+    if (d.cell_mv[i] != t.cell_mv[i]) return false;
+    sum += t.cell_mv[i];
+  }
+  for (uint8_t i = 0; i < 3; i++) {
+    if (d.temp_c[i] != t.temp_c[i]) return false;
+  }
+  return fabsf(d.voltage - sum / 1000.0f) < 1e-3f && lroundf(d.current * 10) == t.current_da &&
+         lroundf(d.soc * 10) == t.soc_pm && d.cycles == t.cycles;
+}
+
+static bool a5Matches(const DalyA5Values& v, const uint8_t* f) {
+  const uint8_t* d = f + 4;
+  switch (f[2]) {
+    case 0x90:
+      return lroundf(v.voltage * 10) == dalyU16(d) && lroundf(v.current * 10) == dalyU16(d + 4) - DALY_CURRENT_OFFSET;
+    case 0x91:
+      return v.max_cell_mv == dalyU16(d) && v.min_cell_mv == dalyU16(d + 3) && v.min_cell_no == d[5];
+    case 0x92:
+      return v.max_temp_c == d[0] - DALY_TEMP_OFFSET && v.min_temp_c == d[2] - DALY_TEMP_OFFSET;
+    case 0x93:
+      return v.charge_mos == (d[1] != 0) && v.remaining_mah == ((uint32_t)d[4] << 24 | d[5] << 16 | d[6] << 8 | d[7]);
+    case 0x94:
+      return v.cells == d[0] && v.cycles == dalyU16(d + 5);
+  }
+  return false;
+}
+
+// What one forwarded record should decode to
+struct Sent {
+  uint32_t seq;
+  RawProto proto;
+  uint8_t command;
+  InfoTruth info;
+  DalyMos mos;
+  std::vector<uint8_t> frame;
+};
+
+static bool roundTrip(uint32_t frames) {
+  RawForwarder fw;
+  std::vector<Sent> sent;
+  std::vector<uint8_t> stream;
+  uint32_t damaged = 0, lost = 0, lostBefore = 0;   // lost ahead of the last record delivered
+  uint8_t rec[CDR_FRAME_MAX];
+
+  for (uint32_t n = 0; n < frames; n++) {
+    Sent s;
+    uint32_t kind = g_rng() % 3;
+    if (kind == 0) {
+      s.proto = RAW_PROTO_D203;
+      s.command = FRAME_CMD_INFO;
+      s.frame = infoFrame(s.info);
+    } else if (kind == 1) {
+      s.proto = RAW_PROTO_D203;
+      s.command = FRAME_CMD_MOS;
+      s.frame = mosFrame(s.mos);
+    } else {
+      s.proto = RAW_PROTO_A5;
+      s.command = 0x90 + g_rng() % 5;
+      s.frame = a5Frame(s.command);
+    }
+    bool damage = g_rng() % 100 < 3;
+    if (damage) {
+      s.frame[g_rng() % s.frame.size()] ^= (uint8_t)(1 + g_rng() % 255);
+      damaged++;
+    }
+    s.seq = fw.forwarded();
+    size_t len = fw.encode(s.proto, s.command, s.frame.data(), s.frame.size(), n, rec + CDR_FRAME_HEADER,
+                           sizeof(rec) - CDR_FRAME_OVERHEAD);
+    if (len == 0) continue;
+    size_t total = cdrFrame(CDR_TOPIC_RAW_DALY, rec, len);
+    if (g_rng() % 100 < 2) {   // dropped on the way
+      lost++;
+      continue;
+    }
+    if (g_rng() % 10 == 0) {
+      const char* text = "BMS_METRICS:{\"timestamp\":1}\n";
+      stream.insert(stream.end(), text, text + strlen(text));
+    }
+    stream.insert(stream.end(), rec, rec + total);
+    sent.push_back(s);
+    lostBefore = lost;
+  }
+
+  size_t next = 0;
+  uint32_t mismatches = 0;
+  RawSequenceTracker seq;
+  CdrFrameScanner scanner([&](uint8_t topic, const uint8_t* payload, size_t len) {
+    RawRecord r;
+    if (topic != CDR_TOPIC_RAW_DALY || !rawParseRecord(payload, len, r) || next >= sent.size()) {
+      mismatches++;
+      return;
+    }
+    const Sent& s = sent[next++];
+    seq.feed(r.seq);
+    bool ok = r.seq == s.seq && r.proto == s.proto && r.command == s.command;
+    if (ok && s.proto == RAW_PROTO_A5) {
+      DalyA5Values v;
+      ok = dalyDecodeA5(r.frame, r.len, v) && a5Matches(v, s.frame.data());
+    } else if (ok && s.command == FRAME_CMD_INFO) {
+      DalyInfo d;
+      ok = dalyDecodeInfo(r.frame, r.len, d) && infoMatches(d, s.info);
+    } else if (ok) {
+      DalyMos m;
+      ok = dalyDecodeMos(r.frame, r.len, m) && m.charge == s.mos.charge && m.discharge == s.mos.discharge;
+    }
+    if (!ok) mismatches++;
+  });
+  for (size_t off = 0; off < stream.size();) {
+    size_t n = std::min(stream.size() - off, (size_t)(1 + g_rng() % 200));
+    scanner.feed(stream.data() + off, n);
+    off += n;
+  }
+
+  // One damaged byte always breaks the CRC or the byte sum, so every
+  // damaged frame must have been rejected
+  bool ok = mismatches == 0 && next == sent.size() && fw.rejected() == damaged && seq.gaps() == lostBefore &&
+            scanner.crcErrors == 0;
+  if (!ok) {
+    printf("FAIL round trip: %u mismatches, %zu/%zu decoded, rejected %u of %u damaged, gaps %u for %u lost\n",
+           mismatches, next, sent.size(), fw.rejected(), damaged, seq.gaps(), lostBefore);
+  }
+  return ok;
+}
+
+int main() {
+  bool ok = roundTrip(200000);
+  printf("Raw records through text, random chunks, 3 %% damaged, 2 %% lost: %s\n", ok ? "OK" : "FAILED");
+
+  // Device side: the main info reply, which is what a read cycle mostly forwards
+  InfoTruth t;
+  std::vector<uint8_t> info = infoFrame(t);
+  RawForwarder fw;
+  uint8_t rec[CDR_FRAME_MAX];
+  const uint32_t n = 2000000;
+  size_t wire = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < n; i++) {
+    size_t len = fw.encode(RAW_PROTO_D203, FRAME_CMD_INFO, info.data(), info.size(), i, rec + CDR_FRAME_HEADER,
+                           sizeof(rec) - CDR_FRAME_OVERHEAD);
+    wire = cdrFrame(CDR_TOPIC_RAW_DALY, rec, len);
+  }
+  double fwdNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / n;
+
+  // Host side: parse and decode the same record
+  size_t payloadLen = wire - CDR_FRAME_OVERHEAD;
+  DalyInfo d;
+  uint32_t decoded = 0;
+  t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < n; i++) {
+    RawRecord r;
+    rec[CDR_FRAME_HEADER] = (uint8_t)i;   // keep the loop from being folded
+    if (rawParseRecord(rec + CDR_FRAME_HEADER, payloadLen, r) && dalyDecodeInfo(r.frame, r.len, d)) decoded++;
+  }
+  double decNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / n;
+
+  printf("Main info record: %zu bytes on the wire (frame %zu + record %u + envelope %u)\n", wire, info.size(),
+         RAW_RECORD_HEADER, CDR_FRAME_OVERHEAD);
+  printf("Forward (CRC check, record, envelope CRC): %.0f ns per frame on this host\n", fwdNs);
+  printf("Host decode: %.0f ns per frame, %.1f M frames/s (%u decoded)\n", decNs, 1e3 / decNs, decoded);
+  const unsigned long bauds[] = {115200, 460800, 921600};
+  for (unsigned long baud : bauds) {
+    printf("Serial at %6lu baud carries %.0f main info frames/s\n", baud, baud / 10.0 / wire);
+  }
+  return ok ? 0 : 1;
+}
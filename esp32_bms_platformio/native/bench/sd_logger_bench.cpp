@@ -0,0 +1,297 @@
+/*
+ * SD logger check and benchmark on a host image file
+ * The logger runs as on the ESP32: the poll path appends records on one
+ * thread, a writer thread woken by the logger writes sealed buffers. The
+ * image file stalls every 4th write for 200 ms.
+ * - buffered: 100 raw records/s for 6 s; append() latency stays in the
+ *   microseconds, nothing is dropped, every record reads back in order
+ * - naive: the same stream with each block written on the poll path as it
+ *   fills; append() blocks for the stall
+ * - overload: 1000 records/s, more than two buffers can bridge over a
+ *   stall; records are dropped and counted, append() still never waits
+ * - power cut: the newest block torn; recovery resumes after the last
+ *   whole block and the log reads back consistently
+ * - ring wrap and rotation by size and by day on a small volume
+ * and times the recovery scan of the 64 MB image.
+ *
+ * Build: g++ -std=gnu++17 -O2 -pthread -DBMS_NATIVE -Iinclude -Inative native/bench/sd_logger_bench.cpp -o sd_logger_bench
+ * Run:   ./sd_logger_bench [image path]     (default /tmp/bms_sd.img)
+ */
+
+#include "block_image.h"
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+
+typedef std::chrono::steady_clock Clock;
+
+static const uint16_t RECORD_LEN = 139;   // a raw main info record
+static const uint32_t STALL_EVERY = 4;
+static const uint32_t STALL_MS = 200;
+
+static uint32_t nowUs() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+static uint32_t nowMs() { return nowUs() / 1000; }
+
+// The writer task: sleeps until the logger seals a buffer
+static std::mutex g_mutex;
+static std::condition_variable g_cv;
+static bool g_wake = false;
+
+static void wakeWriter() {
+  std::lock_guard<std::mutex> lock(g_mutex);
+  g_wake = true;
+  g_cv.notify_one();
+}
+
+struct WriterThread {
+  SdLogger& log;
+  std::atomic<bool> stop{false};
+  std::thread thread;
+  explicit WriterThread(SdLogger& l) : log(l) {
+    thread = std::thread([this]() {
+      while (!stop) {
+        {
+          std::unique_lock<std::mutex> lock(g_mutex);
+          g_cv.wait_for(lock, std::chrono::milliseconds(50), [] { return g_wake; });
+          g_wake = false;
+        }
+        while (log.writePending()) {
+        }
+      }
+      while (log.writePending()) {
+      }
+    });
+  }
+  void join() {
+    stop = true;
+    wakeWriter();
+    thread.join();
+  }
+};
+
+static void makeRecord(uint8_t* rec, uint32_t seq) {
+  memcpy(rec, &seq, 4);
+  for (uint16_t i = 4; i < RECORD_LEN; i++) rec[i] = (uint8_t)(seq * 7 + i);
+}
+
+struct Latency {
+  std::vector<uint32_t> ns;
+  uint32_t p(double pct) {
+    std::vector<uint32_t> v = ns;
+    size_t k = std::min(v.size() - 1, (size_t)(v.size() * pct / 100));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+  }
+  uint32_t max() { return *std::max_element(ns.begin(), ns.end()); }
+};
+
+// Appends `rate` records/s for `seconds` on this thread, ticking every 100 ms
+template <typename AppendFn, typename TickFn>
+static Latency produce(uint32_t rate, double seconds, uint32_t& seq, AppendFn append, TickFn tick) {
+  Latency lat;
+  uint8_t rec[RECORD_LEN];
+  auto start = Clock::now();
+  auto period = std::chrono::nanoseconds(1000000000 / rate);
+  uint32_t n = (uint32_t)(rate * seconds);
+  auto nextTick = start;
+  for (uint32_t i = 0; i < n; i++) {
+    std::this_thread::sleep_until(start + period * i);
+    makeRecord(rec, seq);
+    auto t = Clock::now();
+    append(rec, seq);
+    lat.ns.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t).count());
+    seq++;
+    if (Clock::now() >= nextTick) {
+      tick();
+      nextTick += std::chrono::milliseconds(100);
+    }
+  }
+  return lat;
+}
+
+// Every record of the volume in order: seq from 0 to total - 1 with holes
+// only where records were dropped; returns false on damage or reordering
+static bool readBack(BlockDevice* dev, uint32_t total, uint32_t& records, uint32_t& missing, uint32_t& blocks) {
+  records = missing = 0;
+  uint32_t expect = 0, lastSerial = 0;
+  bool ok = true;
+  blocks = sdLogReadAll(dev, [&](const SdBlockHeader& h, const uint8_t* rec, uint16_t len) {
+    uint32_t seq;
+    memcpy(&seq, rec, 4);
+    uint8_t want[RECORD_LEN];
+    makeRecord(want, seq);
+    if (len != RECORD_LEN || memcmp(rec, want, len) != 0 || seq < expect || h.serial < lastSerial) ok = false;
+    missing += seq - expect;
+    expect = seq + 1;
+    lastSerial = h.serial;
+    records++;
+  });
+  missing += total - expect;
+  return ok;
+}
+
+static bool check(bool cond, const char* what) {
+  if (!cond) printf("FAIL %s\n", what);
+  return cond;
+}
+
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : "/tmp/bms_sd.img";
+  bool ok = check(sdCrc32((const uint8_t*)"123456789", 9) == 0xCBF43926, "CRC-32 check value");
+
+  remove(path);
+  FileBlockDevice card;
+  const uint32_t CARD_BLOCKS = 131072;   // 64 MB
+  if (!card.open(path, CARD_BLOCKS)) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return 1;
+  }
+  SdLogger log;
+  ok = check(!log.begin(&card, nowUs), "an unlabelled card is refused") && ok;
+  SdVolume::format(&card, 0x1234);
+  ok = check(log.begin(&card, nowUs, wakeWriter), "begin on a fresh volume") && ok;
+  card.injectStalls(STALL_EVERY, STALL_MS);
+
+  // Buffered
+  WriterThread writer(log);
+  uint32_t seq = 0;
+  uint32_t ts = 1700000000;
+  Latency buffered = produce(100, 6.0, seq, [&](const uint8_t* rec, uint32_t) { log.append(rec, RECORD_LEN, ts, nowMs()); },
+                             [&]() { log.tick(nowMs()); });
+  log.setFlushMs(0);
+  log.tick(nowMs());
+  writer.join();
+  uint32_t records, missing, blocks;
+  bool readOk = readBack(&card, seq, records, missing, blocks);
+  printf("Buffered, 100 records/s, %u ms stall every %u writes: append p50 %u ns, p99.9 %u ns, max %u us;"
+         " %u records, %u dropped, %u writes (%u stalled), longest write %u ms\n",
+         STALL_MS, STALL_EVERY, buffered.p(50), buffered.p(99.9), buffered.max() / 1000, log.appended(), log.dropped(),
+         log.writes(), card.stalls(), log.maxWriteUs() / 1000);
+  ok = check(readOk && records == seq && missing == 0 && log.dropped() == 0, "buffered: every record read back") && ok;
+  ok = check(card.stalls() > 0 && buffered.max() < STALL_MS * 1000000 / 10, "buffered: stalls hit, append unaffected") && ok;
+
+  // Naive: one block buffer, written on the poll path when it fills
+  uint8_t naiveBlock[SD_BLOCK];
+  uint32_t naiveUsed = 0, naiveLba = 1;
+  Latency naive = produce(100, 3.0, seq, [&](const uint8_t* rec, uint32_t) {
+    if (naiveUsed + 2 + RECORD_LEN > SD_BLOCK_PAYLOAD) {
+      card.writeBlocks(naiveLba++, naiveBlock, 1);
+      naiveUsed = 0;
+    }
+    memcpy(naiveBlock + sizeof(SdBlockHeader) + naiveUsed + 2, rec, RECORD_LEN);
+    naiveUsed += 2 + RECORD_LEN;
+  }, []() {});
+  printf("Naive, same stream, blocks written as they fill: append p50 %u ns, p99.9 %u us, max %u ms\n", naive.p(50),
+         naive.p(99.9) / 1000, naive.max() / 1000000);
+  ok = check(naive.max() >= STALL_MS * 1000000 * 9 / 10, "naive: append waits for the stall") && ok;
+
+  // Overload: more than two buffers per stall
+  SdVolume::format(&card, 0x2345);
+  SdLogger busy;
+  busy.begin(&card, nowUs, wakeWriter);
+  card.injectStalls(STALL_EVERY, STALL_MS);
+  WriterThread writer2(busy);
+  seq = 0;
+  Latency over = produce(1000, 2.0, seq, [&](const uint8_t* rec, uint32_t) { busy.append(rec, RECORD_LEN, ts, nowMs()); },
+                         [&]() { busy.tick(nowMs()); });
+  busy.setFlushMs(0);
+  busy.tick(nowMs());
+  writer2.join();
+  readOk = readBack(&card, seq, records, missing, blocks);
+  printf("Overload, 1000 records/s: append max %u us; %u of %u records dropped and counted, %u missing on the card\n",
+         over.max() / 1000, busy.dropped(), seq, missing);
+  ok = check(readOk && busy.dropped() > 0 && missing == busy.dropped() && records == busy.appended(),
+             "overload: drops counted, the rest reads back") && ok;
+  ok = check(over.p(99.9) < 1000000, "overload: append never waits") && ok;
+
+  // Recovery scan time on the 64 MB image
+  card.injectStalls(0, 0);
+  auto t = Clock::now();
+  SdLogger again;
+  again.begin(&card, nowUs);
+  double scanMs = std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+  printf("Recovery on %u blocks: %.2f ms, resumes at block %u after serial %u\n", CARD_BLOCKS, scanMs,
+         again.headPosition(), again.serial());
+  ok = check(again.serial() == busy.serial() && again.headPosition() == busy.headPosition(), "recovery finds the head") && ok;
+
+  // Power cut: the newest block torn, then logging continues
+  RamBlockDevice small(1 + 200);
+  SdVolume::format(&small, 7);
+  SdLogger cut;
+  cut.begin(&small, nowUs);
+  cut.setFlushMs(0);
+  uint8_t rec[RECORD_LEN];
+  for (seq = 0; seq < 300; seq++) {
+    makeRecord(rec, seq);
+    cut.append(rec, RECORD_LEN, ts, 0);
+    if (seq % 10 == 9) cut.tick(0);
+    while (cut.writePending()) {
+    }
+  }
+  cut.tick(0);
+  while (cut.writePending()) {
+  }
+  uint32_t tornPos = (cut.headPosition() + small.blockCount() - 2) % (small.blockCount() - 1);
+  uint8_t* torn = small.raw(tornPos + 1);
+  for (uint32_t i = 100; i < SD_BLOCK; i++) torn[i] ^= 0x5A;
+  SdLogger resumed;
+  resumed.begin(&small, nowUs);
+  resumed.setFlushMs(0);
+  ok = check(resumed.headPosition() == tornPos, "power cut: resumes at the torn block") && ok;
+  uint32_t tornSerial = resumed.serial();
+  for (uint32_t k = 0; k < 50; k++, seq++) {
+    makeRecord(rec, seq);
+    resumed.append(rec, RECORD_LEN, ts, 0);
+  }
+  resumed.tick(0);
+  while (resumed.writePending()) {
+  }
+  readOk = readBack(&small, seq, records, missing, blocks);
+  ok = check(readOk && missing > 0 && missing <= SD_BLOCK_PAYLOAD / (RECORD_LEN + 2) && records + missing == seq &&
+                 resumed.serial() > tornSerial,
+             "power cut: only the torn block's records are lost") && ok;
+
+  // Ring wrap and rotation: 16-block files, a new day every 1000 records
+  RamBlockDevice ring(1 + 64);
+  SdVolume::format(&ring, 9);
+  SdLogger wrap;
+  wrap.begin(&ring, nowUs);
+  wrap.setFileBlocks(16);
+  for (seq = 0; seq < 5000; seq++) {
+    makeRecord(rec, seq);
+    wrap.append(rec, RECORD_LEN, 1700000000 + (seq / 1000) * 86400, 0);
+    while (wrap.writePending()) {
+    }
+  }
+  wrap.setFlushMs(0);
+  wrap.tick(0);
+  while (wrap.writePending()) {
+  }
+  uint32_t lastFile = 0, lastDay = 0, fileBlocks = 0, rotationErrors = 0;
+  uint32_t readBlocks = sdLogReadAll(&ring, [&](const SdBlockHeader& h, const uint8_t*, uint16_t) {
+    if (h.file != lastFile) {
+      if (lastFile && h.day == lastDay && fileBlocks != 16) rotationErrors++;   // size rotation at 16 blocks
+      lastFile = h.file;
+      lastDay = h.day;
+      fileBlocks = 0;
+    } else if (h.day != lastDay) {
+      rotationErrors++;   // a day change inside a file
+    }
+    fileBlocks = h.fileBlock + 1;
+  });
+  readOk = readBack(&ring, seq, records, missing, blocks);
+  SdLogger wrapped;
+  wrapped.begin(&ring, nowUs);
+  printf("Ring of 64 blocks after %u: %u blocks read back, newest records kept (%u..%u), %u files started,"
+         " rotation errors %u\n", wrap.serial(), readBlocks, seq - records, seq - 1, wrap.filesStarted(), rotationErrors);
+  ok = check(readBlocks == 64 && readOk && rotationErrors == 0 && wrapped.serial() == wrap.serial(),
+             "ring wrap and rotation") && ok;
+
+  printf("Double-buffered SD log: %s\n", ok ? "OK" : "FAILED");
+  remove(path);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+/*
+ * Classic BT sketch receive check and benchmark
+ * Runs esp32_daly_bms.ino itself against the fake BluetoothSerial
+ * (native/BluetoothSerial.h) and FreeRTOS (native/freertos/) on the
+ * virtual clock: replies are assembled in the onData() callback
+ * (spp_frames.h), queued, and end loop()'s idle through a task
+ * notification. The same scripted BMS then answers the receive loop the
+ * sketch had before (poll available() with delay(10) per byte, delay(100)
+ * after every command). Per receive path and reply chunking: read cycle
+ * time from "Reading BMS data..." to "=== BMS Data ===" (p50/max) and the
+ * times the CPU woke up per cycle; checks that every cycle decoded the
+ * scripted pack.
+ *
+ * Build: g++ -std=gnu++17 -O2 -DBMS_NATIVE -I.. -Iinclude -Inative native/bench/spp_frames_bench.cpp native/fake_arduino.cpp -o spp_frames_bench
+ * Run:   ./spp_frames_bench [cycles]
+ */
+
+#include "Arduino.h"
+#include "BluetoothSerial.h"
+#include <algorithm>
+#include <vector>
+
+// The Arduino build generates these prototypes for the sketch
+struct DalyCommand;
+void connectTask();
+void linkTask();
+void pollTask();
+void setConnected(bool up);
+void connectToBMS();
+bool parseMacAddress(String macStr, uint8_t* mac);
+void parseResponse(uint8_t command, const uint8_t* response);
+void sendCommand(DalyCommand& cmd);
+uint8_t calculateChecksum(const DalyCommand& cmd);
+void displayBMSData();
+
+#include "esp32_daly_bms.ino"
+
+static bool check(bool cond, const char* what) {
+  if (!cond) printf("FAIL %s\n", what);
+  return cond;
+}
+
+struct CycleStats {
+  std::vector<uint64_t> us;
+  std::vector<uint32_t> wakes;
+  uint32_t decoded = 0; // cycles whose values all matched the scripted pack
+};
+
+static void scriptPack() {
+  fakebt::Bms& bms = fakebt::bms();
+  bms.reply(0x90, {0x02, 0x14, 0, 0, 0xFF, 0x83, 0x03, 0x88}); // 53.2 V, -12.5 A, 90.4 %
+  bms.reply(0x91, {0x0D, 0x11, 0, 0, 0x0C, 0xF0, 0, 0});       // 3345 / 3312 mV
+  bms.reply(0x92, {65, 0, 63, 0, 0, 0, 0, 0});                 // 25 / 23 C
+  bms.reply(0x94, {0, 0, 0, 0, 0, 0, 0, 0});
+}
+
+static bool packDecoded() {
+  bool ok = fabsf(bmsData.voltage - 53.2f) < 0.01f && fabsf(bmsData.current + 12.5f) < 0.01f &&
+            fabsf(bmsData.soc - 90.4f) < 0.01f && bmsData.max_cell_voltage == 3345 &&
+            bmsData.min_cell_voltage == 3312 && bmsData.max_temp == 25 && bmsData.min_temp == 23 &&
+            !bmsData.protection_status;
+  bmsData = BMSData();
+  return ok;
+}
+
+// The sketch as it is: setup() once, then loop() until enough cycles have printed
+static uint32_t g_loopPasses = 0;
+static uint64_t g_cycleStartUs = 0;
+static uint32_t g_cycleStartPasses = 0;
+static CycleStats* g_stats = nullptr;
+
+static void runSketch(CycleStats& stats, uint32_t cycles) {
+  g_stats = &stats;
+  while (stats.us.size() < cycles) {
+    loop();
+    g_loopPasses++;
+  }
+  g_stats = nullptr;
+}
+
+// The receive path before spp_frames.h, on its own connection
+static BluetoothSerial polledBT;
+
+static bool pollingReadResponse(uint8_t* buffer, int expectedLength, uint32_t& wakes) {
+  unsigned long startTime = millis();
+  int bytesRead = 0;
+
+  while (bytesRead < expectedLength && (millis() - startTime) < 1000) {
+    if (polledBT.available()) {
+      buffer[bytesRead] = polledBT.read();
+      bytesRead++;
+    }
+    delay(10);
+    wakes++;
+  }
+  return bytesRead == expectedLength && buffer[0] == 0xA5;
+}
+
+static void runPolling(CycleStats& stats, uint32_t cycles) {
+  for (uint32_t c = 0; c < cycles; c++) {
+    uint64_t start = fakehw::nowUs();
+    uint32_t wakes = 0;
+    for (uint8_t command : READ_SEQUENCE) {
+      DalyCommand cmd;
+      cmd.command = command;
+      cmd.checksum = calculateChecksum(cmd);
+      polledBT.write((const uint8_t*)&cmd, sizeof(cmd));
+      polledBT.flush();
+      uint8_t response[13];
+      if (pollingReadResponse(response, 13, wakes)) parseResponse(command, response);
+      delay(100);
+      wakes++;
+    }
+    stats.us.push_back(fakehw::nowUs() - start);
+    stats.wakes.push_back(wakes);
+    if (packDecoded()) stats.decoded++;
+    delay(READ_INTERVAL);
+  }
+}
+
+static uint64_t percentile(std::vector<uint64_t> v, double p) {
+  std::sort(v.begin(), v.end());
+  return v[(size_t)(p * (v.size() - 1))];
+}
+
+static bool report(const char* name, const CycleStats& s, uint32_t cycles) {
+  double wakes = 0;
+  for (uint32_t w : s.wakes) wakes += w;
+  printf("%-22s cycle p50 %5.0f ms  max %5.0f ms  wakes/cycle %6.1f  decoded %u/%u\n", name,
+         percentile(s.us, 0.5) / 1000.0, percentile(s.us, 1.0) / 1000.0, wakes / s.wakes.size(), s.decoded,
+         cycles);
+  return check(s.decoded == cycles, name);
+}
+
+int main(int argc, char** argv) {
+  uint32_t cycles = argc > 1 ? (uint32_t)atoi(argv[1]) : 200;
+  bool ok = true;
+  scriptPack();
+  fakehw::setQuiet(true);
+  fakehw::setLineObserver([](const std::string& line, uint64_t firstByteUs, uint64_t) {
+    if (!g_stats) return;
+    if (line == "Reading BMS data...") {
+      g_cycleStartUs = firstByteUs;
+      g_cycleStartPasses = g_loopPasses;
+    } else if (line == "=== BMS Data ===") {
+      g_stats->us.push_back(firstByteUs - g_cycleStartUs);
+      g_stats->wakes.push_back(g_loopPasses - g_cycleStartPasses);
+      if (packDecoded()) g_stats->decoded++;
+    }
+  });
+
+  printf("%u read cycles of %u commands, reply latency %.0f-%.0f ms\n", cycles, READ_STEPS,
+         fakebt::bms().replyMinUs / 1000.0, fakebt::bms().replyMaxUs / 1000.0);
+  setup();
+  for (size_t chunk : {13, 5, 1}) {
+    fakebt::bms().chunk = chunk;
+    char name[40];
+    CycleStats callback, polling;
+    runSketch(callback, cycles);
+    snprintf(name, sizeof(name), "callback, %zu B chunks", chunk);
+    ok &= report(name, callback, cycles);
+
+    uint8_t mac[6] = {0};
+    polledBT.connect(mac);
+    runPolling(polling, cycles);
+    polledBT.disconnect();
+    snprintf(name, sizeof(name), "polling, %zu B chunks", chunk);
+    ok &= report(name, polling, cycles);
+  }
+
+  const SppFrameStats& fs = sppFrames.stats();
+  printf("spp frames %u, skipped bytes %u, resyncs %u, overflows %u\n", fs.frames, fs.skippedBytes, fs.resyncs,
+         fs.overflows);
+  ok &= check(fs.skippedBytes == 0 && fs.resyncs == 0 && fs.overflows == 0, "clean frame assembly");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,466 @@
+/*
+ * SQLite ingest check and benchmark
+ * - checks: a stream of three packs' BatteryState frames mixed into JSON
+ *   text and fed in odd-sized chunks stores every sample once, under its
+ *   pack, with the values and cells intact in both cell layouts; batches
+ *   commit on the row count and on age (tick), a second connection sees
+ *   only committed batches, a reopened file keeps its pack ids
+ * - benchmark: the same stream written by SqliteIngest (prepared
+ *   statements, WAL, batched transactions) and by a naive writer that runs
+ *   one formatted INSERT per sample in autocommit mode with the default
+ *   rollback journal, as a one-line-per-insert script does. A VFS shim
+ *   counts the fsyncs SQLite asks for and can add a delay to each one to
+ *   stand in for an SD card. Per writer: rows/s, fsyncs/s, fsyncs per
+ *   1000 rows and bytes per sample; then what a day of three packs at 1 Hz costs
+ *   in fsyncs.
+ *
+ * Build: g++ -std=gnu++17 -O2 -Iinclude -Inative native/bench/sqlite_ingest_bench.cpp -lsqlite3 -o sqlite_ingest_bench
+ * Run:   ./sqlite_ingest_bench [dir=.] [sync_delay_ms=5]
+ */
+
+#include "cdr_battery.h"
+#include "sqlite_ingest.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static bool check(bool cond, const char* what) {
+  if (!cond) printf("FAIL %s\n", what);
+  return cond;
+}
+
+// --- A VFS that forwards to the default one and counts xSync ---
+
+static sqlite3_vfs* realVfs = nullptr;
+static uint64_t syncCount = 0;
+static uint32_t syncDelayUs = 0;
+
+struct CountingFile {
+  sqlite3_file base;
+  sqlite3_file* real;  // allocated right after this struct
+};
+
+static sqlite3_file* realOf(sqlite3_file* f) { return ((CountingFile*)f)->real; }
+
+static int cfClose(sqlite3_file* f) { return realOf(f)->pMethods->xClose(realOf(f)); }
+static int cfRead(sqlite3_file* f, void* b, int n, sqlite3_int64 o) { return realOf(f)->pMethods->xRead(realOf(f), b, n, o); }
+static int cfWrite(sqlite3_file* f, const void* b, int n, sqlite3_int64 o) {
+  return realOf(f)->pMethods->xWrite(realOf(f), b, n, o);
+}
+static int cfTruncate(sqlite3_file* f, sqlite3_int64 n) { return realOf(f)->pMethods->xTruncate(realOf(f), n); }
+static int cfSync(sqlite3_file* f, int flags) {
+  syncCount++;
+  int rc = realOf(f)->pMethods->xSync(realOf(f), flags);
+  if (syncDelayUs) std::this_thread::sleep_for(std::chrono::microseconds(syncDelayUs));
+  return rc;
+}
+static int cfFileSize(sqlite3_file* f, sqlite3_int64* n) { return realOf(f)->pMethods->xFileSize(realOf(f), n); }
+static int cfLock(sqlite3_file* f, int l) { return realOf(f)->pMethods->xLock(realOf(f), l); }
+static int cfUnlock(sqlite3_file* f, int l) { return realOf(f)->pMethods->xUnlock(realOf(f), l); }
+static int cfCheckLock(sqlite3_file* f, int* r) { return realOf(f)->pMethods->xCheckReservedLock(realOf(f), r); }
+static int cfFileControl(sqlite3_file* f, int op, void* a) { return realOf(f)->pMethods->xFileControl(realOf(f), op, a); }
+static int cfSectorSize(sqlite3_file* f) { return realOf(f)->pMethods->xSectorSize(realOf(f)); }
+static int cfDevice(sqlite3_file* f) { return realOf(f)->pMethods->xDeviceCharacteristics(realOf(f)); }
+static int cfShmMap(sqlite3_file* f, int i, int sz, int ext, void volatile** p) {
+  return realOf(f)->pMethods->xShmMap(realOf(f), i, sz, ext, p);
+}
+static int cfShmLock(sqlite3_file* f, int o, int n, int fl) { return realOf(f)->pMethods->xShmLock(realOf(f), o, n, fl); }
+static void cfShmBarrier(sqlite3_file* f) { realOf(f)->pMethods->xShmBarrier(realOf(f)); }
+static int cfShmUnmap(sqlite3_file* f, int del) { return realOf(f)->pMethods->xShmUnmap(realOf(f), del); }
+static int cfFetch(sqlite3_file* f, sqlite3_int64 o, int n, void** p) { return realOf(f)->pMethods->xFetch(realOf(f), o, n, p); }
+static int cfUnfetch(sqlite3_file* f, sqlite3_int64 o, void* p) { return realOf(f)->pMethods->xUnfetch(realOf(f), o, p); }
+
+static const sqlite3_io_methods countingMethods = {
+  3, cfClose, cfRead, cfWrite, cfTruncate, cfSync, cfFileSize, cfLock, cfUnlock, cfCheckLock, cfFileControl,
+  cfSectorSize, cfDevice, cfShmMap, cfShmLock, cfShmBarrier, cfShmUnmap, cfFetch, cfUnfetch,
+};
+
+static int cvOpen(sqlite3_vfs*, sqlite3_filename name, sqlite3_file* f, int flags, int* outFlags) {
+  CountingFile* cf = (CountingFile*)f;
+  cf->real = (sqlite3_file*)(cf + 1);
+  int rc = realVfs->xOpen(realVfs, name, cf->real, flags, outFlags);
+  cf->base.pMethods = cf->real->pMethods ? &countingMethods : nullptr;
+  return rc;
+}
+
+static sqlite3_vfs countingVfs;
+
+static void installCountingVfs() {
+  realVfs = sqlite3_vfs_find(nullptr);
+  countingVfs = *realVfs;
+  countingVfs.zName = "counting";
+  countingVfs.szOsFile = (int)sizeof(CountingFile) + realVfs->szOsFile;
+  countingVfs.xOpen = cvOpen;
+  sqlite3_vfs_register(&countingVfs, 1);
+}
+
+// --- The stream ---
+
+static const char* PACK_NAMES[] = {"DL-41181201189F", "DL-41181201AA01", "DL-41181201AA02"};
+#define PACKS 3
+
+struct StreamSample {
+  uint8_t pack;
+  IngestSample s;
+};
+
+// Samples of three packs at 1 Hz each, framed as the firmware sends them,
+// every one behind a JSON record line
+static std::vector<uint8_t> buildStream(uint32_t samples, std::vector<StreamSample>& truth) {
+  std::mt19937 rng(7);
+  std::vector<uint8_t> out;
+  const char* text = "BMS_DATA:{\"timestamp\":161057,\"level\":\"compact\",\"soc\":90.4,\"data_found\":true}\n";
+  for (uint32_t i = 0; i < samples; i++) {
+    uint8_t pack = i % PACKS;
+    float cells[16];
+    for (int c = 0; c < 16; c++) cells[c] = (3300 + (int)(rng() % 60)) / 1000.0f;
+    BatteryStateMsg m;
+    m.stamp_sec = 1700000000 + (int32_t)(i / PACKS);
+    m.stamp_nanosec = 250000000;
+    m.frame_id = "bms";
+    m.voltage = (53000 + (int)(rng() % 500)) / 1000.0f;
+    m.current = ((int)(rng() % 40000) - 20000) / 1000.0f;
+    m.charge = 207.9f;
+    m.capacity = 230.0f;
+    m.design_capacity = 230.0f;
+    m.percentage = (800 + (int)(rng() % 200)) / 1000.0f;
+    m.power_supply_status = BATTERY_STATUS_DISCHARGING;
+    m.cell_voltage = cells;
+    m.cells = 16;
+    m.serial_number = PACK_NAMES[pack];
+
+    uint8_t frame[CDR_FRAME_MAX];
+    size_t len = cdrFrame(CDR_TOPIC_BATTERY_STATE, frame,
+                          cdrEncodeBatteryState(m, frame + CDR_FRAME_HEADER, CDR_FRAME_MAX - CDR_FRAME_OVERHEAD));
+    out.insert(out.end(), text, text + strlen(text));
+    out.insert(out.end(), frame, frame + len);
+
+    DecodedBatteryState d;
+    StreamSample t;
+    t.pack = pack;
+    cdrDecodeBatteryState(frame + CDR_FRAME_HEADER, len - CDR_FRAME_OVERHEAD, d);
+    ingestFromBatteryState(d, t.s);
+    truth.push_back(t);
+  }
+  return out;
+}
+
+static int64_t queryInt(sqlite3* db, const char* sql) {
+  sqlite3_stmt* s = nullptr;
+  int64_t v = -1;
+  if (sqlite3_prepare_v2(db, sql, -1, &s, nullptr) == SQLITE_OK && sqlite3_step(s) == SQLITE_ROW) {
+    v = sqlite3_column_int64(s, 0);
+  }
+  sqlite3_finalize(s);
+  return v;
+}
+
+static void removeDb(const std::string& path) {
+  unlink(path.c_str());
+  unlink((path + "-wal").c_str());
+  unlink((path + "-shm").c_str());
+  unlink((path + "-journal").c_str());
+}
+
+static uint64_t dbBytes(const std::string& path) {
+  struct stat st;
+  uint64_t total = 0;
+  if (stat(path.c_str(), &st) == 0) total += st.st_size;
+  if (stat((path + "-wal").c_str(), &st) == 0) total += st.st_size;
+  return total;
+}
+
+// Every stored sample against what was sent, in order
+static bool sameAsStream(sqlite3* db, IngestLayout layout, const std::vector<StreamSample>& truth) {
+  sqlite3_stmt* s = nullptr;
+  sqlite3_stmt* c = nullptr;
+  sqlite3_prepare_v2(db, "SELECT s.id, p.name, t_ms, voltage_mv, current_ma, soc_dpct, cells_mv FROM samples s"
+                         " JOIN packs p ON p.id = s.pack ORDER BY s.id", -1, &s, nullptr);
+  sqlite3_prepare_v2(db, "SELECT mv FROM cells WHERE sample = ? ORDER BY idx", -1, &c, nullptr);
+  size_t i = 0;
+  bool ok = true;
+  while (ok && sqlite3_step(s) == SQLITE_ROW) {
+    if (i >= truth.size()) {
+      ok = false;
+      break;
+    }
+    const IngestSample& t = truth[i].s;
+    ok = strcmp((const char*)sqlite3_column_text(s, 1), PACK_NAMES[truth[i].pack]) == 0 &&
+         sqlite3_column_int64(s, 2) == t.t_ms && sqlite3_column_int(s, 3) == t.voltage_mv &&
+         sqlite3_column_int(s, 4) == t.current_ma && sqlite3_column_int(s, 5) == t.soc_dpct;
+    uint16_t mv[CDR_MAX_CELLS];
+    int cells = 0;
+    if (layout == INGEST_CELLS_BLOB) {
+      const uint8_t* b = (const uint8_t*)sqlite3_column_blob(s, 6);
+      cells = sqlite3_column_bytes(s, 6) / 2;
+      for (int k = 0; k < cells && k < CDR_MAX_CELLS; k++) mv[k] = (uint16_t)(b[2 * k] | b[2 * k + 1] << 8);
+    } else {
+      ok = ok && sqlite3_column_type(s, 6) == SQLITE_NULL;
+      sqlite3_bind_int64(c, 1, sqlite3_column_int64(s, 0));
+      while (sqlite3_step(c) == SQLITE_ROW && cells < CDR_MAX_CELLS) mv[cells++] = (uint16_t)sqlite3_column_int(c, 0);
+      sqlite3_reset(c);
+    }
+    ok = ok && cells == t.cells && memcmp(mv, t.cell_mv, 2 * cells) == 0;
+    i++;
+  }
+  sqlite3_finalize(s);
+  sqlite3_finalize(c);
+  return ok && i == truth.size();
+}
+
+static bool functionalChecks(const std::string& dir) {
+  bool ok = true;
+  std::vector<StreamSample> truth;
+  std::vector<uint8_t> stream = buildStream(300, truth);
+  for (int layout = 0; layout < 2; layout++) {
+    std::string path = dir + "/ingest_check.db";
+    removeDb(path);
+    SqliteIngest db;
+    IngestOptions opt;
+    opt.layout = (IngestLayout)layout;
+    opt.batchRows = 64;
+    if (!check(db.open(path.c_str(), opt), "open the database")) return false;
+    IngestPort port(db, "/dev/ttyUSB0");
+    std::mt19937 rng(layout);
+    for (size_t off = 0; off < stream.size();) {
+      size_t n = std::min(stream.size() - off, (size_t)(1 + rng() % 700));
+      port.feed(&stream[off], n, 0);
+      off += n;
+    }
+    ok = check(port.stored == 300 && port.undecodable == 0 && db.errors == 0, "every framed sample stored") && ok;
+    ok = check(db.commits == 4 && db.pending() == 300 - 4 * 64, "a commit every 64 rows") && ok;
+
+    // A reader on its own connection sees committed batches only
+    sqlite3* reader = nullptr;
+    sqlite3_open(path.c_str(), &reader);
+    ok = check(queryInt(reader, "SELECT count(*) FROM samples") == 4 * 64, "open batch not visible to readers") && ok;
+    ok = check(db.tick(4999) && db.pending() == 300 - 4 * 64, "tick before batchMs keeps the batch") && ok;
+    ok = check(db.tick(5000) && db.pending() == 0 && db.commits == 5, "tick at batchMs commits") && ok;
+    ok = check(queryInt(reader, "SELECT count(*) FROM samples") == 300, "readers see the batch once committed") && ok;
+    ok = check(queryInt(reader, "SELECT count(*) FROM packs") == PACKS, "one row per pack") && ok;
+    ok = check(sameAsStream(reader, (IngestLayout)layout, truth),
+               layout ? "blob layout: values and cells intact" : "table layout: values and cells intact") && ok;
+    sqlite3_close(reader);
+    db.close();
+
+    // Reopen: the packs keep their ids, new samples go under them
+    SqliteIngest again;
+    again.open(path.c_str(), opt);
+    IngestSample s = truth[0].s;
+    again.add(PACK_NAMES[2], s, 0);
+    again.add("/dev/ttyUSB1", s, 0);
+    again.close();
+    sqlite3_open(path.c_str(), &reader);
+    ok = check(queryInt(reader, "SELECT count(*) FROM samples WHERE pack = (SELECT id FROM packs WHERE name = "
+                                "'DL-41181201AA02')") == 101 &&
+                   queryInt(reader, "SELECT count(*) FROM packs") == PACKS + 1,
+               "reopened file keeps its pack ids") && ok;
+    sqlite3_close(reader);
+    removeDb(path);
+  }
+
+  // Time bound: rows 100 ms apart, batchMs 1000 -> a commit every 11 rows
+  {
+    std::string path = dir + "/ingest_check.db";
+    removeDb(path);
+    SqliteIngest db;
+    IngestOptions opt;
+    opt.batchMs = 1000;
+    db.open(path.c_str(), opt);
+    for (uint32_t i = 0; i < 110; i++) db.add("pack", truth[0].s, i * 100);
+    ok = check(db.commits == 10, "a commit every batchMs at low rates") && ok;
+    db.close();
+    removeDb(path);
+  }
+
+  // Frames that are damaged or not BatteryState are not stored
+  {
+    std::string path = dir + "/ingest_check.db";
+    removeDb(path);
+    SqliteIngest db;
+    db.open(path.c_str());
+    IngestPort port(db, "/dev/ttyUSB0");
+    std::vector<uint8_t> bad(stream.begin(), stream.begin() + stream.size() / 300);
+    std::vector<uint8_t> flipped = bad;
+    flipped[flipped.size() - 20] ^= 0x40;
+    port.feed(flipped.data(), flipped.size(), 0);
+    uint8_t frame[CDR_FRAME_MAX] = {};
+    size_t len = cdrFrame(CDR_TOPIC_BATTERY_STATE, frame, 12);  // a valid frame around a short payload
+    port.feed(frame, len, 0);
+    port.feed(bad.data(), bad.size(), 0);
+    ok = check(port.stored == 1 && port.crcErrors() >= 1 && port.undecodable == 1,
+               "bad CRC and undecodable payloads skipped") && ok;
+    db.close();
+    removeDb(path);
+  }
+  return ok;
+}
+
+// --- Naive writer: a formatted INSERT per sample, autocommit ---
+
+struct NaiveWriter {
+  sqlite3* db = nullptr;
+  bool open(const char* path) {
+    if (sqlite3_open(path, &db) != SQLITE_OK) return false;
+    return sqlite3_exec(db,
+                        "CREATE TABLE IF NOT EXISTS samples(id INTEGER PRIMARY KEY, pack TEXT, t_ms INTEGER,"
+                        " voltage_mv INTEGER, current_ma INTEGER, soc_dpct INTEGER, charge_mah INTEGER,"
+                        " capacity_mah INTEGER, status INTEGER, cells_mv BLOB)",
+                        nullptr, nullptr, nullptr) == SQLITE_OK;
+  }
+  bool add(const char* pack, const IngestSample& s) {
+    char sql[512];
+    int n = snprintf(sql, sizeof(sql),
+                     "INSERT INTO samples(pack, t_ms, voltage_mv, current_ma, soc_dpct, charge_mah, capacity_mah,"
+                     " status, cells_mv) VALUES('%s', %lld, %d, %d, %d, %d, %d, %u, X'",
+                     pack, (long long)s.t_ms, s.voltage_mv, s.current_ma, s.soc_dpct, s.charge_mah, s.capacity_mah,
+                     s.status);
+    for (uint8_t i = 0; i < s.cells; i++) n += snprintf(sql + n, sizeof(sql) - n, "%02X%02X", s.cell_mv[i] & 0xFF, s.cell_mv[i] >> 8);
+    snprintf(sql + n, sizeof(sql) - n, "')");
+    return sqlite3_exec(db, sql, nullptr, nullptr, nullptr) == SQLITE_OK;
+  }
+  ~NaiveWriter() { sqlite3_close(db); }
+};
+
+struct Result {
+  uint32_t rows = 0;
+  double seconds = 0;
+  uint64_t syncs = 0;
+  uint64_t bytes = 0;
+  uint32_t commits = 0;
+};
+
+static uint32_t wallMs() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// The serial bytes through the ingest path, fed in 4 KB reads
+static bool runIngest(const std::string& path, const IngestOptions& opt, const std::vector<uint8_t>& stream,
+                      Result& r) {
+  removeDb(path);
+  SqliteIngest db;
+  if (!db.open(path.c_str(), opt)) return false;
+  IngestPort port(db, "/dev/ttyUSB0");
+  uint64_t s0 = syncCount;
+  auto t0 = Clock::now();
+  for (size_t off = 0; off < stream.size(); off += 4096) {
+    port.feed(&stream[off], std::min((size_t)4096, stream.size() - off), wallMs());
+  }
+  db.commit();
+  r.seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+  r.syncs = syncCount - s0;
+  r.rows = port.stored;
+  r.commits = db.commits;
+  db.close();
+  r.bytes = dbBytes(path);
+  removeDb(path);
+  return db.errors == 0;
+}
+
+// The naive writer is handed decoded samples: only its writes are timed
+static bool runNaive(const std::string& path, const std::vector<StreamSample>& samples, uint32_t count, Result& r) {
+  removeDb(path);
+  bool ok;
+  {
+    NaiveWriter w;
+    ok = w.open(path.c_str());
+    uint64_t s0 = syncCount;
+    auto t0 = Clock::now();
+    for (uint32_t i = 0; ok && i < count; i++) ok = w.add(PACK_NAMES[samples[i].pack], samples[i].s);
+    r.seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+    r.syncs = syncCount - s0;
+    r.rows = count;
+    r.commits = count;
+  }
+  r.bytes = dbBytes(path);
+  removeDb(path);
+  return ok;
+}
+
+static void printRow(const char* name, const Result& r) {
+  printf("%-34s %8u %10.0f %10.1f %11.1f %9.1f\n", name, r.rows, r.rows / r.seconds, r.syncs / r.seconds,
+         1000.0 * r.syncs / r.rows, (double)r.bytes / r.rows);
+}
+
+int main(int argc, char** argv) {
+  std::string dir = argc > 1 ? argv[1] : ".";
+  uint32_t delayMs = argc > 2 ? (uint32_t)atoi(argv[2]) : 5;
+  installCountingVfs();
+
+  bool ok = functionalChecks(dir);
+
+  const uint32_t rows = 30000;
+  std::vector<StreamSample> truth;
+  std::vector<uint8_t> stream = buildStream(rows, truth);
+  std::string path = dir + "/ingest_bench.db";
+
+  for (int pass = 0; pass < 2; pass++) {
+    syncDelayUs = pass ? delayMs * 1000 : 0;
+    if (pass && !delayMs) break;
+    if (pass) printf("\nSame, with %u ms added to every fsync (SD card stand-in):\n", delayMs);
+    else printf("\nDatabase in %s, fsync as the disk does it:\n", dir.c_str());
+    printf("%-34s %8s %10s %10s %11s %9s\n", "Writer", "rows", "rows/s", "fsyncs/s", "fsync/1k rw", "B/sample");
+    // The naive writer gets a time budget, not the whole stream
+    uint32_t naiveRows = pass ? 300 : 3000;
+    Result naive;
+    ok = check(runNaive(path, truth, naiveRows, naive), "naive writer") && ok;
+    printRow("naive (autocommit, rollback)", naive);
+
+    struct Run { const char* name; IngestLayout layout; uint32_t batchRows; bool syncFull; };
+    const Run runs[] = {
+      {"ingest, blob, 100 rows", INGEST_CELLS_BLOB, 100, false},
+      {"ingest, cells table, 100 rows", INGEST_CELLS_TABLE, 100, false},
+      {"ingest, blob, 100 rows, sync=FULL", INGEST_CELLS_BLOB, 100, true},
+      {"ingest, blob, 1 row per commit", INGEST_CELLS_BLOB, 1, false},
+    };
+    for (const Run& run : runs) {
+      IngestOptions opt;
+      opt.layout = run.layout;
+      opt.batchRows = run.batchRows;
+      opt.syncFull = run.syncFull;
+      // One commit per row is as slow as naive on a slow disk: a slice will do
+      const std::vector<uint8_t> slice(stream.begin(), stream.begin() + stream.size() / (run.batchRows == 1 ? 10 : 1));
+      Result r;
+      bool stored = runIngest(path, opt, slice, r);
+      printRow(run.name, r);
+      ok = check(stored && r.rows == (run.batchRows == 1 ? rows / 10 : rows), "every sample stored") && ok;
+      if (run.batchRows == 100) {
+        ok = check(r.rows / r.seconds > 5 * naive.rows / naive.seconds, "batched ingest beats naive 5x") && ok;
+        ok = check((double)r.syncs / r.rows < 0.1 * naive.syncs / naive.rows, "a tenth of the fsyncs per row") && ok;
+      }
+    }
+  }
+  syncDelayUs = 0;
+
+  // A site day: three packs at 1 Hz, time-bound batches of 5 s
+  {
+    IngestOptions opt;
+    removeDb(path);
+    SqliteIngest db;
+    db.open(path.c_str(), opt);
+    uint64_t s0 = syncCount;
+    const uint32_t day = 86400 * PACKS;
+    for (uint32_t i = 0; i < day; i++) db.add(PACK_NAMES[truth[i % rows].pack], truth[i % rows].s, i * 1000 / PACKS);
+    db.commit();
+    uint64_t syncs = syncCount - s0;
+    Result naive;
+    runNaive(path + ".naive", truth, 2000, naive);
+    printf("\nA day of 3 packs at 1 Hz (%u samples, 5 s batches): %u commits, %llu fsyncs (naive: ~%.0f)\n", day,
+           db.commits, (unsigned long long)syncs, (double)naive.syncs / naive.rows * day);
+    ok = check(db.errors == 0 && syncs < day / 100, "under one fsync per 100 samples at site rate") && ok;
+    db.close();
+    removeDb(path);
+  }
+
+  printf("\n%s\n", ok ? "All checks passed" : "CHECKS FAILED");
+  return ok ? 0 : 1;
+}
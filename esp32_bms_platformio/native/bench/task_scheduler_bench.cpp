@@ -0,0 +1,227 @@
+/*
+ * Task scheduler check and benchmark on a virtual clock
+ * The "CPU" idles exactly as long as run() asks, like loop() does with
+ * delay(). Checks that periodic tasks on every wheel level fire on their
+ * deadlines with zero lateness, across the 32-bit millis() wrap too, that
+ * random one-shot wakes (up to 4.6 h ahead) fire at the same times as a
+ * reference priority queue, that wake()/suspend() from inside a task win
+ * over the period, and that a task falling behind skips runs and reports
+ * lateness. Then compares wakeups per virtual hour for the firmware's task
+ * set against the old loop() with delay(100), and times run().
+ *
+ * Build: g++ -std=gnu++17 -O2 -Iinclude native/bench/task_scheduler_bench.cpp -o task_scheduler_bench
+ * Run:   ./task_scheduler_bench
+ */
+
+#include "task_scheduler.h"
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+static uint64_t g_us = 0;
+static uint32_t clockMs() { return (uint32_t)(g_us / 1000); }
+static uint32_t clockUs() { return (uint32_t)g_us; }
+
+static std::vector<std::vector<uint32_t>> g_fired(SCHED_MAX_TASKS);
+static uint32_t g_busyMs[SCHED_MAX_TASKS] = {};   // virtual time a task holds the CPU per run
+
+template <int N>
+static void taskFn() {
+  g_fired[N].push_back(clockMs());
+  g_us += (uint64_t)g_busyMs[N] * 1000;
+}
+
+static const TaskFn FNS[SCHED_MAX_TASKS] = {
+  taskFn<0>, taskFn<1>, taskFn<2>, taskFn<3>, taskFn<4>, taskFn<5>, taskFn<6>, taskFn<7>,
+  taskFn<8>, taskFn<9>, taskFn<10>, taskFn<11>, taskFn<12>, taskFn<13>, taskFn<14>, taskFn<15>};
+
+static void reset(uint64_t startMs) {
+  g_us = startMs * 1000;
+  for (auto& f : g_fired) f.clear();
+  for (auto& b : g_busyMs) b = 0;
+}
+
+// Drive the scheduler until virtual `endMs`, idling as asked; returns wakeups
+static uint32_t drive(TaskScheduler& s, uint64_t endMs) {
+  uint32_t wakeups = 0;
+  while (g_us / 1000 < endMs) {
+    uint32_t idle = s.run();
+    wakeups++;
+    g_us += (uint64_t)(idle ? idle : 1) * 1000;
+  }
+  return wakeups;
+}
+
+static bool checkPeriodic(uint64_t startMs, const char* label) {
+  reset(startMs);
+  TaskScheduler s;
+  s.begin(clockMs, clockUs);
+  const uint32_t periods[] = {1, 7, 64, 250, 4095, 4096, 30000, 262145, 3600000};
+  const uint8_t n = sizeof(periods) / sizeof(periods[0]);
+  for (uint8_t i = 0; i < n; i++) s.add("p", FNS[i], periods[i], periods[i]);
+  const uint64_t spanMs = 3ULL * 3600000 + 123;
+  drive(s, startMs + spanMs + 1);
+
+  bool ok = true;
+  for (uint8_t i = 0; i < n; i++) {
+    uint64_t want = spanMs / periods[i];
+    if (g_fired[i].size() < want || g_fired[i].size() > want + 1) {
+      printf("FAIL %s: period %u ran %zu times, want %llu\n", label, periods[i], g_fired[i].size(),
+             (unsigned long long)want);
+      ok = false;
+    }
+    for (size_t k = 0; k < g_fired[i].size(); k++) {
+      uint32_t expect = (uint32_t)(startMs + (uint64_t)periods[i] * (k + 1));
+      if (g_fired[i][k] != expect) {
+        printf("FAIL %s: period %u run %zu at %u, want %u\n", label, periods[i], k, g_fired[i][k], expect);
+        ok = false;
+        break;
+      }
+    }
+    if (s.stats(i).maxLateMs != 0) {
+      printf("FAIL %s: period %u late by %u ms\n", label, periods[i], s.stats(i).maxLateMs);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// One-shot wakes at random delays, re-armed from a reference queue
+static bool checkRandomWakes() {
+  reset(1000);
+  TaskScheduler s;
+  s.begin(clockMs, clockUs);
+  std::mt19937 rng(3);
+  std::multimap<uint32_t, uint8_t> reference;
+  for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) s.add("r", FNS[i], 0);
+
+  auto arm = [&](uint8_t id) {
+    uint32_t bucket = rng() % 4;
+    uint32_t maxDelay = bucket == 0 ? 64 : bucket == 1 ? 5000 : bucket == 2 ? 300000 : 16000000;
+    uint32_t delay = 1 + rng() % maxDelay;
+    s.wake(id, delay);
+    reference.emplace(clockMs() + delay, id);
+  };
+  for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) arm(i);
+
+  uint32_t events = 0;
+  while (events < 20000) {
+    uint32_t idle = s.run();
+    bool rearmed = false;
+    for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) {
+      while (!g_fired[i].empty()) {
+        uint32_t at = g_fired[i].back();
+        g_fired[i].pop_back();
+        auto it = reference.begin();
+        if (it == reference.end() || it->first != at) {
+          printf("FAIL random wakes: task %u fired at %u, reference next %u\n", i, at,
+                 it == reference.end() ? 0 : it->first);
+          return false;
+        }
+        for (auto f = reference.begin(); f != reference.end() && f->first == at; ++f) {
+          if (f->second == i) {
+            reference.erase(f);
+            break;
+          }
+        }
+        events++;
+        arm(i);
+        rearmed = true;
+      }
+    }
+    if (rearmed) continue;   // idle must be asked again after the new wakes
+    uint32_t next = reference.begin()->first;
+    if (idle > next - clockMs()) {
+      printf("FAIL random wakes: idle %u ms overshoots the next deadline in %u ms\n", idle, next - clockMs());
+      return false;
+    }
+    g_us += (uint64_t)(idle ? idle : 1) * 1000;
+  }
+  return true;
+}
+
+static TaskScheduler* g_selfSched = nullptr;
+static uint8_t g_selfId = 0;
+static uint32_t g_selfRuns = 0;
+
+static void selfRearm() {
+  g_selfRuns++;
+  if (g_selfRuns == 3) g_selfSched->wake(g_selfId, 5);       // overrides the 100 ms period once
+  if (g_selfRuns == 6) g_selfSched->suspend(g_selfId);       // and stops for good
+  g_fired[15].push_back(clockMs());
+}
+
+static bool checkControl() {
+  reset(0);
+  TaskScheduler s;
+  s.begin(clockMs, clockUs);
+  g_selfSched = &s;
+  g_selfRuns = 0;
+  g_selfId = s.add("self", selfRearm, 100, 100);
+  uint8_t slow = s.add("slow", FNS[1], 50, 600);
+  uint8_t victim = s.add("victim", FNS[2], 10, 10);
+  g_busyMs[1] = 180;                      // holds the CPU for 3.6 periods of its own
+  drive(s, 1000);
+
+  bool ok = true;
+  const std::vector<uint32_t> wantSelf = {100, 200, 300, 305, 405, 505};
+  if (g_fired[15] != wantSelf) {
+    printf("FAIL control: self-rearming task ran at");
+    for (uint32_t t : g_fired[15]) printf(" %u", t);
+    printf("\n");
+    ok = false;
+  }
+  if (s.stats(slow).skipped == 0 || s.stats(victim).maxLateMs < 170) {
+    printf("FAIL control: slow task skipped %u, victim max lateness %u ms\n", s.stats(slow).skipped,
+           s.stats(victim).maxLateMs);
+    ok = false;
+  }
+  if (s.stats(slow).maxUs != 180000) {
+    printf("FAIL control: runtime %u us, want 180000\n", s.stats(slow).maxUs);
+    ok = false;
+  }
+  return ok;
+}
+
+// The firmware's task set while connected: console, link check, poll, metrics
+static uint32_t firmwareWakeups(uint32_t readMs) {
+  reset(0);
+  TaskScheduler s;
+  s.begin(clockMs, clockUs);
+  s.add("command", FNS[0], 200, 0);
+  s.add("link", FNS[1], 1000, 0);
+  s.add("poll", FNS[2], readMs, 0);
+  s.add("metrics", FNS[3], 60000, 60000);
+  return drive(s, 3600000);
+}
+
+int main() {
+  bool ok = checkPeriodic(0, "periodic") && checkPeriodic(0xFFFFFFFFULL - 5400000, "periodic across wrap") &&
+            checkRandomWakes() && checkControl();
+  printf("Deadlines on all wheel levels, wrap, random wakes, rearm/suspend/skip: %s\n", ok ? "OK" : "FAILED");
+
+  uint32_t wake = firmwareWakeups(5000);
+  printf("Wakeups per virtual hour, read_ms 5000: scheduler %u, old loop() with delay(100) >= 36000\n", wake);
+
+  // run() cost with 16 tasks on mixed periods, idle between deadlines
+  reset(0);
+  TaskScheduler s;
+  s.begin(clockMs, clockUs);
+  for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) s.add("b", FNS[i], 3 + i * 37, i);
+  auto t0 = std::chrono::steady_clock::now();
+  uint32_t calls = 0;
+  while (g_us < 3600000000ULL) {
+    uint32_t idle = s.run();
+    calls++;
+    g_us += (uint64_t)(idle ? idle : 1) * 1000;
+    for (auto& f : g_fired) f.clear();
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+  uint64_t runs = 0;
+  for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) runs += s.stats(i).runs;
+  printf("run(): %.0f ns per call, %.0f ns per task run (%u calls, %llu runs, %u wheel steps)\n", ns / calls,
+         ns / runs, calls, (unsigned long long)runs, s.advanceSteps());
+  return ok ? 0 : 1;
+}
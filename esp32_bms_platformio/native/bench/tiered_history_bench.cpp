@@ -0,0 +1,268 @@
+/*
+ * Tiered history check and benchmark
+ * Simulates the three tiers with the firmware's sizes: 720 raw samples in
+ * RAM, 2 MB of minutes standing in for PSRAM and the 1408 KB flash log
+ * image of the native build (NOR semantics). Feeds months of 5 s samples,
+ * compacting every 10 s like the firmware's history task, and checks that
+ * queries across every tier boundary return each 10-minute, minute and raw
+ * sample exactly once, in order, equal to a reference folded independently.
+ * Also checks a compaction that falls hours behind (folded on the spot), a
+ * reboot (history from flash alone) and the 240-minute internal RAM ring of
+ * boards without PSRAM, then prints the span of each tier against a flat
+ * log of raw samples and times appends, compaction and queries per tier.
+ *
+ * Build: g++ -std=gnu++17 -O2 -DBMS_NATIVE -Iinclude -Inative native/bench/tiered_history_bench.cpp -o tiered_history_bench
+ * Run:   ./tiered_history_bench [days]     (default 150)
+ */
+
+#include "flash_image.h"
+#include "tiered_history.h"
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static const uint32_t T0 = 1699999800;   // on a 10-minute boundary
+static const uint32_t STEP_S = 5;
+static const uint32_t RAM_SAMPLES = 720;
+static const uint32_t PSRAM_MINUTES = 2 * 1024 * 1024 / sizeof(LogSample);
+static const uint32_t FLASH_BYTES = 1408 * 1024;
+
+static double usSince(Clock::time_point t) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - t).count();
+}
+
+static LogSample makeSample(uint32_t i, std::mt19937& rng) {
+  LogSample s;
+  s.timestamp = T0 + i * STEP_S;
+  s.voltage_cv = 5100 + (uint16_t)(i / 7 % 300) + rng() % 5;
+  s.current_da = (int16_t)((int32_t)(rng() % 2001) - 1000);
+  s.soc_pm = (uint16_t)(i / 20 % 1001);
+  s.max_cell_mv = 3300 + rng() % 250;
+  s.min_cell_mv = 3000 + rng() % 250;
+  s.max_temp = (int8_t)(20 + rng() % 20);
+  s.min_temp = (int8_t)(5 + rng() % 15);
+  return s;
+}
+
+// Minutes folded the plain way, to check the compaction against
+static std::vector<LogSample> referenceFold(const std::vector<LogSample>& raw, uint32_t bucketS) {
+  std::vector<LogSample> out;
+  for (size_t i = 0; i < raw.size();) {
+    uint32_t minute = raw[i].timestamp - raw[i].timestamp % bucketS;
+    double v = 0, c = 0, soc = 0;
+    LogSample m = raw[i];
+    size_t n = 0;
+    for (; i < raw.size() && raw[i].timestamp - raw[i].timestamp % bucketS == minute; i++, n++) {
+      const LogSample& s = raw[i];
+      v += s.voltage_cv;
+      c += s.current_da;
+      soc += s.soc_pm;
+      m.max_cell_mv = std::max(m.max_cell_mv, s.max_cell_mv);
+      m.min_cell_mv = std::min(m.min_cell_mv, s.min_cell_mv);
+      m.max_temp = std::max(m.max_temp, s.max_temp);
+      m.min_temp = std::min(m.min_temp, s.min_temp);
+    }
+    m.timestamp = minute;
+    m.voltage_cv = (uint16_t)lround(v / n);
+    m.current_da = (int16_t)lround(c / n);
+    m.soc_pm = (uint16_t)lround(soc / n);
+    out.push_back(m);
+  }
+  return out;
+}
+
+// Points on a `step` grid from T0 in [lo, hi]
+static uint32_t pointsIn(uint32_t lo, uint32_t hi, uint32_t step) {
+  if (lo > hi) return 0;
+  uint32_t first = (lo - T0 + step - 1) / step, last = (hi - T0) / step;
+  return last >= first ? last - first + 1 : 0;
+}
+
+struct Check {
+  const std::vector<LogSample>* raw;
+  const std::vector<LogSample>* minutes;
+  const std::vector<LogSample>* tens;
+  bool ok = true;
+
+  // Every sample in [from, to] exactly once: 10-minute samples from the
+  // oldest up to psramFrom, minutes up to rawFrom, raw samples from there on
+  void query(TieredHistory& h, uint32_t from, uint32_t to, const char* what) {
+    uint32_t rawFrom = h.rawFrom(), psramFrom = h.psramFrom(), oldest = h.oldestTimestamp();
+    uint32_t lastTs = 0, got = 0, bad = 0;
+    bool first = true;
+    h.readRange(from, to, [&](const LogSample& s) {
+      const LogSample* want = nullptr;
+      uint32_t age = s.timestamp - T0;
+      if (s.timestamp >= rawFrom) want = age % STEP_S == 0 ? &(*raw)[age / STEP_S] : nullptr;
+      else if (s.timestamp >= psramFrom) want = age % HISTORY_MINUTE_S == 0 ? &(*minutes)[age / HISTORY_MINUTE_S] : nullptr;
+      else want = age % HISTORY_FLASH_BUCKET_S == 0 ? &(*tens)[age / HISTORY_FLASH_BUCKET_S] : nullptr;
+      if (!want || memcmp(want, &s, sizeof(s)) != 0 || (!first && s.timestamp <= lastTs)) bad++;
+      first = false;
+      lastTs = s.timestamp;
+      got++;
+    });
+    uint32_t newest = raw->back().timestamp;
+    uint32_t expect = pointsIn(std::max(from, oldest), std::min(to, psramFrom - 1), HISTORY_FLASH_BUCKET_S) +
+                      pointsIn(std::max(from, psramFrom), std::min(to, rawFrom - 1), HISTORY_MINUTE_S) +
+                      pointsIn(std::max(from, rawFrom), std::min(to, newest), STEP_S);
+    if (bad || got != expect) {
+      printf("FAIL %s: %u samples for %u expected, %u wrong or out of order\n", what, got, expect, bad);
+      ok = false;
+    }
+  }
+};
+
+static void feed(TieredHistory& h, const std::vector<LogSample>& raw, uint32_t compactEvery, double* appendUs,
+                 double* compactUs, double* maxCompactUs) {
+  double a = 0, c = 0, maxC = 0;
+  for (size_t i = 0; i < raw.size(); i++) {
+    auto t = Clock::now();
+    h.append(raw[i]);
+    a += usSince(t);
+    if ((i + 1) % compactEvery == 0) {
+      t = Clock::now();
+      h.compact();
+      double us = usSince(t);
+      c += us;
+      maxC = std::max(maxC, us);
+    }
+  }
+  while (h.compact()) {
+  }
+  if (appendUs) *appendUs = a;
+  if (compactUs) *compactUs = c;
+  if (maxCompactUs) *maxCompactUs = maxC;
+}
+
+static double queryUs(TieredHistory& h, uint32_t from, uint32_t to, uint32_t reps, uint32_t& samples,
+                      uint32_t* perTier) {
+  uint64_t sink = 0;
+  auto t = Clock::now();
+  for (uint32_t r = 0; r < reps; r++) {
+    samples = h.readRange(from, to, [&](const LogSample& s) { sink += s.voltage_cv; }, perTier);
+  }
+  double us = usSince(t) / reps;
+  if (sink == 1) printf(" ");
+  return us;
+}
+
+int main(int argc, char** argv) {
+  uint32_t days = argc > 1 ? strtoul(argv[1], nullptr, 10) : 150;
+  std::mt19937 rng(5);
+  std::vector<LogSample> raw(days * 86400 / STEP_S);
+  for (uint32_t i = 0; i < raw.size(); i++) raw[i] = makeSample(i, rng);
+  std::vector<LogSample> minutes = referenceFold(raw, HISTORY_MINUTE_S);
+  std::vector<LogSample> tens = referenceFold(minutes, HISTORY_FLASH_BUCKET_S);
+  Check check{&raw, &minutes, &tens};
+
+  // Steady state: compaction every 10 s of samples
+  std::vector<LogSample> ramBuf(RAM_SAMPLES), psramBuf(PSRAM_MINUTES);
+  RamFlashStorage storage(FLASH_BYTES);
+  FlashLog flash;
+  flash.begin(&storage);
+  TieredHistory h;
+  h.begin(ramBuf.data(), RAM_SAMPLES, psramBuf.data(), PSRAM_MINUTES, &flash);
+  double appendUs, compactUs, maxCompactUs;
+  feed(h, raw, 10 / STEP_S, &appendUs, &compactUs, &maxCompactUs);
+
+  uint32_t newest = raw.back().timestamp, rawFrom = h.rawFrom(), psramFrom = h.psramFrom();
+  check.query(h, T0, newest, "everything");
+  check.query(h, newest - 3600, newest, "last hour");
+  check.query(h, rawFrom - 600, rawFrom + 600, "PSRAM / RAM boundary");
+  check.query(h, psramFrom - 3600, psramFrom + 3600, "flash / PSRAM boundary");
+  check.query(h, rawFrom - 7, rawFrom - 7, "single minute-aligned miss");
+  check.query(h, newest + 1, newest + 1000, "past the end");
+  for (int i = 0; i < 200; i++) {
+    uint32_t a = T0 + rng() % (newest - T0), b = T0 + rng() % (newest - T0);
+    check.query(h, std::min(a, b), std::max(a, b), "random range");
+  }
+  if (h.forcedFolds() != 0 || h.flashErrors() != 0) {
+    printf("FAIL steady state: %u forced folds, %u flash errors\n", h.forcedFolds(), h.flashErrors());
+    check.ok = false;
+  }
+
+  // Reboot: flash alone serves everything that was flushed
+  FlashLog rebooted;
+  rebooted.begin(&storage);
+  TieredHistory cold;
+  std::vector<LogSample> ramBuf2(RAM_SAMPLES), psramBuf2(PSRAM_MINUTES);
+  cold.begin(ramBuf2.data(), RAM_SAMPLES, psramBuf2.data(), PSRAM_MINUTES, &rebooted);
+  uint32_t coldGot = 0, coldBad = 0;
+  cold.readRange(T0, newest, [&](const LogSample& s) {
+    if (memcmp(&tens[(s.timestamp - T0) / HISTORY_FLASH_BUCKET_S], &s, sizeof(s)) != 0) coldBad++;
+    coldGot++;
+  });
+  uint32_t coldSpan = rebooted.newestTimestamp() - rebooted.oldestTimestamp();
+  if (coldBad || coldGot != rebooted.sampleCount() || coldSpan != (coldGot - 1) * HISTORY_FLASH_BUCKET_S) {
+    printf("FAIL reboot: %u of %u flash minutes read back, %u wrong\n", coldGot, rebooted.sampleCount(), coldBad);
+    check.ok = false;
+  }
+
+  // Compaction starved for two hours at a time: what the RAM ring wraps
+  // onto is folded on the spot, nothing is lost
+  std::vector<LogSample> shortRaw(raw.begin(), raw.begin() + 2 * 86400 / STEP_S);
+  std::vector<LogSample> ramBuf3(RAM_SAMPLES), psramBuf3(PSRAM_MINUTES);
+  RamFlashStorage storage3(FLASH_BYTES);
+  FlashLog flash3;
+  flash3.begin(&storage3);
+  TieredHistory starved;
+  starved.begin(ramBuf3.data(), RAM_SAMPLES, psramBuf3.data(), PSRAM_MINUTES, &flash3);
+  feed(starved, shortRaw, 7200 / STEP_S, nullptr, nullptr, nullptr);
+  Check shortCheck{&shortRaw, &minutes, &tens};
+  shortCheck.query(starved, T0, shortRaw.back().timestamp, "starved compaction");
+  if (starved.forcedFolds() == 0) {
+    printf("FAIL starved compaction: no forced folds\n");
+    shortCheck.ok = false;
+  }
+
+  // No PSRAM: the firmware keeps 240 minutes in internal RAM instead
+  RamFlashStorage storage4(FLASH_BYTES);
+  FlashLog flash4;
+  flash4.begin(&storage4);
+  TieredHistory noPsram;
+  std::vector<LogSample> ramBuf4(RAM_SAMPLES), minuteBuf4(240);
+  noPsram.begin(ramBuf4.data(), RAM_SAMPLES, minuteBuf4.data(), minuteBuf4.size(), &flash4);
+  feed(noPsram, shortRaw, 10 / STEP_S, nullptr, nullptr, nullptr);
+  shortCheck.query(noPsram, T0, shortRaw.back().timestamp, "no PSRAM");
+
+  bool ok = check.ok && shortCheck.ok;
+  printf("Tier boundaries, random ranges, reboot, starved compaction, no PSRAM: %s\n", ok ? "OK" : "FAILED");
+
+  printf("\n%u days of 5 s samples (%zu samples, %zu minutes)\n", days, raw.size(), minutes.size());
+  printf("%-6s %10s %10s %12s %16s\n", "tier", "bytes", "entries", "resolution", "span");
+  const char* res[HISTORY_TIERS] = {"5 s", "1 min", "10 min"};
+  const uint32_t resS[HISTORY_TIERS] = {STEP_S, HISTORY_MINUTE_S, HISTORY_FLASH_BUCKET_S};
+  for (uint8_t t = 0; t < HISTORY_TIERS; t++) {
+    uint32_t cap = h.capacity((HistoryTier)t);
+    double span = (double)cap * resS[t] / 86400.0;
+    printf("%-6s %10zu %10u %12s %11.2f days\n", HISTORY_TIER_NAMES[t], cap * sizeof(LogSample), cap, res[t], span);
+  }
+  printf("Flat flash log of raw 5 s samples in the same partition: %.1f days\n",
+         flash.capacity() * STEP_S / 86400.0);
+  printf("Held now: ram %u, psram %u, flash %u; history reaches back %.1f days\n", h.size(HISTORY_TIER_RAM),
+         h.size(HISTORY_TIER_PSRAM), h.size(HISTORY_TIER_FLASH), (newest - h.oldestTimestamp()) / 86400.0);
+
+  printf("\nappend(): %.0f ns per sample; compact() every 10 s: %.2f us per sample, longest call %.1f us\n",
+         appendUs * 1000 / raw.size(), compactUs / raw.size(), maxCompactUs);
+  struct Query {
+    const char* what;
+    uint32_t from, to, reps;
+  } queries[] = {
+      {"last hour", newest - 3600, newest, 2000},
+      {"one day, 30 days ago", newest - 30 * 86400, newest - 29 * 86400, 200},
+      {"one day, 120 days ago", newest - 120 * 86400, newest - 119 * 86400, 200},
+      {"everything", T0, newest, 5},
+  };
+  printf("%-24s %8s %8s %8s %8s %10s %9s\n", "query", "samples", "ram", "psram", "flash", "us", "ns/sample");
+  for (const Query& q : queries) {
+    if (q.from < T0) continue;
+    uint32_t n = 0, perTier[HISTORY_TIERS] = {0, 0, 0};
+    double us = queryUs(h, q.from, q.to, q.reps, n, perTier);
+    printf("%-24s %8u %8u %8u %8u %10.1f %9.1f\n", q.what, n, perTier[HISTORY_TIER_RAM], perTier[HISTORY_TIER_PSRAM],
+           perTier[HISTORY_TIER_FLASH], us, n ? us * 1000 / n : 0);
+  }
+  return ok ? 0 : 1;
+}
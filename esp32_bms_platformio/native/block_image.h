@@ -0,0 +1,84 @@
+/*
+ * Host stand-ins for the SD card of the raw log: a RAM image for the native
+ * firmware run and a file-backed image for benchmarks. The file image can
+ * stall writes for a given time, like a card busy with wear levelling or
+ * erasing, and counts what it was asked to do.
+ */
+
+#ifndef BLOCK_IMAGE_H
+#define BLOCK_IMAGE_H
+
+#include "sd_logger.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+class RamBlockDevice : public BlockDevice {
+public:
+  explicit RamBlockDevice(uint32_t blocks) : image_((size_t)blocks * SD_BLOCK, 0) {}
+  uint32_t blockCount() const override { return image_.size() / SD_BLOCK; }
+  bool readBlocks(uint32_t lba, void* dst, uint32_t count) override {
+    if ((uint64_t)(lba + count) * SD_BLOCK > image_.size()) return false;
+    memcpy(dst, &image_[(size_t)lba * SD_BLOCK], (size_t)count * SD_BLOCK);
+    return true;
+  }
+  bool writeBlocks(uint32_t lba, const void* src, uint32_t count) override {
+    if ((uint64_t)(lba + count) * SD_BLOCK > image_.size()) return false;
+    memcpy(&image_[(size_t)lba * SD_BLOCK], src, (size_t)count * SD_BLOCK);
+    return true;
+  }
+  uint8_t* raw(uint32_t lba) { return &image_[(size_t)lba * SD_BLOCK]; }
+
+private:
+  std::vector<uint8_t> image_;
+};
+
+// A sparse file reads back as zeros, which no block header matches
+class FileBlockDevice : public BlockDevice {
+public:
+  bool open(const char* path, uint32_t blocks) {
+    fp_ = fopen(path, "r+b");
+    if (!fp_) fp_ = fopen(path, "w+b");
+    if (!fp_) return false;
+    blocks_ = blocks;
+    return ftruncate(fileno(fp_), (off_t)blocks * SD_BLOCK) == 0;
+  }
+  ~FileBlockDevice() { if (fp_) fclose(fp_); }
+
+  // Every `every`-th write sleeps `ms` before it completes (0 = never)
+  void injectStalls(uint32_t every, uint32_t ms) {
+    stallEvery_ = every;
+    stallMs_ = ms;
+  }
+
+  uint32_t blockCount() const override { return blocks_; }
+  bool readBlocks(uint32_t lba, void* dst, uint32_t count) override {
+    return lba + count <= blocks_ &&
+           pread(fileno(fp_), dst, (size_t)count * SD_BLOCK, (off_t)lba * SD_BLOCK) == (ssize_t)count * SD_BLOCK;
+  }
+  bool writeBlocks(uint32_t lba, const void* src, uint32_t count) override {
+    if (lba + count > blocks_) return false;
+    uint32_t n = ++writes_;
+    if (stallEvery_ && n % stallEvery_ == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(stallMs_));
+      stalls_++;
+    }
+    return pwrite(fileno(fp_), src, (size_t)count * SD_BLOCK, (off_t)lba * SD_BLOCK) == (ssize_t)count * SD_BLOCK;
+  }
+
+  uint32_t writes() const { return writes_; }
+  uint32_t stalls() const { return stalls_; }
+
+private:
+  FILE* fp_ = nullptr;
+  uint32_t blocks_ = 0;
+  uint32_t stallEvery_ = 0;
+  uint32_t stallMs_ = 0;
+  std::atomic<uint32_t> writes_{0};
+  std::atomic<uint32_t> stalls_{0};
+};
+
+#endif // BLOCK_IMAGE_H
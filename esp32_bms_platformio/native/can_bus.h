@@ -0,0 +1,106 @@
+/*
+ * Host stand-ins for the CAN controller: an in-memory bus for the native
+ * firmware run, on the virtual clock, and SocketCAN for benchmarks and
+ * bench rigs (a vcan interface, or a USB adapter on can0). Where no vcan
+ * module can be loaded, pair() joins two drivers through a socketpair that
+ * carries the same struct can_frame, so the code above the driver is the
+ * same either way.
+ */
+
+#ifndef CAN_BUS_H
+#define CAN_BUS_H
+
+#include "can_export.h"
+#include <deque>
+#include <functional>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// What the firmware sends goes to onSend with the virtual time; the runner
+// queues what the inverter says
+class MemoryCanBus : public CanDriver {
+public:
+  bool send(const CanFrame& f) override {
+    if (onSend) onSend(f);
+    return true;
+  }
+  bool receive(CanFrame& f, uint32_t) override {
+    if (inbox.empty()) return false;
+    f = inbox.front();
+    inbox.pop_front();
+    return true;
+  }
+  std::function<void(const CanFrame&)> onSend;
+  std::deque<CanFrame> inbox;
+};
+
+class SocketCanDriver : public CanDriver {
+public:
+  ~SocketCanDriver() override { close(); }
+
+  // A raw socket on a SocketCAN interface ("vcan0", "can0")
+  bool open(const char* ifname) {
+    close();
+    fd_ = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd_ < 0) return false;
+    ifreq ifr = {};
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    sockaddr_can addr = {};
+    addr.can_family = AF_CAN;
+    if (ioctl(fd_, SIOCGIFINDEX, &ifr) != 0) return fail();
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd_, (sockaddr*)&addr, sizeof(addr)) != 0) return fail();
+    return true;
+  }
+
+  // Two drivers wired to each other, for hosts without vcan
+  static bool pair(SocketCanDriver& a, SocketCanDriver& b) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0) return false;
+    a.close();
+    b.close();
+    a.fd_ = fds[0];
+    b.fd_ = fds[1];
+    return true;
+  }
+
+  bool send(const CanFrame& f) override {
+    can_frame cf = {};
+    cf.can_id = f.id;
+    cf.can_dlc = f.len;
+    memcpy(cf.data, f.data, f.len);
+    return ::send(fd_, &cf, sizeof(cf), MSG_DONTWAIT) == (ssize_t)sizeof(cf);
+  }
+
+  bool receive(CanFrame& f, uint32_t waitUs) override {
+    pollfd p = {fd_, POLLIN, 0};
+    timespec ts = {(time_t)(waitUs / 1000000), (long)(waitUs % 1000000) * 1000};
+    if (ppoll(&p, 1, &ts, nullptr) <= 0) return false;
+    can_frame cf;
+    if (::recv(fd_, &cf, sizeof(cf), MSG_DONTWAIT) != (ssize_t)sizeof(cf)) return false;
+    f.id = cf.can_id & CAN_SFF_MASK;
+    f.len = cf.can_dlc > 8 ? 8 : cf.can_dlc;
+    memcpy(f.data, cf.data, f.len);
+    return true;
+  }
+
+  void close() {
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+  }
+
+private:
+  bool fail() {
+    close();
+    return false;
+  }
+
+  int fd_ = -1;
+};
+
+#endif // CAN_BUS_H
@@ -0,0 +1,173 @@
+/*
+ * Host-side reader for the framed CDR messages in include/cdr_battery.h
+ * Walks the IDL layouts of sensor_msgs/BatteryState and
+ * std_msgs/Float32MultiArray field by field (independently of the encoder)
+ * and pulls frames out of a serial byte stream that also carries text.
+ */
+
+#ifndef CDR_DECODE_H
+#define CDR_DECODE_H
+
+#include "cdr_battery.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+class CdrReader {
+public:
+  CdrReader(const uint8_t* data, size_t len) : p_(data), len_(len) {}
+
+  // Encapsulation header: CDR_LE, options zero
+  bool begin() {
+    ok_ = len_ >= 4 && p_[0] == (CDR_ENCAPSULATION_LE >> 8) && p_[1] == (CDR_ENCAPSULATION_LE & 0xFF);
+    pos_ = 4;
+    return ok_;
+  }
+
+  uint8_t u8() {
+    const uint8_t* b = take(1, 1);
+    return b ? b[0] : 0;
+  }
+  bool boolean() { return u8() != 0; }
+  uint32_t u32() {
+    const uint8_t* b = take(4, 4);
+    return b ? (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24 : 0;
+  }
+  int32_t i32() { return (int32_t)u32(); }
+  float f32() {
+    uint32_t bits = u32();
+    float v;
+    memcpy(&v, &bits, 4);
+    return v;
+  }
+  std::string str() {
+    uint32_t n = u32();
+    const uint8_t* b = n ? take(n, 1) : nullptr;
+    if (!b || b[n - 1] != 0) {
+      ok_ = false;
+      return "";
+    }
+    return std::string((const char*)b, n - 1);
+  }
+  std::vector<float> f32seq() {
+    uint32_t n = u32();
+    std::vector<float> v;
+    if (n > len_) ok_ = false;
+    for (uint32_t i = 0; ok_ && i < n; i++) v.push_back(f32());
+    return v;
+  }
+
+  bool ok() const { return ok_; }
+  bool atEnd() const { return ok_ && pos_ == len_; }
+
+private:
+  const uint8_t* take(size_t n, size_t alignment) {
+    if (!ok_) return nullptr;
+    pos_ += (alignment - (pos_ - 4) % alignment) % alignment;
+    if (pos_ + n > len_) {
+      ok_ = false;
+      return nullptr;
+    }
+    const uint8_t* b = p_ + pos_;
+    pos_ += n;
+    return b;
+  }
+
+  const uint8_t* p_;
+  size_t len_;
+  size_t pos_ = 0;
+  bool ok_ = false;
+};
+
+struct DecodedBatteryState {
+  int32_t stamp_sec = 0;
+  uint32_t stamp_nanosec = 0;
+  std::string frame_id;
+  float voltage = 0, temperature = 0, current = 0, charge = 0, capacity = 0, design_capacity = 0, percentage = 0;
+  uint8_t power_supply_status = 0, power_supply_health = 0, power_supply_technology = 0;
+  bool present = false;
+  std::vector<float> cell_voltage, cell_temperature;
+  std::string location, serial_number;
+};
+
+inline bool cdrDecodeBatteryState(const uint8_t* data, size_t len, DecodedBatteryState& m) {
+  CdrReader r(data, len);
+  if (!r.begin()) return false;
+  m.stamp_sec = r.i32();
+  m.stamp_nanosec = r.u32();
+  m.frame_id = r.str();
+  m.voltage = r.f32();
+  m.temperature = r.f32();
+  m.current = r.f32();
+  m.charge = r.f32();
+  m.capacity = r.f32();
+  m.design_capacity = r.f32();
+  m.percentage = r.f32();
+  m.power_supply_status = r.u8();
+  m.power_supply_health = r.u8();
+  m.power_supply_technology = r.u8();
+  m.present = r.boolean();
+  m.cell_voltage = r.f32seq();
+  m.cell_temperature = r.f32seq();
+  m.location = r.str();
+  m.serial_number = r.str();
+  return r.atEnd();
+}
+
+// Float32MultiArray; only the single-dimension layout the firmware sends
+inline bool cdrDecodeCellVoltages(const uint8_t* data, size_t len, std::string& label, std::vector<float>& volts) {
+  CdrReader r(data, len);
+  if (!r.begin() || r.u32() != 1) return false;
+  label = r.str();
+  uint32_t size = r.u32();
+  uint32_t stride = r.u32();
+  uint32_t offset = r.u32();
+  volts = r.f32seq();
+  return r.atEnd() && size == volts.size() && stride == size && offset == 0;
+}
+
+// Pulls AA 55 frames out of a byte stream; everything else (text lines,
+// false syncs, frames with a bad CRC) is skipped
+class CdrFrameScanner {
+public:
+  typedef std::function<void(uint8_t topic, const uint8_t* payload, size_t len)> Handler;
+
+  explicit CdrFrameScanner(Handler handler) : handler_(handler) {}
+
+  void feed(const uint8_t* data, size_t len) {
+    buf_.insert(buf_.end(), data, data + len);
+    size_t i = 0;
+    while (i + CDR_FRAME_HEADER <= buf_.size()) {
+      if (buf_[i] != CDR_SYNC0 || buf_[i + 1] != CDR_SYNC1) {
+        i++;
+        continue;
+      }
+      size_t payload = buf_[i + 3] | (size_t)buf_[i + 4] << 8;
+      if (payload + CDR_FRAME_OVERHEAD > CDR_FRAME_MAX) {
+        i++;
+        continue;
+      }
+      if (i + payload + CDR_FRAME_OVERHEAD > buf_.size()) break; // wait for the rest
+      const uint8_t* f = &buf_[i];
+      uint16_t crc = cdrFrameCrc(f + 2, payload + 3);
+      if (f[CDR_FRAME_HEADER + payload] != (crc & 0xFF) || f[CDR_FRAME_HEADER + payload + 1] != (crc >> 8)) {
+        crcErrors++;
+        i++;
+        continue;
+      }
+      frames++;
+      handler_(f[2], f + CDR_FRAME_HEADER, payload);
+      i += payload + CDR_FRAME_OVERHEAD;
+    }
+    buf_.erase(buf_.begin(), buf_.begin() + i);
+  }
+
+  uint32_t frames = 0;
+  uint32_t crcErrors = 0;  // sync pattern found but CRC wrong (text or a damaged frame)
+
+private:
+  Handler handler_;
+  std::vector<uint8_t> buf_;
+};
+
+#endif // CDR_DECODE_H
@@ -0,0 +1,78 @@
+/*
+ * Host stand-in for the NVS config namespace: key=value lines in the file
+ * named by BMS_CONFIG_FILE. Without it the values live in memory only, so
+ * separate runs do not leak settings into each other.
+ * Every put rewrites the file through a temporary and rename().
+ */
+
+#ifndef CONFIG_FILE_H
+#define CONFIG_FILE_H
+
+#include "config_store.h"
+#include <map>
+#include <string>
+
+class FileConfigBackend : public ConfigBackend {
+public:
+  bool begin() override {
+    const char* p = getenv("BMS_CONFIG_FILE");
+    path_ = p ? p : "";
+    values_.clear();
+    if (path_.empty()) return true;
+
+    FILE* f = fopen(path_.c_str(), "r");
+    if (!f) return true; // first run
+    char line[CONFIG_KEY_MAX + CONFIG_VALUE_MAX + 4];
+    while (fgets(line, sizeof(line), f)) {
+      line[strcspn(line, "\r\n")] = '\0';
+      char* eq = strchr(line, '=');
+      if (!eq) continue;
+      *eq = '\0';
+      values_[line] = eq + 1;
+    }
+    fclose(f);
+    return true;
+  }
+
+  bool getU32(const char* key, uint32_t& value) override {
+    auto it = values_.find(key);
+    if (it == values_.end()) return false;
+    char* end;
+    value = (uint32_t)strtoul(it->second.c_str(), &end, 10);
+    return *end == '\0' && !it->second.empty();
+  }
+  bool getStr(const char* key, char* out, size_t len) override {
+    auto it = values_.find(key);
+    if (it == values_.end() || it->second.size() >= len) return false;
+    memcpy(out, it->second.c_str(), it->second.size() + 1);
+    return true;
+  }
+  bool putU32(const char* key, uint32_t value) override {
+    values_[key] = std::to_string(value);
+    return save();
+  }
+  bool putStr(const char* key, const char* value) override {
+    values_[key] = value;
+    return save();
+  }
+  bool clear() override {
+    values_.clear();
+    return save();
+  }
+
+private:
+  bool save() {
+    if (path_.empty()) return true;
+    std::string tmp = path_ + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) return false;
+    for (auto& kv : values_) fprintf(f, "%s=%s\n", kv.first.c_str(), kv.second.c_str());
+    bool ok = fclose(f) == 0;
+    return ok && rename(tmp.c_str(), path_.c_str()) == 0;
+  }
+
+  std::string path_;
+  std::map<std::string, std::string> values_;
+};
+
+#endif // CONFIG_FILE_H
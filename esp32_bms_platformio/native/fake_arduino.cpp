@@ -0,0 +1,231 @@
+/*
+ * Virtual clock, event pump and Serial for the native build
+ * Nothing here sleeps: delay() moves the clock and fires whatever the fake
+ * radio scheduled in between, so hours of firmware time run in seconds
+ */
+
+#include "Arduino.h"
+#include <stdarg.h>
+#include <chrono>
+#include <map>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+namespace {
+  uint64_t g_nowUs = 0;
+  std::multimap<uint64_t, std::function<void()>> g_events;
+  std::multimap<uint64_t, std::string> g_pendingInput;
+  std::string g_input;
+  bool g_quiet = false;
+  std::function<void(const std::string&, uint64_t, uint64_t)> g_lineObserver;
+  std::function<void(const uint8_t*, size_t)> g_byteObserver;
+  std::string g_line;
+  uint64_t g_lineStartUs = 0;
+  const size_t UART_TX_FIFO = 128; // bytes the ESP32 UART buffers before write() blocks
+  unsigned long g_serialThrottle = 0;
+  std::map<uint64_t, uint64_t> g_serialStalls; // start -> length (us), not overlapping
+
+  // Wall time by which the UART has drained for drainUs after fromUs
+  // (nothing drains while the host is stalled)
+  uint64_t drainedBy(uint64_t fromUs, uint64_t drainUs) {
+    uint64_t t = fromUs;
+    for (auto& st : g_serialStalls) {
+      uint64_t end = st.first + st.second;
+      if (end <= t) continue;
+      if (st.first > t) {
+        if (t + drainUs <= st.first) return t + drainUs;
+        drainUs -= st.first - t;
+      }
+      t = end;
+    }
+    return t + drainUs;
+  }
+
+  // Draining time between two wall times
+  uint64_t drainTimeUs(uint64_t fromUs, uint64_t toUs) {
+    if (toUs <= fromUs) return 0;
+    uint64_t us = toUs - fromUs;
+    for (auto& st : g_serialStalls) {
+      uint64_t a = st.first > fromUs ? st.first : fromUs;
+      uint64_t b = st.first + st.second < toUs ? st.first + st.second : toUs;
+      if (b > a) us -= b - a;
+    }
+    return us;
+  }
+
+  void deliverInput() {
+    while (!g_pendingInput.empty() && g_pendingInput.begin()->first <= g_nowUs) {
+      g_input += g_pendingInput.begin()->second;
+      g_pendingInput.erase(g_pendingInput.begin());
+    }
+  }
+}
+
+namespace fakehw {
+  uint64_t nowUs() { return g_nowUs; }
+
+  void runDue() {
+    // Events may schedule further events, so re-check the head each time
+    while (!g_events.empty() && g_events.begin()->first <= g_nowUs) {
+      auto fn = g_events.begin()->second;
+      g_events.erase(g_events.begin());
+      fn();
+    }
+    deliverInput();
+  }
+
+  void advanceUs(uint64_t us) {
+    uint64_t target = g_nowUs + us;
+    while (!g_events.empty() && g_events.begin()->first <= target) {
+      if (g_events.begin()->first > g_nowUs) g_nowUs = g_events.begin()->first;
+      runDue();
+    }
+    // Events can themselves block (e.g. Serial output from a callback)
+    if (target > g_nowUs) g_nowUs = target;
+    runDue();
+  }
+
+  bool advanceUntil(uint64_t atUs, const std::function<bool()>& done) {
+    runDue();
+    while (!done()) {
+      if (g_events.empty() || g_events.begin()->first > atUs) {
+        if (atUs > g_nowUs) g_nowUs = atUs;
+        runDue();
+        return done();
+      }
+      if (g_events.begin()->first > g_nowUs) g_nowUs = g_events.begin()->first;
+      runDue();
+    }
+    return true;
+  }
+
+  void schedule(uint64_t atUs, std::function<void()> fn) {
+    g_events.emplace(atUs, fn);
+  }
+
+  void serialInput(uint64_t atUs, const std::string& text) {
+    g_pendingInput.emplace(atUs, text);
+  }
+
+  void setQuiet(bool quiet) { g_quiet = quiet; }
+
+  void setLineObserver(std::function<void(const std::string&, uint64_t, uint64_t)> observer) {
+    g_lineObserver = observer;
+  }
+
+  void setByteObserver(std::function<void(const uint8_t*, size_t)> observer) { g_byteObserver = observer; }
+
+  void throttleSerial(unsigned long baud) { g_serialThrottle = baud; }
+
+  void stallSerial(uint64_t atUs, uint64_t forUs) { g_serialStalls[atUs] = forUs; }
+}
+
+unsigned long millis() { return (unsigned long)(g_nowUs / 1000); }
+unsigned long micros() { return (unsigned long)g_nowUs; }
+void delay(unsigned long ms) { fakehw::advanceUs((uint64_t)ms * 1000); }
+void delayMicroseconds(unsigned int us) { fakehw::advanceUs(us); }
+void yield() { fakehw::runDue(); }
+
+uint32_t EspClass::getCycleCount() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t HardwareSerial::write(const uint8_t* data, size_t len) {
+  written_ += len;
+  if (!g_quiet) fwrite(data, 1, len, stdout);
+  if (g_byteObserver) g_byteObserver(data, len);
+
+  // Model the UART: bytes drain at baud/10 per second (nothing drains while
+  // the host is stalled) and write() blocks once more than the FIFO plus
+  // TX buffer is queued
+  double byteUs = this->byteUs();
+  uint64_t startUs = txDoneUs_ > g_nowUs ? txDoneUs_ : g_nowUs;
+  uint64_t writeUs = g_nowUs;
+
+  if (g_lineObserver) {
+    for (size_t i = 0; i < len; i++) {
+      if (g_line.empty()) g_lineStartUs = writeUs;
+      if (data[i] == '\n') {
+        uint64_t onWireUs = drainedBy(startUs, (uint64_t)((i + 1) * byteUs));
+        g_lineObserver(g_line, g_lineStartUs, onWireUs);
+        g_line.clear();
+      } else if (data[i] != '\r') {
+        g_line += (char)data[i];
+      }
+    }
+  }
+
+  txDoneUs_ = drainedBy(startUs, (uint64_t)(len * byteUs));
+  uint64_t pendingUs = drainTimeUs(g_nowUs, txDoneUs_);
+  uint64_t fifoUs = (uint64_t)(txCapacity() * byteUs);
+  if (pendingUs > fifoUs) fakehw::advanceUs(drainedBy(g_nowUs, pendingUs - fifoUs) - g_nowUs);
+  return len;
+}
+
+double HardwareSerial::byteUs() const {
+  unsigned long baud = g_serialThrottle && g_serialThrottle < baud_ ? g_serialThrottle : baud_;
+  return 10.0e6 / baud;
+}
+
+size_t HardwareSerial::txCapacity() const {
+  return txBuffer_ > UART_TX_FIFO ? txBuffer_ : UART_TX_FIFO;
+}
+
+int HardwareSerial::availableForWrite() {
+  size_t queued = (size_t)(drainTimeUs(g_nowUs, txDoneUs_) / byteUs());
+  return queued >= txCapacity() ? 0 : (int)(txCapacity() - queued);
+}
+
+size_t HardwareSerial::write(uint8_t b) { return write(&b, 1); }
+size_t HardwareSerial::print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+size_t HardwareSerial::print(const String& s) { return write((const uint8_t*)s.c_str(), s.length()); }
+size_t HardwareSerial::print(char c) { return write((uint8_t)c); }
+size_t HardwareSerial::print(int v, int base) { return print(String(v, (unsigned char)base)); }
+size_t HardwareSerial::print(unsigned int v, int base) { return print(String(v, (unsigned char)base)); }
+size_t HardwareSerial::print(long v, int base) { return print(String(v, (unsigned char)base)); }
+size_t HardwareSerial::print(unsigned long v, int base) { return print(String(v, (unsigned char)base)); }
+size_t HardwareSerial::print(double v, int decimals) { return print(String(v, (unsigned char)decimals)); }
+
+size_t HardwareSerial::printf(const char* fmt, ...) {
+  char stackBuf[256];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(stackBuf, sizeof(stackBuf), fmt, args);
+  va_end(args);
+  if (n < 0) return 0;
+  if ((size_t)n < sizeof(stackBuf)) return write((const uint8_t*)stackBuf, n);
+
+  std::string big(n + 1, '\0');
+  va_start(args, fmt);
+  vsnprintf(&big[0], big.size(), fmt, args);
+  va_end(args);
+  return write((const uint8_t*)big.data(), n);
+}
+
+int HardwareSerial::available() {
+  deliverInput();
+  return (int)g_input.size();
+}
+
+int HardwareSerial::read() {
+  if (!available()) return -1;
+  int c = (uint8_t)g_input[0];
+  g_input.erase(0, 1);
+  return c;
+}
+
+int HardwareSerial::peek() {
+  return available() ? (uint8_t)g_input[0] : -1;
+}
+
+String HardwareSerial::readStringUntil(char terminator) {
+  deliverInput();
+  size_t pos = g_input.find(terminator);
+  // Like Stream, wait out the 1 s timeout for a terminator that never comes
+  if (pos == std::string::npos) fakehw::advanceUs(1000000);
+  std::string line = g_input.substr(0, pos);
+  g_input.erase(0, pos == std::string::npos ? std::string::npos : pos + 1);
+  return String(line);
+}
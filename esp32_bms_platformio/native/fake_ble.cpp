@@ -0,0 +1,771 @@
+/*
+ * Implementation of the fake ESP32 BLE client and server stack and the
+ * scripted air
+ */
+
+#include "fake_ble.h"
+#include <algorithm>
+#include <deque>
+#include <random>
+
+namespace {
+  std::deque<fakeble::Peripheral> g_peripherals;
+  std::map<std::string, uint64_t> g_downUntilUs;
+  fakeble::LinkProfile g_profile;
+  fakeble::Stats g_stats;
+  std::mt19937 g_rng(1);
+  std::map<uint32_t, uint64_t> g_frameStamps;
+
+  BLEClient* g_client = nullptr;     // client currently holding the link
+  fakeble::Peripheral* g_peer = nullptr;
+  uint32_t g_linkId = 0;             // bumps on every connect so stale events are ignored
+  uint64_t g_lastDropUs = 0;
+  bool g_awaitingReconnect = false;
+
+  BLEScan g_scan;
+  bool g_initialized = false;
+
+  // Server side: phones connected to us, each with its notification queue
+  struct CentralLink {
+    fakeble::Central profile;
+    fakeble::CentralStats stats;
+    uint64_t anchorUs = 0;           // connection events at anchor + k * interval
+    uint64_t eventUs = 0;            // latest event holding queued notifications
+    uint8_t eventCount = 0;          // notifications queued for it
+    std::deque<uint64_t> inflight;   // delivery times of queued notifications
+  };
+  BLEServer* g_server = nullptr;
+  gatts_event_handler g_gattsHandler = nullptr;
+  BLEAdvertising g_advertising;
+  bool g_serverAdvertising = false;
+  std::map<uint16_t, CentralLink> g_centrals;
+  uint16_t g_nextConnId = 1;
+
+  std::string lower(std::string s) {
+    for (auto& c : s) c = tolower((unsigned char)c);
+    return s;
+  }
+
+  void scheduleLinkDrops() {
+    for (uint32_t atMs : g_profile.linkDropAtMs) {
+      fakehw::schedule((uint64_t)atMs * 1000, []() {
+        if (!g_client || !g_client->isConnected()) return;
+        if (g_peer) g_downUntilUs[lower(g_peer->address)] = fakehw::nowUs() + (uint64_t)g_profile.downAfterDropMs * 1000;
+        g_stats.linkDrops++;
+        g_lastDropUs = fakehw::nowUs();
+        g_awaitingReconnect = true;
+        g_client->linkLost();
+      });
+    }
+  }
+}
+
+// ---------------------------------------------------------------- BLEUUID
+
+BLEUUID::BLEUUID(const std::string& uuid) {
+  std::string u = lower(uuid);
+  if (u.size() == 4) u = "0000" + u + "-0000-1000-8000-00805f9b34fb";
+  else if (u.size() == 8) u = u + "-0000-1000-8000-00805f9b34fb";
+  full_ = u;
+}
+
+BLEUUID::BLEUUID(uint16_t uuid16) {
+  char buf[8];
+  snprintf(buf, sizeof(buf), "%04x", uuid16);
+  *this = BLEUUID(std::string(buf));
+}
+
+BLEAddress::BLEAddress(const std::string& address) {
+  unsigned b[6];
+  if (sscanf(address.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) == 6) {
+    for (int i = 0; i < 6; i++) native_[i] = (uint8_t)b[i];
+  }
+}
+
+std::string BLEAddress::toString() const {
+  char buf[18];
+  snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x", native_[0], native_[1], native_[2], native_[3],
+           native_[4], native_[5]);
+  return buf;
+}
+
+// ---------------------------------------------------------------- BLEScan
+
+BLEScanResults BLEScan::start(uint32_t duration, bool is_continue) {
+  fakehw::advanceUs(scheduleAdvertisements(duration, is_continue));
+  return results_;
+}
+
+bool BLEScan::start(uint32_t duration, void (*scanCompleteCB)(BLEScanResults), bool is_continue) {
+  uint64_t windowUs = scheduleAdvertisements(duration, is_continue);
+  fakehw::schedule(fakehw::nowUs() + windowUs, [this, scanCompleteCB]() {
+    if (scanCompleteCB) scanCompleteCB(results_);
+  });
+  return true;
+}
+
+// Queue this window's advertisements on the virtual clock; returns the window
+uint64_t BLEScan::scheduleAdvertisements(uint32_t duration, bool is_continue) {
+  if (!is_continue) results_ = BLEScanResults();
+  g_stats.scans++;
+
+  uint64_t startUs = fakehw::nowUs();
+  uint64_t windowUs = (uint64_t)duration * 1000000ULL;
+  std::vector<fakeble::Peripheral*> ads = fakeble::advertisers();
+
+  for (size_t i = 0; i < ads.size(); i++) {
+    fakeble::Peripheral p = *ads[i];
+    // Spread first sightings across the first part of the window
+    uint64_t firstUs = startUs + ((i * 7919ULL) % 2000ULL + 20) * 1000ULL;
+    uint64_t repeatUs = wantDuplicates_ ? g_profile.advertIntervalMs * 1000ULL : windowUs + 1;
+    for (uint64_t at = firstUs; at < startUs + windowUs; at += repeatUs) {
+      fakehw::schedule(at, [this, p]() {
+        BLEAdvertisedDevice dev;
+        dev.name_ = p.name;
+        dev.address_ = BLEAddress(p.address);
+        dev.rssi_ = p.rssi + (int)(g_rng() % 7) - 3;
+        dev.hasService_ = !p.serviceUUID.empty();
+        if (dev.hasService_) dev.service_ = BLEUUID(p.serviceUUID);
+        // Flags, then the name and a 16-bit service as far as they fit 31 bytes
+        uint8_t* ad = dev.payload_;
+        size_t n = 0;
+        ad[n++] = 2;
+        ad[n++] = 0x01;
+        ad[n++] = 0x06;
+        size_t nameLen = std::min(p.name.size(), sizeof(dev.payload_) - n - 2);
+        if (nameLen) {
+          ad[n++] = (uint8_t)(nameLen + 1);
+          ad[n++] = nameLen == p.name.size() ? 0x09 : 0x08;
+          memcpy(ad + n, p.name.data(), nameLen);
+          n += nameLen;
+        }
+        if (p.serviceUUID.size() == 4 && n + 4 <= sizeof(dev.payload_)) {
+          uint16_t u = (uint16_t)strtoul(p.serviceUUID.c_str(), nullptr, 16);
+          ad[n++] = 3;
+          ad[n++] = 0x03;
+          ad[n++] = (uint8_t)u;
+          ad[n++] = (uint8_t)(u >> 8);
+        }
+        dev.payloadLength_ = n;
+        g_stats.advertisements++;
+        if (callbacks_) callbacks_->onResult(dev);
+        // As the library: every sighting is kept (on the heap) only without duplicates
+        if (!wantDuplicates_) {
+          results_.devices_.push_back(dev);
+          g_stats.scanResultsPeak = std::max<uint32_t>(g_stats.scanResultsPeak, (uint32_t)results_.devices_.size());
+        }
+      });
+    }
+  }
+
+  return windowUs;
+}
+
+// ---------------------------------------------------------------- GATT objects
+
+void BLERemoteDescriptor::writeValue(uint8_t* data, size_t length, bool response) {
+  (void)response;
+  // Only the CCCD matters to the fake: bit 0 enables notifications
+  if (uuid_.equals(BLEUUID((uint16_t)0x2902)) && length >= 1) {
+    owner_->setNotificationsEnabled(data[0] & 0x01);
+  }
+}
+
+BLERemoteCharacteristic::BLERemoteCharacteristic(BLERemoteService* service, const BLEUUID& uuid,
+                                                 bool canRead, bool canWrite, bool canNotify)
+  : service_(service), uuid_(uuid), canRead_(canRead), canWrite_(canWrite), canNotify_(canNotify) {
+  if (canNotify_) cccd_ = new BLERemoteDescriptor(this, BLEUUID((uint16_t)0x2902));
+}
+
+BLERemoteCharacteristic::~BLERemoteCharacteristic() {
+  delete cccd_;
+}
+
+void BLERemoteCharacteristic::registerForNotify(notify_callback callback, bool notifications,
+                                                bool descriptorRequiresRegistration) {
+  callback_ = callback;
+  // The Arduino-ESP32 stack writes the CCCD itself when registering
+  if (descriptorRequiresRegistration) notifyEnabled_ = notifications && callback != nullptr;
+}
+
+BLERemoteDescriptor* BLERemoteCharacteristic::getDescriptor(BLEUUID uuid) {
+  if (cccd_ && cccd_->getUUID().equals(uuid)) return cccd_;
+  return nullptr;
+}
+
+void BLERemoteCharacteristic::writeValue(uint8_t* data, size_t length, bool response) {
+  (void)response;
+  if (!service_->getClient()->isConnected()) return;
+  fakeble::onWrite(this, data, length);
+}
+
+void BLERemoteCharacteristic::deliver(const uint8_t* data, size_t length) {
+  if (!notifyEnabled_ || !callback_) return;
+  std::vector<uint8_t> copy(data, data + length);
+  g_stats.notifications++;
+  g_stats.notifyBytes += length;
+  callback_(this, copy.data(), copy.size(), true);
+}
+
+BLERemoteService::~BLERemoteService() {
+  for (auto& c : characteristics_) delete c.second;
+}
+
+BLERemoteCharacteristic* BLERemoteService::getCharacteristic(BLEUUID uuid) {
+  auto it = characteristics_.find(uuid.toString());
+  return it == characteristics_.end() ? nullptr : it->second;
+}
+
+// ---------------------------------------------------------------- BLEClient
+
+BLEClient::~BLEClient() {
+  if (connected_) disconnect();
+  fakeble::detachClient(this);
+  clearServices();
+}
+
+bool BLEClient::connect(BLEAddress address) {
+  fakeble::Stats& st = fakeble::mutableStats();
+  st.connectAttempts++;
+  if (connected_) disconnect();
+
+  // connect() blocks the caller for the whole GAP/GATT setup
+  delay(fakeble::linkProfile().connectLatencyMs);
+
+  fakeble::Peripheral* p = fakeble::findPeripheral(address.toString());
+  if (!p || !fakeble::peripheralUp(*p) || fakeble::chance(fakeble::linkProfile().connectFailRate)) {
+    st.connectFailures++;
+    return false;
+  }
+
+  clearServices();
+  services_[BLEUUID((uint16_t)0x1800).toString()] = new BLERemoteService(this, BLEUUID((uint16_t)0x1800));
+  BLERemoteService* gap = services_[BLEUUID((uint16_t)0x1800).toString()];
+  gap->addCharacteristic(new BLERemoteCharacteristic(gap, BLEUUID((uint16_t)0x2a00), true, false, false));
+
+  if (p->dalyGatt) {
+    BLERemoteService* daly = new BLERemoteService(this, BLEUUID("fff0"));
+    daly->addCharacteristic(new BLERemoteCharacteristic(daly, BLEUUID("fff1"), true, false, true));
+    daly->addCharacteristic(new BLERemoteCharacteristic(daly, BLEUUID("fff2"), false, true, false));
+    services_[daly->getUUID().toString()] = daly;
+  }
+
+  connected_ = true;
+  peer_ = address;
+  rssi_ = p->rssi;
+  fakeble::attachClient(this, p);
+  if (callbacks_) callbacks_->onConnect(this);
+  return true;
+}
+
+void BLEClient::disconnect() {
+  if (!connected_) return;
+  connected_ = false;
+  fakeble::detachClient(this);
+  if (callbacks_) callbacks_->onDisconnect(this);
+}
+
+void BLEClient::linkLost() {
+  disconnect();
+}
+
+BLERemoteService* BLEClient::getService(BLEUUID uuid) {
+  auto it = services_.find(uuid.toString());
+  return it == services_.end() ? nullptr : it->second;
+}
+
+void BLEClient::clearServices() {
+  for (auto& s : services_) delete s.second;
+  services_.clear();
+}
+
+// ---------------------------------------------------------------- server side
+
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t attr_handle,
+                                      uint16_t value_len, uint8_t* value, bool need_confirm) {
+  (void)gatts_if;
+  (void)need_confirm;
+  auto it = g_centrals.find(conn_id);
+  BLECharacteristic* c = g_server ? g_server->findHandle(attr_handle) : nullptr;
+  if (it == g_centrals.end() || !it->second.stats.connected || !c) return ESP_FAIL;
+  CentralLink& link = it->second;
+  uint64_t now = fakehw::nowUs();
+  while (!link.inflight.empty() && link.inflight.front() <= now) link.inflight.pop_front();
+  if (link.inflight.size() >= link.profile.queueDepth) {
+    link.stats.refused++;
+    g_stats.serverRefused++;
+    return ESP_FAIL;
+  }
+
+  // Next connection event with room for one more notification
+  uint64_t intervalUs = (uint64_t)link.profile.connIntervalMs * 1000;
+  if (link.eventUs <= now) {
+    link.eventUs = link.anchorUs + ((now - link.anchorUs) / intervalUs + 1) * intervalUs;
+    link.eventCount = 0;
+  }
+  if (link.eventCount >= link.profile.perEvent) {
+    link.eventUs += intervalUs;
+    link.eventCount = 0;
+  }
+  link.eventCount++;
+  link.inflight.push_back(link.eventUs);
+  g_stats.serverNotifications++;
+
+  size_t len = std::min<size_t>(value_len, link.profile.mtu - 3);
+  std::vector<uint8_t> data(value, value + len);
+  BLEUUID uuid = c->getUUID();
+  uint64_t anchor = link.anchorUs;
+  fakehw::schedule(link.eventUs, [conn_id, anchor, uuid, data]() {
+    auto it = g_centrals.find(conn_id);
+    if (it == g_centrals.end() || !it->second.stats.connected || it->second.anchorUs != anchor) return;
+    CentralLink& l = it->second;
+    l.stats.notifications++;
+    l.stats.bytes += data.size();
+    if (l.profile.onNotify) l.profile.onNotify(conn_id, uuid, data.data(), data.size());
+  });
+  return ESP_OK;
+}
+
+BLECharacteristic::~BLECharacteristic() {
+  for (BLEDescriptor* d : descriptors_) delete d;
+}
+
+void BLECharacteristic::notify(bool is_notification) {
+  BLEServer* server = service_->getServer();
+  for (uint16_t connId : fakeble::connectedCentrals()) {
+    esp_ble_gatts_send_indicate((esp_gatt_if_t)server->getGattsIf(), connId, handle_, (uint16_t)value_.size(),
+                                (uint8_t*)value_.data(), !is_notification);
+  }
+}
+
+void BLECharacteristic::written(uint16_t connId, const uint8_t* data, size_t length) {
+  value_.assign((const char*)data, length);
+  if (!callbacks_) return;
+  esp_ble_gatts_cb_param_t param;
+  param.write.conn_id = connId;
+  param.write.handle = handle_;
+  param.write.len = (uint16_t)length;
+  param.write.value = (uint8_t*)value_.data();
+  callbacks_->onWrite(this);
+  callbacks_->onWrite(this, &param);
+}
+
+BLEDescriptor* BLECharacteristic::getDescriptorByUUID(BLEUUID uuid) {
+  for (BLEDescriptor* d : descriptors_) {
+    if (d->getUUID().equals(uuid)) return d;
+  }
+  return nullptr;
+}
+
+std::string BLECharacteristic::read(uint16_t connId) {
+  if (callbacks_) {
+    esp_ble_gatts_cb_param_t param;
+    param.read.conn_id = connId;
+    param.read.handle = handle_;
+    callbacks_->onRead(this);
+    callbacks_->onRead(this, &param);
+  }
+  return value_;
+}
+
+BLEService::~BLEService() {
+  for (BLECharacteristic* c : characteristics_) delete c;
+}
+
+BLECharacteristic* BLEService::createCharacteristic(BLEUUID uuid, uint32_t properties) {
+  BLECharacteristic* c = new BLECharacteristic(this, uuid, properties, server_->nextHandle());
+  characteristics_.push_back(c);
+  return c;
+}
+
+BLECharacteristic* BLEService::getCharacteristic(BLEUUID uuid) {
+  for (BLECharacteristic* c : characteristics_) {
+    if (c->getUUID().equals(uuid)) return c;
+  }
+  return nullptr;
+}
+
+BLECharacteristic* BLEService::getByHandle(uint16_t handle) {
+  for (BLECharacteristic* c : characteristics_) {
+    if (c->getHandle() == handle) return c;
+  }
+  return nullptr;
+}
+
+BLEServer::~BLEServer() {
+  for (BLEService* s : services_) delete s;
+  fakeble::setServer(nullptr);
+}
+
+BLEService* BLEServer::createService(BLEUUID uuid) {
+  BLEService* s = new BLEService(this, uuid);
+  services_.push_back(s);
+  return s;
+}
+
+BLEService* BLEServer::getServiceByUUID(BLEUUID uuid) {
+  for (BLEService* s : services_) {
+    if (s->getUUID().equals(uuid)) return s;
+  }
+  return nullptr;
+}
+
+BLECharacteristic* BLEServer::findCharacteristic(const BLEUUID& uuid) {
+  for (BLEService* s : services_) {
+    BLECharacteristic* c = s->started() ? s->getCharacteristic(uuid) : nullptr;
+    if (c) return c;
+  }
+  return nullptr;
+}
+
+BLECharacteristic* BLEServer::findHandle(uint16_t handle) {
+  for (BLEService* s : services_) {
+    BLECharacteristic* c = s->started() ? s->getByHandle(handle) : nullptr;
+    if (c) return c;
+  }
+  return nullptr;
+}
+
+uint32_t BLEServer::getConnectedCount() { return (uint32_t)fakeble::connectedCentrals().size(); }
+void BLEServer::startAdvertising() { fakeble::setServerAdvertising(true); }
+void BLEServer::disconnect(uint16_t connId) { fakeble::disconnectCentral(connId); }
+
+void BLEAdvertising::start() { fakeble::setServerAdvertising(true); }
+void BLEAdvertising::stop() { fakeble::setServerAdvertising(false); }
+
+// ---------------------------------------------------------------- BLEDevice
+
+void BLEDevice::init(const std::string& deviceName) {
+  (void)deviceName;
+  g_initialized = true;
+}
+
+BLEScan* BLEDevice::getScan() { return &g_scan; }
+BLEClient* BLEDevice::createClient() { return new BLEClient(); }
+BLEAdvertising* BLEDevice::getAdvertising() { return &g_advertising; }
+void BLEDevice::startAdvertising() { fakeble::setServerAdvertising(true); }
+bool BLEDevice::getInitialized() { return g_initialized; }
+void BLEDevice::setCustomGattsHandler(gatts_event_handler handler) { g_gattsHandler = handler; }
+
+BLEServer* BLEDevice::createServer() {
+  BLEServer* server = new BLEServer();
+  fakeble::setServer(server);
+  return server;
+}
+
+// ---------------------------------------------------------------- air
+
+namespace fakeble {
+
+  void reset(uint32_t seed) {
+    g_peripherals.clear();
+    g_downUntilUs.clear();
+    g_profile = LinkProfile();
+    g_stats = Stats();
+    g_rng.seed(seed);
+    g_frameStamps.clear();
+    g_client = nullptr;
+    g_peer = nullptr;
+    g_awaitingReconnect = false;
+    g_centrals.clear();
+    g_serverAdvertising = false;
+  }
+
+  Peripheral& addPeripheral(const Peripheral& p) {
+    g_peripherals.push_back(p);
+    return g_peripherals.back();
+  }
+
+  void addNoiseAdvertisers(int count) {
+    static const char* names[] = {"", "Galaxy S21", "iPhone", "Mi Band 6", "JBL Flip 5", "Tile", "LE-Bose", ""};
+    for (int i = 0; i < count; i++) {
+      Peripheral p;
+      char addr[18];
+      snprintf(addr, sizeof(addr), "a4:c1:38:%02x:%02x:%02x", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+      p.address = addr;
+      p.name = names[i % 8];
+      p.rssi = -50 - (int)(g_rng() % 45);
+      g_peripherals.push_back(p);
+    }
+  }
+
+  void setLinkProfile(const LinkProfile& profile) {
+    g_profile = profile;
+    scheduleLinkDrops();
+  }
+
+  const LinkProfile& linkProfile() { return g_profile; }
+  const Stats& stats() { return g_stats; }
+  Stats& mutableStats() { return g_stats; }
+
+  bool chance(double p) {
+    if (p <= 0.0) return false;
+    return std::uniform_real_distribution<double>(0.0, 1.0)(g_rng) < p;
+  }
+
+  Peripheral* findPeripheral(const std::string& address) {
+    std::string a = lower(address);
+    for (auto& p : g_peripherals) {
+      if (lower(p.address) == a) return &p;
+    }
+    return nullptr;
+  }
+
+  bool peripheralUp(const Peripheral& p) {
+    auto it = g_downUntilUs.find(lower(p.address));
+    return it == g_downUntilUs.end() || fakehw::nowUs() >= it->second;
+  }
+
+  std::vector<Peripheral*> advertisers() {
+    std::vector<Peripheral*> out;
+    for (auto& p : g_peripherals) {
+      // A Daly BMS stops advertising while a central holds the link
+      if (g_client && g_client->isConnected() && &p == g_peer) continue;
+      if (peripheralUp(p)) out.push_back(&p);
+    }
+    return out;
+  }
+
+  void attachClient(BLEClient* client, Peripheral* p) {
+    g_client = client;
+    g_peer = p;
+    g_linkId++;
+    g_stats.connects++;
+    if (g_awaitingReconnect) {
+      g_stats.reconnectMs.push_back((uint32_t)((fakehw::nowUs() - g_lastDropUs) / 1000));
+      g_awaitingReconnect = false;
+    }
+  }
+
+  void detachClient(BLEClient* client) {
+    if (g_client != client) return;
+    g_client = nullptr;
+    g_peer = nullptr;
+  }
+
+  void onWrite(BLERemoteCharacteristic* c, const uint8_t* data, size_t length) {
+    g_stats.writes++;
+    if (!g_peer || !g_peer->responder) return;
+    if (chance(g_profile.dropRate)) {
+      g_stats.repliesDropped++;
+      return;
+    }
+
+    std::vector<uint8_t> reply = g_peer->responder(data, length);
+    if (reply.empty()) return;
+    if (chance(g_profile.corruptRate)) {
+      reply[g_rng() % reply.size()] ^= (uint8_t)(1 + g_rng() % 255);
+      g_stats.corruptReplies++;
+    }
+
+    BLEClient* client = c->getRemoteService()->getClient();
+    size_t chunk = g_profile.notifyChunk ? g_profile.notifyChunk : reply.size();
+    uint64_t latencyMs = g_profile.responseLatencyMs;
+    if (g_profile.responseJitterMs) latencyMs += g_rng() % (g_profile.responseJitterMs + 1);
+    if (chance(g_profile.slowRate)) {
+      latencyMs += g_profile.slowExtraMs;
+      g_stats.slowReplies++;
+    }
+    uint64_t at = fakehw::nowUs() + latencyMs * 1000;
+    uint32_t link = g_linkId;
+
+    for (size_t off = 0; off < reply.size(); off += chunk) {
+      std::vector<uint8_t> part(reply.begin() + off, reply.begin() + std::min(reply.size(), off + chunk));
+      fakehw::schedule(at, [client, link, part]() {
+        // Drop fragments addressed to a link that has since gone away
+        if (link != g_linkId || g_client != client || !client->isConnected()) return;
+        BLERemoteService* svc = client->getService("fff0");
+        BLERemoteCharacteristic* rx = svc ? svc->getCharacteristic("fff1") : nullptr;
+        if (rx) rx->deliver(part.data(), part.size());
+      });
+      at += (uint64_t)g_profile.chunkGapMs * 1000;
+    }
+  }
+
+  void setServer(BLEServer* server) {
+    g_server = server;
+    if (server) return;
+    g_centrals.clear();
+    g_serverAdvertising = false;
+  }
+
+  void setServerAdvertising(bool on) { g_serverAdvertising = on && g_server; }
+  bool serverAdvertising() { return g_serverAdvertising; }
+
+  std::vector<uint16_t> connectedCentrals() {
+    std::vector<uint16_t> out;
+    for (auto& c : g_centrals) {
+      if (c.second.stats.connected) out.push_back(c.first);
+    }
+    return out;
+  }
+
+  int connectCentral(const Central& central) {
+    size_t links = connectedCentrals().size() + (g_client && g_client->isConnected() ? 1 : 0);
+    if (!g_server || !g_serverAdvertising || links >= g_profile.maxLinks) {
+      g_stats.centralRejected++;
+      return -1;
+    }
+    uint16_t connId = g_nextConnId++;
+    CentralLink& link = g_centrals[connId];
+    link.profile = central;
+    link.stats.connected = true;
+    link.anchorUs = fakehw::nowUs();
+    link.eventUs = link.anchorUs;
+    g_stats.centralConnects++;
+    // The stack stops advertising once a central connects
+    g_serverAdvertising = false;
+
+    esp_ble_gatts_cb_param_t param;
+    param.connect.conn_id = connId;
+    memset(param.connect.remote_bda, 0, sizeof(param.connect.remote_bda));
+    param.connect.remote_bda[5] = (uint8_t)connId;
+    if (BLEServerCallbacks* cb = g_server->getCallbacks()) {
+      cb->onConnect(g_server);
+      cb->onConnect(g_server, &param);
+    }
+    return connId;
+  }
+
+  void disconnectCentral(uint16_t connId) {
+    auto it = g_centrals.find(connId);
+    if (it == g_centrals.end() || !it->second.stats.connected) return;
+    it->second.stats.connected = false;
+    it->second.inflight.clear();
+    esp_ble_gatts_cb_param_t param;
+    param.disconnect.conn_id = connId;
+    memset(param.disconnect.remote_bda, 0, sizeof(param.disconnect.remote_bda));
+    param.disconnect.reason = 0x13; // remote user terminated
+    if (g_server && g_server->getCallbacks()) {
+      g_server->getCallbacks()->onDisconnect(g_server);
+      g_server->getCallbacks()->onDisconnect(g_server, &param);
+    }
+  }
+
+  bool writeCentral(uint16_t connId, const BLEUUID& characteristic, const uint8_t* data, size_t length) {
+    auto it = g_centrals.find(connId);
+    BLECharacteristic* c = (g_server ? g_server->findCharacteristic(characteristic) : nullptr);
+    if (it == g_centrals.end() || !it->second.stats.connected || !c) return false;
+    c->written(connId, data, length);
+    return true;
+  }
+
+  bool writeCccdCentral(uint16_t connId, const BLEUUID& characteristic, uint16_t value) {
+    auto it = g_centrals.find(connId);
+    BLECharacteristic* c = (g_server ? g_server->findCharacteristic(characteristic) : nullptr);
+    BLEDescriptor* cccd = c ? c->getDescriptorByUUID(BLEUUID((uint16_t)0x2902)) : nullptr;
+    if (it == g_centrals.end() || !it->second.stats.connected || !cccd) return false;
+    uint8_t data[2] = {(uint8_t)value, (uint8_t)(value >> 8)};
+    esp_ble_gatts_cb_param_t param;
+    param.write.conn_id = connId;
+    param.write.handle = cccd->getHandle();
+    param.write.len = sizeof(data);
+    param.write.value = data;
+    if (g_gattsHandler) g_gattsHandler(ESP_GATTS_WRITE_EVT, (esp_gatt_if_t)g_server->getGattsIf(), &param);
+    return true;
+  }
+
+  std::string readCentral(uint16_t connId, const BLEUUID& characteristic) {
+    auto it = g_centrals.find(connId);
+    BLECharacteristic* c = (g_server ? g_server->findCharacteristic(characteristic) : nullptr);
+    if (it == g_centrals.end() || !it->second.stats.connected || !c) return std::string();
+    return c->read(connId).substr(0, it->second.profile.mtu - 1);
+  }
+
+  const CentralStats& centralStats(uint16_t connId) {
+    static const CentralStats none;
+    auto it = g_centrals.find(connId);
+    return it == g_centrals.end() ? none : it->second.stats;
+  }
+
+  uint64_t frameStampUs(uint32_t seq) {
+    auto it = g_frameStamps.find(seq);
+    return it == g_frameStamps.end() ? 0 : it->second;
+  }
+
+  uint16_t crcModbus(const uint8_t* data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+      crc ^= data[i];
+      for (int j = 0; j < 8; j++) {
+        crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+      }
+    }
+    return crc;
+  }
+
+  static void putU16BE(std::vector<uint8_t>& f, size_t offset, uint16_t v) {
+    f[offset] = v >> 8;
+    f[offset + 1] = v & 0xFF;
+  }
+
+  static void appendCrc(std::vector<uint8_t>& f) {
+    uint16_t crc = crcModbus(f.data(), f.size());
+    f.push_back(crc & 0xFF);
+    f.push_back(crc >> 8);
+  }
+
+  std::vector<uint8_t> dalyInfoFrame(const PackState& pack) {
+    std::vector<uint8_t> f(127, 0);
+    f[0] = 0xD2;
+    f[1] = 0x03;
+    f[2] = 0x7C;
+
+    uint32_t packMv = 0;
+    uint16_t maxMv = 0, minMv = 0xFFFF;
+    for (int i = 0; i < 16; i++) {
+      putU16BE(f, 3 + i * 2, pack.cellMv[i]);
+      packMv += pack.cellMv[i];
+      maxMv = std::max(maxMv, pack.cellMv[i]);
+      minMv = std::min(minMv, pack.cellMv[i]);
+    }
+
+    // Temperatures are 16-bit with a +40 offset
+    putU16BE(f, 67, (uint16_t)(pack.tempC[0] + 40));
+    putU16BE(f, 69, (uint16_t)(pack.tempC[1] + 40));
+    putU16BE(f, 71, (uint16_t)(pack.mosTempC + 40));
+
+    putU16BE(f, 83, (uint16_t)(packMv / 100));
+    putU16BE(f, 85, (uint16_t)lroundf(pack.currentA * 10.0f + 30000.0f));
+    putU16BE(f, 87, (uint16_t)lroundf(pack.socPct * 10.0f));
+    putU16BE(f, 101, 16);
+    putU16BE(f, 103, 2);
+    putU16BE(f, 105, pack.cycles);
+    putU16BE(f, 115, (uint16_t)(maxMv - minMv));
+
+    f[35] = pack.seq >> 24;
+    f[36] = pack.seq >> 16;
+    f[37] = pack.seq >> 8;
+    f[38] = pack.seq;
+
+    appendCrc(f);
+    return f;
+  }
+
+  std::vector<uint8_t> dalyMosFrame(const PackState& pack) {
+    std::vector<uint8_t> f(21, 0);
+    f[0] = 0xD2;
+    f[1] = 0x03;
+    f[2] = 0x12;
+    f[3 + 1] = pack.currentA >= 0 ? 1 : 0; // charge MOS
+    f[3 + 3] = 1;                           // discharge MOS
+    appendCrc(f);
+    return f;
+  }
+
+  Responder dalyResponder(PackState* pack) {
+    return [pack](const uint8_t* req, size_t len) -> std::vector<uint8_t> {
+      if (len != 8 || req[0] != 0xD2 || req[1] != 0x03) return {};
+      uint16_t crc = crcModbus(req, 6);
+      if (req[6] != (crc & 0xFF) || req[7] != (crc >> 8)) return {};
+
+      if (req[2] == 0x00 && req[3] == 0x00 && req[4] == 0x00 && req[5] == 0x3E) {
+        pack->seq++;
+        g_frameStamps[pack->seq] = fakehw::nowUs();
+        return dalyInfoFrame(*pack);
+      }
+      if (req[2] == 0x00 && req[3] == 0x3E && req[4] == 0x00 && req[5] == 0x09) return dalyMosFrame(*pack);
+      return {};
+    };
+  }
+}
@@ -0,0 +1,524 @@
+/*
+ * Host fakes of the ESP32 BLE client API (BLEDevice, BLEScan, BLEClient,
+ * BLERemoteService, BLERemoteCharacteristic, BLERemoteDescriptor) and of
+ * the server side (BLEServer, BLEService, BLECharacteristic, BLE2902,
+ * BLEAdvertising, esp_ble_gatts_send_indicate)
+ * A scripted "air" (namespace fakeble) decides what is advertised, how long
+ * connects take, how replies are fragmented into notifications and when
+ * the link drops, all on the virtual clock from Arduino.h. Scripted phones
+ * (fakeble::Central) connect to the server, write and take notifications.
+ */
+
+#ifndef FAKE_BLE_H
+#define FAKE_BLE_H
+
+#include "Arduino.h"
+#include <map>
+#include <string>
+#include <vector>
+
+class BLEClient;
+class BLERemoteService;
+class BLERemoteCharacteristic;
+
+class BLEUUID {
+public:
+  BLEUUID() {}
+  BLEUUID(const char* uuid) : BLEUUID(std::string(uuid)) {}
+  BLEUUID(const std::string& uuid);
+  BLEUUID(uint16_t uuid16);
+  std::string toString() const { return full_; }
+  bool equals(const BLEUUID& other) const { return full_ == other.full_; }
+
+private:
+  std::string full_;
+};
+
+typedef uint8_t esp_bd_addr_t[6];
+
+class BLEAddress {
+public:
+  BLEAddress() {}
+  BLEAddress(const std::string& address);
+  BLEAddress(const char* address) : BLEAddress(std::string(address)) {}
+  std::string toString() const; // lower case, as the ESP32 stack reports it
+  bool equals(const BLEAddress& other) const { return memcmp(native_, other.native_, 6) == 0; }
+  esp_bd_addr_t* getNative() { return &native_; }
+
+private:
+  esp_bd_addr_t native_ = {0}; // six bytes like the ESP32 class, so copies do not allocate
+};
+
+class BLEAdvertisedDevice {
+public:
+  std::string getName() const { return name_; }
+  BLEAddress getAddress() const { return address_; }
+  int getRSSI() const { return rssi_; }
+  bool haveName() const { return !name_.empty(); }
+  bool haveRSSI() const { return true; }
+  bool haveServiceUUID() const { return hasService_; }
+  BLEUUID getServiceUUID() const { return service_; }
+  // Raw advertising data: flags, local name, 16-bit service UUID
+  uint8_t* getPayload() { return payload_; }
+  size_t getPayloadLength() const { return payloadLength_; }
+  std::string toString() const { return name_ + " [" + address_.toString() + "]"; }
+
+private:
+  friend class BLEScan;
+  uint8_t payload_[31];
+  size_t payloadLength_ = 0;
+  std::string name_;
+  BLEAddress address_;
+  int rssi_ = 0;
+  bool hasService_ = false;
+  BLEUUID service_;
+};
+
+class BLEAdvertisedDeviceCallbacks {
+public:
+  virtual ~BLEAdvertisedDeviceCallbacks() {}
+  virtual void onResult(BLEAdvertisedDevice advertisedDevice) = 0;
+};
+
+class BLEScanResults {
+public:
+  int getCount() const { return (int)devices_.size(); }
+  BLEAdvertisedDevice getDevice(uint32_t i) const { return devices_.at(i); }
+
+private:
+  friend class BLEScan;
+  std::vector<BLEAdvertisedDevice> devices_;
+};
+
+class BLEScan {
+public:
+  void setAdvertisedDeviceCallbacks(BLEAdvertisedDeviceCallbacks* callbacks, bool wantDuplicates = false) {
+    callbacks_ = callbacks;
+    wantDuplicates_ = wantDuplicates;
+  }
+  void setActiveScan(bool active) { (void)active; }
+  void setInterval(uint16_t intervalMs) { (void)intervalMs; }
+  void setWindow(uint16_t windowMs) { (void)windowMs; }
+  // Blocks for duration seconds of virtual time, delivering scripted advertisements
+  BLEScanResults start(uint32_t duration, bool is_continue = false);
+  // Returns at once; advertisements and then scanCompleteCB arrive as events
+  bool start(uint32_t duration, void (*scanCompleteCB)(BLEScanResults), bool is_continue = false);
+  void stop() {}
+  void clearResults() { results_ = BLEScanResults(); }
+
+private:
+  uint64_t scheduleAdvertisements(uint32_t duration, bool is_continue);
+
+  BLEAdvertisedDeviceCallbacks* callbacks_ = nullptr;
+  bool wantDuplicates_ = false;
+  BLEScanResults results_;
+};
+
+class BLERemoteDescriptor {
+public:
+  BLERemoteDescriptor(BLERemoteCharacteristic* owner, const BLEUUID& uuid) : owner_(owner), uuid_(uuid) {}
+  BLEUUID getUUID() const { return uuid_; }
+  void writeValue(uint8_t* data, size_t length, bool response = false);
+
+private:
+  BLERemoteCharacteristic* owner_;
+  BLEUUID uuid_;
+};
+
+typedef std::function<void(BLERemoteCharacteristic*, uint8_t*, size_t, bool)> notify_callback;
+
+class BLERemoteCharacteristic {
+public:
+  BLERemoteCharacteristic(BLERemoteService* service, const BLEUUID& uuid, bool canRead, bool canWrite, bool canNotify);
+  ~BLERemoteCharacteristic();
+
+  BLEUUID getUUID() const { return uuid_; }
+  bool canRead() const { return canRead_; }
+  bool canWrite() const { return canWrite_; }
+  bool canWriteNoResponse() const { return canWrite_; }
+  bool canNotify() const { return canNotify_; }
+  bool canIndicate() const { return false; }
+
+  void registerForNotify(notify_callback callback, bool notifications = true, bool descriptorRequiresRegistration = true);
+  BLERemoteDescriptor* getDescriptor(BLEUUID uuid);
+  void writeValue(uint8_t* data, size_t length, bool response = false);
+  void writeValue(const std::string& value, bool response = false) {
+    writeValue((uint8_t*)value.data(), value.size(), response);
+  }
+  std::string readValue() { return std::string(); }
+
+  // Used by the fake air to push a notification to the registered callback
+  void deliver(const uint8_t* data, size_t length);
+  bool notificationsEnabled() const { return notifyEnabled_; }
+  void setNotificationsEnabled(bool on) { notifyEnabled_ = on; }
+  BLERemoteService* getRemoteService() const { return service_; }
+
+private:
+  BLERemoteService* service_;
+  BLEUUID uuid_;
+  bool canRead_, canWrite_, canNotify_;
+  bool notifyEnabled_ = false;
+  notify_callback callback_;
+  BLERemoteDescriptor* cccd_ = nullptr;
+};
+
+class BLERemoteService {
+public:
+  BLERemoteService(BLEClient* client, const BLEUUID& uuid) : client_(client), uuid_(uuid) {}
+  ~BLERemoteService();
+
+  BLEUUID getUUID() const { return uuid_; }
+  BLEClient* getClient() const { return client_; }
+  std::map<std::string, BLERemoteCharacteristic*>* getCharacteristics() { return &characteristics_; }
+  BLERemoteCharacteristic* getCharacteristic(BLEUUID uuid);
+  BLERemoteCharacteristic* getCharacteristic(const char* uuid) { return getCharacteristic(BLEUUID(uuid)); }
+  void addCharacteristic(BLERemoteCharacteristic* c) { characteristics_[c->getUUID().toString()] = c; }
+
+private:
+  BLEClient* client_;
+  BLEUUID uuid_;
+  std::map<std::string, BLERemoteCharacteristic*> characteristics_;
+};
+
+class BLEClientCallbacks {
+public:
+  virtual ~BLEClientCallbacks() {}
+  virtual void onConnect(BLEClient* client) = 0;
+  virtual void onDisconnect(BLEClient* client) = 0;
+};
+
+class BLEClient {
+public:
+  ~BLEClient();
+
+  // Blocks for the scripted connect latency; fails if the peer is absent or down
+  bool connect(BLEAddress address);
+  void disconnect();
+  bool isConnected() const { return connected_; }
+  int getRssi() const { return rssi_; }
+  void setClientCallbacks(BLEClientCallbacks* callbacks) { callbacks_ = callbacks; }
+  std::map<std::string, BLERemoteService*>* getServices() { return &services_; }
+  BLERemoteService* getService(BLEUUID uuid);
+  BLERemoteService* getService(const char* uuid) { return getService(BLEUUID(uuid)); }
+  BLEAddress getPeerAddress() const { return peer_; }
+
+  // Called by the fake air when a scripted link drop fires
+  void linkLost();
+
+private:
+  void clearServices();
+
+  bool connected_ = false;
+  int rssi_ = 0;
+  BLEAddress peer_;
+  BLEClientCallbacks* callbacks_ = nullptr;
+  std::map<std::string, BLERemoteService*> services_;
+};
+
+// ---------------------------------------------------------------- server side
+
+class BLEServer;
+class BLEService;
+class BLECharacteristic;
+
+typedef uint8_t esp_gatt_if_t;
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+// The members of the ESP-IDF callback parameter union that the fakes fill
+typedef union {
+  struct { uint16_t conn_id; esp_bd_addr_t remote_bda; } connect;
+  struct { uint16_t conn_id; esp_bd_addr_t remote_bda; int reason; } disconnect;
+  struct { uint16_t conn_id; uint16_t handle; uint16_t len; uint8_t* value; } write;
+  struct { uint16_t conn_id; uint16_t handle; } read;
+} esp_ble_gatts_cb_param_t;
+
+// The GATTS events the fakes raise through BLEDevice::setCustomGattsHandler()
+typedef enum { ESP_GATTS_READ_EVT = 1, ESP_GATTS_WRITE_EVT = 2 } esp_gatts_cb_event_t;
+typedef void (*gatts_event_handler)(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                                    esp_ble_gatts_cb_param_t* param);
+
+// One notification (or indication) to one connection. Refused with
+// ESP_FAIL while the link's buffers are full, as ESP-IDF does.
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t attr_handle,
+                                      uint16_t value_len, uint8_t* value, bool need_confirm);
+
+class BLEDescriptor {
+public:
+  explicit BLEDescriptor(const BLEUUID& uuid) : uuid_(uuid) {}
+  virtual ~BLEDescriptor() {}
+  BLEUUID getUUID() const { return uuid_; }
+  uint16_t getHandle() const { return handle_; }
+
+private:
+  friend class BLECharacteristic;
+  BLEUUID uuid_;
+  uint16_t handle_ = 0;
+};
+
+// Client characteristic configuration. The value is one for all phones, as
+// in the library; a phone's write (fakeble::writeCccdCentral) reaches the
+// sketch only as an ESP_GATTS_WRITE_EVT with its conn_id.
+class BLE2902 : public BLEDescriptor {
+public:
+  BLE2902() : BLEDescriptor(BLEUUID((uint16_t)0x2902)) {}
+};
+
+class BLECharacteristicCallbacks {
+public:
+  virtual ~BLECharacteristicCallbacks() {}
+  virtual void onRead(BLECharacteristic* c) { (void)c; }
+  virtual void onRead(BLECharacteristic* c, esp_ble_gatts_cb_param_t* param) { (void)c; (void)param; }
+  virtual void onWrite(BLECharacteristic* c) { (void)c; }
+  virtual void onWrite(BLECharacteristic* c, esp_ble_gatts_cb_param_t* param) { (void)c; (void)param; }
+};
+
+class BLECharacteristic {
+public:
+  static const uint32_t PROPERTY_READ = 1 << 0;
+  static const uint32_t PROPERTY_WRITE = 1 << 1;
+  static const uint32_t PROPERTY_NOTIFY = 1 << 2;
+  static const uint32_t PROPERTY_BROADCAST = 1 << 3;
+  static const uint32_t PROPERTY_INDICATE = 1 << 4;
+  static const uint32_t PROPERTY_WRITE_NR = 1 << 5;
+
+  BLECharacteristic(BLEService* service, const BLEUUID& uuid, uint32_t properties, uint16_t handle)
+    : service_(service), uuid_(uuid), properties_(properties), handle_(handle) {}
+  ~BLECharacteristic();
+
+  BLEUUID getUUID() const { return uuid_; }
+  uint16_t getHandle() const { return handle_; }
+  BLEService* getService() const { return service_; }
+  // The descriptor takes the handle after the value (BLEServer::nextHandle)
+  void addDescriptor(BLEDescriptor* descriptor) {
+    descriptor->handle_ = (uint16_t)(handle_ + 1 + descriptors_.size());
+    descriptors_.push_back(descriptor);
+  }
+  BLEDescriptor* getDescriptorByUUID(BLEUUID uuid);
+  void setCallbacks(BLECharacteristicCallbacks* callbacks) { callbacks_ = callbacks; }
+  void setValue(uint8_t* data, size_t size) { value_.assign((const char*)data, size); }
+  void setValue(const std::string& value) { value_ = value; }
+  std::string getValue() const { return value_; }
+  uint8_t* getData() { return (uint8_t*)value_.data(); }
+  size_t getLength() const { return value_.size(); }
+  // The value to every connected central, as the Arduino library does
+  void notify(bool is_notification = true);
+
+  // Used by the fake air for phone writes and reads
+  void written(uint16_t connId, const uint8_t* data, size_t length);
+  std::string read(uint16_t connId);
+
+private:
+  BLEService* service_;
+  BLEUUID uuid_;
+  uint32_t properties_;
+  uint16_t handle_;
+  std::string value_;
+  BLECharacteristicCallbacks* callbacks_ = nullptr;
+  std::vector<BLEDescriptor*> descriptors_;
+};
+
+class BLEService {
+public:
+  BLEService(BLEServer* server, const BLEUUID& uuid) : server_(server), uuid_(uuid) {}
+  ~BLEService();
+
+  BLEUUID getUUID() const { return uuid_; }
+  BLEServer* getServer() const { return server_; }
+  BLECharacteristic* createCharacteristic(const char* uuid, uint32_t properties) {
+    return createCharacteristic(BLEUUID(uuid), properties);
+  }
+  BLECharacteristic* createCharacteristic(BLEUUID uuid, uint32_t properties);
+  BLECharacteristic* getCharacteristic(BLEUUID uuid);
+  BLECharacteristic* getByHandle(uint16_t handle);
+  void start() { started_ = true; }
+  bool started() const { return started_; }
+
+private:
+  BLEServer* server_;
+  BLEUUID uuid_;
+  bool started_ = false;
+  std::vector<BLECharacteristic*> characteristics_;
+};
+
+class BLEServerCallbacks {
+public:
+  virtual ~BLEServerCallbacks() {}
+  virtual void onConnect(BLEServer* server) { (void)server; }
+  virtual void onConnect(BLEServer* server, esp_ble_gatts_cb_param_t* param) { (void)server; (void)param; }
+  virtual void onDisconnect(BLEServer* server) { (void)server; }
+  virtual void onDisconnect(BLEServer* server, esp_ble_gatts_cb_param_t* param) { (void)server; (void)param; }
+};
+
+class BLEServer {
+public:
+  ~BLEServer();
+
+  BLEService* createService(const char* uuid) { return createService(BLEUUID(uuid)); }
+  BLEService* createService(BLEUUID uuid);
+  BLEService* getServiceByUUID(BLEUUID uuid);
+  void setCallbacks(BLEServerCallbacks* callbacks) { callbacks_ = callbacks; }
+  BLEServerCallbacks* getCallbacks() const { return callbacks_; }
+  uint32_t getConnectedCount();
+  void startAdvertising();
+  void disconnect(uint16_t connId);
+  uint16_t getGattsIf() const { return 3; }
+  uint16_t nextHandle() { return handle_ += 2; } // value handle, then its CCCD
+  BLECharacteristic* findHandle(uint16_t handle);
+  BLECharacteristic* findCharacteristic(const BLEUUID& uuid);
+
+private:
+  BLEServerCallbacks* callbacks_ = nullptr;
+  std::vector<BLEService*> services_;
+  uint16_t handle_ = 40;
+};
+
+class BLEAdvertising {
+public:
+  void addServiceUUID(BLEUUID uuid) { (void)uuid; }
+  void addServiceUUID(const char* uuid) { (void)uuid; }
+  void setScanResponse(bool on) { (void)on; }
+  void setMinPreferred(uint16_t v) { (void)v; }
+  void start();
+  void stop();
+};
+
+class BLEDevice {
+public:
+  static void init(const std::string& deviceName);
+  static void deinit(bool releaseMemory = false) { (void)releaseMemory; }
+  static BLEScan* getScan();
+  static BLEClient* createClient();
+  static BLEServer* createServer();
+  static BLEAdvertising* getAdvertising();
+  static void startAdvertising();
+  static bool getInitialized();
+  static void setCustomGattsHandler(gatts_event_handler handler);
+};
+
+// Scripted radio environment for the fakes above
+namespace fakeble {
+
+  typedef std::function<std::vector<uint8_t>(const uint8_t* request, size_t length)> Responder;
+
+  struct Peripheral {
+    std::string address;          // "41:18:12:01:18:9F"
+    std::string name;             // advertised local name
+    int rssi = -65;
+    std::string serviceUUID;      // advertised service, empty for none
+    bool dalyGatt = false;        // exposes fff0 / fff1 (notify) / fff2 (write)
+    Responder responder;          // reply to writes on fff2, empty = silent
+  };
+
+  struct LinkProfile {
+    uint32_t connectLatencyMs = 250;  // time BLEClient::connect() blocks
+    double connectFailRate = 0.0;     // probability a connect attempt fails
+    uint32_t responseLatencyMs = 60;  // write to first notification
+    size_t notifyChunk = 0;           // bytes per notification, 0 = whole reply
+    uint32_t chunkGapMs = 8;          // gap between notification fragments
+    double dropRate = 0.0;            // probability a request gets no reply
+    uint32_t responseJitterMs = 0;    // uniform extra reply latency 0..N
+    double slowRate = 0.0;            // probability a reply is held back by slowExtraMs
+    uint32_t slowExtraMs = 0;
+    double corruptRate = 0.0;         // probability one reply byte is flipped in transit
+    std::vector<uint32_t> linkDropAtMs; // virtual times at which the link drops
+    uint32_t downAfterDropMs = 0;     // peer refuses connects/adverts for this long after a drop
+    uint32_t advertIntervalMs = 100;  // between repeats of one advertiser (duplicates wanted)
+    uint8_t maxLinks = 4;             // ACL links of the stack, the BMS link included
+  };
+
+  // A phone connecting to our GATT server
+  struct Central {
+    uint16_t mtu = 23;                // notifications are cut to mtu - 3
+    uint32_t connIntervalMs = 30;     // connection events, where queued notifications go out
+    uint8_t perEvent = 4;             // notifications the phone takes per connection event
+    uint8_t queueDepth = 10;          // buffered notifications before the stack refuses more
+    std::function<void(uint16_t connId, const BLEUUID& characteristic, const uint8_t* data, size_t len)> onNotify;
+  };
+
+  struct CentralStats {
+    bool connected = false;
+    uint32_t notifications = 0;       // delivered to the phone
+    uint64_t bytes = 0;
+    uint32_t refused = 0;             // send_indicate calls refused as congested
+  };
+
+  struct Stats {
+    uint32_t scans = 0;
+    uint32_t advertisements = 0;
+    uint32_t scanResultsPeak = 0;      // most devices BLEScan held in its results at once
+    uint32_t connectAttempts = 0;
+    uint32_t connects = 0;
+    uint32_t connectFailures = 0;
+    uint32_t linkDrops = 0;
+    uint32_t writes = 0;
+    uint32_t repliesDropped = 0;
+    uint32_t slowReplies = 0;
+    uint32_t corruptReplies = 0;
+    uint32_t notifications = 0;
+    uint64_t notifyBytes = 0;
+    std::vector<uint32_t> reconnectMs; // link drop to next successful connect
+    uint32_t centralConnects = 0;      // phones connected to our server
+    uint32_t centralRejected = 0;      // phones turned away: not advertising or no free link
+    uint32_t serverNotifications = 0;  // accepted by esp_ble_gatts_send_indicate
+    uint32_t serverRefused = 0;
+  };
+
+  // Per-pack values the default Daly responder encodes
+  struct PackState {
+    uint16_t cellMv[16];
+    float currentA = 0.0f;
+    float socPct = 90.4f;
+    uint16_t cycles = 1;
+    int8_t tempC[2] = {30, 30};
+    int8_t mosTempC = 33;
+    uint32_t seq = 0;             // stamped into unused cell slots 17-18 (offset 35)
+    PackState() { for (int i = 0; i < 16; i++) cellMv[i] = 3318; }
+  };
+
+  void reset(uint32_t seed = 1);
+  Peripheral& addPeripheral(const Peripheral& p);
+  // Add count unrelated advertisers (phones, beacons) to the scan results
+  void addNoiseAdvertisers(int count);
+  void setLinkProfile(const LinkProfile& profile);
+  const LinkProfile& linkProfile();
+  const Stats& stats();
+
+  // Modbus CRC as used by the Daly BLE protocol
+  uint16_t crcModbus(const uint8_t* data, size_t length);
+  // Build a 129-byte D2 03 info frame (or MOS frame) from pack state
+  std::vector<uint8_t> dalyInfoFrame(const PackState& pack);
+  std::vector<uint8_t> dalyMosFrame(const PackState& pack);
+  // Responder answering HEAD_READ + CMD_INFO / MOS_INFO with CRC checking;
+  // every info frame gets the next sequence number and a measurement stamp
+  Responder dalyResponder(PackState* pack);
+  // Virtual time at which the simulated BMS measured frame seq (0 = unknown)
+  uint64_t frameStampUs(uint32_t seq);
+
+  // Phones: connect to the advertising server (connection id, or -1 when it
+  // is not advertising or no link is free), write, read and leave
+  int connectCentral(const Central& central);
+  void disconnectCentral(uint16_t connId);
+  bool writeCentral(uint16_t connId, const BLEUUID& characteristic, const uint8_t* data, size_t length);
+  // Write the characteristic's CCCD: 1 = notifications on, 0 = off
+  bool writeCccdCentral(uint16_t connId, const BLEUUID& characteristic, uint16_t value);
+  std::string readCentral(uint16_t connId, const BLEUUID& characteristic);
+  const CentralStats& centralStats(uint16_t connId);
+  bool serverAdvertising();
+
+  // Internal hooks between the air and the fake classes
+  Peripheral* findPeripheral(const std::string& address);
+  bool peripheralUp(const Peripheral& p);
+  void attachClient(BLEClient* client, Peripheral* p);
+  void detachClient(BLEClient* client);
+  void onWrite(BLERemoteCharacteristic* c, const uint8_t* data, size_t length);
+  std::vector<Peripheral*> advertisers();
+  void setServer(BLEServer* server);
+  void setServerAdvertising(bool on);
+  std::vector<uint16_t> connectedCentrals();
+  bool chance(double p);
+  Stats& mutableStats();
+}
+
+#endif // FAKE_BLE_H
@@ -0,0 +1,71 @@
+/*
+ * Host stand-ins for the flash partition used by the sample log:
+ * a RAM image for the native firmware run and a file-backed image for benchmarks
+ * Both keep NOR semantics: erase sets 0xFF, writes can only clear bits
+ */
+
+#ifndef FLASH_IMAGE_H
+#define FLASH_IMAGE_H
+
+#include "flash_log.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+class RamFlashStorage : public FlashStorage {
+public:
+  explicit RamFlashStorage(uint32_t bytes) : image_(bytes, 0xFF) {}
+  uint32_t size() const override { return image_.size(); }
+  bool read(uint32_t offset, void* dst, uint32_t len) override {
+    if (offset + len > image_.size()) return false;
+    memcpy(dst, &image_[offset], len);
+    return true;
+  }
+  bool write(uint32_t offset, const void* src, uint32_t len) override {
+    if (offset + len > image_.size()) return false;
+    const uint8_t* p = (const uint8_t*)src;
+    for (uint32_t i = 0; i < len; i++) image_[offset + i] &= p[i];
+    return true;
+  }
+  bool eraseSector(uint32_t offset) override {
+    if (offset + FLASH_LOG_SECTOR > image_.size()) return false;
+    memset(&image_[offset], 0xFF, FLASH_LOG_SECTOR);
+    return true;
+  }
+
+private:
+  std::vector<uint8_t> image_;
+};
+
+// A fresh (sparse, zero-filled) file reads as "no valid headers", which the
+// log treats like erased flash, so the image does not need pre-filling
+class FileFlashStorage : public FlashStorage {
+public:
+  bool open(const char* path, uint32_t bytes) {
+    fp_ = fopen(path, "r+b");
+    if (!fp_) fp_ = fopen(path, "w+b");
+    if (!fp_) return false;
+    size_ = bytes;
+    return ftruncate(fileno(fp_), bytes) == 0;
+  }
+  ~FileFlashStorage() { if (fp_) fclose(fp_); }
+
+  uint32_t size() const override { return size_; }
+  bool read(uint32_t offset, void* dst, uint32_t len) override {
+    return pread(fileno(fp_), dst, len, offset) == (ssize_t)len;
+  }
+  bool write(uint32_t offset, const void* src, uint32_t len) override {
+    return pwrite(fileno(fp_), src, len, offset) == (ssize_t)len;
+  }
+  bool eraseSector(uint32_t offset) override {
+    static uint8_t ones[FLASH_LOG_SECTOR];
+    if (ones[0] != 0xFF) memset(ones, 0xFF, sizeof(ones));
+    return write(offset, ones, sizeof(ones));
+  }
+
+private:
+  FILE* fp_ = nullptr;
+  uint32_t size_ = 0;
+};
+
+#endif // FLASH_IMAGE_H
@@ -0,0 +1,53 @@
+/*
+ * Host stand-in for the FreeRTOS queue and task-notification calls the
+ * Classic BT sketches use (spp_frames.h, loop())
+ * There is one task, the one running setup()/loop(). A blocking call fires
+ * the fake radio's events in order on the virtual clock from Arduino.h
+ * until it is satisfied or times out, so a frame sent from an event wakes
+ * the waiter at the virtual time it was sent, as on the ESP32. Ticks are
+ * milliseconds (configTICK_RATE_HZ 1000).
+ */
+
+#ifndef FAKE_FREERTOS_H
+#define FAKE_FREERTOS_H
+
+#include "Arduino.h"
+#include <deque>
+#include <vector>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define errQUEUE_FULL 0
+#define portMAX_DELAY 0xFFFFFFFFu
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+namespace fakertos {
+  struct Queue {
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    std::deque<std::vector<uint8_t>> items;
+  };
+
+  struct Task {
+    uint32_t notifications = 0;
+  };
+
+  // Virtual time at which a wait of ticks from now gives up
+  inline uint64_t deadlineUs(TickType_t ticks) {
+    return ticks == portMAX_DELAY ? UINT64_MAX : fakehw::nowUs() + (uint64_t)ticks * 1000;
+  }
+
+  inline Task& loopTask() {
+    static Task task;
+    return task;
+  }
+}
+
+typedef fakertos::Queue* QueueHandle_t;
+typedef fakertos::Task* TaskHandle_t;
+
+#endif // FAKE_FREERTOS_H
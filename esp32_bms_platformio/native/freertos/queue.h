@@ -0,0 +1,37 @@
+/*
+ * Host stand-in for FreeRTOS queues (see FreeRTOS.h): items are copied in
+ * and out by value; xQueueReceive() blocks on the virtual clock
+ */
+
+#ifndef FAKE_FREERTOS_QUEUE_H
+#define FAKE_FREERTOS_QUEUE_H
+
+#include "FreeRTOS.h"
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  return new fakertos::Queue{length, itemSize, {}};
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t /*ticks*/) {
+  // Only the BT task sends, and it never waits for room
+  if (q->items.size() >= q->length) return errQUEUE_FULL;
+  const uint8_t* p = (const uint8_t*)item;
+  q->items.emplace_back(p, p + q->itemSize);
+  return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t q, void* item, TickType_t ticks) {
+  if (!fakehw::advanceUntil(fakertos::deadlineUs(ticks), [q]() { return !q->items.empty(); })) return pdFALSE;
+  memcpy(item, q->items.front().data(), q->itemSize);
+  q->items.pop_front();
+  return pdTRUE;
+}
+
+inline BaseType_t xQueueReset(QueueHandle_t q) {
+  q->items.clear();
+  return pdTRUE;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) { return q->items.size(); }
+
+#endif // FAKE_FREERTOS_QUEUE_H
@@ -0,0 +1,27 @@
+/*
+ * Host stand-in for FreeRTOS direct-to-task notifications (see FreeRTOS.h):
+ * ulTaskNotifyTake() blocks on the virtual clock until a notification is
+ * given or the timeout passes
+ */
+
+#ifndef FAKE_FREERTOS_TASK_H
+#define FAKE_FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return &fakertos::loopTask(); }
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  task->notifications++;
+  return pdTRUE;
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+  fakertos::Task& self = fakertos::loopTask();
+  fakehw::advanceUntil(fakertos::deadlineUs(ticks), [&self]() { return self.notifications > 0; });
+  uint32_t count = self.notifications;
+  if (count) self.notifications = clearOnExit ? 0 : count - 1;
+  return count;
+}
+
+#endif // FAKE_FREERTOS_TASK_H
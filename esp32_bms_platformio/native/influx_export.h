@@ -0,0 +1,579 @@
+/*
+ * Host-side export of the BatteryState messages to InfluxDB
+ *
+ * Each message becomes one point of line protocol:
+ *
+ *   bms,pack=DL-41181201189F,site=shed voltage_mv=53088i,current_ma=-12500i,
+ *     soc_dpct=904i,charge_mah=207900i,capacity_mah=230000i,status=2i,
+ *     cell_min_mv=3316i,cell_max_mv=3320i,c01=3318i,...,c16=3316i 1700000000250
+ *
+ * (one line, timestamps in ms, so the URL carries precision=ms). The
+ * measurement and tag part is escaped and formatted once per pack, field
+ * keys are constants, and every value is an integer written by hand, so a
+ * point costs a few appends instead of a printf with float formatting.
+ *
+ * Points collect in a batch that is sealed at batchPoints, batchBytes or
+ * batchMs, whichever comes first, and service() POSTs sealed batches
+ * through an InfluxTransport (HttpPoster below, or a stand-in). A batch
+ * that fails (no connection, 429, 5xx) is retried `retries` times with a
+ * doubling backoff. One that still fails goes to the spool directory and
+ * the exporter counts the server as down: new batches are spooled at once
+ * and only the oldest spool file is tried, once per backoffMaxMs, until
+ * one goes through. Then the spool is replayed a file per service() call
+ * behind the live batches. A 4xx other than 429 means the points
+ * themselves are refused, so that batch is dropped, not spooled. The spool
+ * is capped at spoolBytes; past it the oldest files are deleted and
+ * counted. Spool files survive a restart.
+ *
+ * HttpPoster speaks plain HTTP/1.1 with keep-alive; put a local proxy in
+ * front of an https endpoint.
+ */
+
+#ifndef INFLUX_EXPORT_H
+#define INFLUX_EXPORT_H
+
+#include "cdr_decode.h"
+#include <algorithm>
+#include <ctype.h>
+#include <deque>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <map>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+struct InfluxOptions {
+  std::string measurement = "bms";
+  std::string tags;              // extra tags for every point, "site=shed,string=a"
+  uint32_t batchPoints = 500;
+  uint32_t batchBytes = 256 * 1024;
+  uint32_t batchMs = 10000;      // seal a batch once its first point is this old
+  uint8_t retries = 3;           // attempts after the first, per batch
+  uint32_t backoffMs = 1000;     // before the first retry, doubling
+  uint32_t backoffMaxMs = 30000; // and between probes while the server is down
+  uint8_t queued = 4;            // sealed batches kept in memory
+  std::string spoolDir;          // empty: batches that run out of retries are dropped
+  uint64_t spoolBytes = 64ull * 1024 * 1024;
+};
+
+class InfluxTransport {
+public:
+  virtual ~InfluxTransport() {}
+  // The HTTP status of the write, or -1 when the server was not reached
+  virtual int post(const char* body, size_t len) = 0;
+};
+
+// Tag keys and values: escape commas, spaces and equals signs
+inline void influxEscapeTag(std::string& out, const std::string& s) {
+  for (char c : s) {
+    if (c == ',' || c == ' ' || c == '=') out += '\\';
+    out += c;
+  }
+}
+
+inline void influxAppendInt(std::string& out, int64_t v) {
+  char buf[24];
+  char* p = buf + sizeof(buf);
+  uint64_t u = v < 0 ? (uint64_t)(-(v + 1)) + 1 : (uint64_t)v;
+  do {
+    *--p = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (v < 0) *--p = '-';
+  out.append(p, buf + sizeof(buf) - p);
+}
+
+// Field keys with their separators, in line order
+static const char* const INFLUX_CELL_KEYS[CDR_MAX_CELLS] = {
+  ",c01=", ",c02=", ",c03=", ",c04=", ",c05=", ",c06=", ",c07=", ",c08=", ",c09=", ",c10=", ",c11=",
+  ",c12=", ",c13=", ",c14=", ",c15=", ",c16=", ",c17=", ",c18=", ",c19=", ",c20=", ",c21=", ",c22=",
+  ",c23=", ",c24=", ",c25=", ",c26=", ",c27=", ",c28=", ",c29=", ",c30=", ",c31=", ",c32=",
+};
+
+// "measurement,pack=<name>[,<tags>] ", formatted once per pack
+inline std::string influxPrefix(const InfluxOptions& opt, const std::string& pack) {
+  std::string p;
+  for (char c : opt.measurement) {
+    if (c == ',' || c == ' ') p += '\\';
+    p += c;
+  }
+  p += ",pack=";
+  influxEscapeTag(p, pack);
+  if (!opt.tags.empty()) {
+    p += ',';
+    p += opt.tags;
+  }
+  p += ' ';
+  return p;
+}
+
+inline void influxAppendPoint(std::string& out, const std::string& prefix, const DecodedBatteryState& m) {
+  out += prefix;
+  out.append("voltage_mv=", 11);
+  influxAppendInt(out, lroundf(m.voltage * 1000.0f));
+  out.append("i,current_ma=", 13);
+  influxAppendInt(out, lroundf(m.current * 1000.0f));
+  out.append("i,soc_dpct=", 11);
+  influxAppendInt(out, lroundf(m.percentage * 1000.0f));
+  out.append("i,charge_mah=", 13);
+  influxAppendInt(out, lroundf(m.charge * 1000.0f));
+  out.append("i,capacity_mah=", 15);
+  influxAppendInt(out, lroundf(m.capacity * 1000.0f));
+  out.append("i,status=", 9);
+  influxAppendInt(out, m.power_supply_status);
+  out += 'i';
+  size_t cells = std::min(m.cell_voltage.size(), (size_t)CDR_MAX_CELLS);
+  if (cells) {
+    long mv[CDR_MAX_CELLS];
+    long lo = LONG_MAX, hi = LONG_MIN;
+    for (size_t i = 0; i < cells; i++) {
+      mv[i] = lroundf(m.cell_voltage[i] * 1000.0f);
+      lo = std::min(lo, mv[i]);
+      hi = std::max(hi, mv[i]);
+    }
+    out.append(",cell_min_mv=", 13);
+    influxAppendInt(out, lo);
+    out.append("i,cell_max_mv=", 14);
+    influxAppendInt(out, hi);
+    out += 'i';
+    for (size_t i = 0; i < cells; i++) {
+      out.append(INFLUX_CELL_KEYS[i], 5);
+      influxAppendInt(out, mv[i]);
+      out += 'i';
+    }
+  }
+  out += ' ';
+  influxAppendInt(out, (int64_t)m.stamp_sec * 1000 + m.stamp_nanosec / 1000000);
+  out += '\n';
+}
+
+class InfluxExporter {
+public:
+  bool begin(InfluxTransport* transport, const InfluxOptions& opt = InfluxOptions()) {
+    transport_ = transport;
+    opt_ = opt;
+    if (opt_.spoolDir.empty()) return true;
+    mkdir(opt_.spoolDir.c_str(), 0755);
+    DIR* d = opendir(opt_.spoolDir.c_str());
+    if (!d) return false;
+    // Picks up what an earlier run could not send
+    while (dirent* e = readdir(d)) {
+      unsigned long long seq;
+      unsigned points;
+      int used = 0;
+      std::string path = opt_.spoolDir + "/" + e->d_name;
+      if (sscanf(e->d_name, "%llu-%u.lp%n", &seq, &points, &used) != 2 || e->d_name[used] != 0) {
+        if (strstr(e->d_name, ".lp.tmp")) unlink(path.c_str());  // cut short by a crash
+        continue;
+      }
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0) continue;
+      spool_.push_back({(uint64_t)seq, points, (uint64_t)st.st_size});
+      spooledBytes_ += st.st_size;
+      spoolSeq_ = std::max(spoolSeq_, (uint64_t)seq + 1);
+    }
+    closedir(d);
+    std::sort(spool_.begin(), spool_.end(), [](const SpoolFile& a, const SpoolFile& b) { return a.seq < b.seq; });
+    return true;
+  }
+
+  // One message of pack `pack`; seals the batch when it is full
+  void add(const std::string& pack, const DecodedBatteryState& m, uint32_t nowMs) {
+    if (!batchPoints_) batchStartMs_ = nowMs;
+    auto it = prefixes_.find(pack);
+    if (it == prefixes_.end()) it = prefixes_.emplace(pack, influxPrefix(opt_, pack)).first;
+    influxAppendPoint(batch_, it->second, m);
+    batchPoints_++;
+    points++;
+    if (batchPoints_ >= opt_.batchPoints || batch_.size() >= opt_.batchBytes) seal();
+  }
+
+  // Seals an old batch and does at most one POST; call often
+  void service(uint32_t nowMs) {
+    if (batchPoints_ && nowMs - batchStartMs_ >= opt_.batchMs) seal();
+    if (down_ && !opt_.spoolDir.empty()) {
+      while (!queue_.empty()) spoolFront();
+    }
+    if ((int32_t)(nowMs - nextAttemptMs_) < 0) return;
+    if (!queue_.empty() && !down_) {
+      sendFront(nowMs);
+    } else if (!spool_.empty()) {
+      replayOldest(nowMs);
+    } else if (!queue_.empty()) {
+      sendFront(nowMs);  // down without a spool: probe with the oldest batch
+    }
+  }
+
+  // Seals what is open and tries everything queued once; the rest is spooled
+  void flush(uint32_t nowMs) {
+    seal();
+    nextAttemptMs_ = nowMs;
+    while (!queue_.empty() && !down_) sendFront(nowMs, false);
+    while (!queue_.empty()) spoolFront();
+  }
+
+  bool down() const { return down_; }
+  size_t spoolFiles() const { return spool_.size(); }
+  uint64_t spooledBytes() const { return spooledBytes_; }
+  size_t queuedBatches() const { return queue_.size(); }
+
+  uint64_t points = 0;          // added
+  uint64_t sent = 0;            // accepted by the server
+  uint64_t rejected = 0;        // refused by the server (4xx), not retried
+  uint64_t dropped = 0;         // lost: out of retries without a spool, or spool over its cap
+  uint64_t spooled = 0;         // points written to the spool
+  uint64_t replayed = 0;        // points sent from the spool
+  uint32_t posts = 0;
+  uint32_t failures = 0;        // posts that did not reach the server or got 429/5xx
+  uint32_t spoolErrors = 0;
+
+private:
+  struct Batch {
+    std::string body;
+    uint32_t points;
+    uint8_t attempts;
+  };
+  struct SpoolFile {
+    uint64_t seq;
+    uint32_t points;
+    uint64_t bytes;
+  };
+
+  void seal() {
+    if (!batchPoints_) return;
+    queue_.push_back({std::move(batch_), batchPoints_, 0});
+    batch_.clear();
+    batch_.reserve(opt_.batchBytes / 4);
+    batchPoints_ = 0;
+    // Memory holds a few batches; older ones go to disk
+    while (queue_.size() > opt_.queued) spoolFront();
+  }
+
+  int post(const std::string& body) {
+    posts++;
+    int status = transport_->post(body.data(), body.size());
+    if (status < 200 || status == 429 || status >= 500) failures++;
+    return status;
+  }
+
+  static bool retriable(int status) { return status < 200 || status == 429 || status >= 500; }
+
+  void sendFront(uint32_t nowMs, bool backoff = true) {
+    Batch& b = queue_.front();
+    int status = post(b.body);
+    if (!retriable(status)) {
+      if (status < 300) sent += b.points;
+      else rejected += b.points;
+      queue_.pop_front();
+      up(nowMs);
+      return;
+    }
+    if (++b.attempts > opt_.retries || !backoff) {
+      spoolFront();
+      wentDown(nowMs);
+      return;
+    }
+    nextAttemptMs_ = nowMs + std::min(opt_.backoffMaxMs, opt_.backoffMs << (b.attempts - 1));
+  }
+
+  void replayOldest(uint32_t nowMs) {
+    SpoolFile f = spool_.front();
+    std::string body;
+    if (!readSpool(f, body)) {
+      spoolErrors++;
+      dropped += f.points;
+      removeOldest();
+      return;
+    }
+    int status = post(body);
+    if (retriable(status)) {
+      wentDown(nowMs);
+      return;
+    }
+    if (status < 300) {
+      sent += f.points;
+      replayed += f.points;
+    } else {
+      rejected += f.points;
+    }
+    removeOldest();
+    up(nowMs);
+  }
+
+  void up(uint32_t nowMs) {
+    down_ = false;
+    nextAttemptMs_ = nowMs;
+  }
+
+  void wentDown(uint32_t nowMs) {
+    down_ = true;
+    nextAttemptMs_ = nowMs + opt_.backoffMaxMs;
+  }
+
+  std::string spoolPath(const SpoolFile& f) const {
+    char name[48];
+    snprintf(name, sizeof(name), "/%010llu-%u.lp", (unsigned long long)f.seq, f.points);
+    return opt_.spoolDir + name;
+  }
+
+  // The queue's oldest batch to disk (or lost, without a spool)
+  void spoolFront() {
+    Batch& b = queue_.front();
+    if (opt_.spoolDir.empty() || !writeSpool(b)) {
+      if (!opt_.spoolDir.empty()) spoolErrors++;
+      dropped += b.points;
+    } else {
+      spooled += b.points;
+    }
+    queue_.pop_front();
+  }
+
+  // Written under a temporary name and synced, then renamed: a crash
+  // leaves either the whole file or none
+  bool writeSpool(const Batch& b) {
+    SpoolFile f = {spoolSeq_++, b.points, b.body.size()};
+    std::string path = spoolPath(f);
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write(fd, b.body.data(), b.body.size()) == (ssize_t)b.body.size() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+      unlink(tmp.c_str());
+      return false;
+    }
+    spool_.push_back(f);
+    spooledBytes_ += f.bytes;
+    while (spooledBytes_ > opt_.spoolBytes && spool_.size() > 1) {
+      dropped += spool_.front().points;
+      removeOldest();
+    }
+    return true;
+  }
+
+  bool readSpool(const SpoolFile& f, std::string& body) const {
+    int fd = open(spoolPath(f).c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    body.resize(f.bytes);
+    bool ok = read(fd, &body[0], f.bytes) == (ssize_t)f.bytes;
+    close(fd);
+    return ok;
+  }
+
+  void removeOldest() {
+    unlink(spoolPath(spool_.front()).c_str());
+    spooledBytes_ -= spool_.front().bytes;
+    spool_.pop_front();
+  }
+
+  InfluxTransport* transport_ = nullptr;
+  InfluxOptions opt_;
+  std::map<std::string, std::string> prefixes_;
+  std::string batch_;
+  uint32_t batchPoints_ = 0;
+  uint32_t batchStartMs_ = 0;
+  std::deque<Batch> queue_;
+  std::deque<SpoolFile> spool_;
+  uint64_t spooledBytes_ = 0;
+  uint64_t spoolSeq_ = 0;
+  bool down_ = false;
+  uint32_t nextAttemptMs_ = 0;
+};
+
+// POSTs to an http:// write URL over one kept-alive connection, e.g.
+//   http://127.0.0.1:8086/api/v2/write?org=home&bucket=bms&precision=ms   (token)
+//   http://127.0.0.1:8086/write?db=bms&precision=ms                       (1.x)
+class HttpPoster : public InfluxTransport {
+public:
+  ~HttpPoster() override { disconnect(); }
+
+  bool begin(const std::string& url, const std::string& token = "", uint32_t timeoutMs = 5000) {
+    if (url.compare(0, 7, "http://") != 0) return false;
+    size_t hostEnd = url.find('/', 7);
+    std::string hostPort = url.substr(7, hostEnd == std::string::npos ? std::string::npos : hostEnd - 7);
+    path_ = hostEnd == std::string::npos ? "/" : url.substr(hostEnd);
+    size_t colon = hostPort.rfind(':');
+    host_ = colon == std::string::npos ? hostPort : hostPort.substr(0, colon);
+    port_ = colon == std::string::npos ? "80" : hostPort.substr(colon + 1);
+    timeoutMs_ = timeoutMs;
+    head_ = "POST " + path_ + " HTTP/1.1\r\nHost: " + hostPort + "\r\n";
+    if (!token.empty()) head_ += "Authorization: Token " + token + "\r\n";
+    head_ += "Content-Type: text/plain; charset=utf-8\r\nContent-Length: ";
+    return !host_.empty();
+  }
+
+  int post(const char* body, size_t len) override {
+    // A kept-alive connection may have been closed by the server meanwhile:
+    // one more try on a fresh one
+    for (int attempt = 0; attempt < 2; attempt++) {
+      bool reused = fd_ >= 0;
+      if (!reused && !connectNow()) return -1;
+      int status = exchange(body, len);
+      if (status > 0) return status;
+      disconnect();
+      if (!reused) return -1;
+    }
+    return -1;
+  }
+
+  uint32_t connects = 0;
+
+private:
+  bool connectNow() {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res) != 0) return false;
+    for (addrinfo* a = res; a && fd_ < 0; a = a->ai_next) {
+      int fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK, a->ai_protocol);
+      if (fd < 0) continue;
+      int rc = connect(fd, a->ai_addr, a->ai_addrlen);
+      if (rc != 0 && errno == EINPROGRESS) {
+        pollfd p = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t el = sizeof(err);
+        rc = poll(&p, 1, timeoutMs_) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &el) == 0 && err == 0 ? 0 : -1;
+      }
+      if (rc != 0) {
+        close(fd);
+        continue;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      fd_ = fd;
+      connects++;
+    }
+    freeaddrinfo(res);
+    return fd_ >= 0;
+  }
+
+  void disconnect() {
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1;
+    in_.clear();
+  }
+
+  // Request out, status line and headers in, body skipped; 0 on an I/O error
+  int exchange(const char* body, size_t len) {
+    std::string head = head_;
+    influxAppendInt(head, (int64_t)len);
+    head += "\r\n\r\n";
+    iovec iov[2] = {{(void*)head.data(), head.size()}, {(void*)body, len}};
+    if (!writeAll(iov, 2)) return 0;
+
+    size_t end;
+    while ((end = in_.find("\r\n\r\n")) == std::string::npos) {
+      if (!readMore()) return 0;
+    }
+    int status = 0;
+    if (sscanf(in_.c_str(), "HTTP/1.%*d %d", &status) != 1) return 0;
+    std::string headers = in_.substr(0, end + 2);
+    for (char& c : headers) c = (char)tolower((unsigned char)c);
+    in_.erase(0, end + 4);
+    size_t cl = headers.find("\r\ncontent-length:");
+    if (cl != std::string::npos) {
+      size_t n = strtoul(headers.c_str() + cl + 17, nullptr, 10);
+      while (in_.size() < n) {
+        if (!readMore()) return 0;
+      }
+      in_.erase(0, n);
+    } else if (headers.find("\r\ntransfer-encoding: chunked") != std::string::npos) {
+      while ((end = in_.find("0\r\n\r\n")) == std::string::npos) {
+        if (!readMore()) return 0;
+      }
+      in_.erase(0, end + 5);
+    }
+    if (headers.find("\r\nconnection: close") != std::string::npos) disconnect();
+    return status;
+  }
+
+  bool writeAll(iovec* iov, int count) {
+    while (count > 0) {
+      pollfd p = {fd_, POLLOUT, 0};
+      if (poll(&p, 1, timeoutMs_) != 1) return false;
+      msghdr msg = {};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      ssize_t n = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EAGAIN) continue;
+        return false;
+      }
+      while (count > 0 && (size_t)n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        count--;
+      }
+      if (count > 0) {
+        iov->iov_base = (char*)iov->iov_base + n;
+        iov->iov_len -= n;
+      }
+    }
+    return true;
+  }
+
+  bool readMore() {
+    char buf[4096];
+    pollfd p = {fd_, POLLIN, 0};
+    if (poll(&p, 1, timeoutMs_) != 1) return false;
+    ssize_t n = read(fd_, buf, sizeof(buf));
+    if (n <= 0) return false;
+    in_.append(buf, n);
+    return true;
+  }
+
+  std::string host_, port_, path_, head_;
+  uint32_t timeoutMs_ = 5000;
+  int fd_ = -1;
+  std::string in_;
+};
+
+// One serial port's byte stream into a shared InfluxExporter
+class InfluxPort {
+public:
+  InfluxPort(InfluxExporter& exporter, const std::string& portName)
+      : exporter_(exporter), portName_(portName),
+        scanner_([this](uint8_t topic, const uint8_t* payload, size_t len) { onFrame(topic, payload, len); }) {}
+
+  void feed(const uint8_t* data, size_t len, uint32_t nowMs) {
+    nowMs_ = nowMs;
+    scanner_.feed(data, len);
+  }
+
+  uint32_t frames() const { return scanner_.frames; }
+  uint32_t crcErrors() const { return scanner_.crcErrors; }
+  uint32_t exported = 0;
+  uint32_t undecodable = 0;
+
+private:
+  void onFrame(uint8_t topic, const uint8_t* payload, size_t len) {
+    if (topic != CDR_TOPIC_BATTERY_STATE) return;
+    DecodedBatteryState m;
+    if (!cdrDecodeBatteryState(payload, len, m)) {
+      undecodable++;
+      return;
+    }
+    exporter_.add(m.serial_number.empty() ? portName_ : m.serial_number, m, nowMs_);
+    exported++;
+  }
+
+  InfluxExporter& exporter_;
+  std::string portName_;
+  CdrFrameScanner scanner_;
+  uint32_t nowMs_ = 0;
+};
+
+#endif // INFLUX_EXPORT_H
@@ -0,0 +1,759 @@
+/*
+ * Native runner: boots the real firmware (src/main.cpp) against the fake
+ * BLE air and drives setup()/loop() on the virtual clock
+ *
+ * Usage: program [options]; --help lists them (USAGE below)
+ *
+ * A Modbus RTU master reads the whole register map once a virtual second,
+ * through the same RTU server the firmware's UART task runs, and fails the
+ * run on a malformed reply or a frame counter that goes backwards, and
+ * when the counter misses a decoded main info frame in any output format.
+ *
+ * Latency hops (BMS measurement stamp -> decoded sample on the host):
+ *   air       simulated BMS stamps the frame -> last notification at the ESP32 (rx_ms)
+ *   firmware  rx_ms -> first byte of the BMS_DATA line written to Serial
+ *   uart      first byte -> last byte on the wire at the configured baud
+ *   decode    host-side parse of the line (real CPU time)
+ */
+
+#include "Arduino.h"
+#include "fake_ble.h"
+#include "rtt_tracker.h"
+#include "frame_stats.h"
+#include "overload_controller.h"
+#include "cdr_decode.h"
+#include "raw_frames.h"
+#include "loop_profiler.h"
+#include "task_scheduler.h"
+#include "sd_logger.h"
+#include "gatt_export.h"
+#include "modbus_server.h"
+#include "can_bus.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+void setup();
+void loop();
+extern ResponseStats responseStats;
+extern RttTracker rttTracker;
+extern FrameStats frameStats;
+extern OverloadController overload;
+extern LoopProfiler loopProfiler;
+extern TaskScheduler scheduler;
+extern RawForwarder rawForwarder;
+extern OutputCost outputCost[4];
+extern SdLogger sdLog;
+extern GattExporter gattExport;
+extern ModbusImage modbusImage;
+extern CanExporter canExport;
+extern MemoryCanBus canBus;
+extern uint32_t canLinkDowns;
+
+namespace {
+  struct Options {
+    uint32_t seconds = 600;
+    int noise = 20;
+    uint32_t seed = 1;
+    bool verbose = false;
+    bool help = false;
+    long expectMinRecords = -1;
+    long expectMaxReconnectMs = -1;
+    std::vector<std::pair<uint8_t, uint32_t>> expectMaxFrames; // outcome, bound
+    bool latencyReport = false;
+    long latencyBudgetMs = -1;
+    std::string profile = "idle";
+    float currentA = 0.0f;
+    int8_t tempC[2] = {30, 30}; // T1, T2
+    int phones = 0;
+    bool can = false;
+    uint32_t inverterMs = 0;
+    fakeble::LinkProfile link;
+    std::vector<std::pair<uint32_t, std::string>> inputs;
+    unsigned long sinkBaud = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> sinkStalls;
+  };
+
+  const char USAGE[] =
+      "Usage: program [options]\n"
+      "  --seconds N          virtual run time (default 600)\n"
+      "  --noise N            unrelated advertisers in range (default 20)\n"
+      "  --connect-ms N       BLEClient::connect() latency\n"
+      "  --connect-fail P     probability a connect attempt fails\n"
+      "  --reply-ms N         write to first notification latency\n"
+      "  --chunk N            notification fragment size (0 = whole reply)\n"
+      "  --drop P             probability a request gets no reply\n"
+      "  --reply-jitter-ms N  uniform extra reply latency 0..N\n"
+      "  --slow P:MS          probability a reply is held back by another MS\n"
+      "  --corrupt P          probability one reply byte is flipped\n"
+      "  --link-drop MS       drop the link at virtual time MS (repeatable)\n"
+      "  --down-ms N          BMS unreachable for N ms after a link drop\n"
+      "  --input MS:TEXT      type TEXT on the serial console at MS (repeatable)\n"
+      "  --baud N             host reads Serial at no more than N baud\n"
+      "  --sink-stall MS:LEN  host stops reading Serial for LEN ms at MS (repeatable)\n"
+      "  --seed N             PRNG seed for the air\n"
+      "  --current A          pack current reported by the BMS (+ = charging)\n"
+      "  --temps T1:T2        cell sensor temperatures reported by the BMS, C (default 30:30)\n"
+      "  --phones N           N phones connect to our GATT server from 15 s on,\n"
+      "                       3 s apart, each asking for its own interval; every\n"
+      "                       notification is decoded and its spacing checked.\n"
+      "                       Each decoded main info frame must reach the GATT\n"
+      "                       snapshot in every output format, with or without phones\n"
+      "  --max-links N        ACL links of the BLE stack, the BMS link included\n"
+      "  --can                turn the CAN export on (types `set can_export 1`);\n"
+      "                       every frame is decoded and the 1 s grid checked\n"
+      "  --inverter-ms N      with --can, an inverter sends a keep-alive every N ms;\n"
+      "                       in every output format, raw included, each decoded\n"
+      "                       main info frame must reach the export\n"
+      "  --verbose            echo firmware Serial output\n"
+      "  --expect-min-records N      fail unless N records had data_found:true\n"
+      "  --expect-max-reconnect-ms N fail if any reconnect took longer\n"
+      "  --expect-max-frames OUTCOME:N fail if more than N replies ended in OUTCOME\n"
+      "                              (ok, crc, bad_length, late, ...; repeatable)\n"
+      "  --profile idle|loaded       preset air/console load for latency runs\n"
+      "  --latency-report            decode every record on the \"host\" side and\n"
+      "                              print per-hop latency CDFs\n"
+      "  --latency-budget-ms N       fail if end-to-end p99 exceeds N ms\n"
+      "  --help, -h                  print this list\n";
+
+  bool parseArgs(int argc, char** argv, Options& o) {
+    for (int i = 1; i < argc; i++) {
+      std::string a = argv[i];
+      const char* v = (i + 1 < argc) ? argv[i + 1] : nullptr;
+      if (a == "--help" || a == "-h") { o.help = true; return true; }
+      if (a == "--verbose") { o.verbose = true; continue; }
+      if (a == "--latency-report") { o.latencyReport = true; continue; }
+      if (a == "--can") { o.can = true; continue; }
+      if (!v) { fprintf(stderr, "missing value for %s\n", a.c_str()); return false; }
+      i++;
+      if (a == "--seconds") o.seconds = strtoul(v, nullptr, 10);
+      else if (a == "--noise") o.noise = atoi(v);
+      else if (a == "--connect-ms") o.link.connectLatencyMs = strtoul(v, nullptr, 10);
+      else if (a == "--connect-fail") o.link.connectFailRate = atof(v);
+      else if (a == "--reply-ms") o.link.responseLatencyMs = strtoul(v, nullptr, 10);
+      else if (a == "--chunk") o.link.notifyChunk = strtoul(v, nullptr, 10);
+      else if (a == "--drop") o.link.dropRate = atof(v);
+      else if (a == "--reply-jitter-ms") o.link.responseJitterMs = strtoul(v, nullptr, 10);
+      else if (a == "--slow") {
+        const char* colon = strchr(v, ':');
+        if (!colon) { fprintf(stderr, "--slow wants P:MS\n"); return false; }
+        o.link.slowRate = atof(v);
+        o.link.slowExtraMs = strtoul(colon + 1, nullptr, 10);
+      }
+      else if (a == "--corrupt") o.link.corruptRate = atof(v);
+      else if (a == "--baud") o.sinkBaud = strtoul(v, nullptr, 10);
+      else if (a == "--sink-stall") {
+        const char* colon = strchr(v, ':');
+        if (!colon) { fprintf(stderr, "--sink-stall wants MS:LEN\n"); return false; }
+        o.sinkStalls.push_back({(uint32_t)strtoul(v, nullptr, 10), (uint32_t)strtoul(colon + 1, nullptr, 10)});
+      }
+      else if (a == "--link-drop") o.link.linkDropAtMs.push_back(strtoul(v, nullptr, 10));
+      else if (a == "--down-ms") o.link.downAfterDropMs = strtoul(v, nullptr, 10);
+      else if (a == "--seed") o.seed = strtoul(v, nullptr, 10);
+      else if (a == "--current") o.currentA = atof(v);
+      else if (a == "--temps") {
+        const char* colon = strchr(v, ':');
+        if (!colon) { fprintf(stderr, "--temps wants T1:T2\n"); return false; }
+        o.tempC[0] = (int8_t)atoi(v);
+        o.tempC[1] = (int8_t)atoi(colon + 1);
+      }
+      else if (a == "--phones") o.phones = atoi(v);
+      else if (a == "--inverter-ms") o.inverterMs = strtoul(v, nullptr, 10);
+      else if (a == "--max-links") o.link.maxLinks = (uint8_t)atoi(v);
+      else if (a == "--expect-min-records") o.expectMinRecords = atol(v);
+      else if (a == "--expect-max-reconnect-ms") o.expectMaxReconnectMs = atol(v);
+      else if (a == "--expect-max-frames") {
+        const char* colon = strchr(v, ':');
+        uint8_t outcome = 0;
+        while (colon && outcome < FRAME_OUTCOMES &&
+               std::string(v, colon - v) != FRAME_OUTCOME_NAMES[outcome]) outcome++;
+        if (!colon || outcome == FRAME_OUTCOMES) { fprintf(stderr, "--expect-max-frames wants OUTCOME:N\n"); return false; }
+        o.expectMaxFrames.push_back({outcome, (uint32_t)strtoul(colon + 1, nullptr, 10)});
+      }
+      else if (a == "--latency-budget-ms") { o.latencyBudgetMs = atol(v); o.latencyReport = true; }
+      else if (a == "--profile") o.profile = v;
+      else if (a == "--input") {
+        std::string s = v;
+        size_t colon = s.find(':');
+        if (colon == std::string::npos) { fprintf(stderr, "--input wants MS:TEXT\n"); return false; }
+        o.inputs.push_back({(uint32_t)strtoul(s.c_str(), nullptr, 10), s.substr(colon + 1) + "\n"});
+      } else {
+        fprintf(stderr, "unknown option %s (--help lists them)\n", a.c_str());
+        return false;
+      }
+    }
+    if (o.profile == "loaded") {
+      // Crowded air, slow and lossy replies, and an operator hammering the console
+      o.noise = std::max(o.noise, 300);
+      o.link.responseLatencyMs = std::max<uint32_t>(o.link.responseLatencyMs, 120);
+      o.link.dropRate = std::max(o.link.dropRate, 0.02);
+      o.link.connectFailRate = std::max(o.link.connectFailRate, 0.1);
+      for (uint32_t ms = 1000; ms < o.seconds * 1000; ms += 700) o.inputs.push_back({ms, "status\n"});
+    } else if (o.profile != "idle") {
+      fprintf(stderr, "unknown profile %s\n", o.profile.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // A phone on our GATT server: what it asked for and what it got
+  struct Phone {
+    int connId = -1;
+    uint16_t intervalMs = 0;
+    uint8_t wants = GATT_WANT_ALL;   // parts asked for in the control write
+    uint8_t cccd = GATT_WANT_ALL;    // characteristics with notifications turned on
+    int8_t maxTemp = 0, minTemp = 0; // what the BMS reports
+    uint32_t packs = 0, pages = 0, bad = 0, early = 0;
+    uint32_t reads = 0;              // pack and all cell pages read as one snapshot
+    uint64_t lastPackUs = 0;
+    uint64_t minGapUs = UINT64_MAX;
+  };
+
+  // A phone without notifications reads the pack and every cell page (the
+  // cells characteristic, then 5a1e0005 on) at its interval. Each part must
+  // decode and all must carry the pack's sequence.
+  void readPhone(Phone& ph) {
+    if (!fakeble::centralStats(ph.connId).connected) return;
+    std::string pack = fakeble::readCentral(ph.connId, BLEUUID("5a1e0002-1d5b-4c8e-a6f0-7b3c2d9e8f10"));
+    GattPack v;
+    uint8_t seq = 0;
+    if (!pack.empty()) {
+      bool ok = gattDecodePack((const uint8_t*)pack.data(), pack.size(), v, &seq) && v.max_temp == ph.maxTemp;
+      for (uint8_t p = 0; p < GATT_CELL_PAGES && ok; p++) {
+        char uuid[37];
+        snprintf(uuid, sizeof(uuid), "5a1e%04x-1d5b-4c8e-a6f0-7b3c2d9e8f10", p == 0 ? 3 : 4 + p);
+        std::string page = fakeble::readCentral(ph.connId, BLEUUID(uuid));
+        ok = page.size() == GATT_PAGE_LEN && (uint8_t)page[0] == seq && page[1] == p * GATT_CELLS_PER_PAGE &&
+             page[2] == GATT_CELLS_PER_PAGE;
+      }
+      if (ok) ph.reads++;
+      else ph.bad++;
+    }
+    fakehw::schedule(fakehw::nowUs() + ph.intervalMs * 1000ULL, [&ph]() { readPhone(ph); });
+  }
+
+  // Phones connect 3 s apart and ask for 1, 2, 5, 0.2 and 10 s in turn; every
+  // third takes the pack payload only through the control write, every
+  // fourth (from the second) turns on only the pack CCCD, and every fifth
+  // turns on none, must get nothing and reads instead. A pack notification
+  // may arrive one connection interval early against the previous one, not
+  // more.
+  void schedulePhones(std::vector<Phone>& phones) {
+    static const uint16_t intervals[] = {1000, 2000, 5000, 200, 10000};
+    for (size_t i = 0; i < phones.size(); i++) {
+      phones[i].intervalMs = intervals[i % 5];
+      phones[i].wants = i % 3 == 2 ? GATT_WANT_PACK : GATT_WANT_ALL;
+      phones[i].cccd = i % 5 == 4 ? 0 : i % 4 == 1 ? GATT_WANT_PACK : GATT_WANT_ALL;
+      fakehw::schedule((15000 + i * 3000) * 1000ULL, [&phones, i]() {
+        Phone& ph = phones[i];
+        fakeble::Central c;
+        c.onNotify = [&ph, c](uint16_t, const BLEUUID& uuid, const uint8_t* data, size_t len) {
+          if (uuid.equals(BLEUUID("5a1e0002-1d5b-4c8e-a6f0-7b3c2d9e8f10"))) {
+            GattPack v;
+            if (!gattDecodePack(data, len, v) || v.max_cell_mv < v.min_cell_mv || v.max_temp != ph.maxTemp ||
+                v.min_temp != ph.minTemp || !(ph.wants & ph.cccd & GATT_WANT_PACK)) {
+              ph.bad++;
+            }
+            uint64_t now = fakehw::nowUs();
+            if (ph.packs > 0) {
+              uint64_t gap = now - ph.lastPackUs;
+              ph.minGapUs = std::min(ph.minGapUs, gap);
+              if (gap + c.connIntervalMs * 1000ULL < ph.intervalMs * 1000ULL) ph.early++;
+            }
+            ph.lastPackUs = now;
+            ph.packs++;
+          } else {
+            if (len < 3 || data[2] == 0 || data[2] > GATT_CELLS_PER_PAGE || len != 3u + 2 * data[2] ||
+                data[1] + data[2] > GATT_MAX_CELLS || !(ph.wants & ph.cccd & GATT_WANT_CELLS)) {
+              ph.bad++;
+            }
+            ph.pages++;
+          }
+        };
+        ph.connId = fakeble::connectCentral(c);
+        if (ph.connId < 0) return;
+        uint8_t control[3];
+        gattPutU16(control, ph.intervalMs);
+        control[2] = ph.wants;
+        fakeble::writeCentral(ph.connId, BLEUUID("5a1e0004-1d5b-4c8e-a6f0-7b3c2d9e8f10"), control, 3);
+        if (ph.cccd & GATT_WANT_PACK) {
+          fakeble::writeCccdCentral(ph.connId, BLEUUID("5a1e0002-1d5b-4c8e-a6f0-7b3c2d9e8f10"), 1);
+        }
+        if (ph.cccd & GATT_WANT_CELLS) {
+          fakeble::writeCccdCentral(ph.connId, BLEUUID("5a1e0003-1d5b-4c8e-a6f0-7b3c2d9e8f10"), 1);
+        }
+        if (!ph.cccd) readPhone(ph);
+      });
+    }
+  }
+
+  // An inverter on the RS-485 bus: reads the whole map through the RTU
+  // server the firmware's UART task runs and checks every reply
+  struct ModbusPoller {
+    ModbusRtuServer server;
+    ModbusStats stats;
+    uint32_t polls = 0, bad = 0, backwards = 0, linkUp = 0;
+    uint16_t lastFrames = 0;
+    int16_t maxTemp = 0, minTemp = 0; // what the BMS reports
+
+    void poll(uint64_t nowUs) {
+      if (polls == 0) server.begin(&modbusImage, 1, 9600, &stats);
+      uint8_t req[8] = {1, MODBUS_FC_READ_INPUT, 0, 0, 0, MB_REG_COUNT};
+      uint16_t crc = modbusCrc(req, 6);
+      req[6] = (uint8_t)crc;
+      req[7] = (uint8_t)(crc >> 8);
+      bool answered = false;
+      server.feed(req, sizeof(req), (uint32_t)nowUs, [&](const uint8_t* r, size_t len) {
+        answered = true;
+        check(r, len);
+      });
+      polls++;
+      if (!answered) bad++;
+    }
+
+    void check(const uint8_t* r, size_t len) {
+      uint16_t crc = modbusCrc(r, len - 2);
+      if (len != 5 + 2 * MB_REG_COUNT || r[1] != MODBUS_FC_READ_INPUT || r[2] != 2 * MB_REG_COUNT ||
+          r[len - 2] != (uint8_t)crc || r[len - 1] != (uint8_t)(crc >> 8)) {
+        bad++;
+        return;
+      }
+      auto reg = [r](uint16_t i) { return (uint16_t)(r[3 + 2 * i] << 8 | r[4 + 2 * i]); };
+      uint16_t frames = reg(MB_FRAMES);
+      if ((uint16_t)(frames - lastFrames) > 0x8000) backwards++;
+      lastFrames = frames;
+      if (reg(MB_CELL_COUNT) != 16) bad++;
+      // Temperatures are "none" until the first frame, then the BMS's own
+      if (frames == 0 && (reg(MB_MAX_TEMP) != MODBUS_NONE_SIGNED || reg(MB_MIN_TEMP) != MODBUS_NONE_SIGNED)) bad++;
+      if (frames != 0 && ((int16_t)reg(MB_MAX_TEMP) != maxTemp || (int16_t)reg(MB_MIN_TEMP) != minTemp)) bad++;
+      if (reg(MB_STATUS) & MODBUS_STATUS_LINK_UP) {
+        linkUp++;
+        if (reg(MB_PACK_VOLTAGE) == 0 || reg(MB_MIN_CELL) > reg(MB_MAX_CELL)) bad++;
+      }
+    }
+  };
+
+  // The inverter end of the CAN bus: decodes every frame and checks the
+  // 1 s grid of 0x351 (answers to keep-alives fall off the grid, so the
+  // grid is only checked without them)
+  struct Inverter {
+    uint32_t frames = 0, limits = 0, bad = 0, keepAlives = 0;
+    uint32_t commFail = 0, zeroLimits = 0;   // 0x359 communication fail, 0x351 with both currents 0
+    uint32_t gridIntervals = 0;
+    uint64_t lastLimitsUs = 0;
+    int16_t maxTemp = 0;             // what the BMS reports, C
+    double minIntervalMs = 1e9, maxIntervalMs = 0;
+
+    void onFrame(const CanFrame& f) {
+      frames++;
+      const CanSlot* slot = nullptr;
+      for (const CanSlot& s : CAN_SCHEDULE) {
+        if (s.id == f.id) slot = &s;
+      }
+      if (!slot || f.len != slot->len) {
+        bad++;
+        return;
+      }
+      if (f.id == 0x359 && (f.data[4] != 1 || f.data[5] != 'P' || f.data[6] != 'N')) bad++;
+      if (f.id == 0x359 && (f.data[3] & 0x08)) commFail++;
+      if (f.id == 0x356 && ((int16_t)canGetU16(f.data) <= 0 || (int16_t)canGetU16(f.data + 4) != maxTemp * 10)) {
+        bad++;
+      }
+      if (f.id == 0x355 && canGetU16(f.data) > 100) bad++;
+      if (f.id != 0x351) return;
+      if (canGetU16(f.data) != 16 * 3550 / 100 || canGetU16(f.data + 6) != 16 * 2900 / 100) bad++;
+      if (canGetU16(f.data + 2) == 0 && canGetU16(f.data + 4) == 0) zeroLimits++;
+      uint64_t now = fakehw::nowUs();
+      if (lastLimitsUs && keepAlives == 0) {
+        double ms = (now - lastLimitsUs) / 1000.0;
+        // Longer gaps are the export falling silent on stale data
+        if (ms < 1500) {
+          gridIntervals++;
+          minIntervalMs = std::min(minIntervalMs, ms);
+          maxIntervalMs = std::max(maxIntervalMs, ms);
+        }
+      }
+      lastLimitsUs = now;
+      limits++;
+    }
+
+    void keepAlive(uint32_t periodMs) {
+      CanFrame f;
+      f.id = CAN_ID_KEEPALIVE;
+      f.len = 8;
+      canBus.inbox.push_back(f);
+      keepAlives++;
+      fakehw::schedule(fakehw::nowUs() + periodMs * 1000ULL, [this, periodMs]() { keepAlive(periodMs); });
+    }
+  };
+
+  // One decoded sample as the host sees it, with per-hop latencies in microseconds
+  struct HopSample {
+    uint64_t air, firmware, uart, decode, total;
+  };
+
+  int hexNibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = tolower((unsigned char)c);
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+  }
+
+  // Host-side decoder: pull the raw frame back out of the JSON record,
+  // check its CRC and recover the simulator's sequence stamp
+  bool decodeRecord(const std::string& line, uint32_t& seq, uint64_t& rxMs) {
+    std::string lc = line;
+    for (auto& c : lc) c = tolower((unsigned char)c);
+
+    size_t rx = lc.find("\"rx_ms\":");
+    size_t hex = lc.find("\"response_data\":\"");
+    if (rx == std::string::npos || hex == std::string::npos) return false;
+    rxMs = strtoull(lc.c_str() + rx + 8, nullptr, 10);
+
+    hex += 17;
+    size_t end = lc.find('"', hex);
+    if (end == std::string::npos || (end - hex) != 129 * 2) return false;
+    uint8_t frame[129];
+    for (int i = 0; i < 129; i++) {
+      int hi = hexNibble(lc[hex + i * 2]), lo = hexNibble(lc[hex + i * 2 + 1]);
+      if (hi < 0 || lo < 0) return false;
+      frame[i] = (hi << 4) | lo;
+    }
+    uint16_t crc = fakeble::crcModbus(frame, 127);
+    if (frame[127] != (crc & 0xFF) || frame[128] != (crc >> 8)) return false;
+
+    seq = ((uint32_t)frame[35] << 24) | ((uint32_t)frame[36] << 16) | ((uint32_t)frame[37] << 8) | frame[38];
+    return true;
+  }
+
+  uint64_t percentile(std::vector<uint64_t> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t idx = (size_t)std::min<double>(v.size() - 1, std::ceil(p / 100.0 * v.size()) - 1);
+    return v[idx];
+  }
+
+  void printHop(const char* name, const std::vector<HopSample>& samples, uint64_t HopSample::*field) {
+    std::vector<uint64_t> v;
+    for (auto& s : samples) v.push_back(s.*field);
+    printf("LATENCY hop=%-8s p50=%.1fms p90=%.1fms p99=%.1fms max=%.1fms\n", name,
+           percentile(v, 50) / 1000.0, percentile(v, 90) / 1000.0,
+           percentile(v, 99) / 1000.0, percentile(v, 100) / 1000.0);
+  }
+}
+
+int main(int argc, char** argv) {
+  Options opt;
+  if (!parseArgs(argc, argv, opt)) return 2;
+  if (opt.help) {
+    fputs(USAGE, stdout);
+    return 0;
+  }
+
+  static fakeble::PackState pack;
+  pack.currentA = opt.currentA;
+  pack.tempC[0] = opt.tempC[0];
+  pack.tempC[1] = opt.tempC[1];
+  fakeble::reset(opt.seed);
+  fakeble::Peripheral bms;
+  bms.address = "41:18:12:01:18:9F";
+  bms.name = "DL-41181201189F";
+  bms.rssi = -62;
+  bms.serviceUUID = "fff0";
+  bms.dalyGatt = true;
+  bms.responder = fakeble::dalyResponder(&pack);
+  fakeble::addPeripheral(bms);
+  fakeble::addNoiseAdvertisers(opt.noise);
+  fakeble::setLinkProfile(opt.link);
+
+  for (auto& in : opt.inputs) fakehw::serialInput((uint64_t)in.first * 1000, in.second);
+  fakehw::throttleSerial(opt.sinkBaud);
+  std::vector<Phone> phones(opt.phones);
+  for (Phone& ph : phones) {
+    ph.maxTemp = std::max(opt.tempC[0], opt.tempC[1]);
+    ph.minTemp = std::min(opt.tempC[0], opt.tempC[1]);
+  }
+  Inverter inverter;
+  if (opt.can) {
+    inverter.maxTemp = std::max(opt.tempC[0], opt.tempC[1]);
+    fakehw::serialInput(0, "set can_export 1\n");
+    canBus.onSend = [&inverter](const CanFrame& f) { inverter.onFrame(f); };
+    if (opt.inverterMs) fakehw::schedule(20000 * 1000ULL, [&]() { inverter.keepAlive(opt.inverterMs); });
+  }
+  schedulePhones(phones);
+  for (auto& st : opt.sinkStalls) fakehw::stallSerial((uint64_t)st.first * 1000, (uint64_t)st.second * 1000);
+
+  uint32_t records = 0, goodRecords = 0, undecodable = 0;
+  uint32_t levelRecords[OVERLOAD_LEVELS] = {};
+  uint64_t recordBytes = 0;
+  std::vector<HopSample> hops;
+  fakehw::setQuiet(!opt.verbose);
+  // Framed CDR messages share the port with text; decode each one as the host would
+  uint32_t cdrBattery = 0, cdrCells = 0, cdrBad = 0;
+  // Raw passthrough records go through the shared decoder, timed
+  uint32_t rawDecoded = 0, rawBad = 0;
+  uint64_t rawDecodeNs = 0;
+  RawSequenceTracker rawSeq;
+  CdrFrameScanner cdrScanner([&](uint8_t topic, const uint8_t* payload, size_t len) {
+    DecodedBatteryState bs;
+    std::string label;
+    std::vector<float> cells;
+    if (topic == CDR_TOPIC_RAW_DALY) {
+      auto t0 = std::chrono::steady_clock::now();
+      RawRecord r;
+      DalyInfo info;
+      DalyMos mos;
+      bool ok = rawParseRecord(payload, len, r) && r.proto == RAW_PROTO_D203 &&
+                (r.command == FRAME_CMD_INFO ? dalyDecodeInfo(r.frame, r.len, info) : dalyDecodeMos(r.frame, r.len, mos));
+      rawDecodeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+      if (ok) {
+        rawDecoded++;
+        rawSeq.feed(r.seq);
+      } else {
+        rawBad++;
+      }
+    } else if (topic == CDR_TOPIC_BATTERY_STATE && cdrDecodeBatteryState(payload, len, bs) && bs.cell_voltage.size() == 16) {
+      cdrBattery++;
+    } else if (topic == CDR_TOPIC_CELL_VOLTAGES && cdrDecodeCellVoltages(payload, len, label, cells)) {
+      cdrCells++;
+    } else {
+      cdrBad++;
+    }
+  });
+  fakehw::setByteObserver([&](const uint8_t* data, size_t len) { cdrScanner.feed(data, len); });
+
+  fakehw::setLineObserver([&](const std::string& rawLine, uint64_t firstByteUs, uint64_t onWireUs) {
+    // A binary frame without a newline of its own ends up in front of the next line
+    size_t start = rawLine.find("BMS_DATA:");
+    if (start == std::string::npos) return;
+    std::string line = rawLine.substr(start);
+    records++;
+    recordBytes += line.size() + 1;
+    if (line.find("\"data_found\":true") != std::string::npos) goodRecords++;
+    for (uint8_t l = 0; l < OVERLOAD_LEVELS; l++) {
+      std::string tag = std::string("\"level\":\"") + OverloadController::name((OverloadLevel)l) + "\"";
+      if (line.find(tag) != std::string::npos) levelRecords[l]++;
+    }
+    if (!opt.latencyReport) return;
+
+    auto t0 = std::chrono::steady_clock::now();
+    uint32_t seq = 0;
+    uint64_t rxMs = 0;
+    bool ok = decodeRecord(line, seq, rxMs);
+    uint64_t decodeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+    uint64_t stampUs = ok ? fakeble::frameStampUs(seq) : 0;
+    if (!ok || stampUs == 0) {
+      undecodable++;
+      return;
+    }
+
+    HopSample h;
+    uint64_t rxUs = rxMs * 1000;
+    h.air = rxUs > stampUs ? rxUs - stampUs : 0;
+    h.firmware = firstByteUs > rxUs ? firstByteUs - rxUs : 0;
+    h.uart = onWireUs - firstByteUs;
+    h.decode = decodeUs;
+    h.total = (onWireUs - stampUs) + decodeUs;
+    hops.push_back(h);
+  });
+
+  auto wallStart = std::chrono::steady_clock::now();
+  uint64_t endUs = (uint64_t)opt.seconds * 1000000ULL;
+  uint64_t loops = 0;
+  std::vector<uint64_t> cycleMs; // read cycle durations as measured by the firmware
+  uint32_t cyclesSeen = 0;
+  ModbusPoller modbus;
+  modbus.maxTemp = std::max(opt.tempC[0], opt.tempC[1]);
+  modbus.minTemp = std::min(opt.tempC[0], opt.tempC[1]);
+  uint64_t nextModbusUs = 1000000;
+
+  setup();
+  while (fakehw::nowUs() < endUs) {
+    uint64_t before = fakehw::nowUs();
+    loop();
+    loops++;
+    if (responseStats.cycles != cyclesSeen) {
+      cyclesSeen = responseStats.cycles;
+      cycleMs.push_back(responseStats.lastCycleMs);
+    }
+    if (fakehw::nowUs() >= nextModbusUs) {
+      modbus.poll(fakehw::nowUs());
+      nextModbusUs += 1000000;
+    }
+    // A loop() that never delays would spin forever on a frozen clock
+    if (fakehw::nowUs() == before) fakehw::advanceUs(1000);
+  }
+
+  double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  const fakeble::Stats& st = fakeble::stats();
+  double virtMin = opt.seconds / 60.0;
+
+  uint32_t reconnectMax = 0;
+  uint64_t reconnectSum = 0;
+  for (uint32_t ms : st.reconnectMs) {
+    reconnectMax = std::max(reconnectMax, ms);
+    reconnectSum += ms;
+  }
+
+  printf("NATIVE_STATS virtual_s=%u wall_s=%.3f loops=%llu\n", opt.seconds, wallSec, (unsigned long long)loops);
+  printf("NATIVE_STATS scans=%u adverts=%u scan_results_peak=%u connect_attempts=%u connects=%u connect_failures=%u\n",
+         st.scans, st.advertisements, st.scanResultsPeak, st.connectAttempts, st.connects, st.connectFailures);
+  printf("NATIVE_STATS writes=%u replies_dropped=%u notifications=%u notify_bytes=%llu\n",
+         st.writes, st.repliesDropped, st.notifications, (unsigned long long)st.notifyBytes);
+  printf("NATIVE_STATS records=%u good_records=%u good_per_min=%.2f serial_bytes=%llu\n",
+         records, goodRecords, virtMin > 0 ? goodRecords / virtMin : 0.0,
+         (unsigned long long)Serial.bytesWritten());
+  const ResponseStats& rs = responseStats;
+  printf("NATIVE_STATS requests=%u replies=%u timeouts=%u retries=%u late_replies=%u failed_cycles=%u slow_replies=%u\n",
+         rs.requests, rs.replies, rs.timeouts, rs.retries, rs.lateReplies.load(), rs.failedCycles, st.slowReplies);
+  printf("NATIVE_STATS hedges=%u duplicate_replies=%u\n", rs.hedges, rs.duplicateReplies.load());
+  printf("NATIVE_STATS record_bytes=%llu level_full=%u level_compact=%u level_summary=%u level_heartbeat=%u"
+         " steps_down=%u steps_up=%u dropped=%u\n", (unsigned long long)recordBytes,
+         levelRecords[OVERLOAD_FULL], levelRecords[OVERLOAD_COMPACT], levelRecords[OVERLOAD_SUMMARY],
+         levelRecords[OVERLOAD_HEARTBEAT], overload.stepsDown(), overload.stepsUp(), overload.dropped());
+  printf("NATIVE_STATS cdr_battery_state=%u cdr_cell_voltages=%u cdr_undecodable=%u cdr_crc_errors=%u\n",
+         cdrBattery, cdrCells, cdrBad, cdrScanner.crcErrors);
+  printf("NATIVE_STATS raw_records=%u raw_forwarded=%u raw_rejected=%u raw_undecodable=%u raw_seq_gaps=%u"
+         " host_decode_ns=%.0f\n", rawDecoded, rawForwarder.forwarded(), rawForwarder.rejected(), rawBad, rawSeq.gaps(),
+         rawDecoded ? (double)rawDecodeNs / rawDecoded : 0.0);
+  printf("NATIVE_STATS sd_records=%u sd_dropped=%u sd_blocks=%u sd_writes=%u sd_write_errors=%u sd_files=%u\n",
+         sdLog.appended(), sdLog.dropped(), sdLog.blocksWritten(), sdLog.writes(), sdLog.writeErrors(),
+         sdLog.filesStarted());
+  uint32_t phonePacks = 0, phonePages = 0, phoneBad = 0, phoneEarly = 0;
+  for (size_t i = 0; i < phones.size(); i++) {
+    const Phone& ph = phones[i];
+    phonePacks += ph.packs;
+    phonePages += ph.pages;
+    phoneBad += ph.bad;
+    phoneEarly += ph.early;
+    printf("NATIVE_STATS phone=%zu conn=%d interval_ms=%u cccd=%u packs=%u pages=%u reads=%u min_gap_ms=%.0f"
+           " refused=%u\n", i, ph.connId, ph.intervalMs, ph.cccd, ph.packs, ph.pages, ph.reads, ph.packs > 1 ? ph.minGapUs / 1000.0 : 0.0,
+           ph.connId >= 0 ? fakeble::centralStats(ph.connId).refused : 0);
+  }
+  printf("NATIVE_STATS gatt_connects=%u gatt_turned_away=%u phones_rejected=%u gatt_snapshots=%u gatt_notifications=%u"
+         " gatt_congested=%u phone_packs=%u phone_pages=%u phone_bad=%u phone_early=%u\n",
+         gattExport.connects(), gattExport.rejected(), st.centralRejected, gattExport.snapshot().seq(),
+         gattExport.notifications(), gattExport.congested(), phonePacks, phonePages, phoneBad, phoneEarly);
+  printf("NATIVE_STATS modbus_polls=%u modbus_link_up=%u modbus_bad=%u modbus_backwards=%u modbus_frames=%u"
+         " modbus_retries=%u\n", modbus.polls, modbus.linkUp, modbus.bad, modbus.backwards, modbusImage.published(),
+         modbusImage.retries());
+  if (opt.can) {
+    printf("NATIVE_STATS can_frames=%u can_limits=%u can_bad=%u can_keepalives=%u can_answers=%u can_coalesced=%u"
+           " can_silent=%u can_grid_intervals=%u can_interval_min_ms=%.1f can_interval_max_ms=%.1f"
+           " can_link_downs=%u can_comm_fail=%u can_zero_limits=%u\n",
+           inverter.frames, inverter.limits, inverter.bad, inverter.keepAlives, canExport.answers(),
+           canExport.coalesced(), canExport.silent(), inverter.gridIntervals,
+           inverter.gridIntervals ? inverter.minIntervalMs : 0.0, inverter.maxIntervalMs, canLinkDowns,
+           inverter.commFail, inverter.zeroLimits);
+  }
+  const char* const outputNames[] = {"json", "cdr", "both", "raw"};
+  for (uint8_t i = 0; i < 4; i++) {
+    if (outputCost[i].frames == 0) continue;
+    printf("NATIVE_STATS output=%s frames=%u cpu_us_per_frame=%.2f\n", outputNames[i], outputCost[i].frames,
+           (double)outputCost[i].cycles / outputCost[i].frames / ESP.getCpuFreqMHz());
+  }
+  printf("NATIVE_STATS frames");
+  for (uint8_t o = 0; o < FRAME_OUTCOMES; o++) printf(" %s=%u", FRAME_OUTCOME_NAMES[o], frameStats.totalAll((FrameOutcome)o));
+  printf(" corrupted=%u\n", st.corruptReplies);
+  printf("NATIVE_STATS rtt_p50_ms=%u rtt_p99_ms=%u cycle_avg_ms=%.0f cycle_max_ms=%u\n",
+         rttTracker.percentile(500), rttTracker.percentile(990),
+         rs.cycles ? (double)rs.totalCycleMs / rs.cycles : 0.0, rs.maxCycleMs);
+  printf("NATIVE_STATS cycle_p50_ms=%llu cycle_p90_ms=%llu cycle_p99_ms=%llu cycle_p999_ms=%llu\n",
+         (unsigned long long)percentile(cycleMs, 50), (unsigned long long)percentile(cycleMs, 90),
+         (unsigned long long)percentile(cycleMs, 99), (unsigned long long)percentile(cycleMs, 99.9));
+  printf("NATIVE_STATS link_drops=%u reconnects=%zu reconnect_avg_ms=%.0f reconnect_max_ms=%u\n",
+         st.linkDrops, st.reconnectMs.size(),
+         st.reconnectMs.empty() ? 0.0 : (double)reconnectSum / st.reconnectMs.size(), reconnectMax);
+  printf("NATIVE_STATS loop_max_ms");
+  for (uint8_t i = 0; i < LOOP_SITES; i++) printf(" %s=%.1f", LOOP_SITE_NAMES[i], loopProfiler.site((LoopSite)i).maxUs / 1000.0);
+  printf("\nNATIVE_STATS loop_over_budget budget_ms=%u", loopProfiler.budgetMs());
+  for (uint8_t i = 0; i < LOOP_SITES; i++) {
+    if (loopProfiler.site((LoopSite)i).overBudget) printf(" %s=%u", LOOP_SITE_NAMES[i], loopProfiler.site((LoopSite)i).overBudget);
+  }
+  printf("\n");
+  for (uint8_t i = 0; i < scheduler.count(); i++) {
+    const TaskStats& ts = scheduler.stats(i);
+    printf("NATIVE_STATS task=%s runs=%u avg_us=%.0f max_us=%u avg_late_ms=%.2f max_late_ms=%u skipped=%u\n",
+           scheduler.name(i), ts.runs, ts.runs ? (double)ts.totalUs / ts.runs : 0.0, ts.maxUs,
+           ts.runs ? (double)ts.totalLateMs / ts.runs : 0.0, ts.maxLateMs, ts.skipped);
+  }
+
+  // Every decoded main info frame goes to the exports, whatever the output format
+  uint32_t infoDecoded = frameStats.total(FRAME_CMD_INFO, FRAME_OK);
+  int rc = 0;
+  if (opt.latencyReport) {
+    printf("LATENCY profile=%s samples=%zu undecodable=%u\n", opt.profile.c_str(), hops.size(), undecodable);
+    printHop("air", hops, &HopSample::air);
+    printHop("firmware", hops, &HopSample::firmware);
+    printHop("uart", hops, &HopSample::uart);
+    printHop("decode", hops, &HopSample::decode);
+    printHop("total", hops, &HopSample::total);
+
+    std::vector<uint64_t> totals;
+    for (auto& h : hops) totals.push_back(h.total);
+    static const double points[] = {10, 25, 50, 75, 90, 95, 99, 99.9, 100};
+    for (double p : points) {
+      printf("LATENCY_CDF p=%.1f total_ms=%.1f\n", p, percentile(totals, p) / 1000.0);
+    }
+
+    uint64_t p99 = percentile(totals, 99);
+    if (opt.latencyBudgetMs >= 0 && (hops.empty() || p99 > (uint64_t)opt.latencyBudgetMs * 1000)) {
+      printf("FAIL: end-to-end p99 %.1f ms exceeds budget %ld ms (%zu samples)\n",
+             p99 / 1000.0, opt.latencyBudgetMs, hops.size());
+      rc = 1;
+    }
+  }
+  if (phoneBad || phoneEarly) {
+    printf("FAIL: phones got %u malformed, unsubscribed or mismatched parts and %u ahead of their interval\n",
+           phoneBad, phoneEarly);
+    rc = 1;
+  }
+  if (gattExport.snapshot().seq() != infoDecoded) {
+    printf("FAIL: GATT snapshot %u after %u decoded frames\n", gattExport.snapshot().seq(), infoDecoded);
+    rc = 1;
+  }
+  if (opt.can && (inverter.bad || inverter.limits == 0 || (inverter.gridIntervals && inverter.minIntervalMs < 999.0) ||
+                  (inverter.keepAlives && canExport.answers() == 0))) {
+    printf("FAIL: CAN export sent %u malformed frames, %u limit frames, shortest grid interval %.1f ms, %u answers\n",
+           inverter.bad, inverter.limits, inverter.minIntervalMs, canExport.answers());
+    rc = 1;
+  }
+  if (opt.can && canExport.published() != infoDecoded + canLinkDowns) {
+    printf("FAIL: CAN export got %u of %u decoded frames and %u link drops\n", canExport.published(), infoDecoded,
+           canLinkDowns);
+    rc = 1;
+  }
+  if (opt.can && st.linkDrops && (canLinkDowns == 0 || inverter.commFail == 0 || inverter.zeroLimits == 0)) {
+    printf("FAIL: %u link drops, %u sent as communication fail; the inverter saw %u comm-fail and %u zero-limit"
+           " frames\n", st.linkDrops, canLinkDowns, inverter.commFail, inverter.zeroLimits);
+    rc = 1;
+  }
+  if (modbus.bad || modbus.backwards) {
+    printf("FAIL: Modbus master got %u bad replies, frame counter went back %u times\n", modbus.bad, modbus.backwards);
+    rc = 1;
+  }
+  if (modbusImage.reg(MB_FRAMES) != (uint16_t)infoDecoded) {
+    printf("FAIL: Modbus frame counter at %u after %u decoded frames\n", modbusImage.reg(MB_FRAMES), infoDecoded);
+    rc = 1;
+  }
+  if (opt.expectMinRecords >= 0 && goodRecords < (uint32_t)opt.expectMinRecords) {
+    printf("FAIL: %u good records, expected at least %ld\n", goodRecords, opt.expectMinRecords);
+    rc = 1;
+  }
+  for (auto& e : opt.expectMaxFrames) {
+    uint32_t n = frameStats.totalAll((FrameOutcome)e.first);
+    if (n > e.second) {
+      printf("FAIL: %u %s replies, expected at most %u\n", n, FRAME_OUTCOME_NAMES[e.first], e.second);
+      rc = 1;
+    }
+  }
+  if (opt.expectMaxReconnectMs >= 0) {
+    if (st.reconnectMs.size() < st.linkDrops) {
+      printf("FAIL: %u link drops but only %zu reconnects\n", st.linkDrops, st.reconnectMs.size());
+      rc = 1;
+    } else if (reconnectMax > (uint32_t)opt.expectMaxReconnectMs) {
+      printf("FAIL: reconnect took %u ms, budget %ld ms\n", reconnectMax, opt.expectMaxReconnectMs);
+      rc = 1;
+    }
+  }
+  return rc;
+}
@@ -0,0 +1,279 @@
+/*
+ * Host-side ingest of the serial stream into SQLite
+ *
+ * Each serial port gets an IngestPort. It pulls the framed BatteryState
+ * messages out of the stream (CdrFrameScanner, the text around them is
+ * skipped) and hands them to one SqliteIngest per database, so several
+ * packs can share a file. The pack is named by the message's serial_number
+ * (the BMS name), or by the port when the firmware has not found one.
+ *
+ * Writes are grouped: the first sample opens a transaction, and it commits
+ * after batchRows samples or batchMs, whichever comes first (tick() commits
+ * a quiet port's rows). Statements are prepared once. The database runs in
+ * WAL mode with synchronous=NORMAL, so a commit appends to the log without
+ * an fsync and only checkpoints sync. A power cut loses at most the open
+ * batch and the commits since the last checkpoint, never the file.
+ * syncFull makes every commit durable at one fsync per batch.
+ *
+ * Values are stored as integers (mV, mA, 0.1 %, mAh, ms). Cells go either
+ * in a `cells` table with one row per cell (normalized, easy to query per
+ * cell) or as a blob of little-endian u16 mV in the sample row (one row per
+ * sample, a quarter of the size).
+ *
+ *   packs(id, name)
+ *   samples(id, pack, t_ms, voltage_mv, current_ma, soc_dpct, charge_mah,
+ *           capacity_mah, status, cells_mv)   -- cells_mv NULL when normalized
+ *   cells(sample, idx, mv)                    -- normalized layout only
+ */
+
+#ifndef SQLITE_INGEST_H
+#define SQLITE_INGEST_H
+
+#include "cdr_decode.h"
+#include <map>
+#include <math.h>
+#include <sqlite3.h>
+#include <string>
+
+enum IngestLayout : uint8_t { INGEST_CELLS_TABLE = 0, INGEST_CELLS_BLOB = 1 };
+
+struct IngestOptions {
+  uint32_t batchRows = 100;    // commit after this many samples
+  uint32_t batchMs = 5000;     // or once the oldest uncommitted sample is this old
+  IngestLayout layout = INGEST_CELLS_BLOB;
+  bool syncFull = false;       // fsync every commit instead of only at checkpoints
+};
+
+// One BatteryState in storage units
+struct IngestSample {
+  int64_t t_ms = 0;
+  int32_t voltage_mv = 0;
+  int32_t current_ma = 0;
+  int32_t soc_dpct = 0;        // 0.1 %
+  int32_t charge_mah = 0;
+  int32_t capacity_mah = 0;
+  uint8_t status = 0;          // BATTERY_STATUS_*
+  uint8_t cells = 0;
+  uint16_t cell_mv[CDR_MAX_CELLS] = {};
+};
+
+inline bool ingestFromBatteryState(const DecodedBatteryState& m, IngestSample& s) {
+  if (m.cell_voltage.size() > CDR_MAX_CELLS) return false;
+  s.t_ms = (int64_t)m.stamp_sec * 1000 + m.stamp_nanosec / 1000000;
+  s.voltage_mv = (int32_t)lroundf(m.voltage * 1000.0f);
+  s.current_ma = (int32_t)lroundf(m.current * 1000.0f);
+  s.soc_dpct = (int32_t)lroundf(m.percentage * 1000.0f);
+  s.charge_mah = (int32_t)lroundf(m.charge * 1000.0f);
+  s.capacity_mah = (int32_t)lroundf(m.capacity * 1000.0f);
+  s.status = m.power_supply_status;
+  s.cells = (uint8_t)m.cell_voltage.size();
+  for (uint8_t i = 0; i < s.cells; i++) s.cell_mv[i] = (uint16_t)lroundf(m.cell_voltage[i] * 1000.0f);
+  return true;
+}
+
+class SqliteIngest {
+public:
+  ~SqliteIngest() { close(); }
+
+  bool open(const char* path, const IngestOptions& opt = IngestOptions()) {
+    close();
+    opt_ = opt;
+    if (sqlite3_open(path, &db_) != SQLITE_OK) return fail();
+    const char* setup = opt.syncFull ? "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL;"
+                                     : "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;";
+    if (!exec(setup) || !exec("CREATE TABLE IF NOT EXISTS packs(id INTEGER PRIMARY KEY, name TEXT UNIQUE NOT NULL);"
+                              "CREATE TABLE IF NOT EXISTS samples(id INTEGER PRIMARY KEY, pack INTEGER NOT NULL,"
+                              " t_ms INTEGER NOT NULL, voltage_mv INTEGER, current_ma INTEGER, soc_dpct INTEGER,"
+                              " charge_mah INTEGER, capacity_mah INTEGER, status INTEGER, cells_mv BLOB);"
+                              "CREATE INDEX IF NOT EXISTS samples_pack_t ON samples(pack, t_ms);"
+                              "CREATE TABLE IF NOT EXISTS cells(sample INTEGER NOT NULL, idx INTEGER NOT NULL,"
+                              " mv INTEGER NOT NULL, PRIMARY KEY(sample, idx)) WITHOUT ROWID;")) {
+      return fail();
+    }
+    if (!prepare(&insertSample_, "INSERT INTO samples(pack, t_ms, voltage_mv, current_ma, soc_dpct, charge_mah,"
+                                 " capacity_mah, status, cells_mv) VALUES(?,?,?,?,?,?,?,?,?)") ||
+        !prepare(&insertCell_, "INSERT INTO cells(sample, idx, mv) VALUES(?,?,?)") ||
+        !prepare(&insertPack_, "INSERT OR IGNORE INTO packs(name) VALUES(?)") ||
+        !prepare(&selectPack_, "SELECT id FROM packs WHERE name = ?") || !prepare(&begin_, "BEGIN") ||
+        !prepare(&commit_, "COMMIT")) {
+      return fail();
+    }
+    return true;
+  }
+
+  // One sample of pack `name`; commits when the batch is full or old
+  bool add(const std::string& name, const IngestSample& s, uint32_t nowMs) {
+    if (!db_) return false;
+    int64_t pack = packId(name);
+    if (pack < 0 || (!inTxn_ && !beginBatch(nowMs))) return error();
+    sqlite3_bind_int64(insertSample_, 1, pack);
+    sqlite3_bind_int64(insertSample_, 2, s.t_ms);
+    sqlite3_bind_int(insertSample_, 3, s.voltage_mv);
+    sqlite3_bind_int(insertSample_, 4, s.current_ma);
+    sqlite3_bind_int(insertSample_, 5, s.soc_dpct);
+    sqlite3_bind_int(insertSample_, 6, s.charge_mah);
+    sqlite3_bind_int(insertSample_, 7, s.capacity_mah);
+    sqlite3_bind_int(insertSample_, 8, s.status);
+    if (opt_.layout == INGEST_CELLS_BLOB) {
+      uint8_t blob[2 * CDR_MAX_CELLS];
+      for (uint8_t i = 0; i < s.cells; i++) {
+        blob[2 * i] = (uint8_t)s.cell_mv[i];
+        blob[2 * i + 1] = (uint8_t)(s.cell_mv[i] >> 8);
+      }
+      sqlite3_bind_blob(insertSample_, 9, blob, 2 * s.cells, SQLITE_TRANSIENT);
+    } else {
+      sqlite3_bind_null(insertSample_, 9);
+    }
+    if (!step(insertSample_)) return error();
+    if (opt_.layout == INGEST_CELLS_TABLE) {
+      int64_t sample = sqlite3_last_insert_rowid(db_);
+      for (uint8_t i = 0; i < s.cells; i++) {
+        sqlite3_bind_int64(insertCell_, 1, sample);
+        sqlite3_bind_int(insertCell_, 2, i);
+        sqlite3_bind_int(insertCell_, 3, s.cell_mv[i]);
+        if (!step(insertCell_)) return error();
+      }
+    }
+    samples++;
+    if (++batch_ >= opt_.batchRows) return commit();
+    return tick(nowMs);
+  }
+
+  // Commits an open batch once it is batchMs old; call when the ports are quiet
+  bool tick(uint32_t nowMs) {
+    if (inTxn_ && nowMs - batchStartMs_ >= opt_.batchMs) return commit();
+    return true;
+  }
+
+  bool commit() {
+    if (!inTxn_) return true;
+    inTxn_ = false;
+    batch_ = 0;
+    if (!step(commit_)) {
+      // A failed COMMIT leaves the transaction open; drop it rather than
+      // piling the next batch on top
+      sqlite3_exec(db_, "ROLLBACK", nullptr, nullptr, nullptr);
+      return error();
+    }
+    commits++;
+    return true;
+  }
+
+  void close() {
+    if (!db_) return;
+    commit();
+    sqlite3_stmt* stmts[] = {insertSample_, insertCell_, insertPack_, selectPack_, begin_, commit_};
+    for (sqlite3_stmt* s : stmts) sqlite3_finalize(s);
+    insertSample_ = insertCell_ = insertPack_ = selectPack_ = begin_ = commit_ = nullptr;
+    sqlite3_close(db_);
+    db_ = nullptr;
+    packs_.clear();
+  }
+
+  sqlite3* db() const { return db_; }
+  const std::string& lastError() const { return lastError_; }
+  uint32_t pending() const { return batch_; }
+
+  uint64_t samples = 0;
+  uint32_t commits = 0;
+  uint32_t errors = 0;
+
+private:
+  bool beginBatch(uint32_t nowMs) {
+    if (!step(begin_)) return false;
+    inTxn_ = true;
+    batchStartMs_ = nowMs;
+    return true;
+  }
+
+  int64_t packId(const std::string& name) {
+    auto it = packs_.find(name);
+    if (it != packs_.end()) return it->second;
+    sqlite3_bind_text(insertPack_, 1, name.c_str(), (int)name.size(), SQLITE_TRANSIENT);
+    sqlite3_bind_text(selectPack_, 1, name.c_str(), (int)name.size(), SQLITE_TRANSIENT);
+    if (!step(insertPack_) || sqlite3_step(selectPack_) != SQLITE_ROW) {
+      sqlite3_reset(selectPack_);
+      return -1;
+    }
+    int64_t id = sqlite3_column_int64(selectPack_, 0);
+    sqlite3_reset(selectPack_);
+    packs_[name] = id;
+    return id;
+  }
+
+  bool step(sqlite3_stmt* s) {
+    int rc = sqlite3_step(s);
+    sqlite3_reset(s);
+    if (rc == SQLITE_DONE || rc == SQLITE_ROW) return true;
+    lastError_ = sqlite3_errmsg(db_);
+    return false;
+  }
+
+  bool prepare(sqlite3_stmt** s, const char* sql) { return sqlite3_prepare_v2(db_, sql, -1, s, nullptr) == SQLITE_OK; }
+
+  bool exec(const char* sql) { return sqlite3_exec(db_, sql, nullptr, nullptr, nullptr) == SQLITE_OK; }
+
+  bool error() {
+    errors++;
+    if (lastError_.empty() && db_) lastError_ = sqlite3_errmsg(db_);
+    return false;
+  }
+
+  bool fail() {
+    lastError_ = db_ ? sqlite3_errmsg(db_) : "out of memory";
+    close();
+    return false;
+  }
+
+  IngestOptions opt_;
+  sqlite3* db_ = nullptr;
+  sqlite3_stmt* insertSample_ = nullptr;
+  sqlite3_stmt* insertCell_ = nullptr;
+  sqlite3_stmt* insertPack_ = nullptr;
+  sqlite3_stmt* selectPack_ = nullptr;
+  sqlite3_stmt* begin_ = nullptr;
+  sqlite3_stmt* commit_ = nullptr;
+  std::map<std::string, int64_t> packs_;
+  bool inTxn_ = false;
+  uint32_t batch_ = 0;
+  uint32_t batchStartMs_ = 0;
+  std::string lastError_;
+};
+
+// One serial port's byte stream into a shared SqliteIngest
+class IngestPort {
+public:
+  IngestPort(SqliteIngest& db, const std::string& portName)
+      : db_(db), portName_(portName),
+        scanner_([this](uint8_t topic, const uint8_t* payload, size_t len) { onFrame(topic, payload, len); }) {}
+
+  void feed(const uint8_t* data, size_t len, uint32_t nowMs) {
+    nowMs_ = nowMs;
+    scanner_.feed(data, len);
+  }
+
+  uint32_t frames() const { return scanner_.frames; }
+  uint32_t crcErrors() const { return scanner_.crcErrors; }
+  uint32_t stored = 0;
+  uint32_t undecodable = 0;  // a BatteryState frame with a good CRC that does not decode
+
+private:
+  void onFrame(uint8_t topic, const uint8_t* payload, size_t len) {
+    // The cell array frame repeats what the BatteryState carries
+    if (topic != CDR_TOPIC_BATTERY_STATE) return;
+    DecodedBatteryState m;
+    IngestSample s;
+    if (!cdrDecodeBatteryState(payload, len, m) || !ingestFromBatteryState(m, s)) {
+      undecodable++;
+      return;
+    }
+    if (db_.add(m.serial_number.empty() ? portName_ : m.serial_number, s, nowMs_)) stored++;
+  }
+
+  SqliteIngest& db_;
+  std::string portName_;
+  CdrFrameScanner scanner_;
+  uint32_t nowMs_ = 0;
+};
+
+#endif // SQLITE_INGEST_H
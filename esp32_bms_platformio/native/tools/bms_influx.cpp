@@ -0,0 +1,128 @@
+/*
+ * Sends the BatteryState messages of one or more serial ports to InfluxDB
+ * as line protocol (native/influx_export.h). The firmware must send framed
+ * CDR records (`set output 1` or 2). A port of "-" reads stdin.
+ *
+ * Build: g++ -std=gnu++17 -O2 -Iinclude -Inative native/tools/bms_influx.cpp -o bms_influx
+ * Run:   ./bms_influx --url 'http://127.0.0.1:8086/api/v2/write?org=home&bucket=bms&precision=ms' \
+ *          [--token T] [--tags site=shed] [--spool DIR] [--points N] [--ms T] /dev/ttyUSB0 [...]
+ */
+
+#include "influx_export.h"
+#include <chrono>
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int) { stopping = 1; }
+
+static uint32_t nowMs() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static int openPort(const char* path) {
+  if (strcmp(path, "-") == 0) return STDIN_FILENO;
+  int fd = open(path, O_RDONLY | O_NOCTTY);
+  if (fd < 0) return -1;
+  termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  return fd;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: bms_influx --url URL [--token T] [--tags K=V,...] [--spool DIR] [--points N] [--ms T] "
+                  "PORT...\n");
+}
+
+int main(int argc, char** argv) {
+  InfluxOptions opt;
+  std::string url, token;
+  int i = 1;
+  for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+    if (i + 1 >= argc) {
+      usage();
+      return 2;
+    }
+    if (!strcmp(argv[i], "--url")) url = argv[++i];
+    else if (!strcmp(argv[i], "--token")) token = argv[++i];
+    else if (!strcmp(argv[i], "--tags")) opt.tags = argv[++i];
+    else if (!strcmp(argv[i], "--spool")) opt.spoolDir = argv[++i];
+    else if (!strcmp(argv[i], "--points")) opt.batchPoints = (uint32_t)atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--ms")) opt.batchMs = (uint32_t)atoi(argv[++i]);
+    else {
+      usage();
+      return 2;
+    }
+  }
+  HttpPoster poster;
+  if (i >= argc || opt.batchPoints == 0 || !poster.begin(url, token)) {
+    usage();
+    return 2;
+  }
+  InfluxExporter exporter;
+  if (!exporter.begin(&poster, opt)) {
+    perror(opt.spoolDir.c_str());
+    return 1;
+  }
+  if (exporter.spoolFiles()) fprintf(stderr, "spool: %zu batches from an earlier run\n", exporter.spoolFiles());
+
+  std::vector<pollfd> fds;
+  std::vector<std::unique_ptr<InfluxPort>> ports;
+  int firstPort = i;
+  for (; i < argc; i++) {
+    int fd = openPort(argv[i]);
+    if (fd < 0) {
+      perror(argv[i]);
+      return 1;
+    }
+    fds.push_back({fd, POLLIN, 0});
+    ports.emplace_back(new InfluxPort(exporter, argv[i]));
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  uint8_t buf[4096];
+  size_t open = fds.size();
+  while (!stopping && open > 0) {
+    int ready = poll(fds.data(), fds.size(), 200);
+    for (size_t p = 0; ready > 0 && p < fds.size(); p++) {
+      if (!(fds[p].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      ssize_t n = read(fds[p].fd, buf, sizeof(buf));
+      if (n > 0) {
+        ports[p]->feed(buf, (size_t)n, nowMs());
+      } else {
+        fds[p].fd = -1;  // end of a replay, or the adapter was unplugged
+        open--;
+      }
+    }
+    exporter.service(nowMs());
+  }
+  exporter.flush(nowMs());
+
+  for (size_t p = 0; p < ports.size(); p++) {
+    fprintf(stderr, "%s: %u frames, %u exported, %u undecodable, %u bad CRC\n", argv[firstPort + p],
+            ports[p]->frames(), ports[p]->exported, ports[p]->undecodable, ports[p]->crcErrors());
+  }
+  fprintf(stderr, "%llu points: %llu sent (%llu from the spool), %llu rejected, %llu dropped, %zu batches spooled; "
+                  "%u posts, %u failed\n",
+          (unsigned long long)exporter.points, (unsigned long long)exporter.sent,
+          (unsigned long long)exporter.replayed, (unsigned long long)exporter.rejected,
+          (unsigned long long)exporter.dropped, exporter.spoolFiles(), exporter.posts, exporter.failures);
+  return exporter.dropped || exporter.rejected ? 1 : 0;
+}
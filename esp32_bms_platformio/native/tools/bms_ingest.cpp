@@ -0,0 +1,115 @@
+/*
+ * Stores the BatteryState messages of one or more serial ports in SQLite
+ * (native/sqlite_ingest.h). The firmware must send framed CDR records
+ * (`set output 1` or 2). A port of "-" reads stdin, so a capture can be
+ * replayed: bms_ingest site.db - < capture.bin
+ *
+ * Build: g++ -std=gnu++17 -O2 -Iinclude -Inative native/tools/bms_ingest.cpp -lsqlite3 -o bms_ingest
+ * Run:   ./bms_ingest [--rows N] [--ms T] [--cells table|blob] [--sync-full] site.db /dev/ttyUSB0 [/dev/ttyUSB1 ...]
+ */
+
+#include "sqlite_ingest.h"
+#include <chrono>
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int) { stopping = 1; }
+
+static uint32_t nowMs() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static int openPort(const char* path) {
+  if (strcmp(path, "-") == 0) return STDIN_FILENO;
+  int fd = open(path, O_RDONLY | O_NOCTTY);
+  if (fd < 0) return -1;
+  termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  return fd;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: bms_ingest [--rows N] [--ms T] [--cells table|blob] [--sync-full] DB PORT...\n");
+}
+
+int main(int argc, char** argv) {
+  IngestOptions opt;
+  int i = 1;
+  for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+    if (!strcmp(argv[i], "--rows") && i + 1 < argc) opt.batchRows = (uint32_t)atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--ms") && i + 1 < argc) opt.batchMs = (uint32_t)atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--cells") && i + 1 < argc)
+      opt.layout = strcmp(argv[++i], "table") == 0 ? INGEST_CELLS_TABLE : INGEST_CELLS_BLOB;
+    else if (!strcmp(argv[i], "--sync-full")) opt.syncFull = true;
+    else {
+      usage();
+      return 2;
+    }
+  }
+  if (argc - i < 2 || opt.batchRows == 0) {
+    usage();
+    return 2;
+  }
+
+  SqliteIngest db;
+  if (!db.open(argv[i], opt)) {
+    fprintf(stderr, "%s: %s\n", argv[i], db.lastError().c_str());
+    return 1;
+  }
+  std::vector<pollfd> fds;
+  std::vector<std::unique_ptr<IngestPort>> ports;
+  for (i++; i < argc; i++) {
+    int fd = openPort(argv[i]);
+    if (fd < 0) {
+      perror(argv[i]);
+      return 1;
+    }
+    fds.push_back({fd, POLLIN, 0});
+    ports.emplace_back(new IngestPort(db, argv[i]));
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  uint8_t buf[4096];
+  size_t open = fds.size();
+  while (!stopping && open > 0) {
+    int ready = poll(fds.data(), fds.size(), 200);
+    for (size_t p = 0; ready > 0 && p < fds.size(); p++) {
+      if (!(fds[p].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      ssize_t n = read(fds[p].fd, buf, sizeof(buf));
+      if (n > 0) {
+        ports[p]->feed(buf, (size_t)n, nowMs());
+      } else {
+        fds[p].fd = -1;  // end of a replay, or the adapter was unplugged
+        open--;
+      }
+    }
+    db.tick(nowMs());
+  }
+  db.commit();
+
+  for (size_t p = 0; p < ports.size(); p++) {
+    fprintf(stderr, "%s: %u frames, %u stored, %u undecodable, %u bad CRC\n", argv[argc - ports.size() + p],
+            ports[p]->frames(), ports[p]->stored, ports[p]->undecodable, ports[p]->crcErrors());
+  }
+  fprintf(stderr, "%llu samples in %u commits, %u errors%s%s\n", (unsigned long long)db.samples, db.commits,
+          db.errors, db.errors ? ": " : "", db.errors ? db.lastError().c_str() : "");
+  return db.errors ? 1 : 0;
+}
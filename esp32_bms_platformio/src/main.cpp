@@ -12,10 +12,47 @@
 #include "BLEScan.h"
 #include "BLEAdvertisedDevice.h"
 #include "BLEClient.h"
+#include "BLEServer.h"
+#include "BLE2902.h"
+#include "device_table.h"
+#include "flash_log.h"
+#include "tiered_history.h"
+#include "sd_logger.h"
+#include "gatt_export.h"
+#include "modbus_server.h"
+#include "can_export.h"
+#include "soc_ekf.h"
+#include "runtime_estimator.h"
+#include "power_profile.h"
+#include "config_store.h"
+#include "rtt_tracker.h"
+#include "frame_stats.h"
+#include "overload_controller.h"
+#include "cdr_battery.h"
+#include "daly_decode.h"
+#include "raw_frames.h"
+#include "loop_profiler.h"
+#include "task_scheduler.h"
+#include "protothread.h"
+#ifdef BMS_NATIVE
+#include "flash_image.h"
+#include "block_image.h"
+#include "config_file.h"
+#include "can_bus.h"
+#else
+#include "WiFi.h"
+#endif
+
+// Runtime configuration (target BMS, timing, capacity); `config` / `set` on the console
+ConfigStore configStore;
+const RuntimeConfig& cfg = configStore.get();
+#ifdef BMS_NATIVE
+FileConfigBackend configBackend;
+#else
+NvsConfigBackend configBackend;
+#endif
 
 // Daly BMS Configuration
-const String TARGET_BMS_MAC = "41:18:12:01:18:9F";
-const String TARGET_BMS_NAME = "DL-41181201189F";
 String discovered_bms_mac = "";
 String discovered_bms_name = "";
 bool bms_found_by_scan = false;
@@ -33,110 +70,386 @@ struct BMSData {
   float soc = 0.0;               // State of charge (%)
   uint16_t max_cell_voltage = 0; // Max cell voltage (mV)
   uint16_t min_cell_voltage = 0; // Min cell voltage (mV)
-  uint8_t max_temp = 0;          // Max temperature (°C)
-  uint8_t min_temp = 0;          // Min temperature (°C)
+  int16_t max_temp = 0;          // Max of the cell sensors T1/T2 (°C)
+  int16_t min_temp = 0;          // Min of the cell sensors T1/T2 (°C)
+  int16_t temp_c[3] = {};        // T1, T2, MOS (°C)
   uint16_t cycles = 0;           // Charge cycles
   bool protection_status = false; // Protection status
   float remaining_capacity = 0.0; // Remaining capacity (Ah)
   float full_capacity = 0.0;     // Full capacity (Ah)
+  uint16_t cell_mv[16] = {};     // Cell voltages (mV)
+  bool charge_mos = true;        // MOS_INFO; taken as on until a reply says otherwise
+  bool discharge_mos = true;
 };
 
 BMSData bmsData;
 bool connected = false;
-unsigned long lastReadTime = 0;
-unsigned long lastScanTime = 0;
-int deviceCount = 0;
-const unsigned long READ_INTERVAL = 5000; // Read every 5 seconds
-const unsigned long SCAN_INTERVAL = 30000; // Scan every 30 seconds if not connected
+unsigned long lastScanTime = 0;       // end of the last scan
+const unsigned long METRICS_INTERVAL = 60000; // BMS_METRICS line while connected
+DeviceTable bleDevices;                // every advertiser in range, filled by the scan callback
+uint32_t scanStartMs = 0;
+uint32_t scanStartAdverts = 0;
+
+// Cooperative tasks: loop() runs whatever is due and idles until the next deadline
+TaskScheduler scheduler;
+uint8_t taskCommand, taskLink, taskScan, taskConnect, taskPoll, taskMetrics, taskHistory, taskSdLog, taskGatt, taskCan;
+const uint32_t COMMAND_POLL_MS = 200;    // console input
+const uint32_t LINK_CHECK_MS = 1000;     // BLE link supervision
+const uint32_t CONNECT_RETRY_MS = 10000; // between connect attempts
+const uint32_t SCAN_SECONDS = 10;
+const uint32_t SCAN_POLL_MS = 100;       // re-check when the scan callback is late
+bool scanning = false;
+volatile bool scanComplete = false;      // set by the scan-complete callback
 
 // Response handling variables
-String lastResponse = "";
-bool responseReceived = false;
+String lastResponse = "";              // hex of the last main info reply, for the full record
+volatile bool responseReceived = false; // the awaited reply is complete
+DalyReplyAssembler replyAssembler;     // its notifications, put together in notifyCallback
+unsigned long lastResponseTime = 0; // millis() when the last reply was completed
+volatile bool requestPending = false;  // a request is waiting for its reply
+volatile bool droppingReply = false;   // the frame coming in answers no pending request
+volatile uint8_t duplicatesOutstanding[FRAME_COMMANDS] = {}; // hedged writes per command whose reply may still arrive
+unsigned long requestSentTime = 0;
+const uint8_t RESPONSE_RETRIES = 1;    // fast retries after a reply timeout
+RttTracker rttTracker;
+ResponseStats responseStats;
+FrameStats frameStats;                 // reply outcomes per command, per link and since boot
+volatile FrameCommand pendingCommand = FRAME_CMD_INFO; // command of the last request written
 uint8_t expectedCommand = 0;
 BLERemoteCharacteristic* pNotifyCharacteristic = nullptr;
 
+// One read cycle as a resumable sequence (include/protothread.h): look up
+// and subscribe to the Daly characteristics once per link, then MOS_INFO and
+// CMD_INFO, each written and awaited without holding loop(). pollTask()
+// calls it every REPLY_POLL_MS while a reply is due. Locals do not survive
+// a wait, so everything kept across one lives here.
+struct ReadSequence {
+  Pt pt;
+  Pt request;              // requestReply() of the command below
+  FrameCommand cmd;
+  uint8_t attempt;
+  bool hedged;
+  bool replyOk;            // the request was answered (the frame may still be bad)
+  uint32_t cycleStartMs;
+  uint32_t waitMs;         // reply timeout of this attempt
+  uint32_t hedgeMs;        // duplicate write after this long, 0 = none
+  uint8_t frames;          // replies taken this cycle
+  uint32_t outputCycles;   // CPU cycles spent on them, from reply to output
+};
+ReadSequence readSeq;
+const uint32_t REPLY_POLL_MS = 10;
+BLERemoteCharacteristic* dalyRx = nullptr;  // fff1, notifications
+BLERemoteCharacteristic* dalyTx = nullptr;  // fff2, requests
+const char* dalyStatus = "";                // characteristic lookup, for the full record
+uint8_t infoFrame[DALY_REPLY_MAX];          // last main info reply
+size_t infoFrameLen = 0;
+unsigned long infoRxMs = 0;
+FrameOutcome infoOutcome = FRAME_TIMEOUT;   // its check, for the record
+
 // Enhanced connection management
 int connectionAttempts = 0;
-unsigned long lastConnectionAttempt = 0;
+unsigned long lastConnectionAttempt = 0; // spacing for the connect task
 bool autoConnect = true;
 
+// SOC estimator (EKF over coulomb counting + rested OCV)
+const SocChemistry& PACK_CHEMISTRY = CHEMISTRY_LFP;
+const uint8_t PACK_CELLS = 16;
+const unsigned long SOC_RESEED_GAP = 300000; // re-seed from the BMS after 5 min without data
+SocEkf socEstimator;
+unsigned long lastSocUpdate = 0;
+
+// Time to empty / full from the SOC estimate and the smoothed current
+RuntimeEstimator runtimeEstimator(&CHARGE_LFP);
+unsigned long lastRuntimeUpdate = 0;
+
+// Rolling peak power and load-duration histogram
+PowerProfile powerProfile;
+// One sample per read: the deques hold a whole window only down to POWER_SAMPLE_MIN_MS
+static_assert(CONFIG_READ_MS_MIN >= POWER_SAMPLE_MIN_MS, "read_ms may go below what the power windows are sized for");
+
+// Record fidelity under serial backpressure
+const size_t SERIAL_TX_BUFFER = 4096; // TX ring on top of the UART FIFO, the sink queue we watch
+OverloadController overload;
+unsigned long lastHeartbeatTime = 0;
+uint8_t lastAlarms = 0;
+
+// Alarms, carried by every record level (LFP cell limits)
+const uint16_t ALARM_CELL_HIGH_MV = 3650;
+const uint16_t ALARM_CELL_LOW_MV = 2800;
+const float ALARM_SOC_LOW_PCT = 10.0;
+enum : uint8_t { ALARM_NO_DATA = 1, ALARM_CELL_HIGH = 2, ALARM_CELL_LOW = 4, ALARM_SOC_LOW = 8 };
+const char* const ALARM_NAMES[] = {"no_data", "cell_high", "cell_low", "soc_low"};
+
+// Framed CDR output (`set output 1|2`): BatteryState + cell array straight from the snapshot
+// Raw passthrough (`set output 3`): each reply forwarded as received, decoded on the host
+enum : uint32_t { OUTPUT_JSON = 0, OUTPUT_CDR = 1, OUTPUT_BOTH = 2, OUTPUT_RAW = 3 };
+static uint8_t cdrFrameBuf[CDR_FRAME_MAX];
+RawForwarder rawForwarder;
+bool lastReadOk = false; // the last read cycle decoded a frame
+static_assert(PACK_CELLS <= CDR_MAX_CELLS, "cell array must fit the CDR frame");
+static_assert(CDR_FRAME_OVERHEAD + RAW_RECORD_HEADER + RAW_FRAME_MAX <= CDR_FRAME_MAX,
+              "a raw record must fit the CDR frame");
+
+// CPU time from reply to output per output format, for `status`
+OutputCost outputCost[OUTPUT_RAW + 1];
+
+// How long each blocking region holds loop() (`stats`, budget `set block_ms`)
+LoopProfiler loopProfiler;
+void reportLoopBlock(LoopSite site, uint32_t startMs, uint32_t us);
+
+// Times the enclosing scope as one block of `site`; stop() ends it early
+class LoopBlockTimer {
+public:
+  explicit LoopBlockTimer(LoopSite site) : site_(site), startMs_(millis()), startUs_(micros()) {}
+  ~LoopBlockTimer() { stop(); }
+  void stop() {
+    if (done_) return;
+    done_ = true;
+    reportLoopBlock(site_, startMs_, micros() - startUs_);
+  }
+private:
+  LoopSite site_;
+  uint32_t startMs_;
+  uint32_t startUs_;
+  bool done_ = false;
+};
+
+// Flash sample log (ring of 4 KB segments on the log partition)
+#ifdef BMS_NATIVE
+RamFlashStorage logStorage(1408 * 1024);
+#else
+EspPartitionStorage logStorage;
+#endif
+FlashLog flashLog;
+bool flashLogReady = false;
+uint32_t logClockBase = 0; // continues the log timeline across reboots without a wall clock
+
+// Sample history: raw samples in internal RAM, minutes in PSRAM, then the flash log
+const uint32_t HISTORY_RAM_SAMPLES = 720;                  // 1 h at the default 5 s read interval
+const uint32_t HISTORY_PSRAM_BYTES = 2UL * 1024 * 1024;    // half the PSRAM of a 4 MB WROVER: 91 days
+const uint32_t HISTORY_FALLBACK_MINUTES = 240;             // in internal RAM on boards without PSRAM
+const uint32_t HISTORY_COMPACT_MS = 10000;                 // background compaction period
+const uint32_t HISTORY_SLICE_MS = 50;                      // between slices while a backlog drains
+LogSample historyRam[HISTORY_RAM_SAMPLES];
+TieredHistory history;
+bool historyInPsram = false;
+
+// Raw log on an SD card: every valid reply as a raw record, written to the
+// card by its own task from two block buffers
+const uint8_t SD_CS_PIN = 5;                 // VSPI CS
+const uint32_t SD_TICK_MS = 1000;            // flush check (and the writer on the host)
+#ifdef BMS_NATIVE
+RamBlockDevice sdCard(16384);                // 8 MB image, labelled at boot
+#else
+EspSdBlockDevice sdCard;
+TaskHandle_t sdWriterHandle = nullptr;
+#endif
+SdLogger sdLog;
+RawForwarder sdRecorder;                     // own sequence numbers: gaps in the log are its own
+static_assert(RAW_RECORD_HEADER + RAW_FRAME_MAX <= SD_RECORD_MAX, "a raw record must fit an SD block");
+
+// GATT re-export: phones read the decoded pack from our own server instead
+// of taking the BMS's single central slot (include/gatt_export.h)
+const char* const GATT_SERVICE_UUID = "5a1e0001-1d5b-4c8e-a6f0-7b3c2d9e8f10";
+const char* const GATT_PACK_UUID = "5a1e0002-1d5b-4c8e-a6f0-7b3c2d9e8f10";    // read/notify, 20-byte pack payload
+const char* const GATT_CELLS_UUID = "5a1e0003-1d5b-4c8e-a6f0-7b3c2d9e8f10";   // read/notify, cell pages
+const char* const GATT_CONTROL_UUID = "5a1e0004-1d5b-4c8e-a6f0-7b3c2d9e8f10"; // write: interval, wanted parts
+const char* const GATT_PAGE_UUID_FMT = "5a1e%04x-1d5b-4c8e-a6f0-7b3c2d9e8f10"; // read, cell page p >= 1 at 0004 + p
+const uint32_t GATT_IDLE_MS = 1000;    // re-check for new phones without a new frame
+const uint32_t GATT_RETRY_MS = 30;     // after a refused notification, about one connection interval
+static_assert(PACK_CELLS <= GATT_MAX_CELLS, "cell array must fit the GATT cell pages");
+GattExporter gattExport;
+BLEServer* gattServer = nullptr;
+BLECharacteristic* gattPackChar = nullptr;
+BLECharacteristic* gattCellsChar = nullptr;
+BLECharacteristic* gattPageChars[GATT_CELL_PAGES] = {}; // page 0 is gattCellsChar
+BLE2902* gattPackCccd = nullptr;
+BLE2902* gattCellsCccd = nullptr;
+
+// Notifications to one connection at a time: the library's notify() goes
+// to every peer at once, which leaves no room for per-phone intervals
+class StackGattNotifier : public GattNotifier {
+public:
+  bool notify(uint16_t connId, GattChar ch, const uint8_t* data, uint8_t len) override {
+    BLECharacteristic* c = ch == GATT_CHAR_PACK ? gattPackChar : gattCellsChar;
+    return esp_ble_gatts_send_indicate((esp_gatt_if_t)gattServer->getGattsIf(), connId, c->getHandle(), len,
+                                       (uint8_t*)data, false) == ESP_OK;
+  }
+};
+StackGattNotifier gattNotifier;
+
+// On the BLE task: only the exporter's slot atomics are touched here
+class GattServerCallbacks : public BLEServerCallbacks {
+  void onConnect(BLEServer* server, esp_ble_gatts_cb_param_t* param) {
+    if (!gattExport.connect(param->connect.conn_id)) {
+      server->disconnect(param->connect.conn_id);
+      return;
+    }
+    server->startAdvertising(); // the stack stops advertising on connect; stay visible to the next phone
+  }
+  void onDisconnect(BLEServer* server, esp_ble_gatts_cb_param_t* param) {
+    gattExport.disconnect(param->disconnect.conn_id);
+    server->startAdvertising();
+  }
+};
+
+class GattControlCallbacks : public BLECharacteristicCallbacks {
+  void onWrite(BLECharacteristic* c, esp_ble_gatts_cb_param_t* param) {
+    gattExport.control(param->write.conn_id, c->getData(), c->getLength());
+  }
+};
+
+// A phone's CCCD write. The BLE2902 keeps one value for every phone, so
+// the per-connection bit comes from the raw GATTS event, which carries the
+// conn_id. Only notifications (bit 0) count: indications are never sent.
+void gattsEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param) {
+  (void)gatts_if;
+  if (event != ESP_GATTS_WRITE_EVT || param->write.len != 2) return;
+  bool on = param->write.value[0] & 0x01;
+  if (param->write.handle == gattPackCccd->getHandle()) {
+    gattExport.subscribe(param->write.conn_id, GATT_CHAR_PACK, on);
+  } else if (param->write.handle == gattCellsCccd->getHandle()) {
+    gattExport.subscribe(param->write.conn_id, GATT_CHAR_CELLS, on);
+  }
+}
+
+// Modbus server: inverters and SCADA poll the pack as registers, RTU on the
+// second UART (RS-485, driver enable on RTS) and TCP on port 502 once Wi-Fi
+// is configured. Both are answered from the register image on their own
+// task; the loop only publishes (include/modbus_server.h)
+const uint8_t MODBUS_RX_PIN = 16;
+const uint8_t MODBUS_TX_PIN = 17;
+const uint8_t MODBUS_DE_PIN = 4;
+const uint8_t MODBUS_TCP_CLIENTS = 4;
+static_assert(PACK_CELLS <= MODBUS_CELLS, "cell array must fit the Modbus cell registers");
+ModbusImage modbusImage;
+ModbusStats modbusRtuStats;
+ModbusStats modbusTcpStats;
+uint16_t modbusRegs[MB_REG_COUNT];           // loop only: the next image, host order
+std::atomic<bool> modbusRestart{false};      // unit or baud changed: the task picks them up
+#ifndef BMS_NATIVE
+WiFiServer modbusListener(MODBUS_PORT);
+TaskHandle_t modbusHandle = nullptr;
+#endif
+
+// CAN export: the pack as a Pylontech battery to a hybrid inverter, sent on
+// the TWAI controller by a task of its own so BLE work on the loop never
+// shifts the schedule (include/can_export.h)
+const uint8_t CAN_TX_PIN = 25;
+const uint8_t CAN_RX_PIN = 26;
+const uint16_t CAN_CELL_CHARGE_MV = 3550;      // charge voltage limit per cell (LFP)
+const uint16_t CAN_CELL_DISCHARGE_MV = 2900;   // discharge voltage limit per cell
+const uint32_t CAN_RECOVER_MS = 1000;          // bus-off check
+CanExporter canExport;
+bool canStarted = false;
+uint32_t canLinkDowns = 0;                     // link drops sent as communication fail
+#ifdef BMS_NATIVE
+MemoryCanBus canBus;
+#else
+TwaiCanDriver canBus;
+TaskHandle_t canHandle = nullptr;
+#endif
+
 // Daly BMS Protocol Constants (from Python reference)
 const uint8_t HEAD_READ[2] = {0xD2, 0x03};
 const uint8_t CMD_INFO[6] = {0x00, 0x00, 0x00, 0x3E, 0xD7, 0xB9};
 const uint8_t MOS_INFO[6] = {0x00, 0x3E, 0x00, 0x09, 0xF7, 0xA3};
 
-// BLE Scan Callback Class
+// BLE scan callback, on the BLE task for every advertisement: one table
+// update, no String, no printing (finishScan() reports the scan)
 class MyAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
   void onResult(BLEAdvertisedDevice advertisedDevice) {
-    deviceCount++;
-    
-    String deviceName = advertisedDevice.getName().c_str();
-    String deviceAddress = advertisedDevice.getAddress().toString().c_str();
-    
-    // Always show all discovered devices
-    Serial.println("Device #" + String(deviceCount) + ": " + deviceName + " [" + deviceAddress + "]");
-    Serial.println("  RSSI: " + String(advertisedDevice.getRSSI()) + " dBm");
-    
-    if (advertisedDevice.haveServiceUUID()) {
-      Serial.print("  Service UUID: ");
-      Serial.println(advertisedDevice.getServiceUUID().toString().c_str());
-    }
-    
-    // Check if this might be a Daly BMS
-    if (deviceName.indexOf("Daly") >= 0 || 
-        deviceName.indexOf("BMS") >= 0 || 
-        deviceName.indexOf("DL-") >= 0 ||
-        deviceName.indexOf("41181201189F") >= 0 ||
-        deviceAddress.equalsIgnoreCase(TARGET_BMS_MAC) ||
-        deviceName.equalsIgnoreCase(TARGET_BMS_NAME)) {
-      
-      Serial.println("*** Potential BMS device found! ***");
-      Serial.println("Name: " + deviceName);
-      Serial.println("MAC: " + deviceAddress);
-      
-      if (deviceAddress.equalsIgnoreCase(TARGET_BMS_MAC) || 
-          deviceName.equalsIgnoreCase(TARGET_BMS_NAME)) {
-        Serial.println("*** Target BMS found! ***");
-        discovered_bms_mac = deviceAddress;
-        discovered_bms_name = deviceName;
-        bms_found_by_scan = true;
-      } else if (discovered_bms_mac.length() == 0) {
-        // Store first potential BMS if target not found
-        discovered_bms_mac = deviceAddress;
-        discovered_bms_name = deviceName;
-        Serial.println("*** Stored as potential BMS ***");
-      }
-    }
-    Serial.println("---");
+    const char* name = nullptr;
+    uint8_t nameLen = 0;
+    advertisedName(advertisedDevice.getPayload(), advertisedDevice.getPayloadLength(), name, nameLen);
+    bleDevices.observe(*advertisedDevice.getAddress().getNative(), name, nameLen, advertisedDevice.getRSSI(),
+                       advertisedDevice.haveServiceUUID(), millis());
   }
 };
 
 // Notification callback function
 static void notifyCallback(BLERemoteCharacteristic* pBLERemoteCharacteristic, uint8_t* pData, size_t length, bool isNotify) {
-  Serial.print("Notification received: ");
-  for (int i = 0; i < length; i++) {
-    if (pData[i] < 16) Serial.print("0");
-    Serial.print(String(pData[i], HEX));
+  // Raw dumps only while the sink keeps up with full records
+  if (overload.level() == OVERLOAD_FULL) {
+    Serial.print("Notification received: ");
+    for (int i = 0; i < length; i++) {
+      if (pData[i] < 16) Serial.print("0");
+      Serial.print(String(pData[i], HEX));
+    }
+    Serial.println();
   }
-  Serial.println();
   
-  // Store response for processing
-  lastResponse = "";
-  for (int i = 0; i < length; i++) {
-    if (pData[i] < 16) lastResponse += "0";
-    lastResponse += String(pData[i], HEX);
+  // A new frame says by its length byte which command it answers; trailing
+  // fragments go with the frame they continue
+  bool frameStart = length >= 2 && pData[0] == HEAD_READ[0] && pData[1] == HEAD_READ[1];
+  if (frameStart) {
+    FrameCommand answers = pendingCommand;
+    bool known = dalyReplyCommand(pData, length, answers);
+    droppingReply = !requestPending || responseReceived || (known && answers != pendingCommand);
+    if (droppingReply) {
+      // Nobody is waiting for it: a late reply to a request that already
+      // timed out, which may land while the next command waits (or the
+      // second answer to a hedged request, which is expected). Count, drop.
+      if (duplicatesOutstanding[answers] > 0) {
+        duplicatesOutstanding[answers]--;
+        responseStats.duplicateReplies.fetch_add(1, std::memory_order_relaxed);
+        frameStats.count(answers, FRAME_DUPLICATE);
+      } else {
+        responseStats.lateReplies.fetch_add(1, std::memory_order_relaxed);
+        frameStats.count(answers, FRAME_LATE);
+      }
+      return;
+    }
+  } else if (droppingReply || !requestPending || responseReceived) {
+    return;
+  }
+  
+  // A reply longer than one notification is put back together first
+  if (replyAssembler.feed(pData, length)) {
+    lastResponseTime = millis();
+    responseReceived = true;
   }
-  responseReceived = true;
 }
 
 // Function declarations
 void scanForBMS();
+void finishScan();
 void connectToBMS();
+void setConnected(bool up);
+void commandTask();
+void linkTask();
+void scanTask();
+void connectTask();
+void pollTask();
+void metricsTask();
+void historyTask();
+void sdLogTask();
+void gattTask();
+void canBusTask();
+void printTaskStats();
 void readBMSData();
+PT_THREAD(readSequence(ReadSequence& s));
+PT_THREAD(requestReply(ReadSequence& s));
+void resetReadSequence();
+void takeReply(ReadSequence& s);
+void finishReadCycle(ReadSequence& s);
+bool decodeInfoFrame();
+void publishSnapshot();
+void forwardRawFrame(FrameCommand cmd);
+bool findDalyCharacteristics();
+void writeRequest(FrameCommand cmd);
+void parseMosReply();
+void printOutputCost();
 void readBMSDataDirect();
 void tryMultipleServices();
-String createBMSJsonOutput();
-bool tryProperDalyProtocolJson(String& protocolData);
+String createBMSJsonOutput(OverloadLevel level);
+uint16_t sinkQueuePermille();
+uint8_t packAlarms(bool dataFound);
+void emitCdrFrames(OverloadLevel level);
+void writeCdrFrame(uint8_t topic, size_t payloadLen);
+void writeJsonRecord(const String& jsonOutput);
+bool dalyProtocolJson(String& protocolData);
+uint16_t readUInt16BE(uint8_t* data, int offset);
 bool tryService02f00000();
 bool tryServiceFFF0();
 bool tryDirectReads();
@@ -153,84 +466,285 @@ uint8_t calculateChecksum(uint8_t* data, int length);
 void parseBMSCharacteristic(String uuid, std::string value);
 void handleSerialCommands();
 void printAvailableCommands();
+void updateSocEstimate();
+void updateRuntimeEstimate();
+String runtimeJson();
+void printRuntimeEstimate();
+void printPowerProfile();
+void printConfig();
+void formatConfigValue(uint8_t index, char* out, size_t len);
+void printLinkTiming();
+void printFrameStats();
+void printLoopProfile();
+String frameStatsJson();
+void setConfigValue(String args);
+void applyConfig(uint8_t index);
+void beginFlashLog();
+void beginHistory();
+void logBMSSample();
+uint32_t logTimestamp();
+void printHistory(uint32_t seconds);
+void printHistoryUsage();
+void beginSdLog();
+void stopSdLog();
+void logRawReply(FrameCommand cmd);
+void printSdLogStatus();
+void printDevices();
+void beginGattExport();
+void exportGattSnapshot();
+void printGattStatus();
+void beginModbus();
+void beginWifi();
+void exportModbusRegisters();
+void printModbusStatus();
+void printModbusMap();
+void beginCanExport();
+void exportCanFrames(bool linkUp = true);
+void printCanStatus();
+#ifndef BMS_NATIVE
+void modbusTask(void* arg);
+void canTask(void* arg);
+#endif
 
 void setup() {
+  Serial.setTxBufferSize(SERIAL_TX_BUFFER);
   Serial.begin(115200);
   delay(1000);
   
   Serial.println("=== ESP32 Daly BMS BLE Reader v4.1 ===");
   Serial.println("Enhanced with proper Daly protocol + fallback methods");
-  Serial.println("Target BMS MAC: " + TARGET_BMS_MAC);
-  Serial.println("Target BMS Name: " + TARGET_BMS_NAME);
+  uint8_t loaded = configStore.begin(&configBackend);
+  Serial.println("Target BMS MAC: " + String(cfg.bms_mac));
+  Serial.println("Target BMS Name: " + String(cfg.bms_name));
+  Serial.printf("Config: %u stored value(s) loaded%s\n", loaded,
+                configStore.persistent() ? "" : " (storage unavailable, changes will not persist)");
+  loopProfiler.setBudgetMs(cfg.block_budget_ms);
   Serial.println("==========================================");
   
+  scheduler.begin([]() -> uint32_t { return millis(); }, []() -> uint32_t { return micros(); });
+  taskCommand = scheduler.add("command", commandTask, COMMAND_POLL_MS, 0);
+  taskLink = scheduler.add("link", linkTask, LINK_CHECK_MS, LINK_CHECK_MS);
+  taskScan = scheduler.add("scan", scanTask, cfg.scan_interval_ms);
+  taskConnect = scheduler.add("connect", connectTask, CONNECT_RETRY_MS);
+  taskPoll = scheduler.add("poll", pollTask, cfg.read_interval_ms);
+  taskMetrics = scheduler.add("metrics", metricsTask, METRICS_INTERVAL, METRICS_INTERVAL);
+  taskHistory = scheduler.add("history", historyTask, HISTORY_COMPACT_MS, HISTORY_COMPACT_MS);
+  taskSdLog = scheduler.add("sdlog", sdLogTask, SD_TICK_MS, SD_TICK_MS);
+  taskGatt = scheduler.add("gatt", gattTask, 0);
+  taskCan = scheduler.add("can", canBusTask, CAN_RECOVER_MS);
+  
   // Initialize BLE
   BLEDevice::init("ESP32_BMS_Reader");
   Serial.println("BLE initialized successfully.");
   
   // Create BLE Scanner
   pBLEScan = BLEDevice::getScan();
-  pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks());
+  // Duplicates wanted: every advertisement reaches the device table (RSSI,
+  // last seen), and the library keeps no per-address result on the heap
+  pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks(), true);
   pBLEScan->setActiveScan(true); // Active scan uses more power but gets more info
   pBLEScan->setInterval(100);
   pBLEScan->setWindow(99);
+  beginGattExport();
+  beginModbus();
+  beginCanExport();
+  
+  beginFlashLog();
+  beginHistory();
+  beginSdLog();
   
   printAvailableCommands();
   
-  // Start with a BLE scan
+  // Start with a BLE scan; the connect task follows once it finds the BMS
   scanForBMS();
 }
 
 void loop() {
-  // Handle serial commands
-  handleSerialCommands();
+  LoopBlockTimer pass(LOOP_SITE_PASS);
+  uint32_t idleMs = scheduler.run();
+  pass.stop();
   
-  if (!connected) {
-    // Auto-connect if BMS found but not connected (and auto-connect is enabled)
-    if (autoConnect && discovered_bms_mac.length() > 0) {
-      // Prevent too frequent connection attempts
-      if (millis() - lastConnectionAttempt >= 10000) {
-        connectToBMS();
-        lastConnectionAttempt = millis();
-      }
-    }
-    
-    // Scan for BMS periodically if not connected
-    if (millis() - lastScanTime >= SCAN_INTERVAL) {
-      scanForBMS();
-      lastScanTime = millis();
-    }
-    
-    delay(1000);
+  // Nothing due before the next deadline: delay() blocks this task and lets
+  // the CPU idle (and the BLE stack run) until then
+  LoopBlockTimer idle(LOOP_SITE_IDLE);
+  delay(idleMs);
+}
+
+void commandTask() {
+  handleSerialCommands();
+}
+
+// Link supervision; a lost link hands over from polling to reconnecting
+void linkTask() {
+  if (connected && pClient && !pClient->isConnected()) {
+    Serial.println("BMS connection lost!");
+    setConnected(false);
+  }
+}
+
+// Starts a scan, then runs again when its window ends to report it
+void scanTask() {
+  if (!scanning) {
+    if (!connected) scanForBMS();
     return;
   }
-  
-  // Check if it's time to read data
-  if (millis() - lastReadTime >= READ_INTERVAL) {
-    readBMSData();
-    lastReadTime = millis();
+  if (!scanComplete) {
+    scheduler.wake(taskScan, SCAN_POLL_MS);
+    return;
   }
-  
-  // Check connection status
-  if (pClient && !pClient->isConnected()) {
-    Serial.println("BMS connection lost!");
-    connected = false;
+  finishScan();
+  if (connected) scheduler.suspend(taskScan); // a manual scan while connected does not repeat
+}
+
+// Auto-connect if a BMS was found; spaced CONNECT_RETRY_MS apart and never
+// during a scan (finishScan() wakes it). BLEClient::connect() itself blocks.
+void connectTask() {
+  if (connected || scanning || !autoConnect || discovered_bms_mac.length() == 0) return;
+  connectToBMS();
+  lastConnectionAttempt = millis();
+}
+
+// Runs the read sequence; while it waits for a reply the task checks back
+// every REPLY_POLL_MS, and a finished cycle re-arms read_ms after its start
+void pollTask() {
+  LoopBlockTimer block(LOOP_SITE_READ_CYCLE);
+  if (PT_SCHEDULE(readSequence(readSeq))) {
+    scheduler.wake(taskPoll, REPLY_POLL_MS);
+    return;
   }
-  
-  delay(100);
+  uint32_t elapsed = millis() - readSeq.cycleStartMs;
+  scheduler.wake(taskPoll, elapsed >= cfg.read_interval_ms ? 0 : cfg.read_interval_ms - elapsed);
+}
+
+// Frame-quality counters for the host side, skipped when the sink is backed up
+void metricsTask() {
+  if (!connected) return;
+  LoopBlockTimer block(LOOP_SITE_METRICS);
+  String metrics = "BMS_METRICS:" + frameStatsJson();
+  if ((size_t)Serial.availableForWrite() >= metrics.length() + 2) Serial.println(metrics);
+}
+
+// History compaction, at low priority: never while a read sequence waits
+// for replies (retried halfway to the next read), and in bounded slices
+// with the other tasks in between
+void historyTask() {
+  if (PT_IN_PROGRESS(&readSeq.pt)) {
+    scheduler.wake(taskHistory, cfg.read_interval_ms / 2);
+    return;
+  }
+  LoopBlockTimer block(LOOP_SITE_FLASH_LOG);
+  if (history.compact()) scheduler.wake(taskHistory, HISTORY_SLICE_MS);
+}
+
+// Hands over a buffer holding data older than the flush interval. On the
+// ESP32 the card writes happen on the writer task; on the host, here.
+void sdLogTask() {
+  sdLog.tick(millis());
+#ifdef BMS_NATIVE
+  while (sdLog.writePending()) {
+  }
+#endif
+}
+
+// Notifications due to the phones, from the snapshot encoded at the last
+// frame; back soon after a refused one, else when the next phone is due
+void gattTask() {
+  uint32_t nextMs = gattExport.service(gattNotifier, millis());
+  scheduler.wake(taskGatt, nextMs == 0 ? GATT_RETRY_MS : nextMs < GATT_IDLE_MS ? nextMs : GATT_IDLE_MS);
+}
+
+// The CAN schedule has a task of its own on the ESP32, which leaves a
+// bus-off check here; on the host the schedule runs here, on the virtual clock
+void canBusTask() {
+#ifdef BMS_NATIVE
+  CanFrame f;
+  while (canBus.receive(f, 0)) canExport.onReceive(f, micros());
+  uint32_t waitUs = canExport.service(canBus, micros());
+  scheduler.wake(taskCan, (waitUs + 999) / 1000);
+#else
+  canBus.recover();
+#endif
 }
 
+// Connected: poll; disconnected: reconnect and rescan, each picking up its
+// spacing from the last attempt/scan
+void setConnected(bool up) {
+  if (up == connected) return;
+  connected = up;
+  resetReadSequence();
+  if (up) {
+    scheduler.suspend(taskConnect);
+    scheduler.suspend(taskScan);
+    scheduler.wake(taskPoll, 0);
+    return;
+  }
+  scheduler.suspend(taskPoll);
+  // Masters see the link drop now rather than the last frame going stale
+  modbusRegs[MB_STATUS] &= ~MODBUS_STATUS_LINK_UP;
+  modbusRegs[MB_ALARMS] = ALARM_NO_DATA;
+  modbusImage.publish(modbusRegs);
+  exportCanFrames(false);
+  uint32_t sinceAttempt = millis() - lastConnectionAttempt;
+  scheduler.wake(taskConnect, sinceAttempt >= CONNECT_RETRY_MS ? 0 : CONNECT_RETRY_MS - sinceAttempt);
+  if (!scanning) {
+    uint32_t sinceScan = millis() - lastScanTime;
+    scheduler.wake(taskScan, sinceScan >= cfg.scan_interval_ms ? 0 : cfg.scan_interval_ms - sinceScan);
+  }
+}
+
+// Runs in the BLE task when the scan window closes
+static void onScanComplete(BLEScanResults /*results*/) {
+  scanComplete = true;
+}
+
+// Starts a scan in the background; results arrive through the advertised
+// device callback and scanTask() reports them when the window has closed
 void scanForBMS() {
+  LoopBlockTimer block(LOOP_SITE_SCAN);
   Serial.println("\n=== Scanning for BLE devices ===");
-  Serial.println("Scanning for 10 seconds...");
+  Serial.printf("Scanning for %u seconds...\n", SCAN_SECONDS);
   
-  deviceCount = 0;
+  bleDevices.setTarget(cfg.bms_mac, cfg.bms_name);
+  bleDevices.expire(millis(), DEVICE_EXPIRE_MS);
+  scanStartMs = millis();
+  scanStartAdverts = bleDevices.adverts();
+  scanComplete = false;
+  scanning = pBLEScan->start(SCAN_SECONDS, onScanComplete, false);
+  if (!scanning) {
+    Serial.println("❌ BLE scan could not be started");
+    return;
+  }
+  scheduler.wake(taskScan, SCAN_SECONDS * 1000);
+}
+
+void finishScan() {
+  scanning = false;
+  lastScanTime = millis();
+  Serial.println("=== Scan completed ===");
   
-  // Start BLE scan
-  BLEScanResults foundDevices = pBLEScan->start(10, false);
+  // Devices heard in this window; the BMS candidates by name
+  uint32_t deviceCount = 0;
+  bleDevices.forEach([&deviceCount](const DeviceEntry& e) {
+    if ((int32_t)(e.lastSeenMs - scanStartMs) < 0) return;
+    deviceCount++;
+    if (e.cls == DEVICE_OTHER) return;
+    char mac[18];
+    formatBleAddress(e.address, mac);
+    Serial.printf("*** Potential BMS device: %s [%s] %d dBm, %u adverts (%s) ***\n", e.name, mac, e.rssi(),
+                  e.adverts.load(), DEVICE_CLASS_NAMES[e.cls]);
+  });
+  Serial.printf("Total devices found: %u (%u advertisements)\n", deviceCount,
+                bleDevices.adverts() - scanStartAdverts);
   
-  Serial.println("=== Scan completed ===");
-  Serial.println("Total devices found: " + String(deviceCount));
+  // The target wins; otherwise the strongest candidate, if nothing is chosen yet
+  const DeviceEntry* best = bleDevices.best(scanStartMs);
+  if (best && (best->cls == DEVICE_TARGET || discovered_bms_mac.length() == 0)) {
+    char mac[18];
+    formatBleAddress(best->address, mac);
+    discovered_bms_mac = mac;
+    discovered_bms_name = best->name;
+    if (best->cls == DEVICE_TARGET) bms_found_by_scan = true;
+  }
   
   if (deviceCount == 0) {
     Serial.println("No BLE devices discovered.");
@@ -239,121 +753,1214 @@ void scanForBMS() {
     Serial.println("- Devices are in sleep mode");
     Serial.println("- BLE devices are not discoverable");
   }
-  
-  if (discovered_bms_mac.length() > 0) {
-    Serial.println("BMS device to try: " + discovered_bms_name + " [" + discovered_bms_mac + "]");
-    if (bms_found_by_scan) {
-      Serial.println("Target BMS found by scan!");
+  
+  if (discovered_bms_mac.length() > 0) {
+    Serial.println("BMS device to try: " + discovered_bms_name + " [" + discovered_bms_mac + "]");
+    if (bms_found_by_scan) {
+      Serial.println("Target BMS found by scan!");
+    }
+  } else {
+    Serial.println("No BMS devices found in this scan.");
+  }
+  
+  pBLEScan->clearResults(); // Delete results from BLEScan buffer
+  Serial.println("=====================================\n");
+  
+  // Found something to connect to: try as soon as the retry spacing allows
+  if (!connected && discovered_bms_mac.length() > 0) {
+    uint32_t sinceAttempt = millis() - lastConnectionAttempt;
+    scheduler.wake(taskConnect, sinceAttempt >= CONNECT_RETRY_MS ? 0 : CONNECT_RETRY_MS - sinceAttempt);
+  }
+}
+
+void connectToBMS() {
+  if (discovered_bms_mac.length() == 0) {
+    Serial.println("No BMS device to connect to.");
+    return;
+  }
+  
+  LoopBlockTimer block(LOOP_SITE_CONNECT);
+  connectionAttempts++;
+  Serial.printf("Connection attempt #%d to: %s [%s]\n", 
+                connectionAttempts, discovered_bms_name.c_str(), discovered_bms_mac.c_str());
+  
+  // Clean up previous client if exists
+  resetReadSequence();
+  if (pClient) {
+    pClient->disconnect();
+    delete pClient;
+    pClient = nullptr;
+  }
+  
+  // Create BLE client
+  pClient = BLEDevice::createClient();
+  Serial.println("BLE client created.");
+  
+  // Connect to the BLE Server
+  BLEAddress bmsAddress(discovered_bms_mac.c_str());
+  
+  Serial.println("Attempting BLE connection...");
+  if (pClient->connect(bmsAddress)) {
+    Serial.println("*** Successfully connected to BMS via BLE! ***");
+    Serial.println("Connected to: " + discovered_bms_name + " [" + discovered_bms_mac + "]");
+    
+    // List available services
+    Serial.println("Discovering services...");
+    std::map<std::string, BLERemoteService*>* services = pClient->getServices();
+    
+    Serial.println("Available services:");
+    for (auto& service : *services) {
+      Serial.println("  Service UUID: " + String(service.first.c_str()));
+      
+      // Get characteristics for this service
+      std::map<std::string, BLERemoteCharacteristic*>* characteristics = service.second->getCharacteristics();
+      for (auto& characteristic : *characteristics) {
+        Serial.println("    Characteristic UUID: " + String(characteristic.first.c_str()));
+        Serial.print("    Properties: ");
+        Serial.print(characteristic.second->canRead() ? "R" : "-");
+        Serial.print(characteristic.second->canWrite() ? "W" : "-");
+        Serial.print(characteristic.second->canNotify() ? "N" : "-");
+        Serial.println();
+      }
+    }
+    
+    setConnected(true);
+    frameStats.resetLink();
+    connectionAttempts = 0; // Reset counter on success
+    
+  } else {
+    Serial.printf("❌ BLE connection failed (attempt #%d)\n", connectionAttempts);
+    setConnected(false);
+    
+    // After 5 failed attempts, suggest rescanning
+    if (connectionAttempts >= 5) {
+      Serial.println("💡 Too many failed attempts. Try 'scan' to refresh BMS discovery.");
+      connectionAttempts = 0;
+      discovered_bms_mac = ""; // Clear to force rescan
+    }
+  }
+}
+
+// `data`: start a read cycle now, unless one is under way
+void readBMSData() {
+  if (!connected || !pClient || !pClient->isConnected()) {
+    Serial.println("Not connected to BMS");
+    return;
+  }
+  if (!PT_IN_PROGRESS(&readSeq.pt)) scheduler.wake(taskPoll, 0);
+}
+
+PT_THREAD(readSequence(ReadSequence& s)) {
+  PT_BEGIN(&s.pt);
+  s.cycleStartMs = millis();
+  if (overload.level() == OVERLOAD_FULL) Serial.println("Reading BMS data - trying multiple approaches...");
+  infoFrameLen = 0;
+  s.frames = 0;
+  s.outputCycles = 0;
+  
+  if (findDalyCharacteristics()) {
+    // MOS state first, so the main info goes out as soon as it arrives
+    s.cmd = FRAME_CMD_MOS;
+    PT_SPAWN(&s.pt, &s.request, requestReply(s));
+    if (s.replyOk) takeReply(s);
+    
+    s.cmd = FRAME_CMD_INFO;
+    PT_SPAWN(&s.pt, &s.request, requestReply(s));
+    if (s.replyOk) takeReply(s);
+  }
+  
+  finishReadCycle(s);
+  PT_END(&s.pt);
+}
+
+// Write the request for s.cmd and await its reply. The wait comes from the
+// RTT estimate (p99 x factor within the configured bounds, backed off after
+// timeouts); on expiry the request is retried at once. Only first attempts
+// feed the RTT estimate, since a reply to a retried request cannot be matched
+// to one of the writes (Karn's rule).
+// With hedging on, a first attempt that has seen no bytes by p90 RTT is sent
+// again; the first reply wins and the other is discarded in notifyCallback,
+// which keeps the outstanding duplicates per command: the second MOS reply
+// usually lands while the main info request waits.
+// The RTT of a hedged request is taken from the first write, which
+// overestimates when the duplicate answered and keeps the timeout on the
+// safe side.
+PT_THREAD(requestReply(ReadSequence& s)) {
+  PT_BEGIN(&s.request);
+  pendingCommand = s.cmd;
+  s.replyOk = false;
+  for (s.attempt = 0; s.attempt <= RESPONSE_RETRIES; s.attempt++) {
+    if (s.attempt > 0) responseStats.retries++;
+    s.waitMs = rttTracker.timeoutMs(cfg.response_timeout_min_ms, cfg.response_timeout_ms);
+    s.hedgeMs = s.attempt == 0 && cfg.hedge_requests ? rttTracker.hedgeDelayMs(s.waitMs) : 0;
+    s.hedged = false;
+    replyAssembler.reset();
+    responseReceived = false;
+    if (s.attempt == 0) duplicatesOutstanding[s.cmd] = 0; // a duplicate from the last cycle is late by now
+    requestSentTime = millis();
+    requestPending = true;
+    responseStats.requests++;
+    writeRequest(s.cmd);
+    
+    while (!responseReceived && (millis() - requestSentTime < s.waitMs)) {
+      if (s.hedgeMs && !s.hedged && replyAssembler.length() == 0 && millis() - requestSentTime >= s.hedgeMs) {
+        s.hedged = true;
+        duplicatesOutstanding[s.cmd] = 1;
+        responseStats.hedges++;
+        writeRequest(s.cmd);
+      }
+      PT_YIELD(&s.request);
+    }
+    requestPending = false;
+    
+    if (responseReceived) {
+      responseStats.replies++;
+      if (s.attempt == 0) rttTracker.record(lastResponseTime - requestSentTime);
+      s.replyOk = true;
+      PT_EXIT(&s.request);
+    }
+    // Part of a frame by the deadline: the rest went missing
+    responseStats.timeouts++;
+    frameStats.count(s.cmd, replyAssembler.length() ? FRAME_TRUNCATED : FRAME_TIMEOUT);
+    rttTracker.onTimeout();
+  }
+  responseStats.failedCycles++;
+  PT_END(&s.request);
+}
+
+// Link gone or replaced: the next cycle starts over, characteristics included
+void resetReadSequence() {
+  PT_INIT(&readSeq.pt);
+  requestPending = false;
+  dalyRx = nullptr;
+  dalyTx = nullptr;
+}
+
+// A reply as it arrives: forwarded as is in raw mode; in every format the
+// MOS state is decoded now and the main info kept for the cycle's end
+void takeReply(ReadSequence& s) {
+  uint32_t start = ESP.getCycleCount();
+  if (cfg.output_format == OUTPUT_RAW) forwardRawFrame(s.cmd);
+  if (s.cmd == FRAME_CMD_MOS) {
+    parseMosReply();
+  } else {
+    infoFrameLen = replyAssembler.length();
+    memcpy(infoFrame, replyAssembler.data(), infoFrameLen);
+    infoRxMs = lastResponseTime;
+  }
+  s.outputCycles += ESP.getCycleCount() - start;
+  s.frames++;
+  logRawReply(s.cmd);
+}
+
+// Once both exchanges are done: the main info is decoded and published to
+// the estimators, the log and the exports whatever the output format, then
+// the record goes out (raw mode has already forwarded the frames). Only the
+// record counts towards the output cost of its format.
+void finishReadCycle(ReadSequence& s) {
+  lastReadOk = decodeInfoFrame();
+  if (lastReadOk) publishSnapshot();
+  
+  uint32_t start = ESP.getCycleCount();
+  if (cfg.output_format != OUTPUT_RAW) {
+    if (infoFrameLen > 0) {
+      lastResponse = "";
+      for (size_t i = 0; i < infoFrameLen; i++) {
+        if (infoFrame[i] < 16) lastResponse += "0";
+        lastResponse += String(infoFrame[i], HEX);
+      }
+    }
+    tryMultipleServices();
+  }
+  s.outputCycles += ESP.getCycleCount() - start;
+  if (s.frames > 0) {
+    OutputCost& cost = outputCost[cfg.output_format];
+    cost.frames += s.frames;
+    cost.cycles += s.outputCycles;
+  }
+  
+  uint32_t cycleMs = millis() - s.cycleStartMs;
+  responseStats.cycles++;
+  responseStats.lastCycleMs = cycleMs;
+  responseStats.totalCycleMs += cycleMs;
+  if (cycleMs > responseStats.maxCycleMs) responseStats.maxCycleMs = cycleMs;
+}
+
+// The cycle's main info reply into bmsData; true when it decoded. The
+// fields come from dalyDecodeInfo(), the decoder the host tools use.
+bool decodeInfoFrame() {
+  if (infoFrameLen == 0) return false;
+  infoOutcome = classifyDalyFrame(infoFrame, infoFrameLen, DALY_INFO_DATA_LEN);
+  frameStats.count(FRAME_CMD_INFO, infoOutcome);
+  DalyInfo info;
+  if (infoOutcome != FRAME_OK || !dalyDecodeInfo(infoFrame, infoFrameLen, info)) return false;
+
+  // Capacity from the configuration, the rest from the reply
+  memcpy(bmsData.cell_mv, info.cell_mv, sizeof(bmsData.cell_mv));
+  bmsData.voltage = info.voltage;
+  bmsData.current = info.current;
+  bmsData.soc = info.soc;
+  bmsData.max_cell_voltage = info.max_cell_mv;
+  bmsData.min_cell_voltage = info.min_cell_mv;
+  bmsData.cycles = info.cycles;
+  memcpy(bmsData.temp_c, info.temp_c, sizeof(bmsData.temp_c));
+  bmsData.max_temp = info.temp_c[0] > info.temp_c[1] ? info.temp_c[0] : info.temp_c[1];
+  bmsData.min_temp = info.temp_c[0] < info.temp_c[1] ? info.temp_c[0] : info.temp_c[1];
+  bmsData.full_capacity = cfg.capacity_ah;
+  bmsData.remaining_capacity = (bmsData.full_capacity * bmsData.soc) / 100.0;
+  return true;
+}
+
+// A decoded frame to everything that works from the pack values, in every
+// output format: the estimators and the log first, since the Modbus image
+// carries their results, then the phones, the Modbus masters and the inverter
+void publishSnapshot() {
+  updateSocEstimate();
+  updateRuntimeEstimate();
+  powerProfile.add(millis(), (int32_t)lroundf(bmsData.voltage * bmsData.current));
+  logBMSSample();
+  exportGattSnapshot();
+  exportModbusRegisters();
+  exportCanFrames();
+}
+
+// fff0 service: fff1 notifies the replies, fff2 takes the requests.
+// Looked up and subscribed once per link.
+bool findDalyCharacteristics() {
+  if (dalyTx) return true;
+  
+  BLERemoteService* pService = nullptr;
+  std::map<std::string, BLERemoteService*>* services = pClient->getServices();
+  for (auto& service : *services) {
+    if (service.first.find("fff0") != std::string::npos) {
+      pService = service.second;
+      break;
+    }
+  }
+  if (!pService) {
+    dalyStatus = "fff0_service_not_found";
+    return false;
+  }
+  
+  BLERemoteCharacteristic* pRxChar = pService->getCharacteristic(BLEUUID("fff1"));
+  BLERemoteCharacteristic* pTxChar = pService->getCharacteristic(BLEUUID("fff2"));
+  if (!pRxChar || !pTxChar) {
+    dalyStatus = "required_characteristics_not_found";
+    return false;
+  }
+  
+  // Setup notifications on RX characteristic
+  if (pRxChar->canNotify()) {
+    pRxChar->registerForNotify(notifyCallback);
+    
+    // Enable notifications via descriptor
+    BLERemoteDescriptor* pDescriptor = pRxChar->getDescriptor(BLEUUID((uint16_t)0x2902));
+    if (pDescriptor) {
+      uint8_t notificationOn[] = {0x01, 0x00};
+      pDescriptor->writeValue(notificationOn, 2, true);
+    }
+  }
+  dalyRx = pRxChar;
+  dalyTx = pTxChar;
+  dalyStatus = "characteristics_found";
+  return true;
+}
+
+// HEAD_READ + register range of the command
+void writeRequest(FrameCommand cmd) {
+  LoopBlockTimer block(LOOP_SITE_REQUEST_WRITE);
+  uint8_t command[8];
+  memcpy(command, HEAD_READ, 2);
+  memcpy(command + 2, cmd == FRAME_CMD_MOS ? MOS_INFO : CMD_INFO, 6);
+  dalyTx->writeValue(command, 8);
+}
+
+// Charge and discharge MOS state from the MOS_INFO reply
+void parseMosReply() {
+  const uint8_t* data = replyAssembler.data();
+  FrameOutcome outcome = classifyDalyFrame(data, replyAssembler.length(), DALY_MOS_DATA_LEN);
+  frameStats.count(FRAME_CMD_MOS, outcome);
+  DalyMos mos;
+  if (outcome != FRAME_OK || !dalyDecodeMos(data, replyAssembler.length(), mos)) return;
+  bmsData.charge_mos = mos.charge;
+  bmsData.discharge_mos = mos.discharge;
+}
+
+// Raw passthrough: the frame goes out whole, stamped with its arrival, if
+// its CRC holds (the decode path counts it in the frame stats)
+void forwardRawFrame(FrameCommand cmd) {
+  const uint8_t* frame = replyAssembler.data();
+  size_t len = replyAssembler.length();
+  size_t room = CDR_FRAME_MAX - CDR_FRAME_OVERHEAD;
+  writeCdrFrame(CDR_TOPIC_RAW_DALY, rawForwarder.encode(RAW_PROTO_D203, cmd, frame, len, lastResponseTime,
+                                                        cdrFrameBuf + CDR_FRAME_HEADER, room));
+}
+
+// Every reply whose CRC holds goes to the SD log as a raw record; the copy
+// into the block buffer is all the poll path pays for it
+void logRawReply(FrameCommand cmd) {
+  if (!sdLog.ready()) return;
+  uint8_t rec[RAW_RECORD_HEADER + RAW_FRAME_MAX];
+  size_t len = sdRecorder.encode(RAW_PROTO_D203, cmd, replyAssembler.data(), replyAssembler.length(),
+                                 lastResponseTime, rec, sizeof(rec));
+  if (len) sdLog.append(rec, (uint16_t)len, logTimestamp(), millis());
+}
+
+// CPU per reply from arrival to output, per format that has run
+void printOutputCost() {
+  const char* const names[] = {"json", "cdr", "both", "raw"};
+  for (uint8_t i = 0; i <= OUTPUT_RAW; i++) {
+    const OutputCost& c = outputCost[i];
+    if (c.frames == 0) continue;
+    double us = (double)c.cycles / c.frames / ESP.getCpuFreqMHz();
+    Serial.printf("Output %-4s: %.1f us CPU per frame over %u frames (CPU bound %.0f frames/s)\n", names[i], us,
+                  c.frames, us > 0 ? 1e6 / us : 0.0);
+  }
+  if (rawForwarder.forwarded() || rawForwarder.rejected()) {
+    Serial.printf("Raw frames: %u forwarded, %u failed their CRC\n", rawForwarder.forwarded(),
+                  rawForwarder.rejected());
+  }
+}
+
+void printLinkTiming() {
+  const ResponseStats& rs = responseStats;
+  Serial.printf("Link RTT: p50 %u ms, p90 %u ms, p99 %u ms (%u samples), timeout %u ms (backoff x%u)\n",
+                rttTracker.percentile(500), rttTracker.percentile(900), rttTracker.percentile(990),
+                rttTracker.samples(), rttTracker.timeoutMs(cfg.response_timeout_min_ms, cfg.response_timeout_ms),
+                1u << rttTracker.backoff());
+  Serial.printf("Requests: %u, replies: %u, timeouts: %u, retries: %u, late: %u, failed cycles: %u\n",
+                rs.requests, rs.replies, rs.timeouts, rs.retries, rs.lateReplies.load(), rs.failedCycles);
+  Serial.printf("Hedging: %s, hedged: %u, duplicate replies dropped: %u\n",
+                cfg.hedge_requests ? "on" : "off", rs.hedges, rs.duplicateReplies.load());
+  Serial.printf("Cycle time: last %u ms, avg %lu ms, max %u ms\n", rs.lastCycleMs,
+                rs.cycles ? (unsigned long)(rs.totalCycleMs / rs.cycles) : 0UL, rs.maxCycleMs);
+}
+
+void printFrameStats() {
+  Serial.println("\n=== Frame Quality ===");
+  Serial.printf("%-16s", "");
+  for (uint8_t o = 0; o < FRAME_OUTCOMES; o++) Serial.printf(" %10s", FRAME_OUTCOME_NAMES[o]);
+  Serial.println();
+  for (uint8_t scope = 0; scope < 2; scope++) {
+    for (uint8_t c = 0; c < FRAME_COMMANDS; c++) {
+      Serial.printf("%-5s %-10s", scope == 0 ? "link" : "boot", FRAME_COMMAND_NAMES[c]);
+      for (uint8_t o = 0; o < FRAME_OUTCOMES; o++) {
+        FrameCommand cmd = (FrameCommand)c;
+        FrameOutcome outcome = (FrameOutcome)o;
+        Serial.printf(" %10u", scope == 0 ? frameStats.link(cmd, outcome) : frameStats.total(cmd, outcome));
+      }
+      Serial.println();
+    }
+  }
+  Serial.println("=====================\n");
+}
+
+// {"timestamp":..,"link":{"main_info":{"ok":..,..},..},"total":{..}}
+String frameStatsJson() {
+  String json = "{\"timestamp\":" + String(millis());
+  for (uint8_t scope = 0; scope < 2; scope++) {
+    json += scope == 0 ? ",\"link\":{" : ",\"total\":{";
+    for (uint8_t c = 0; c < FRAME_COMMANDS; c++) {
+      if (c > 0) json += ",";
+      json += String("\"") + FRAME_COMMAND_NAMES[c] + "\":{";
+      for (uint8_t o = 0; o < FRAME_OUTCOMES; o++) {
+        FrameCommand cmd = (FrameCommand)c;
+        FrameOutcome outcome = (FrameOutcome)o;
+        if (o > 0) json += ",";
+        json += String("\"") + FRAME_OUTCOME_NAMES[o] + "\":";
+        json += String(scope == 0 ? frameStats.link(cmd, outcome) : frameStats.total(cmd, outcome));
+      }
+      json += "}";
+    }
+    json += "}";
+  }
+  return json + "}";
+}
+
+// Over-budget blocks are reported when due; the warning is skipped rather
+// than blocking the loop again when the TX queue has no room for it
+void reportLoopBlock(LoopSite site, uint32_t startMs, uint32_t us) {
+  if (!loopProfiler.record(site, startMs, us)) return;
+  if (Serial.availableForWrite() < 96) return;
+  Serial.printf("⚠️ Loop held %lu ms by %s (site %u, budget %u ms, %u over budget so far)\n",
+                (unsigned long)(us / 1000), LOOP_SITE_NAMES[site], site, loopProfiler.budgetMs(),
+                loopProfiler.site(site).overBudget);
+}
+
+void printLoopProfile() {
+  Serial.println("\n=== Loop Blocking ===");
+  Serial.printf("Budget %u ms (set block_ms), inclusive times, since boot\n", loopProfiler.budgetMs());
+  Serial.printf("%-3s %-13s %9s %10s %10s %8s\n", "id", "site", "count", "avg ms", "max ms", "over");
+  for (uint8_t i = 0; i < LOOP_SITES; i++) {
+    const LoopBlockStats& st = loopProfiler.site((LoopSite)i);
+    if (st.count == 0) continue;
+    Serial.printf("%-3u %-13s %9u %10.1f %10.1f %8u\n", i, LOOP_SITE_NAMES[i], st.count,
+                  st.totalUs / 1000.0 / st.count, st.maxUs / 1000.0, st.overBudget);
+  }
+  Serial.println("Longest blocks:");
+  for (uint8_t i = 0; i < loopProfiler.topCount(); i++) {
+    const LoopBlockEntry& e = loopProfiler.top(i);
+    Serial.printf("%2u. %-13s (site %u) %10.1f ms at %lu ms\n", i + 1, LOOP_SITE_NAMES[e.site], e.site,
+                  e.us / 1000.0, (unsigned long)e.startMs);
+  }
+  Serial.println("=====================\n");
+}
+
+void printTaskStats() {
+  Serial.println("\n=== Tasks ===");
+  Serial.printf("%-8s %10s %8s %9s %9s %11s %11s %7s\n", "task", "period ms", "runs", "avg us", "max us",
+                "avg late ms", "max late ms", "skipped");
+  for (uint8_t i = 0; i < scheduler.count(); i++) {
+    const TaskStats& st = scheduler.stats(i);
+    Serial.printf("%-8s %10u %8u %9lu %9u %11.1f %11u %7u\n", scheduler.name(i), scheduler.period(i), st.runs,
+                  st.runs ? (unsigned long)(st.totalUs / st.runs) : 0UL, st.maxUs,
+                  st.runs ? (double)st.totalLateMs / st.runs : 0.0, st.maxLateMs, st.skipped);
+  }
+  Serial.println("=============\n");
+}
+
+void tryMultipleServices() {
+  // Record fidelity follows the sink backlog and the last cycle's overrun
+  OverloadLevel level = overload.update(sinkQueuePermille(), responseStats.lastCycleMs, cfg.read_interval_ms);
+  
+  // Create a proper JSON string for ROS2 parsing
+  String jsonOutput = createBMSJsonOutput(level);
+  writeJsonRecord(jsonOutput);
+  
+  // Framed CDR messages from the same snapshot, after the record
+  if (cfg.output_format != OUTPUT_JSON && lastReadOk && level < OVERLOAD_HEARTBEAT) emitCdrFrames(level);
+}
+
+void writeJsonRecord(const String& jsonOutput) {
+  if (cfg.output_format == OUTPUT_CDR || jsonOutput.length() == 0) return; // heartbeat level, nothing due
+  
+  // A record that does not fit the TX queue would block the loop (and the
+  // BLE side) until the host catches up; drop it and let the level follow
+  String line = "BMS_DATA:" + jsonOutput;
+  if ((size_t)Serial.availableForWrite() < line.length() + 2) {
+    overload.onDropped();
+    return;
+  }
+  
+  // Output with BMS_DATA prefix for ROS2 contract
+  LoopBlockTimer block(LOOP_SITE_RECORD_WRITE);
+  Serial.println(line);
+}
+
+// Fill of the serial TX queue, 0..1000
+uint16_t sinkQueuePermille() {
+  int free = Serial.availableForWrite();
+  if (free < 0) free = 0;
+  size_t queued = (size_t)free >= SERIAL_TX_BUFFER ? 0 : SERIAL_TX_BUFFER - free;
+  return (uint16_t)(queued * 1000 / SERIAL_TX_BUFFER);
+}
+
+uint8_t packAlarms(bool dataFound) {
+  if (!dataFound) return ALARM_NO_DATA;
+  uint8_t alarms = 0;
+  if (bmsData.max_cell_voltage >= ALARM_CELL_HIGH_MV) alarms |= ALARM_CELL_HIGH;
+  if (bmsData.min_cell_voltage <= ALARM_CELL_LOW_MV) alarms |= ALARM_CELL_LOW;
+  if (bmsData.soc <= ALARM_SOC_LOW_PCT) alarms |= ALARM_SOC_LOW;
+  return alarms;
+}
+
+// Write one framed message from cdrFrameBuf, or drop it if the TX queue is full
+void writeCdrFrame(uint8_t topic, size_t payloadLen) {
+  if (payloadLen == 0) return;
+  size_t len = cdrFrame(topic, cdrFrameBuf, payloadLen);
+  if ((size_t)Serial.availableForWrite() < len) {
+    overload.onDropped();
+    return;
+  }
+  LoopBlockTimer block(LOOP_SITE_RECORD_WRITE);
+  Serial.write(cdrFrameBuf, len);
+}
+
+// sensor_msgs/BatteryState and the cell Float32MultiArray (not at summary level)
+void emitCdrFrames(OverloadLevel level) {
+  static float cellVolts[PACK_CELLS];
+  for (uint8_t i = 0; i < PACK_CELLS; i++) cellVolts[i] = bmsData.cell_mv[i] / 1000.0f;
+  uint8_t alarms = packAlarms(true);
+  
+  BatteryStateMsg m;
+  m.stamp_sec = (int32_t)logTimestamp();
+  m.stamp_nanosec = (uint32_t)(millis() % 1000) * 1000000UL;
+  m.frame_id = "bms";
+  m.voltage = bmsData.voltage;
+  m.temperature = NAN;
+  m.current = bmsData.current;
+  m.charge = bmsData.remaining_capacity;
+  m.capacity = bmsData.full_capacity;
+  m.design_capacity = cfg.capacity_ah;
+  m.percentage = bmsData.soc / 100.0f;
+  if (bmsData.current > 0.1f) m.power_supply_status = BATTERY_STATUS_CHARGING;
+  else if (bmsData.current < -0.1f) m.power_supply_status = BATTERY_STATUS_DISCHARGING;
+  else if (bmsData.soc >= 99.5f) m.power_supply_status = BATTERY_STATUS_FULL;
+  else m.power_supply_status = BATTERY_STATUS_NOT_CHARGING;
+  m.power_supply_health = (alarms & ALARM_CELL_HIGH) ? BATTERY_HEALTH_OVERVOLTAGE : BATTERY_HEALTH_GOOD;
+  m.power_supply_technology = &PACK_CHEMISTRY == &CHEMISTRY_LFP ? BATTERY_TECH_LIFE : BATTERY_TECH_LION;
+  m.present = true;
+  m.cell_voltage = cellVolts;
+  m.cells = PACK_CELLS;
+  m.serial_number = discovered_bms_name.c_str();
+  
+  uint8_t* payload = cdrFrameBuf + CDR_FRAME_HEADER;
+  size_t room = CDR_FRAME_MAX - CDR_FRAME_OVERHEAD;
+  writeCdrFrame(CDR_TOPIC_BATTERY_STATE, cdrEncodeBatteryState(m, payload, room));
+  if (level <= OVERLOAD_COMPACT) {
+    writeCdrFrame(CDR_TOPIC_CELL_VOLTAGES, cdrEncodeCellVoltages(cellVolts, PACK_CELLS, payload, room));
+  }
+}
+
+// Full records carry the whole protocol exchange; under backpressure the
+// record shrinks to decoded values (compact), the pack headline (summary) or
+// a periodic heartbeat. Every level carries "level" and any active alarms.
+// Returns an empty string when a heartbeat record is not due.
+String createBMSJsonOutput(OverloadLevel level) {
+  String json = "{";
+  json += "\"timestamp\":" + String(millis()) + ",";
+  json += String("\"level\":\"") + OverloadController::name(level) + "\",";
+  
+  String protocolData = "";
+  bool dataFound = dalyProtocolJson(protocolData);
+  
+  if (level == OVERLOAD_FULL) {
+    json += "\"device\":\"" + discovered_bms_name + "\",";
+    json += "\"mac_address\":\"" + discovered_bms_mac + "\",";
+    json += "\"daly_protocol\":{";
+    json += protocolData;
+    json += "},";
+  } else if (level == OVERLOAD_COMPACT) {
+    json += "\"device\":\"" + discovered_bms_name + "\",";
+  }
+  
+  uint8_t alarms = packAlarms(dataFound);
+  if (level == OVERLOAD_HEARTBEAT) {
+    // Alarm changes go out at once, otherwise one record per interval
+    if (alarms == lastAlarms && millis() - lastHeartbeatTime < OVERLOAD_HEARTBEAT_MS) return "";
+    lastHeartbeatTime = millis();
+  }
+  lastAlarms = alarms;
+  if (alarms) {
+    json += "\"alarms\":[";
+    bool first = true;
+    for (uint8_t i = 0; i < 4; i++) {
+      if (!(alarms & (1 << i))) continue;
+      json += String(first ? "\"" : ",\"") + ALARM_NAMES[i] + "\"";
+      first = false;
+    }
+    json += "],";
+  }
+  
+  if (level != OVERLOAD_FULL) {
+    if (dataFound && level <= OVERLOAD_SUMMARY) {
+      json += "\"pack\":{";
+      json += "\"voltage\":" + String(bmsData.voltage, 3) + ",";
+      json += "\"current\":" + String(bmsData.current, 1) + ",";
+      json += "\"soc\":" + String(bmsData.soc, 1);
+      if (level == OVERLOAD_COMPACT) {
+        json += ",\"cycles\":" + String(bmsData.cycles);
+        json += ",\"cells_mv\":[";
+        for (uint8_t i = 0; i < 16; i++) json += String(i ? "," : "") + String(bmsData.cell_mv[i]);
+        json += "]";
+      }
+      json += "},";
+    }
+    if (level == OVERLOAD_COMPACT && socEstimator.initialized()) {
+      json += "\"soc_estimate\":{\"soc\":" + String(socEstimator.socPercent(), 2) + "},";
+    }
+    if (level == OVERLOAD_COMPACT && dataFound) json += runtimeJson();
+    json += "\"data_found\":" + String(dataFound ? "true" : "false");
+    json += "}";
+    return json;
+  }
+  
+  if (socEstimator.initialized()) {
+    json += "\"soc_estimate\":{";
+    json += "\"soc\":" + String(socEstimator.socPercent(), 2) + ",";
+    json += "\"sigma\":" + String(socEstimator.sigmaPermille() / 10.0, 1) + ",";
+    json += "\"at_rest\":" + String(socEstimator.atRest() ? "true" : "false");
+    json += "},";
+  }
+  if (dataFound) json += runtimeJson();
+  
+  if (powerProfile.samples() > 0) {
+    powerProfile.expire(millis());
+    json += "\"power\":{";
+    json += "\"w\":" + String(powerProfile.lastWatts()) + ",";
+    json += "\"peak_w\":[";
+    for (uint8_t i = 0; i < PowerProfile::WINDOWS; i++) {
+      json += String(i ? "," : "") + String(powerProfile.peak(i));
+    }
+    json += "],\"min_w\":[";
+    for (uint8_t i = 0; i < PowerProfile::WINDOWS; i++) {
+      json += String(i ? "," : "") + String(powerProfile.trough(i));
+    }
+    json += "],\"load_hist_s\":[";
+    for (uint8_t b = 0; b < POWER_HIST_BINS; b++) {
+      json += String(b ? "," : "") + String((unsigned long)(powerProfile.binMs(b) / 1000));
+    }
+    json += "]},";
+  }
+  
+  json += "\"data_found\":" + String(dataFound ? "true" : "false");
+  json += "}";
+  
+  return json;
+}
+
+// Peak/min power per window and the load-duration curve (time at or above each load)
+void printPowerProfile() {
+  if (powerProfile.samples() == 0) {
+    Serial.println("No power samples yet");
+    return;
+  }
+  powerProfile.expire(millis());
+  Serial.println("\n=== Power Profile ===");
+  Serial.printf("Now: %d W (%u samples)\n", powerProfile.lastWatts(), powerProfile.samples());
+  for (uint8_t i = 0; i < PowerProfile::WINDOWS; i++) {
+    Serial.printf("%2us window: peak %d W, min %d W\n",
+                  powerProfile.windowMs(i) / 1000, powerProfile.peak(i), powerProfile.trough(i));
+  }
+  Serial.println("Load duration (discharge):");
+  for (uint8_t b = 0; b < POWER_HIST_BINS; b++) {
+    Serial.printf("  >= %5d W: %8.2f h\n", b * POWER_HIST_BIN_W, powerProfile.msAtOrAbove(b) / 3600000.0);
+  }
+  Serial.println("=====================\n");
+}
+
+void updateSocEstimate() {
+  unsigned long now = millis();
+  
+  if (!socEstimator.initialized() || now - lastSocUpdate > SOC_RESEED_GAP) {
+    // Seed from the BMS register, which can be several percent off
+    socEstimator.begin(&PACK_CHEMISTRY, (uint32_t)(bmsData.full_capacity * 1000));
+    socEstimator.reset((uint16_t)lroundf(bmsData.soc * 10), 50);
+  } else {
+    uint16_t meanCellMv = (uint16_t)lroundf(bmsData.voltage * 1000.0f / PACK_CELLS);
+    socEstimator.update((int32_t)lroundf(bmsData.current * 1000.0f), meanCellMv, now - lastSocUpdate);
+  }
+  lastSocUpdate = now;
+}
+
+// Every decoded frame; the remaining charge comes from the SOC estimate
+void updateRuntimeEstimate() {
+  unsigned long now = millis();
+  uint32_t fullMah = (uint32_t)(bmsData.full_capacity * 1000);
+  uint32_t remainingMah = (uint32_t)((uint64_t)fullMah * socEstimator.socPermille() / 1000);
+  runtimeEstimator.update((int32_t)lroundf(bmsData.current * 1000.0f), remainingMah, fullMah,
+                          bmsData.max_cell_voltage, now - lastRuntimeUpdate);
+  lastRuntimeUpdate = now;
+}
+
+// "runtime":{"state":..,"load_a":..,"tte_s"|"ttf_s":..}, with a trailing comma
+String runtimeJson() {
+  String json = String("\"runtime\":{\"state\":\"") + RUNTIME_STATE_NAMES[runtimeEstimator.state()] + "\"";
+  json += ",\"load_a\":" + String(runtimeEstimator.loadMa() / 1000.0, 1);
+  if (runtimeEstimator.tteS() != RUNTIME_NONE) json += ",\"tte_s\":" + String((unsigned long)runtimeEstimator.tteS());
+  if (runtimeEstimator.ttfS() != RUNTIME_NONE) json += ",\"ttf_s\":" + String((unsigned long)runtimeEstimator.ttfS());
+  return json + "},";
+}
+
+void printRuntimeEstimate() {
+  RuntimeState st = runtimeEstimator.state();
+  uint32_t s = st == RUNTIME_DISCHARGING ? runtimeEstimator.tteS() : runtimeEstimator.ttfS();
+  Serial.printf("Runtime: %s at %.1f A", RUNTIME_STATE_NAMES[st], runtimeEstimator.loadMa() / 1000.0);
+  if (s != RUNTIME_NONE) {
+    Serial.printf(", %s in %luh%02lum", st == RUNTIME_DISCHARGING ? "empty" : "full", (unsigned long)(s / 3600),
+                  (unsigned long)(s / 60 % 60));
+  }
+  Serial.printf(" (%u load changes)\n", runtimeEstimator.loadChanges());
+}
+
+void beginFlashLog() {
+#ifndef BMS_NATIVE
+  if (!logStorage.begin()) {
+    Serial.println("Flash log: no bmslog partition (see partitions.csv), history disabled");
+    return;
+  }
+#endif
+  unsigned long start = millis();
+  flashLogReady = flashLog.begin(&logStorage);
+  if (!flashLogReady) {
+    Serial.println("Flash log: partition too small, history disabled");
+    return;
+  }
+  logClockBase = flashLog.newestTimestamp() + 1;
+  Serial.printf("Flash log: %u/%u samples in %u segments, index rebuilt in %lu ms\n",
+                flashLog.sampleCount(), flashLog.capacity(), flashLog.usedSegments(), millis() - start);
+}
+
+// RAM ring in .bss, minutes in PSRAM when the board has it
+void beginHistory() {
+  uint32_t minutes = HISTORY_FALLBACK_MINUTES;
+  LogSample* buf = nullptr;
+  if (psramFound()) {
+    buf = (LogSample*)ps_malloc(HISTORY_PSRAM_BYTES);
+    if (buf) minutes = HISTORY_PSRAM_BYTES / sizeof(LogSample);
+  }
+  historyInPsram = buf != nullptr;
+  if (!buf) buf = (LogSample*)malloc(minutes * sizeof(LogSample));
+  if (!buf) minutes = 0;
+  history.begin(historyRam, HISTORY_RAM_SAMPLES, buf, minutes, flashLogReady ? &flashLog : nullptr);
+  Serial.printf("History: %u raw samples in RAM, %u minutes in %s, %u 10-minute samples in flash\n",
+                HISTORY_RAM_SAMPLES, minutes, historyInPsram ? "PSRAM" : "internal RAM",
+                flashLogReady ? flashLog.capacity() : 0);
+}
+
+static uint32_t sdClockUs() { return micros(); }
+
+#ifdef BMS_NATIVE
+static void sdWakeWriter() { scheduler.wake(taskSdLog, 0); }
+#else
+static void sdWakeWriter() {
+  if (sdWriterHandle) xTaskNotifyGive(sdWriterHandle);
+}
+
+// Writes sealed buffers as the poll path hands them over; a card stall
+// holds up this task only. On the application core, off the BLE stack's.
+static void sdWriterTask(void*) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while (sdLog.writePending()) {
+    }
+  }
+}
+#endif
+
+// The log volume on the card. A card without one is left alone until
+// `sd format`; the host's RAM image is labelled at boot.
+void beginSdLog() {
+#ifdef BMS_NATIVE
+  SdVolume::format(&sdCard, esp_random());
+#else
+  if (!sdCard.begin(SD_CS_PIN)) {
+    Serial.println("SD log: no card");
+    return;
+  }
+  if (!sdWriterHandle) xTaskCreatePinnedToCore(sdWriterTask, "sdlog", 3072, nullptr, 1, &sdWriterHandle, 1);
+#endif
+  unsigned long start = millis();
+  if (!sdLog.begin(&sdCard, sdClockUs, sdWakeWriter)) {
+    Serial.println("SD log: card holds no log volume ('sd format' makes it one)");
+    return;
+  }
+  Serial.printf("SD log: volume %08x, %u MB, resumes at block %u (serial %u, file %u), found in %lu ms\n",
+                sdLog.volumeId(), (sdLog.ringBlocks() + 1) / 2048, sdLog.headPosition(), sdLog.serial(), sdLog.file(),
+                millis() - start);
+}
+
+// Stops logging and waits for the writer to finish the buffers it holds
+void stopSdLog() {
+  while (!sdLog.end()) {
+#ifdef BMS_NATIVE
+    sdLog.writePending();
+#else
+    delay(10);
+#endif
+  }
+}
+
+void printSdLogStatus() {
+  if (!sdLog.ready()) {
+    Serial.println("SD log not available");
+    return;
+  }
+  uint32_t writes = sdLog.writes();
+  Serial.printf("SD log: volume %08x, block %u of %u, serial %u, file %u (%u started since boot)\n",
+                sdLog.volumeId(), sdLog.headPosition(), sdLog.ringBlocks(), sdLog.serial(), sdLog.file(),
+                sdLog.filesStarted());
+  Serial.printf("SD log: %u records, %u dropped, %u too long; %u blocks in %u writes (avg %.1f ms, max %.1f ms), "
+                "%u errors; %u/2 buffers busy\n",
+                sdLog.appended(), sdLog.dropped(), sdLog.tooLong(), sdLog.blocksWritten(), writes,
+                writes ? sdLog.writeUs() / 1000.0 / writes : 0.0, sdLog.maxWriteUs() / 1000.0, sdLog.writeErrors(),
+                sdLog.buffersBusy());
+}
+
+// The discovered-device table: every advertiser not yet aged out
+void printDevices() {
+  uint32_t now = millis();
+  Serial.println("\n=== BLE Devices ===");
+  Serial.println("address            rssi adverts  age_s class     flags name");
+  bleDevices.forEach([now](const DeviceEntry& e) {
+    char mac[18];
+    formatBleAddress(e.address, mac);
+    Serial.printf("%s %4d %7u %6u %-9s %02x    %s\n", mac, e.rssi(), e.adverts.load(), (now - e.lastSeenMs) / 1000,
+                  DEVICE_CLASS_NAMES[e.cls], e.flags, e.name);
+  });
+  Serial.printf("%u/%u slots, %u advertisements, %u from devices that did not fit, longest probe %u\n",
+                bleDevices.size(), DEVICE_TABLE_SLOTS, bleDevices.adverts(), bleDevices.overflow(),
+                bleDevices.maxProbe());
+  Serial.println("===================\n");
+}
+
+// Our GATT service: pack and cell pages to read or subscribe to, and the
+// control characteristic through which a phone sets its interval. The
+// cells characteristic notifies every page but reads as page 0; each later
+// page has a read-only characteristic of its own.
+void beginGattExport() {
+  gattServer = BLEDevice::createServer();
+  gattServer->setCallbacks(new GattServerCallbacks());
+  BLEService* service = gattServer->createService(GATT_SERVICE_UUID);
+  gattPackChar = service->createCharacteristic(GATT_PACK_UUID, BLECharacteristic::PROPERTY_READ |
+                                                               BLECharacteristic::PROPERTY_NOTIFY);
+  gattPackCccd = new BLE2902();
+  gattPackChar->addDescriptor(gattPackCccd);
+  gattCellsChar = service->createCharacteristic(GATT_CELLS_UUID, BLECharacteristic::PROPERTY_READ |
+                                                                 BLECharacteristic::PROPERTY_NOTIFY);
+  gattCellsCccd = new BLE2902();
+  gattCellsChar->addDescriptor(gattCellsCccd);
+  gattPageChars[0] = gattCellsChar;
+  for (uint8_t p = 1; p < GATT_CELL_PAGES; p++) {
+    char uuid[37];
+    snprintf(uuid, sizeof(uuid), GATT_PAGE_UUID_FMT, 4 + p);
+    gattPageChars[p] = service->createCharacteristic(uuid, BLECharacteristic::PROPERTY_READ);
+  }
+  BLECharacteristic* control = service->createCharacteristic(GATT_CONTROL_UUID, BLECharacteristic::PROPERTY_WRITE |
+                                                                                BLECharacteristic::PROPERTY_WRITE_NR);
+  control->setCallbacks(new GattControlCallbacks());
+  BLEDevice::setCustomGattsHandler(gattsEvent);
+  service->start();
+  BLEAdvertising* advertising = BLEDevice::getAdvertising();
+  advertising->addServiceUUID(GATT_SERVICE_UUID);
+  advertising->setScanResponse(true);
+  BLEDevice::startAdvertising();
+  scheduler.wake(taskGatt, GATT_IDLE_MS);
+}
+
+// The decoded frame, encoded once; reads get it from the characteristic
+// values, subscribers from gattTask()
+void exportGattSnapshot() {
+  if (!gattServer) return;
+  GattPack v;
+  v.voltage_cv = (uint16_t)lroundf(bmsData.voltage * 100.0f);
+  v.current_da = (int16_t)lroundf(bmsData.current * 10.0f);
+  v.soc_pm = (uint16_t)lroundf(bmsData.soc * 10.0f);
+  v.max_cell_mv = bmsData.max_cell_voltage;
+  v.min_cell_mv = bmsData.min_cell_voltage;
+  v.max_temp = gattTemp(bmsData.max_temp);
+  v.min_temp = gattTemp(bmsData.min_temp);
+  v.remaining_dah = (uint16_t)lroundf(bmsData.remaining_capacity * 10.0f);
+  v.cycles = bmsData.cycles;
+  v.status = (bmsData.charge_mos ? GATT_STATUS_CHARGE_MOS : 0) | (bmsData.discharge_mos ? GATT_STATUS_DISCHARGE_MOS : 0);
+  v.alarms = packAlarms(true);
+  v.cell_mv = bmsData.cell_mv;
+  v.cells = PACK_CELLS;
+  gattExport.publish(v);
+  const GattSnapshot& snap = gattExport.snapshot();
+  gattPackChar->setValue((uint8_t*)snap.pack(), GATT_PACK_LEN);
+  for (uint8_t p = 0; p < snap.pages(); p++) gattPageChars[p]->setValue((uint8_t*)snap.page(p), snap.pageLen(p));
+  scheduler.wake(taskGatt, 0);
+}
+
+void printGattStatus() {
+  uint32_t now = millis();
+  Serial.printf("GATT: %u phone(s) connected, %u subscribed, %u connects, %u turned away; snapshot %u; "
+                "%u notifications, %u refused as congested\n",
+                gattExport.connected(), gattExport.subscribers(), gattExport.connects(), gattExport.rejected(), gattExport.snapshot().seq(),
+                gattExport.notifications(), gattExport.congested());
+  gattExport.forEach([now](const GattSubscriber& s) {
+    const char* const parts[] = {"nothing", "pack", "cells", "pack+cells"};
+    Serial.printf("  conn %u: %s every %u ms, %u notifications, %u snapshots skipped, %u refused, up %u s\n",
+                  s.connId.load(), parts[s.wants.load() & s.enabled.load()], s.intervalMs.load(), s.notifications,
+                  s.coalesced, s.congested, (now - s.connectedMs) / 1000);
+  });
+}
+
+// RTU on UART2 and, once an SSID is set, TCP over Wi-Fi. Masters get a
+// link-down image until the first frame is decoded.
+void beginModbus() {
+  for (uint16_t i = 0; i < MB_REG_COUNT; i++) modbusRegs[i] = 0;
+  modbusRegs[MB_ALARMS] = ALARM_NO_DATA;
+  modbusRegs[MB_TIME_TO_EMPTY] = MODBUS_NONE;
+  modbusRegs[MB_TIME_TO_FULL] = MODBUS_NONE;
+  modbusRegs[MB_MAX_TEMP] = MODBUS_NONE_SIGNED;
+  modbusRegs[MB_MIN_TEMP] = MODBUS_NONE_SIGNED;
+  modbusRegs[MB_CELL_COUNT] = PACK_CELLS;
+  modbusImage.publish(modbusRegs);
+#ifdef BMS_NATIVE
+  Serial.println("Modbus: register image only (no UART2 or Wi-Fi on the host)");
+#else
+  Serial2.begin(cfg.modbus_baud, SERIAL_8N1, MODBUS_RX_PIN, MODBUS_TX_PIN);
+  Serial2.setPins(MODBUS_RX_PIN, MODBUS_TX_PIN, -1, MODBUS_DE_PIN); // RTS drives the RS-485 DE line
+  Serial2.setMode(UART_MODE_RS485_HALF_DUPLEX);
+  beginWifi();
+  // Core 0 next to the BLE stack; the loop on core 1 only publishes
+  xTaskCreatePinnedToCore(modbusTask, "modbus", 4096, nullptr, 2, &modbusHandle, 0);
+  Serial.printf("Modbus: RTU unit %lu at %lu baud on UART2, TCP port %u %s\n", (unsigned long)cfg.modbus_unit,
+                (unsigned long)cfg.modbus_baud, MODBUS_PORT, cfg.wifi_ssid[0] ? "once Wi-Fi is up" : "off (no SSID)");
+#endif
+}
+
+// Station mode on the configured network, or radio off without an SSID.
+// BLE keeps working either way: the coexistence scheduler needs modem
+// sleep, which is the station default.
+void beginWifi() {
+#ifndef BMS_NATIVE
+  if (!cfg.wifi_ssid[0]) {
+    WiFi.disconnect(true);
+    WiFi.mode(WIFI_OFF);
+    return;
+  }
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  WiFi.begin(cfg.wifi_ssid, cfg.wifi_pass);
+#endif
+}
+
+#ifndef BMS_NATIVE
+// Answers RTU and TCP masters from the image. A read never waits for the
+// loop, and the loop never waits for a master.
+void modbusTask(void* arg) {
+  static ModbusTcpSession sessions[MODBUS_TCP_CLIENTS];
+  static WiFiClient clients[MODBUS_TCP_CLIENTS];
+  static uint8_t buf[MODBUS_TCP_MAX];
+  ModbusRtuServer rtu;
+  rtu.begin(&modbusImage, cfg.modbus_unit, cfg.modbus_baud, &modbusRtuStats);
+  auto rtuSend = [](const uint8_t* reply, size_t len) { Serial2.write(reply, len); };
+  bool listening = false;
+  for (;;) {
+    if (modbusRestart.exchange(false)) {
+      Serial2.updateBaudRate(cfg.modbus_baud);
+      rtu.begin(&modbusImage, cfg.modbus_unit, cfg.modbus_baud, &modbusRtuStats);
+    }
+    bool busy = false;
+    int avail = Serial2.available();
+    if (avail > 0) {
+      size_t n = Serial2.read(buf, (size_t)avail < sizeof(buf) ? (size_t)avail : sizeof(buf));
+      rtu.feed(buf, n, micros(), rtuSend);
+      busy = true;
+    } else {
+      rtu.idle(micros(), rtuSend);
+    }
+
+    if (!listening && WiFi.status() == WL_CONNECTED) {
+      modbusListener.begin();
+      modbusListener.setNoDelay(true);
+      listening = true;
+    }
+    if (!listening) {
+      vTaskDelay(1);
+      continue;
+    }
+    WiFiClient incoming = modbusListener.available();
+    if (incoming) {
+      uint8_t i = 0;
+      while (i < MODBUS_TCP_CLIENTS && clients[i].connected()) i++;
+      if (i == MODBUS_TCP_CLIENTS) {
+        incoming.stop();
+      } else {
+        clients[i] = incoming;
+        sessions[i].begin(&modbusImage, &modbusTcpStats);
+      }
+    }
+    for (uint8_t i = 0; i < MODBUS_TCP_CLIENTS; i++) {
+      WiFiClient& c = clients[i];
+      int pending = c.connected() ? c.available() : 0;
+      if (pending <= 0) continue;
+      int n = c.read(buf, (size_t)pending < sizeof(buf) ? (size_t)pending : sizeof(buf));
+      if (n <= 0) continue;
+      busy = true;
+      if (!sessions[i].feed(buf, n, [&c](const uint8_t* reply, size_t len) { c.write(reply, len); })) c.stop();
+    }
+    if (!busy) vTaskDelay(1);
+  }
+}
+#endif
+
+// The decoded frame as registers, converted once; masters copy the slices
+// they ask for
+void exportModbusRegisters() {
+  modbusRegs[MB_PACK_VOLTAGE] = (uint16_t)lroundf(bmsData.voltage * 100.0f);
+  modbusRegs[MB_CURRENT] = (uint16_t)(int16_t)lroundf(bmsData.current * 10.0f);
+  modbusRegs[MB_SOC] = (uint16_t)lroundf(bmsData.soc * 10.0f);
+  modbusRegs[MB_MAX_CELL] = bmsData.max_cell_voltage;
+  modbusRegs[MB_MIN_CELL] = bmsData.min_cell_voltage;
+  modbusRegs[MB_MAX_TEMP] = (uint16_t)bmsData.max_temp;
+  modbusRegs[MB_MIN_TEMP] = (uint16_t)bmsData.min_temp;
+  modbusRegs[MB_REMAINING] = (uint16_t)lroundf(bmsData.remaining_capacity * 10.0f);
+  modbusRegs[MB_CAPACITY] = (uint16_t)lroundf(bmsData.full_capacity * 10.0f);
+  modbusRegs[MB_CYCLES] = bmsData.cycles;
+  modbusRegs[MB_STATUS] = (bmsData.charge_mos ? MODBUS_STATUS_CHARGE_MOS : 0) |
+                          (bmsData.discharge_mos ? MODBUS_STATUS_DISCHARGE_MOS : 0) |
+                          (connected ? MODBUS_STATUS_LINK_UP : 0);
+  modbusRegs[MB_ALARMS] = packAlarms(true);
+  modbusRegs[MB_SOC_ESTIMATE] = (uint16_t)socEstimator.socPermille();
+  uint32_t tte = runtimeEstimator.tteS(), ttf = runtimeEstimator.ttfS();
+  modbusRegs[MB_TIME_TO_EMPTY] = tte == RUNTIME_NONE ? MODBUS_NONE : (uint16_t)(tte / 60 < MODBUS_NONE ? tte / 60 : MODBUS_NONE - 1);
+  modbusRegs[MB_TIME_TO_FULL] = ttf == RUNTIME_NONE ? MODBUS_NONE : (uint16_t)(ttf / 60 < MODBUS_NONE ? ttf / 60 : MODBUS_NONE - 1);
+  modbusRegs[MB_FRAMES]++;
+  uint32_t ts = logTimestamp();
+  modbusRegs[MB_TIMESTAMP_HI] = (uint16_t)(ts >> 16);
+  modbusRegs[MB_TIMESTAMP_LO] = (uint16_t)ts;
+  for (uint8_t i = 0; i < PACK_CELLS; i++) modbusRegs[MB_CELL_BASE + i] = bmsData.cell_mv[i];
+  modbusImage.publish(modbusRegs);
+}
+
+void printModbusStatus() {
+  Serial.printf("Modbus: %u frames published, %u reads retried over a publish\n", modbusImage.published(),
+                modbusImage.retries());
+  const ModbusStats* const stats[] = {&modbusRtuStats, &modbusTcpStats};
+  for (uint8_t i = 0; i < 2; i++) {
+    const ModbusStats& m = *stats[i];
+    Serial.printf("  %s: %u requests, %u exceptions, %u bad frames", i == 0 ? "RTU" : "TCP", m.requests.load(),
+                  m.exceptions.load(), m.badFrames.load());
+    if (i == 0) Serial.printf(", %u for other units", m.otherUnits.load());
+    Serial.println();
+  }
+#ifdef BMS_NATIVE
+  Serial.println("  (no UART2 or Wi-Fi on the host)");
+#else
+  Serial.printf("  RTU unit %lu at %lu baud; ", (unsigned long)cfg.modbus_unit, (unsigned long)cfg.modbus_baud);
+  if (!cfg.wifi_ssid[0]) Serial.println("Wi-Fi off");
+  else if (WiFi.status() != WL_CONNECTED) Serial.printf("Wi-Fi connecting to %s\n", cfg.wifi_ssid);
+  else Serial.printf("TCP on %s:%u\n", WiFi.localIP().toString().c_str(), MODBUS_PORT);
+#endif
+}
+
+// The compiled-in register map with the values masters read right now
+void printModbusMap() {
+  Serial.println("\n=== Modbus registers (FC 03/04) ===");
+  for (uint8_t f = 0; f < MODBUS_FIELD_COUNT; f++) {
+    const ModbusField& field = MODBUS_MAP[f];
+    Serial.printf("%3u %-14s", field.reg, field.name);
+    if (field.words == 2) {
+      Serial.printf(" %lu", (unsigned long)modbusImage.reg(field.reg) << 16 | modbusImage.reg(field.reg + 1));
+    } else {
+      for (uint16_t w = 0; w < field.words; w++) Serial.printf(" %u", modbusImage.reg(field.reg + w));
     }
-  } else {
-    Serial.println("No BMS devices found in this scan.");
+    Serial.printf(field.unit[0] ? " (%s)\n" : "\n", field.unit);
   }
-  
-  pBLEScan->clearResults(); // Delete results from BLEScan buffer
-  Serial.println("=====================================\n");
+  Serial.println("===================================\n");
 }
 
-void connectToBMS() {
-  if (discovered_bms_mac.length() == 0) {
-    Serial.println("No BMS device to connect to.");
+// The TWAI controller and the CAN task, on first enable; turning the
+// export off later only silences it
+void beginCanExport() {
+  canExport.setEnabled(cfg.can_export);
+  if (!cfg.can_export || canStarted) return;
+#ifndef BMS_NATIVE
+  if (!canBus.begin(CAN_TX_PIN, CAN_RX_PIN)) {
+    Serial.println("CAN: TWAI driver did not start");
     return;
   }
-  
-  connectionAttempts++;
-  Serial.printf("Connection attempt #%d to: %s [%s]\n", 
-                connectionAttempts, discovered_bms_name.c_str(), discovered_bms_mac.c_str());
-  
-  // Clean up previous client if exists
-  if (pClient) {
-    pClient->disconnect();
-    delete pClient;
-    pClient = nullptr;
+  xTaskCreatePinnedToCore(canTask, "can", 3072, nullptr, 3, &canHandle, 0);
+#endif
+  canStarted = true;
+  scheduler.wake(taskCan, 0);
+  Serial.printf("CAN: Pylontech frames at %u kbit/s, charge %lu A, discharge %lu A\n", CAN_BITRATE / 1000,
+                (unsigned long)cfg.can_charge_a, (unsigned long)cfg.can_discharge_a);
+}
+
+#ifndef BMS_NATIVE
+// Sleeps until the next frame is due or an inverter frame arrives; the
+// exporter keeps the deadlines, so a late wake-up does not shift the grid
+void canTask(void* arg) {
+  for (;;) {
+    CanFrame f;
+    if (canBus.receive(f, canExport.service(canBus, micros()))) canExport.onReceive(f, micros());
   }
-  
-  // Create BLE client
-  pClient = BLEDevice::createClient();
-  Serial.println("BLE client created.");
-  
-  // Connect to the BLE Server
-  BLEAddress bmsAddress(discovered_bms_mac.c_str());
-  
-  Serial.println("Attempting BLE connection...");
-  if (pClient->connect(bmsAddress)) {
-    Serial.println("*** Successfully connected to BMS via BLE! ***");
-    Serial.println("Connected to: " + discovered_bms_name + " [" + discovered_bms_mac + "]");
-    
-    // List available services
-    Serial.println("Discovering services...");
-    std::map<std::string, BLERemoteService*>* services = pClient->getServices();
-    
-    Serial.println("Available services:");
-    for (auto& service : *services) {
-      Serial.println("  Service UUID: " + String(service.first.c_str()));
-      
-      // Get characteristics for this service
-      std::map<std::string, BLERemoteCharacteristic*>* characteristics = service.second->getCharacteristics();
-      for (auto& characteristic : *characteristics) {
-        Serial.println("    Characteristic UUID: " + String(characteristic.first.c_str()));
-        Serial.print("    Properties: ");
-        Serial.print(characteristic.second->canRead() ? "R" : "-");
-        Serial.print(characteristic.second->canWrite() ? "W" : "-");
-        Serial.print(characteristic.second->canNotify() ? "N" : "-");
-        Serial.println();
-      }
-    }
-    
-    connected = true;
-    connectionAttempts = 0; // Reset counter on success
-    
-  } else {
-    Serial.printf("❌ BLE connection failed (attempt #%d)\n", connectionAttempts);
-    connected = false;
-    
-    // After 5 failed attempts, suggest rescanning
-    if (connectionAttempts >= 5) {
-      Serial.println("💡 Too many failed attempts. Try 'scan' to refresh BMS discovery.");
-      connectionAttempts = 0;
-      discovered_bms_mac = ""; // Clear to force rescan
-    }
+}
+#endif
+
+// Limits from the configured currents, cut to zero at the cell alarm
+// thresholds or when the BMS has opened the MOS. A dropped link zeroes them
+// and sets the communication-fail bit at once, so the inverter does not run
+// on the last frame's limits until the export goes stale.
+void exportCanFrames(bool linkUp) {
+  if (!cfg.can_export) return;
+  if (!linkUp) {
+    if (canExport.published() == 0) return; // no limits out yet to withdraw
+    canLinkDowns++;
   }
+  uint8_t alarms = packAlarms(true);
+  CanPack v;
+  v.charge_v_dv = (uint16_t)((uint32_t)PACK_CELLS * CAN_CELL_CHARGE_MV / 100);
+  v.discharge_v_dv = (uint16_t)((uint32_t)PACK_CELLS * CAN_CELL_DISCHARGE_MV / 100);
+  v.flags = (alarms & ALARM_CELL_HIGH ? CAN_FLAG_CELL_HIGH : 0) | (alarms & ALARM_CELL_LOW ? CAN_FLAG_CELL_LOW : 0) |
+            (alarms & ALARM_SOC_LOW ? CAN_FLAG_SOC_LOW : 0) | (bmsData.charge_mos ? 0 : CAN_FLAG_CHARGE_OFF) |
+            (bmsData.discharge_mos ? 0 : CAN_FLAG_DISCHARGE_OFF) |
+            (linkUp ? 0 : CAN_FLAG_NO_DATA | CAN_FLAG_CHARGE_OFF | CAN_FLAG_DISCHARGE_OFF);
+  v.charge_a_da = v.flags & (CAN_FLAG_CELL_HIGH | CAN_FLAG_CHARGE_OFF) ? 0 : (int16_t)(cfg.can_charge_a * 10);
+  v.discharge_a_da = v.flags & (CAN_FLAG_CELL_LOW | CAN_FLAG_DISCHARGE_OFF) ? 0 : (int16_t)(cfg.can_discharge_a * 10);
+  v.soc_pct = (uint16_t)lroundf(bmsData.soc);
+  float soh = cfg.capacity_ah ? bmsData.full_capacity * 100.0f / cfg.capacity_ah : 100.0f;
+  v.soh_pct = (uint16_t)lroundf(soh > 100.0f ? 100.0f : soh);
+  v.voltage_cv = (int16_t)lroundf(bmsData.voltage * 100.0f);
+  v.current_da = (int16_t)lroundf(bmsData.current * 10.0f);
+  v.temp_dc = (int16_t)(bmsData.max_temp * 10);
+  canExport.publish(v);
 }
 
-void readBMSData() {
-  if (!connected || !pClient || !pClient->isConnected()) {
-    Serial.println("Not connected to BMS");
+void printCanStatus() {
+  if (!canStarted) {
+    Serial.println("CAN: export off ('set can_export 1')");
     return;
   }
-  
-  Serial.println("Reading BMS data - trying multiple approaches...");
-  
-  // Try multiple services and approaches
-  tryMultipleServices();
+  Serial.printf("CAN: %s, %u frames published (%u link drops), %u sent, %u refused by the TX queue, %u not sent "
+                "(off or stale)\n", canExport.enabled() ? "on" : "off", canExport.published(), canLinkDowns,
+                canExport.sent(), canExport.refused(), canExport.silent());
+  Serial.printf("  schedule: %u us average, %u us worst lateness, %u periods missed\n", canExport.avgLateUs(),
+                canExport.maxLateUs(), canExport.overruns());
+  Serial.printf("  inverter: %s, %u keep-alives, %u answered, %u within %u ms of an answer, %u other frames\n",
+                canExport.inverterPresent(micros()) ? "present" : "not heard", canExport.requests(),
+                canExport.answers(), canExport.coalesced(), CAN_ANSWER_MIN_US / 1000, canExport.ignored());
 }
 
-void tryMultipleServices() {
-  // Create a proper JSON string for ROS2 parsing
-  String jsonOutput = createBMSJsonOutput();
-  
-  // Output with BMS_DATA prefix for ROS2 contract
-  Serial.println("BMS_DATA:" + jsonOutput);
+// Seconds for the log: wall clock once SNTP has set it, else a clock that
+// continues from the newest logged sample
+uint32_t logTimestamp() {
+#ifndef BMS_NATIVE
+  time_t now = time(nullptr);
+  if (now > 1600000000) return (uint32_t)now;
+#endif
+  return logClockBase + millis() / 1000;
 }
 
-String createBMSJsonOutput() {
-  String json = "{";
-  json += "\"timestamp\":" + String(millis()) + ",";
-  json += "\"device\":\"" + discovered_bms_name + "\",";
-  json += "\"mac_address\":\"" + discovered_bms_mac + "\",";
-  json += "\"daly_protocol\":{";
-  
-  String protocolData = "";
-  bool dataFound = tryProperDalyProtocolJson(protocolData);
-  
-  json += protocolData;
-  json += "},";
-  json += "\"data_found\":" + String(dataFound ? "true" : "false");
-  json += "}";
+void logBMSSample() {
+  LogSample s;
+  s.timestamp = logTimestamp();
+  s.voltage_cv = (uint16_t)lroundf(bmsData.voltage * 100.0f);
+  s.current_da = (int16_t)lroundf(bmsData.current * 10.0f);
+  s.soc_pm = (uint16_t)lroundf(bmsData.soc * 10.0f);
+  s.max_cell_mv = bmsData.max_cell_voltage;
+  s.min_cell_mv = bmsData.min_cell_voltage;
+  s.max_temp = (int8_t)bmsData.max_temp;
+  s.min_temp = (int8_t)bmsData.min_temp;
+  history.append(s);
+}
+
+// Dump the last N seconds of history, one CSV line per sample: raw samples
+// for the last hour or so, one per minute before that, one per 10 minutes
+// from flash before that
+void printHistory(uint32_t seconds) {
+  uint32_t to = history.newestTimestamp();
+  uint32_t from = to > seconds ? to - seconds : 0;
+  unsigned long start = millis();
   
-  return json;
+  Serial.println("BMS_HISTORY:timestamp,voltage,current,soc,max_cell_mv,min_cell_mv,max_temp,min_temp");
+  uint32_t perTier[HISTORY_TIERS];
+  uint32_t count = history.readRange(from, to, [](const LogSample& s) {
+    Serial.printf("BMS_HISTORY:%u,%.2f,%.1f,%.1f,%u,%u,%d,%d\n",
+                  s.timestamp, s.voltage_cv / 100.0, s.current_da / 10.0, s.soc_pm / 10.0,
+                  s.max_cell_mv, s.min_cell_mv, s.max_temp, s.min_temp);
+  }, perTier);
+  Serial.printf("History: %u samples (%u raw, %u from PSRAM, %u from flash) in %lu ms\n", count,
+                perTier[HISTORY_TIER_RAM], perTier[HISTORY_TIER_PSRAM], perTier[HISTORY_TIER_FLASH], millis() - start);
+}
+
+// Tier usage and the compaction backlog
+void printHistoryUsage() {
+  for (uint8_t t = 0; t < HISTORY_TIERS; t++) {
+    Serial.printf("History %-5s: %u/%u%s\n", HISTORY_TIER_NAMES[t], history.size((HistoryTier)t),
+                  history.capacity((HistoryTier)t),
+                  t == HISTORY_TIER_PSRAM && !historyInPsram ? " (internal RAM, no PSRAM)" : "");
+  }
+  Serial.printf("History: %u..%u, %u samples -> %u minutes -> %u in flash; pending fold %u, flush %u; "
+                "forced folds %u, flash errors %u\n",
+                history.oldestTimestamp(), history.newestTimestamp(), history.appended(), history.minutes(),
+                history.flushed(), history.pendingFold(), history.pendingFlush(), history.forcedFolds(),
+                history.flashErrors());
 }
 
 // CRC calculation function for Daly protocol
@@ -379,46 +1986,16 @@ int16_t readInt16BE(uint8_t* data, int offset) {
 }
 
 // NEW: JSON-serializable version of Daly protocol implementation
-bool tryProperDalyProtocolJson(String& protocolData) {
-  // Find the fff0 service (standard Daly service)
-  BLERemoteService* pService = nullptr;
-  std::map<std::string, BLERemoteService*>* services = pClient->getServices();
-  
-  for (auto& service : *services) {
-    if (service.first.find("fff0") != std::string::npos) {
-      pService = service.second;
-      break;
-    }
-  }
-  
-  if (!pService) {
-    protocolData = "\"status\":\"fff0_service_not_found\"";
-    return false;
-  }
-  
-  // Find characteristics
-  BLERemoteCharacteristic* pRxChar = pService->getCharacteristic(BLEUUID("fff1"));
-  BLERemoteCharacteristic* pTxChar = pService->getCharacteristic(BLEUUID("fff2"));
-  
-  if (!pRxChar || !pTxChar) {
-    protocolData = "\"status\":\"required_characteristics_not_found\"";
+// The main info exchange of the last read sequence as the record's
+// daly_protocol object; true when the reply decoded
+bool dalyProtocolJson(String& protocolData) {
+  if (!dalyTx) {
+    protocolData = String("\"status\":\"") + dalyStatus + "\"";
     return false;
   }
   
   protocolData = "\"status\":\"characteristics_found\",\"notifications\":\"enabled\",";
   
-  // Setup notifications on RX characteristic
-  if (pRxChar->canNotify()) {
-    pRxChar->registerForNotify(notifyCallback);
-    
-    // Enable notifications via descriptor
-    BLERemoteDescriptor* pDescriptor = pRxChar->getDescriptor(BLEUUID((uint16_t)0x2902));
-    if (pDescriptor) {
-      uint8_t notificationOn[] = {0x01, 0x00};
-      pDescriptor->writeValue(notificationOn, 2, true);
-    }
-  }
-  
   bool success = false;
   
   // Prepare command: HEAD_READ + CMD_INFO
@@ -438,32 +2015,19 @@ bool tryProperDalyProtocolJson(String& protocolData) {
   protocolData += "\"command_sent\":\"" + commandHex + "\",";
   
   try {
-    // Send command
-    pTxChar->writeValue(command, 8);
-    
-    // Wait for response
-    responseReceived = false;
-    unsigned long startTime = millis();
-    while (!responseReceived && (millis() - startTime < 3000)) {
-      delay(10);
-    }
-    
-    if (responseReceived) {
+    // Reply to the request (adaptive timeout, fast retry) of readSequence()
+    if (infoFrameLen > 0) {
       protocolData += "\"response_received\":true,";
+      protocolData += "\"rx_ms\":" + String(infoRxMs) + ",";
       protocolData += "\"response_data\":\"" + lastResponse + "\",";
       
-      // Parse the response using corrected Daly protocol logic
-      if (lastResponse.length() >= 16) {
-        // Convert hex string to bytes for parsing
-        int dataLen = lastResponse.length() / 2;
-        uint8_t* data = new uint8_t[dataLen];
-        for (int i = 0; i < dataLen; i++) {
-          String byteStr = lastResponse.substring(i * 2, i * 2 + 2);
-          data[i] = strtol(byteStr.c_str(), NULL, 16);
-        }
+      // Formatted from what decodeInfoFrame() took out of the reply
+      {
+        uint8_t* data = infoFrame;
+        int dataLen = infoFrameLen;
         
-        // Validate response format (expect 129 bytes total)
-        if (dataLen == 129 && data[0] == 0xD2 && data[1] == 0x03) {
+        FrameOutcome outcome = infoOutcome;
+        if (outcome == FRAME_OK) {
           protocolData += "\"parsed_data\":{";
           
           // Header information
@@ -473,99 +2037,38 @@ bool tryProperDalyProtocolJson(String& protocolData) {
           protocolData += "\"dataLength\":" + String(data[2]);
           protocolData += "},";
           
-          // Parse cell voltages (bytes 3-35) - 16 cells, 2 bytes each
+          // Cell voltages (bytes 3-35) - 16 cells, 2 bytes each
           protocolData += "\"cellVoltages\":[";
-          float packVoltage = 0.0;
-          uint16_t maxCellVoltage = 0;
-          uint16_t minCellVoltage = 65535;
-          
           for (int i = 0; i < 16; i++) {
-            int offset = 3 + (i * 2);
-            uint16_t cellVoltageRaw = readUInt16BE(data, offset);
-            float cellVoltage = cellVoltageRaw / 1000.0;
-            packVoltage += cellVoltage;
-            
-            if (cellVoltageRaw > maxCellVoltage) maxCellVoltage = cellVoltageRaw;
-            if (cellVoltageRaw < minCellVoltage) minCellVoltage = cellVoltageRaw;
-            
+            float cellVoltage = bmsData.cell_mv[i] / 1000.0;
             protocolData += "{\"cellNumber\":" + String(i + 1) + ",\"voltage\":" + String(cellVoltage, 3) + "}";
             if (i < 15) protocolData += ",";
           }
           protocolData += "],";
           
           // Pack voltage (calculated from cells)
-          protocolData += "\"packVoltage\":" + String(packVoltage, 3) + ",";
-          
-          // Current (0.0A when idle)
-          protocolData += "\"current\":0.0,";
-          
-          // Parse SOC (value 904 at bytes 87-88 = 90.4%)
-          uint16_t socRaw = readUInt16BE(data, 87);
-          float soc = 0.0;
-          if (socRaw == 904) {
-            soc = 90.4;
-          } else if (socRaw <= 1000) {
-            soc = socRaw / 10.0;
-          } else {
-            soc = socRaw;
-          }
-          protocolData += "\"soc\":" + String(soc, 1) + ",";
-          
-          // Calculate remaining and total capacity
-          float totalCapacity = 230.0;
-          float remainingCapacity = (totalCapacity * soc) / 100.0;
-          protocolData += "\"remainingCapacity\":" + String(remainingCapacity, 1) + ",";
-          protocolData += "\"totalCapacity\":" + String(totalCapacity, 0) + ",";
-          
-          // Parse cycles (value 1 found at byte 106)
-          uint16_t cycles = data[106];
-          protocolData += "\"cycles\":" + String(cycles) + ",";
+          protocolData += "\"packVoltage\":" + String(bmsData.voltage, 3) + ",";
+          protocolData += "\"current\":" + String(bmsData.current, 1) + ",";
+          protocolData += "\"soc\":" + String(bmsData.soc, 1) + ",";
+          protocolData += "\"remainingCapacity\":" + String(bmsData.remaining_capacity, 1) + ",";
+          protocolData += "\"totalCapacity\":" + String(bmsData.full_capacity, 0) + ",";
+          protocolData += "\"cycles\":" + String(bmsData.cycles) + ",";
           
-          // Parse temperatures
+          // Temperatures as decoded: the two cell sensors and the MOS
           protocolData += "\"temperatures\":[";
-          bool tempFound = false;
-          
-          // T1 and T2 at bytes 68 and 70 (value 70 = 30°C with +40 offset)
-          if (data[68] == 70) {
-            protocolData += "{\"sensor\":\"T1\",\"temperature\":30}";
-            tempFound = true;
-          }
-          if (data[70] == 70) {
-            if (tempFound) protocolData += ",";
-            protocolData += "{\"sensor\":\"T2\",\"temperature\":30}";
-            tempFound = true;
-          }
-          
-          // Look for MOS temperature (33°C = 73 with offset)
-          for (int i = 72; i < 85; i++) {
-            if (data[i] == 73) {
-              if (tempFound) protocolData += ",";
-              protocolData += "{\"sensor\":\"MOS\",\"temperature\":33}";
-              tempFound = true;
-              break;
-            }
-          }
-          
-          if (!tempFound) {
-            // Fallback temperature parsing
-            for (int i = 60; i < 85; i++) {
-              if (data[i] >= 40 && data[i] <= 120) {
-                int temp = data[i] - 40;
-                if (temp >= 0 && temp <= 80) {
-                  protocolData += "{\"sensor\":\"T" + String((i-60)/2 + 1) + "\",\"temperature\":" + String(temp) + "}";
-                  tempFound = true;
-                  break;
-                }
-              }
-            }
+          static const char* const TEMP_SENSORS[3] = {"T1", "T2", "MOS"};
+          for (int i = 0; i < 3; i++) {
+            if (i > 0) protocolData += ",";
+            protocolData += String("{\"sensor\":\"") + TEMP_SENSORS[i] + "\",\"temperature\":" +
+                            String(bmsData.temp_c[i]) + "}";
           }
           
           protocolData += "],";
           
-          // MOS Status (assuming normal operation)
+          // MOS Status from the MOS_INFO reply (balancing is not in it)
           protocolData += "\"mosStatus\":{";
-          protocolData += "\"chargingMos\":true,";
-          protocolData += "\"dischargingMos\":true,";
+          protocolData += String("\"chargingMos\":") + (bmsData.charge_mos ? "true," : "false,");
+          protocolData += String("\"dischargingMos\":") + (bmsData.discharge_mos ? "true," : "false,");
           protocolData += "\"balancing\":false";
           protocolData += "},";
           
@@ -579,25 +2082,13 @@ bool tryProperDalyProtocolJson(String& protocolData) {
           
           protocolData += "}";
           
-          // Update global BMS data structure
-          bmsData.voltage = packVoltage;
-          bmsData.current = 0.0;
-          bmsData.soc = soc;
-          bmsData.max_cell_voltage = maxCellVoltage;
-          bmsData.min_cell_voltage = minCellVoltage;
-          bmsData.cycles = cycles;
-          bmsData.remaining_capacity = remainingCapacity;
-          bmsData.full_capacity = totalCapacity;
-          
           success = true;
         } else {
-          protocolData += "\"error\":\"invalid_format_or_length\",\"expected_length\":129,\"actual_length\":" + String(dataLen);
+          protocolData += String("\"error\":\"") + (outcome == FRAME_CRC_FAIL ? "invalid_crc" : "invalid_format_or_length") + "\",";
+          protocolData += String("\"frame\":\"") + FRAME_OUTCOME_NAMES[outcome] + "\",";
+          protocolData += "\"expected_length\":129,\"actual_length\":" + String(dataLen);
         }
-        
-        delete[] data;
       }
-      
-      responseReceived = false;
     } else {
       protocolData += "\"response_received\":false";
     }
@@ -665,7 +2156,7 @@ bool tryProperDalyProtocol() {
     // Wait for response
     responseReceived = false;
     unsigned long startTime = millis();
-    while (!responseReceived && (millis() - startTime < 3000)) {
+    while (!responseReceived && (millis() - startTime < cfg.response_timeout_ms)) {
       delay(10);
     }
     
@@ -723,7 +2214,7 @@ bool tryProperDalyProtocol() {
           Serial.printf("\"soc\":%.1f,", soc);
           
           // Calculate remaining and total capacity
-          float totalCapacity = 230.0;
+          float totalCapacity = cfg.capacity_ah;
           float remainingCapacity = (totalCapacity * soc) / 100.0;
           Serial.printf("\"remainingCapacity\":%.1f,", remainingCapacity);
           Serial.printf("\"totalCapacity\":%.0f,", totalCapacity);
@@ -820,14 +2311,19 @@ bool tryProperDalyProtocol() {
 
 void handleSerialCommands() {
   if (Serial.available()) {
+    LoopBlockTimer block(LOOP_SITE_COMMAND);
     String command = Serial.readStringUntil('\n');
     command.trim();
+    String rawCommand = command; // config values (names) keep their case
     command.toLowerCase();
     
     if (command == "scan" || command == "s") {
-      scanForBMS();
+      if (scanning) Serial.println("Scan already running");
+      else scanForBMS();
     } else if (command == "connect" || command == "c") {
-      if (discovered_bms_mac.length() > 0) {
+      if (scanning) {
+        Serial.println("Scan running, connecting when it completes");
+      } else if (discovered_bms_mac.length() > 0) {
         Serial.println("Manual connection requested...");
         connectToBMS();
       } else {
@@ -848,7 +2344,56 @@ void handleSerialCommands() {
       if (discovered_bms_mac.length() > 0) {
         Serial.printf("BMS: %s [%s]\n", discovered_bms_name.c_str(), discovered_bms_mac.c_str());
       }
+      printLinkTiming();
+      printRuntimeEstimate();
+      Serial.printf("Output level: %s (stepped down %u, up %u, %u records dropped), sink queue %u%%\n",
+                    OverloadController::name(overload.level()), overload.stepsDown(), overload.stepsUp(),
+                    overload.dropped(), sinkQueuePermille() / 10);
+      printOutputCost();
       Serial.println("====================\n");
+    } else if (command == "stats") {
+      printFrameStats();
+      printLoopProfile();
+      printTaskStats();
+    } else if (command == "history" || command.startsWith("history ")) {
+      long seconds = command.length() > 8 ? command.substring(8).toInt() : 3600;
+      printHistory(seconds > 0 ? (uint32_t)seconds : 3600);
+    } else if (command == "log") {
+      printHistoryUsage();
+      if (flashLogReady) {
+        Serial.printf("Flash log: %u/%u samples, %u/%u segments, %u..%u\n",
+                      flashLog.sampleCount(), flashLog.capacity(),
+                      flashLog.usedSegments(), flashLog.segmentCount(),
+                      flashLog.oldestTimestamp(), flashLog.newestTimestamp());
+      } else {
+        Serial.println("Flash log not available");
+      }
+    } else if (command == "devices") {
+      printDevices();
+    } else if (command == "gatt") {
+      printGattStatus();
+    } else if (command == "modbus") {
+      printModbusStatus();
+    } else if (command == "modbus map") {
+      printModbusMap();
+    } else if (command == "can") {
+      printCanStatus();
+    } else if (command == "sd") {
+      printSdLogStatus();
+    } else if (command == "sd format") {
+      stopSdLog();
+      if (!SdVolume::format(&sdCard, esp_random())) Serial.println("SD log: no card to format");
+      else beginSdLog();
+    } else if (command == "config") {
+      printConfig();
+    } else if (command == "config reset") {
+      bool cleared = configStore.reset();
+      Serial.println(cleared ? "Config reset to defaults" : "Config reset to defaults (storage not cleared)");
+      for (uint8_t i = 0; i < CONFIG_KEY_COUNT; i++) applyConfig(i);
+    } else if (command.startsWith("set ")) {
+      setConfigValue(rawCommand.substring(4));
+    } else if (command == "power" || command == "p") {
+      printPowerProfile();
     } else if (command == "auto") {
       autoConnect = !autoConnect;
       Serial.printf("Auto-connect: %s\n", autoConnect ? "✅ ENABLED" : "❌ DISABLED");
@@ -859,7 +2404,7 @@ void handleSerialCommands() {
       discovered_bms_mac = "";
       discovered_bms_name = "";
       bms_found_by_scan = false;
-      connected = false;
+      setConnected(false);
       if (pClient && pClient->isConnected()) {
         pClient->disconnect();
       }
@@ -897,6 +2442,107 @@ void printAvailableCommands() {
   Serial.println("auto     - Toggle auto-connect");
   Serial.println("reset    - Reset and disconnect");
   Serial.println("services - List BLE services/characteristics");
+  Serial.println("devices  - List the BLE devices seen by recent scans");
+  Serial.println("stats    - Frame quality by outcome, per command and link; loop blocking; task timing");
+  Serial.println("history [s] - Dump the sample history of the last s seconds (default 3600)");
+  Serial.println("log      - Show history tier and flash log usage");
+  Serial.println("sd       - Show the SD raw log ('sd format' makes the card a new, empty log volume)");
+  Serial.println("gatt     - Show the phones reading the pack through our GATT server");
+  Serial.println("modbus   - Show Modbus RTU/TCP server counters ('modbus map' lists the registers)");
+  Serial.println("can      - Show the CAN export to the inverter (frames, schedule lateness, keep-alives)");
+  Serial.println("power    - Show peak power windows and load duration");
+  Serial.println("config   - Show runtime config ('config reset' for defaults)");
+  Serial.println("set <key> <value> - Change a config value (applied live, persisted)");
   Serial.println("help     - Show this help");
   Serial.println("================\n");
 }
+
+void printConfig() {
+  Serial.println("\n=== Config ===");
+  for (uint8_t i = 0; i < CONFIG_KEY_COUNT; i++) {
+    char value[CONFIG_VALUE_MAX + 1];
+    formatConfigValue(i, value, sizeof(value));
+    Serial.printf("%-12s %-18s %s\n", CONFIG_KEYS[i].name, value, CONFIG_KEYS[i].help);
+  }
+  Serial.printf("Storage: %s\n", configStore.persistent() ? "persistent" : "RAM only");
+  Serial.println("==============\n");
+}
+
+// The stored value as text; the Wi-Fi passphrase is only shown as set or not
+void formatConfigValue(uint8_t index, char* out, size_t len) {
+  if (CONFIG_KEYS[index].offset == offsetof(RuntimeConfig, wifi_pass) && cfg.wifi_pass[0]) {
+    snprintf(out, len, "********");
+    return;
+  }
+  configStore.format(index, out, len);
+}
+
+// "set <key>" alone clears a string key (wifi_ssid turns Wi-Fi off)
+void setConfigValue(String args) {
+  args.trim();
+  if (args.length() == 0) {
+    Serial.println("Usage: set <key> <value> (see 'config')");
+    return;
+  }
+  int space = args.indexOf(' ');
+  if (space < 0) space = args.length();
+  String key = args.substring(0, space);
+  String value = args.substring(space + 1);
+  key.toLowerCase();
+  value.trim();
+  
+  uint8_t index = 0;
+  ConfigResult r = configStore.set(key.c_str(), value.c_str(), &index);
+  if (r == CONFIG_UNKNOWN_KEY) {
+    Serial.println("❌ Unknown config key: " + key);
+    return;
+  }
+  if (r == CONFIG_INVALID || r == CONFIG_OUT_OF_RANGE) {
+    Serial.printf("❌ %s: %s (%s)\n", key.c_str(), ConfigStore::resultText(r), CONFIG_KEYS[index].help);
+    return;
+  }
+  char applied[CONFIG_VALUE_MAX + 1];
+  formatConfigValue(index, applied, sizeof(applied));
+  Serial.printf("%s = %s (%s)\n", key.c_str(), applied, ConfigStore::resultText(r));
+  applyConfig(index);
+}
+
+// Push a changed value into the state that caches it; the reply timeout is
+// read from cfg on every use and needs nothing here
+void applyConfig(uint8_t index) {
+  const void* field = (const uint8_t*)&cfg + CONFIG_KEYS[index].offset;
+  
+  if (field == &cfg.read_interval_ms) {
+    scheduler.setPeriod(taskPoll, cfg.read_interval_ms);
+  } else if (field == &cfg.scan_interval_ms) {
+    scheduler.setPeriod(taskScan, cfg.scan_interval_ms);
+  } else if (field == &cfg.block_budget_ms) {
+    loopProfiler.setBudgetMs(cfg.block_budget_ms);
+  } else if (field == &cfg.modbus_unit || field == &cfg.modbus_baud) {
+    modbusRestart = true;
+  } else if (field == cfg.wifi_ssid || field == cfg.wifi_pass) {
+    beginWifi();
+  } else if (field == &cfg.can_export) {
+    canExport.setEnabled(cfg.can_export);
+    beginCanExport();
+  } else if (field == &cfg.capacity_ah) {
+    bmsData.full_capacity = cfg.capacity_ah;
+    if (socEstimator.initialized()) socEstimator.setCapacity(cfg.capacity_ah * 1000);
+  } else if (field == cfg.bms_mac || field == cfg.bms_name) {
+    // A different target: drop the current device and rescan right away
+    if (discovered_bms_mac.length() > 0 &&
+        !discovered_bms_mac.equalsIgnoreCase(cfg.bms_mac) &&
+        !discovered_bms_name.equalsIgnoreCase(cfg.bms_name)) {
+      Serial.println("Target changed, disconnecting from " + discovered_bms_name);
+      rttTracker.reset();
+      discovered_bms_mac = "";
+      discovered_bms_name = "";
+      bms_found_by_scan = false;
+      setConnected(false);
+      if (pClient && pClient->isConnected()) {
+        pClient->disconnect();
+      }
+      if (!scanning) scheduler.wake(taskScan, 0);
+    }
+  }
+}
@@ -5,8 +5,13 @@
  */
 
 #include "BluetoothSerial.h"
+#include "spp_frames.h"
+// Shared with the PlatformIO firmware: esp32_bms_platformio/include, added
+// as an Arduino library (INSTALLATION_GUIDE.md)
+#include <task_scheduler.h>
 
 BluetoothSerial SerialBT;
+SppFrameReceiver sppFrames; // frames assembled in the BT callback
 
 // Daly BMS Configuration
 const String BMS_MAC = "41:18:12:01:18:9F";
@@ -40,41 +45,77 @@ struct BMSData {
 
 BMSData bmsData;
 bool connected = false;
-unsigned long lastReadTime = 0;
 const unsigned long READ_INTERVAL = 5000; // Read every 5 seconds
 
+// Cooperative tasks: loop() runs whatever is due and idles until the next deadline
+TaskScheduler scheduler;
+uint8_t taskConnect, taskPoll, taskLink;
+const uint32_t RECONNECT_INTERVAL = 5000; // between connect attempts
+const uint32_t LINK_CHECK_MS = 1000;
+const uint32_t CONNECT_SETTLE_MS = 1000;  // first read after connecting
+const uint32_t RESPONSE_TIMEOUT_MS = 1000;
+const uint32_t COMMAND_GAP_MS = 100;      // between the commands of one read
+
+// One read is a sequence of command exchanges, one step per task run
+const uint8_t READ_SEQUENCE[] = {0x90, 0x91, 0x92, 0x93, 0x94};
+const uint8_t READ_STEPS = sizeof(READ_SEQUENCE);
+uint8_t readStep = 0;
+bool awaitingReply = false;
+unsigned long replyDeadline = 0;
+
 void setup() {
   Serial.begin(115200);
   Serial.println("ESP32 Daly BMS Bluetooth Reader Starting...");
   
   SerialBT.begin("ESP32_BMS_Reader"); // Bluetooth device name
+  if (!sppFrames.begin(SerialBT, xTaskGetCurrentTaskHandle())) {
+    Serial.println("Failed to create the frame queue");
+  }
   Serial.println("Bluetooth initialized. Attempting to connect to Daly BMS...");
   
+  scheduler.begin([]() -> uint32_t { return millis(); }, []() -> uint32_t { return micros(); });
+  taskConnect = scheduler.add("connect", connectTask, RECONNECT_INTERVAL, RECONNECT_INTERVAL);
+  taskPoll = scheduler.add("poll", pollTask, READ_INTERVAL);
+  taskLink = scheduler.add("link", linkTask, LINK_CHECK_MS, LINK_CHECK_MS);
+  
   // Attempt to connect to BMS
   connectToBMS();
 }
 
 void loop() {
-  if (!connected) {
-    Serial.println("Attempting to reconnect to BMS...");
-    connectToBMS();
-    delay(5000);
-    return;
-  }
-  
-  // Check if it's time to read data
-  if (millis() - lastReadTime >= READ_INTERVAL) {
-    readBMSData();
-    lastReadTime = millis();
-  }
-  
-  // Check connection status
-  if (!SerialBT.connected()) {
+  // A reply frame ends the wait for it now rather than at the next deadline
+  if (sppFrames.frameArrived() && awaitingReply) scheduler.wake(taskPoll, 0);
+  // Nothing due before the next deadline: idle until then, or until the
+  // BT callback queues a frame and notifies this task
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(scheduler.run()));
+}
+
+void connectTask() {
+  if (connected) return;
+  Serial.println("Attempting to reconnect to BMS...");
+  connectToBMS();
+}
+
+void linkTask() {
+  if (connected && !SerialBT.connected()) {
     Serial.println("BMS disconnected!");
-    connected = false;
+    setConnected(false);
+  }
+}
+
+// Connected: poll (after the link has settled); disconnected: reconnect
+void setConnected(bool up) {
+  if (up == connected) return;
+  connected = up;
+  if (up) {
+    readStep = 0;
+    awaitingReply = false;
+    scheduler.suspend(taskConnect);
+    scheduler.wake(taskPoll, CONNECT_SETTLE_MS);
+  } else {
+    scheduler.suspend(taskPoll);
+    scheduler.wake(taskConnect, 0);
   }
-  
-  delay(100);
 }
 
 void connectToBMS() {
@@ -83,10 +124,10 @@ void connectToBMS() {
   // Convert MAC address string to uint8_t array
   uint8_t mac[6];
   if (parseMacAddress(BMS_MAC, mac)) {
-    connected = SerialBT.connect(mac);
+    // SerialBT.connect() blocks until the link is up or the attempt fails
+    setConnected(SerialBT.connect(mac));
     if (connected) {
       Serial.println("Successfully connected to Daly BMS!");
-      delay(1000); // Give time for connection to stabilize
     } else {
       Serial.println("Failed to connect to BMS");
     }
@@ -107,92 +148,78 @@ bool parseMacAddress(String macStr, uint8_t* mac) {
   return true;
 }
 
-void readBMSData() {
-  Serial.println("Reading BMS data...");
-  
-  // Read different data types from BMS
-  readVoltageCurrentSOC();    // Command 0x90
-  delay(100);
-  readCellVoltages();         // Command 0x91
-  delay(100);
-  readTemperatures();         // Command 0x92
-  delay(100);
-  readBalanceStatus();        // Command 0x93
-  delay(100);
-  readProtectionStatus();     // Command 0x94
-  delay(100);
-  
-  // Display collected data
-  displayBMSData();
-}
-
-void readVoltageCurrentSOC() {
-  DalyCommand cmd;
-  cmd.command = 0x90; // Voltage, Current, SOC command
-  sendCommand(cmd);
-  
-  uint8_t response[13];
-  if (readResponse(response, 13)) {
-    // Parse voltage (bytes 4-5)
-    bmsData.voltage = ((response[4] << 8) | response[5]) * 0.1;
-    
-    // Parse current (bytes 8-9) - signed value
-    int16_t current_raw = (response[8] << 8) | response[9];
-    bmsData.current = current_raw * 0.1;
-    
-    // Parse SOC (bytes 10-11)
-    bmsData.soc = ((response[10] << 8) | response[11]) * 0.1;
+// One step of a read: write the next command, or take its reply. While a
+// reply is due the task is armed for the deadline only; loop() wakes it as
+// soon as the BT callback queues a frame. Between commands it re-arms for
+// the gap; after the last command it falls back to its READ_INTERVAL period.
+void pollTask() {
+  if (!awaitingReply) {
+    if (readStep == 0) Serial.println("Reading BMS data...");
+    DalyCommand cmd;
+    cmd.command = READ_SEQUENCE[readStep];
+    sendCommand(cmd);
+    awaitingReply = true;
+    replyDeadline = millis() + RESPONSE_TIMEOUT_MS;
+    scheduler.wake(taskPoll, RESPONSE_TIMEOUT_MS);
+    return;
   }
-}
-
-void readCellVoltages() {
-  DalyCommand cmd;
-  cmd.command = 0x91; // Cell voltages command
-  sendCommand(cmd);
   
-  uint8_t response[13];
-  if (readResponse(response, 13)) {
-    // Parse max cell voltage (bytes 4-5)
-    bmsData.max_cell_voltage = (response[4] << 8) | response[5];
-    
-    // Parse min cell voltage (bytes 8-9)
-    bmsData.min_cell_voltage = (response[8] << 8) | response[9];
+  uint8_t response[SPP_FRAME_LEN];
+  bool received = sppFrames.waitFrame(response, 0);
+  long left = (long)(replyDeadline - millis());
+  if (!received && left > 0) {
+    scheduler.wake(taskPoll, left);
+    return;
+  }
+  awaitingReply = false;
+  if (received) {
+    parseResponse(READ_SEQUENCE[readStep], response);
+  } else {
+    Serial.println("Failed to read valid response");
   }
-}
-
-void readTemperatures() {
-  DalyCommand cmd;
-  cmd.command = 0x92; // Temperature command
-  sendCommand(cmd);
   
-  uint8_t response[13];
-  if (readResponse(response, 13)) {
-    // Parse max temperature (byte 4) - offset by 40
-    bmsData.max_temp = response[4] - 40;
-    
-    // Parse min temperature (byte 6) - offset by 40
-    bmsData.min_temp = response[6] - 40;
+  if (++readStep < READ_STEPS) {
+    scheduler.wake(taskPoll, COMMAND_GAP_MS);
+    return;
   }
-}
-
-void readBalanceStatus() {
-  DalyCommand cmd;
-  cmd.command = 0x93; // Balance status command
-  sendCommand(cmd);
+  readStep = 0;
   
-  uint8_t response[13];
-  readResponse(response, 13); // Read but don't process for now
+  // Display collected data
+  displayBMSData();
 }
 
-void readProtectionStatus() {
-  DalyCommand cmd;
-  cmd.command = 0x94; // Protection status command
-  sendCommand(cmd);
-  
-  uint8_t response[13];
-  if (readResponse(response, 13)) {
-    // Check protection status (byte 4)
-    bmsData.protection_status = (response[4] != 0);
+void parseResponse(uint8_t command, const uint8_t* response) {
+  switch (command) {
+    case 0x90: // Voltage, Current, SOC
+      // Parse voltage (bytes 4-5)
+      bmsData.voltage = ((response[4] << 8) | response[5]) * 0.1;
+      
+      // Parse current (bytes 8-9) - signed value
+      bmsData.current = (int16_t)((response[8] << 8) | response[9]) * 0.1;
+      
+      // Parse SOC (bytes 10-11)
+      bmsData.soc = ((response[10] << 8) | response[11]) * 0.1;
+      break;
+    case 0x91: // Cell voltages
+      // Parse max cell voltage (bytes 4-5)
+      bmsData.max_cell_voltage = (response[4] << 8) | response[5];
+      
+      // Parse min cell voltage (bytes 8-9)
+      bmsData.min_cell_voltage = (response[8] << 8) | response[9];
+      break;
+    case 0x92: // Temperatures
+      // Parse max temperature (byte 4) - offset by 40
+      bmsData.max_temp = response[4] - 40;
+      
+      // Parse min temperature (byte 6) - offset by 40
+      bmsData.min_temp = response[6] - 40;
+      break;
+    case 0x93: // Balance status: read but don't process for now
+      break;
+    case 0x94: // Protection status
+      // Check protection status (byte 4)
+      bmsData.protection_status = (response[4] != 0);
+      break;
   }
 }
 
@@ -200,6 +227,9 @@ void sendCommand(DalyCommand& cmd) {
   // Calculate checksum
   cmd.checksum = calculateChecksum(cmd);
   
+  // A late reply to an earlier command must not be taken for this one
+  sppFrames.flush();
+  
   // Send command bytes
   SerialBT.write(cmd.start);
   SerialBT.write(cmd.host_addr);
@@ -223,29 +253,6 @@ uint8_t calculateChecksum(const DalyCommand& cmd) {
   return sum;
 }
 
-bool readResponse(uint8_t* buffer, int expectedLength) {
-  unsigned long startTime = millis();
-  int bytesRead = 0;
-  
-  while (bytesRead < expectedLength && (millis() - startTime) < 1000) {
-    if (SerialBT.available()) {
-      buffer[bytesRead] = SerialBT.read();
-      bytesRead++;
-    }
-    delay(10);
-  }
-  
-  if (bytesRead == expectedLength) {
-    // Verify response format
-    if (buffer[0] == 0xA5) { // Check start byte
-      return true;
-    }
-  }
-  
-  Serial.println("Failed to read valid response");
-  return false;
-}
-
 void displayBMSData() {
   Serial.println("=== BMS Data ===");
   Serial.println("Voltage: " + String(bmsData.voltage, 2) + " V");
@@ -11,6 +11,12 @@
 
 #include "BluetoothSerial.h"
 #include "config.h"
+#include "spp_frames.h"
+// Shared with the PlatformIO firmware: esp32_bms_platformio/include, added
+// as an Arduino library (INSTALLATION_GUIDE.md)
+#include <task_scheduler.h>
+#include <cdr_battery.h>
+#include <raw_frames.h>
 
 // Forward declaration of BMSData structure for utils.h
 struct BMSData {
@@ -32,6 +38,7 @@ struct BMSData {
 #include "utils.h"
 
 BluetoothSerial SerialBT;
+SppFrameReceiver sppFrames; // frames assembled in the BT callback
 
 // Daly BMS Command Structure
 struct DalyCommand {
@@ -48,9 +55,25 @@ struct DalyCommand {
 BMSData bmsData;
 bool connected = false;
 unsigned long lastReadTime = 0;
-unsigned long lastConnectionAttempt = 0;
 int reconnectAttempts = 0;
-bool outputMode = 0; // 0 = Normal, 1 = JSON, 2 = CSV
+uint8_t outputMode = 0; // 0 = Normal, 1 = JSON, 2 = CSV, 3 = raw frames
+
+// Raw passthrough: replies go out framed as received, the host decodes them
+RawForwarder rawForwarder;
+uint8_t rawRecord[CDR_FRAME_OVERHEAD + RAW_RECORD_HEADER + SPP_FRAME_LEN];
+
+// Cooperative tasks: loop() runs whatever is due and idles until the next deadline
+TaskScheduler scheduler;
+uint8_t taskCommand, taskConnect, taskPoll, taskLink;
+
+// One read is a sequence of command exchanges, one step per task run
+const uint8_t READ_SEQUENCE[] = {CMD_VOUT_IOUT_SOC, CMD_MIN_MAX_CELL_VOLTAGE, CMD_MIN_MAX_TEMPERATURE,
+                                 CMD_STATUS_INFO};
+const uint8_t READ_STEPS = sizeof(READ_SEQUENCE);
+uint8_t readStep = 0;
+bool awaitingReply = false;
+bool readOk = true;             // every exchange of the current read succeeded
+unsigned long replyDeadline = 0;
 
 void setup() {
   Serial.begin(SERIAL_BAUD_RATE);
@@ -63,70 +86,68 @@ void setup() {
   Serial.println("============================================");
   
   SerialBT.begin(ESP32_BT_NAME);
+  if (!sppFrames.begin(SerialBT, xTaskGetCurrentTaskHandle())) {
+    Serial.println("Failed to create the frame queue");
+  }
   Serial.println("Bluetooth initialized as: " + String(ESP32_BT_NAME));
   
   // Print available commands
   printCommands();
   
+  scheduler.begin([]() -> uint32_t { return millis(); }, []() -> uint32_t { return micros(); });
+  taskCommand = scheduler.add("command", handleSerialCommands, COMMAND_POLL_MS, 0);
+  taskConnect = scheduler.add("connect", connectTask, RECONNECT_DELAY, RECONNECT_DELAY);
+  taskPoll = scheduler.add("poll", pollTask, READ_INTERVAL);
+  taskLink = scheduler.add("link", linkTask, LINK_CHECK_MS, LINK_CHECK_MS);
+  
   // Attempt initial connection
   connectToBMS();
 }
 
 void loop() {
-  // Handle serial commands
-  handleSerialCommands();
-  
-  // Connection management
-  if (!connected) {
-    if (millis() - lastConnectionAttempt >= RECONNECT_DELAY) {
-      if (reconnectAttempts < MAX_RECONNECT_ATTEMPTS) {
-        Serial.println("Reconnection attempt " + String(reconnectAttempts + 1) + 
-                      "/" + String(MAX_RECONNECT_ATTEMPTS));
-        connectToBMS();
-        reconnectAttempts++;
-        lastConnectionAttempt = millis();
-      } else {
-        Serial.println("Max reconnection attempts reached. Waiting...");
-        delay(30000); // Wait 30 seconds before resetting attempts
-        reconnectAttempts = 0;
-      }
-    }
-    return;
-  }
-  
-  // Check if it's time to read data
-  if (millis() - lastReadTime >= READ_INTERVAL) {
-    if (readBMSData()) {
-      bmsData.last_update = millis();
-      bmsData.data_valid = true;
-      
-      // Output data based on selected mode
-      switch (outputMode) {
-        case 0: // Normal output
-          displayBMSData();
-          break;
-        case 1: // JSON output
-          Serial.println(createJSONOutput(bmsData));
-          break;
-        case 2: // CSV output
-          logCSVData(bmsData);
-          break;
-      }
-    } else {
-      bmsData.data_valid = false;
-      Serial.println("Failed to read BMS data");
-    }
-    lastReadTime = millis();
+  // A reply frame ends the wait for it now rather than at the next deadline
+  if (sppFrames.frameArrived() && awaitingReply) scheduler.wake(taskPoll, 0);
+  // Nothing due before the next deadline: idle until then, or until the
+  // BT callback queues a frame and notifies this task
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(scheduler.run()));
+}
+
+void connectTask() {
+  if (connected) return;
+  if (reconnectAttempts < MAX_RECONNECT_ATTEMPTS) {
+    Serial.println("Reconnection attempt " + String(reconnectAttempts + 1) + 
+                  "/" + String(MAX_RECONNECT_ATTEMPTS));
+    connectToBMS();
+    if (!connected) reconnectAttempts++;
+  } else {
+    Serial.println("Max reconnection attempts reached. Waiting...");
+    reconnectAttempts = 0;
+    scheduler.wake(taskConnect, RECONNECT_BACKOFF);
   }
-  
-  // Check connection status
-  if (!SerialBT.connected()) {
+}
+
+void linkTask() {
+  if (connected && !SerialBT.connected()) {
     Serial.println("BMS connection lost!");
-    connected = false;
+    setConnected(false);
+  }
+}
+
+// Connected: poll (after the link has settled); disconnected: reconnect
+void setConnected(bool up) {
+  if (up == connected) return;
+  connected = up;
+  if (up) {
+    reconnectAttempts = 0;
+    readStep = 0;
+    awaitingReply = false;
+    scheduler.suspend(taskConnect);
+    scheduler.wake(taskPoll, CONNECT_SETTLE_MS);
+  } else {
     reconnectAttempts = 0;
+    scheduler.suspend(taskPoll);
+    scheduler.wake(taskConnect, 0);
   }
-  
-  delay(100);
 }
 
 void handleSerialCommands() {
@@ -154,17 +175,25 @@ void handleSerialCommands() {
     } else if (command == "normal" || command == "n") {
       outputMode = 0;
       Serial.println("Output mode set to Normal");
+    } else if (command == "raw") {
+      outputMode = 3;
+      Serial.println("Output mode set to raw frames");
     } else if (command == "reconnect" || command == "r") {
       Serial.println("Forcing reconnection...");
       SerialBT.disconnect();
-      connected = false;
-      reconnectAttempts = 0;
+      setConnected(false);
     } else if (command == "debug") {
       Serial.println("Debug info:");
       Serial.println("Connected: " + String(connected ? "Yes" : "No"));
       Serial.println("BT Connected: " + String(SerialBT.connected() ? "Yes" : "No"));
       Serial.println("Last read: " + String((millis() - lastReadTime) / 1000) + "s ago");
       Serial.println("Data valid: " + String(bmsData.data_valid ? "Yes" : "No"));
+      const SppFrameStats& fs = sppFrames.stats();
+      Serial.println("SPP frames: " + String(fs.frames) + ", skipped bytes: " + String(fs.skippedBytes) +
+                     ", resyncs: " + String(fs.resyncs) + ", overflows: " + String(fs.overflows));
+      Serial.println("Raw frames: " + String(rawForwarder.forwarded()) + " forwarded, " +
+                     String(rawForwarder.rejected()) + " failed their checksum");
+      printTaskStats();
     } else if (command != "") {
       Serial.println("Unknown command: " + command);
       Serial.println("Type 'help' for available commands");
@@ -180,17 +209,29 @@ void printCommands() {
   Serial.println("json (j)     - Switch to JSON output");
   Serial.println("csv (c)      - Switch to CSV output");
   Serial.println("normal (n)   - Switch to normal output");
+  Serial.println("raw          - Forward BMS frames undecoded (framed binary)");
   Serial.println("reconnect (r)- Force reconnection");
-  Serial.println("debug        - Show debug information");
+  Serial.println("debug        - Show debug information and task timing");
   Serial.println("==========================\n");
 }
 
+void printTaskStats() {
+  Serial.println("Task      period ms  runs      avg us  max us    max late ms  skipped");
+  for (uint8_t i = 0; i < scheduler.count(); i++) {
+    const TaskStats& ts = scheduler.stats(i);
+    Serial.printf("%-9s %-10lu %-9lu %-7lu %-9lu %-12lu %lu\n", scheduler.name(i),
+                  (unsigned long)scheduler.period(i), (unsigned long)ts.runs,
+                  (unsigned long)(ts.runs ? ts.totalUs / ts.runs : 0), (unsigned long)ts.maxUs,
+                  (unsigned long)ts.maxLateMs, (unsigned long)ts.skipped);
+  }
+}
+
 void printSystemStatus() {
   Serial.println("\n=== System Status ===");
   Serial.println("Uptime: " + formatUptime(millis()));
   Serial.println("BMS Connected: " + String(connected ? "Yes" : "No"));
   Serial.println("Bluetooth Status: " + String(SerialBT.connected() ? "Connected" : "Disconnected"));
-  Serial.println("Output Mode: " + String(outputMode == 0 ? "Normal" : (outputMode == 1 ? "JSON" : "CSV")));
+  Serial.println("Output Mode: " + String(outputMode == 0 ? "Normal" : (outputMode == 1 ? "JSON" : (outputMode == 2 ? "CSV" : "Raw"))));
   Serial.println("Read Interval: " + String(READ_INTERVAL / 1000) + " seconds");
   Serial.println("Reconnect Attempts: " + String(reconnectAttempts) + "/" + String(MAX_RECONNECT_ATTEMPTS));
   
@@ -209,11 +250,10 @@ void connectToBMS() {
   // Convert MAC address string to uint8_t array
   uint8_t mac[6];
   if (parseMacAddress(String(BMS_MAC_ADDRESS), mac)) {
-    connected = SerialBT.connect(mac);
+    // SerialBT.connect() blocks until the link is up or the attempt fails
+    setConnected(SerialBT.connect(mac));
     if (connected) {
       Serial.println("Successfully connected to Daly BMS!");
-      reconnectAttempts = 0;
-      delay(1000); // Give time for connection to stabilize
     } else {
       Serial.println("Failed to connect to BMS");
     }
@@ -234,102 +274,128 @@ bool parseMacAddress(String macStr, uint8_t* mac) {
   return true;
 }
 
-bool readBMSData() {
-  if (DEBUG_ENABLED) {
-    Serial.println("Reading BMS data...");
+// One step of a read: write the next command, or take its reply. While a
+// reply is due the task is armed for the deadline only; loop() wakes it as
+// soon as the BT callback queues a frame. Between commands it re-arms for
+// the gap; after the last command it falls back to its READ_INTERVAL period.
+void pollTask() {
+  if (!awaitingReply) {
+    if (readStep == 0) {
+      readOk = true;
+      if (DEBUG_ENABLED) {
+        Serial.println("Reading BMS data...");
+      }
+    }
+    DalyCommand cmd;
+    cmd.command = READ_SEQUENCE[readStep];
+    sendCommand(cmd);
+    awaitingReply = true;
+    replyDeadline = millis() + RESPONSE_TIMEOUT;
+    scheduler.wake(taskPoll, RESPONSE_TIMEOUT);
+    return;
   }
   
-  bool success = true;
-  
-  // Read different data types from BMS
-  success &= readVoltageCurrentSOC();    // Command 0x90
-  delay(100);
-  success &= readCellVoltages();         // Command 0x91
-  delay(100);
-  success &= readTemperatures();         // Command 0x92
-  delay(100);
-  success &= readProtectionStatus();     // Command 0x94
-  delay(100);
-  
-  return success;
-}
-
-bool readVoltageCurrentSOC() {
-  DalyCommand cmd;
-  cmd.command = CMD_VOUT_IOUT_SOC;
-  sendCommand(cmd);
+  uint8_t response[SPP_FRAME_LEN];
+  bool received = sppFrames.waitFrame(response, 0);
+  long left = (long)(replyDeadline - millis());
+  if (!received && left > 0) {
+    scheduler.wake(taskPoll, left);
+    return;
+  }
+  awaitingReply = false;
+  uint8_t command = READ_SEQUENCE[readStep];
+  if (outputMode == 3) {
+    if (!received || !forwardRawFrame(command, response)) readOk = false;
+  } else if (checkResponse(response, received, command)) {
+    parseResponse(command, response);
+  } else {
+    readOk = false;
+  }
   
-  uint8_t response[13];
-  if (readResponse(response, 13, CMD_VOUT_IOUT_SOC)) {
-    // Parse voltage (bytes 4-5)
-    bmsData.voltage = ((response[4] << 8) | response[5]) * VOLTAGE_SCALE;
-    
-    // Parse current (bytes 8-9) - signed value
-    int16_t current_raw = (response[8] << 8) | response[9];
-    bmsData.current = current_raw * CURRENT_SCALE;
-    
-    // Parse SOC (bytes 10-11)
-    bmsData.soc = ((response[10] << 8) | response[11]) * SOC_SCALE;
-    
-    return true;
+  if (++readStep < READ_STEPS) {
+    scheduler.wake(taskPoll, COMMAND_GAP_MS);
+    return;
   }
-  return false;
+  readStep = 0;
+  finishRead(readOk);
 }
 
-bool readCellVoltages() {
-  DalyCommand cmd;
-  cmd.command = CMD_MIN_MAX_CELL_VOLTAGE;
-  sendCommand(cmd);
-  
-  uint8_t response[13];
-  if (readResponse(response, 13, CMD_MIN_MAX_CELL_VOLTAGE)) {
-    // Parse max cell voltage (bytes 4-5)
-    bmsData.max_cell_voltage = ((response[4] << 8) | response[5]) * CELL_VOLTAGE_SCALE;
+void finishRead(bool success) {
+  lastReadTime = millis();
+  if (outputMode == 3) return; // the frames went out as they arrived
+  if (success) {
+    bmsData.last_update = millis();
+    bmsData.data_valid = true;
     
-    // Parse min cell voltage (bytes 8-9)
-    bmsData.min_cell_voltage = ((response[8] << 8) | response[9]) * CELL_VOLTAGE_SCALE;
-    
-    return true;
+    // Output data based on selected mode
+    switch (outputMode) {
+      case 0: // Normal output
+        displayBMSData();
+        break;
+      case 1: // JSON output
+        Serial.println(createJSONOutput(bmsData));
+        break;
+      case 2: // CSV output
+        logCSVData(bmsData);
+        break;
+    }
+  } else {
+    bmsData.data_valid = false;
+    Serial.println("Failed to read BMS data");
   }
-  return false;
 }
 
-bool readTemperatures() {
-  DalyCommand cmd;
-  cmd.command = CMD_MIN_MAX_TEMPERATURE;
-  sendCommand(cmd);
-  
-  uint8_t response[13];
-  if (readResponse(response, 13, CMD_MIN_MAX_TEMPERATURE)) {
-    // Parse max temperature (byte 4) - offset by 40
-    bmsData.max_temp = response[4] - TEMPERATURE_OFFSET;
-    
-    // Parse min temperature (byte 6) - offset by 40
-    bmsData.min_temp = response[6] - TEMPERATURE_OFFSET;
-    
-    return true;
-  }
-  return false;
+// One reply as a raw record (include/raw_frames.h); false if its checksum fails
+bool forwardRawFrame(uint8_t command, const uint8_t* frame) {
+  size_t len = rawForwarder.encode(RAW_PROTO_A5, command, frame, SPP_FRAME_LEN, millis(),
+                                   rawRecord + CDR_FRAME_HEADER, sizeof(rawRecord) - CDR_FRAME_OVERHEAD);
+  if (len == 0) return false;
+  Serial.write(rawRecord, cdrFrame(CDR_TOPIC_RAW_DALY, rawRecord, len));
+  return true;
 }
 
-bool readProtectionStatus() {
-  DalyCommand cmd;
-  cmd.command = CMD_STATUS_INFO;
-  sendCommand(cmd);
-  
-  uint8_t response[13];
-  if (readResponse(response, 13, CMD_STATUS_INFO)) {
-    // Check protection status (byte 4)
-    bmsData.protection_status = (response[4] != 0);
-    return true;
+void parseResponse(uint8_t command, const uint8_t* response) {
+  switch (command) {
+    case CMD_VOUT_IOUT_SOC: {
+      // Parse voltage (bytes 4-5)
+      bmsData.voltage = ((response[4] << 8) | response[5]) * VOLTAGE_SCALE;
+      
+      // Parse current (bytes 8-9) - signed value
+      int16_t current_raw = (response[8] << 8) | response[9];
+      bmsData.current = current_raw * CURRENT_SCALE;
+      
+      // Parse SOC (bytes 10-11)
+      bmsData.soc = ((response[10] << 8) | response[11]) * SOC_SCALE;
+      break;
+    }
+    case CMD_MIN_MAX_CELL_VOLTAGE:
+      // Parse max cell voltage (bytes 4-5)
+      bmsData.max_cell_voltage = ((response[4] << 8) | response[5]) * CELL_VOLTAGE_SCALE;
+      
+      // Parse min cell voltage (bytes 8-9)
+      bmsData.min_cell_voltage = ((response[8] << 8) | response[9]) * CELL_VOLTAGE_SCALE;
+      break;
+    case CMD_MIN_MAX_TEMPERATURE:
+      // Parse max temperature (byte 4) - offset by 40
+      bmsData.max_temp = response[4] - TEMPERATURE_OFFSET;
+      
+      // Parse min temperature (byte 6) - offset by 40
+      bmsData.min_temp = response[6] - TEMPERATURE_OFFSET;
+      break;
+    case CMD_STATUS_INFO:
+      // Check protection status (byte 4)
+      bmsData.protection_status = (response[4] != 0);
+      break;
   }
-  return false;
 }
 
 void sendCommand(DalyCommand& cmd) {
   // Calculate checksum
   cmd.checksum = calculateChecksum(cmd);
   
+  // A late reply to an earlier command must not be taken for this one
+  sppFrames.flush();
+  
   // Send command bytes
   SerialBT.write(cmd.start);
   SerialBT.write(cmd.host_addr);
@@ -360,26 +426,15 @@ uint8_t calculateChecksum(const DalyCommand& cmd) {
   return sum;
 }
 
-bool readResponse(uint8_t* buffer, int expectedLength, uint8_t expectedCommand) {
-  unsigned long startTime = millis();
-  int bytesRead = 0;
-  
-  while (bytesRead < expectedLength && (millis() - startTime) < RESPONSE_TIMEOUT) {
-    if (SerialBT.available()) {
-      buffer[bytesRead] = SerialBT.read();
-      bytesRead++;
-    }
-    delay(10);
-  }
-  
-  if (bytesRead == expectedLength) {
+bool checkResponse(uint8_t* buffer, bool received, uint8_t expectedCommand) {
+  if (received) {
     if (DEBUG_RAW_DATA) {
-      printHexData(buffer, expectedLength, "Received Response");
+      printHexData(buffer, SPP_FRAME_LEN, "Received Response");
     }
     
     // Validate response
-    if (validateResponse(buffer, expectedLength, expectedCommand)) {
-      if (verifyChecksum(buffer, expectedLength)) {
+    if (validateResponse(buffer, SPP_FRAME_LEN, expectedCommand)) {
+      if (verifyChecksum(buffer, SPP_FRAME_LEN)) {
         return true;
       }
     }
@@ -387,7 +442,7 @@ bool readResponse(uint8_t* buffer, int expectedLength, uint8_t expectedCommand)
   
   if (DEBUG_ENABLED) {
     Serial.println("Failed to read valid response for command 0x" + String(expectedCommand, HEX));
-    Serial.println("Bytes read: " + String(bytesRead) + "/" + String(expectedLength));
+    Serial.println(received ? "Frame received but invalid" : "No frame within timeout");
   }
   return false;
 }
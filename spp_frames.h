@@ -0,0 +1,102 @@
+/*
+ * Event-driven Daly frame receive for the Bluetooth Classic (SPP) sketches
+ * BluetoothSerial hands every received chunk to onData() in the Bluetooth
+ * task. The bytes are assembled into 13-byte A5 frames there and complete
+ * frames go into a FreeRTOS queue (a ring of frames), so the protocol code
+ * blocks in waitFrame() and wakes the moment a frame is complete instead of
+ * polling available() with delay(10) between bytes. A sketch that idles in
+ * loop() passes its task handle to begin(): every queued frame then sets
+ * frameArrived() and notifies that task, so the idle ends with the frame.
+ */
+
+#ifndef SPP_FRAMES_H
+#define SPP_FRAMES_H
+
+#include "Arduino.h"
+#include "BluetoothSerial.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#define SPP_FRAME_LEN 13         // A5 + addr + addr + len + cmd + 8 data + checksum
+#define SPP_FRAME_START 0xA5
+#define SPP_FRAME_QUEUE 8        // frames buffered between the BT task and loop()
+#define SPP_FRAME_GAP_MS 50      // a pause this long restarts frame assembly
+
+struct SppFrameStats {
+  uint32_t frames = 0;           // complete frames queued
+  uint32_t skippedBytes = 0;     // bytes dropped while hunting for 0xA5
+  uint32_t resyncs = 0;          // partial frames abandoned after a gap
+  uint32_t overflows = 0;        // frames dropped because the queue was full
+};
+
+class SppFrameReceiver {
+public:
+  // notify: task to wake per queued frame (nullptr: waitFrame() only)
+  bool begin(BluetoothSerial& bt, TaskHandle_t notify = nullptr) {
+    notify_ = notify;
+    queue_ = xQueueCreate(SPP_FRAME_QUEUE, SPP_FRAME_LEN);
+    if (!queue_) return false;
+    bt.onData([this](const uint8_t* data, size_t len) { onData(data, len); });
+    return true;
+  }
+
+  // Drop frames left over from an earlier (timed out) request
+  void flush() {
+    if (queue_) xQueueReset(queue_);
+  }
+
+  // Block until a full frame arrives or timeout_ms passes
+  bool waitFrame(uint8_t* frame, uint32_t timeout_ms) {
+    if (!queue_) return false;
+    return xQueueReceive(queue_, frame, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+  }
+
+  // True once per batch of frames queued since the last call
+  bool frameArrived() {
+    if (!arrived_) return false;
+    arrived_ = false;
+    return true;
+  }
+
+  const SppFrameStats& stats() const { return stats_; }
+
+private:
+  // Runs in the Bluetooth task
+  void onData(const uint8_t* data, size_t len) {
+    uint32_t now = millis();
+    if (fill_ > 0 && now - lastByteMs_ >= SPP_FRAME_GAP_MS) {
+      fill_ = 0;
+      stats_.resyncs++;
+    }
+    lastByteMs_ = now;
+
+    for (size_t i = 0; i < len; i++) {
+      if (fill_ == 0 && data[i] != SPP_FRAME_START) {
+        stats_.skippedBytes++;
+        continue;
+      }
+      frame_[fill_++] = data[i];
+      if (fill_ == SPP_FRAME_LEN) {
+        if (xQueueSend(queue_, frame_, 0) == pdTRUE) {
+          stats_.frames++;
+          arrived_ = true;
+          if (notify_) xTaskNotifyGive(notify_);
+        } else {
+          stats_.overflows++;
+        }
+        fill_ = 0;
+      }
+    }
+  }
+
+  QueueHandle_t queue_ = nullptr;
+  TaskHandle_t notify_ = nullptr;
+  volatile bool arrived_ = false;
+  uint8_t frame_[SPP_FRAME_LEN];
+  uint8_t fill_ = 0;
+  uint32_t lastByteMs_ = 0;
+  SppFrameStats stats_;
+};
+
+#endif // SPP_FRAMES_H